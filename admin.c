@@ -0,0 +1,411 @@
+#include "admin.h"
+
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <winsock2.h>
+#include <ws2tcpip.h>
+#include "logmsg.h"
+#include "error.h"
+
+/* The longest line an answer is made of */
+#define admin_reply_size 512
+
+
+static const struct {
+	const char * name;
+	enum AdminVerb verb;
+	size_t arguments_min;
+	size_t arguments_max;
+	const char * usage;
+} commands[] = {
+	{"help", admin_help, 0, 0, "help: this list"},
+	{"status", admin_status, 0, 0, "status: the clients, the threads and the limits"},
+	{"log", admin_log, 0, 1, "log [error|info|debug]: show or set the log level"},
+	{"rate", admin_rate, 0, 2, "rate [messages bytes]: show or set each client's rate limits per second, 0 for unlimited"},
+	{"budget", admin_budget, 0, 2, "budget [clientKiB allMiB]: show or set the memory budgets, 0 for unlimited"},
+	{"threads", admin_threads, 0, 2, "threads [min [max]]: show or set the bounds of the thread pool, which is elastic if they're apart"},
+	{"clients", admin_clients, 0, 2, "clients [from [count]]: the state of the clients, skipping the first from, count of them or 1000"},
+	{"kick", admin_kick, 1, 1, "kick id: disconnect the client with that connection ID"},
+	{"quit", admin_quit, 0, 0, "quit: close the connection"}
+};
+
+static const char * const log_levels[] = {"error", "info", "debug"};
+
+static void
+disconnect_operator
+(
+ AdminChannel * channel
+)
+{
+	if ( channel->operator == INVALID_SOCKET )
+		return;
+	if ( closesocket(channel->operator) == SOCKET_ERROR )
+		wsa_perror("couldn't close admin connection");
+	channel->operator = INVALID_SOCKET;
+	channel->input_n = 0;
+	channel->overlong = 0;
+	channel->quitting = 0;
+	free(channel->output);
+	channel->output = NULL;
+	channel->output_n = channel->output_sent = channel->output_size = 0;
+	logmsg("admin disconnected");
+}
+
+int
+admin_open
+(
+ AdminChannel * channel,
+ u_short port
+)
+{
+	const struct sockaddr_in loopback = {
+		.sin_family = AF_INET,
+		.sin_addr.s_addr = htonl(INADDR_LOOPBACK),
+		.sin_port = htons(port)
+	};
+	
+	*channel = (AdminChannel){
+		.listener = INVALID_SOCKET,
+		.operator = INVALID_SOCKET,
+		.listener_event = WSA_INVALID_EVENT,
+		.operator_event = WSA_INVALID_EVENT
+	};
+	
+	if ( (channel->listener = WSASocketW(AF_INET, SOCK_STREAM, IPPROTO_TCP, NULL, 0, 0)) == INVALID_SOCKET )
+		wsa_perror("couldn't create admin socket");
+	else
+	if ( bind(channel->listener, (const struct sockaddr *)&loopback, sizeof(loopback)) == SOCKET_ERROR )
+		wsa_perror("couldn't bind admin socket to the loopback address");
+	else
+	if ( listen(channel->listener, 1) == SOCKET_ERROR )
+		wsa_perror("couldn't put admin socket to listen");
+	else
+	if ( (channel->listener_event = WSACreateEvent()) == WSA_INVALID_EVENT || (channel->operator_event = WSACreateEvent()) == WSA_INVALID_EVENT )
+		wsa_perror("couldn't create events for the admin channel");
+	else
+	if ( WSAEventSelect(channel->listener, channel->listener_event, FD_ACCEPT) == SOCKET_ERROR )
+		wsa_perror("couldn't select the events of the admin socket");
+	else
+	{
+		logmsgf("admin channel listening on 127.0.0.1:%u\n", (unsigned)port);
+		return 1;
+	}
+	
+	admin_close(channel);
+	return 0;
+}
+
+void
+admin_close
+(
+ AdminChannel * channel
+)
+{
+	disconnect_operator(channel);
+	if ( channel->listener != INVALID_SOCKET && closesocket(channel->listener) == SOCKET_ERROR )
+		wsa_perror("couldn't close admin socket");
+	if ( channel->listener_event != WSA_INVALID_EVENT )
+		WSACloseEvent(channel->listener_event);
+	if ( channel->operator_event != WSA_INVALID_EVENT )
+		WSACloseEvent(channel->operator_event);
+	channel->listener = INVALID_SOCKET;
+	channel->listener_event = WSA_INVALID_EVENT;
+	channel->operator_event = WSA_INVALID_EVENT;
+}
+
+/* Sends what's left of the replies until the operator's side takes no
+ * more, FD_WRITE then coming once it does */
+static void
+flush_output
+(
+ AdminChannel * channel
+)
+{
+	while ( channel->output_sent != channel->output_n )
+	{
+		const int result = send(channel->operator, channel->output + channel->output_sent, (int)(channel->output_n - channel->output_sent), 0);
+		if ( result == SOCKET_ERROR )
+		{
+			if ( WSAGetLastError() == WSAEWOULDBLOCK )
+				return;
+			wsa_perror("couldn't answer admin");
+			disconnect_operator(channel);
+			return;
+		}
+		channel->output_sent += (size_t)result;
+	}
+	channel->output_n = channel->output_sent = 0;
+	if ( channel->quitting )
+		disconnect_operator(channel);
+}
+
+static void
+accept_operator
+(
+ AdminChannel * channel
+)
+{
+	const SOCKET s = accept(channel->listener, NULL, NULL);
+	if ( s == INVALID_SOCKET )
+	{
+		if ( WSAGetLastError() != WSAEWOULDBLOCK )
+			wsa_perror("couldn't accept admin connection");
+		return;
+	}
+	
+	/* One at a time, so that no two of them tune the server at once */
+	if ( channel->operator != INVALID_SOCKET )
+	{
+		static const char busy[] = "error: someone else is connected\n";
+		send(s, busy, sizeof(busy) - 1, 0);
+		closesocket(s);
+		return;
+	}
+	
+	/* Which makes it non-blocking as well */
+	if ( WSAEventSelect(s, channel->operator_event, FD_READ | FD_WRITE | FD_CLOSE) == SOCKET_ERROR )
+	{
+		wsa_perror("couldn't select the events of admin connection");
+		closesocket(s);
+		return;
+	}
+	channel->operator = s;
+	logmsg("admin connected");
+	admin_reply(channel, "lappenchat admin channel; help lists the commands");
+}
+
+void
+admin_poll
+(
+ AdminChannel * channel
+)
+{
+	WSANETWORKEVENTS events;
+	
+	if ( WSAEnumNetworkEvents(channel->listener, channel->listener_event, &events) != SOCKET_ERROR && (events.lNetworkEvents & FD_ACCEPT) )
+		accept_operator(channel);
+	/* What the operator sent is read by admin_next_command, each
+	 * recv it makes having the event set again if there's more */
+	if ( channel->operator != INVALID_SOCKET && WSAEnumNetworkEvents(channel->operator, channel->operator_event, &events) != SOCKET_ERROR && (events.lNetworkEvents & FD_WRITE) )
+		flush_output(channel);
+}
+
+/* Returns 0 once there's nothing more to read for now, or no operator */
+static int
+read_more
+(
+ AdminChannel * channel
+)
+{
+	/* A line this long is no command; it's skipped up to its end */
+	if ( channel->input_n == sizeof(channel->input) )
+	{
+		channel->overlong = 1;
+		channel->input_n = 0;
+	}
+	
+	const int received = recv(channel->operator, channel->input + channel->input_n, (int)(sizeof(channel->input) - channel->input_n), 0);
+	if ( received > 0 )
+	{
+		channel->input_n += (size_t)received;
+		return 1;
+	}
+	if ( received == SOCKET_ERROR && WSAGetLastError() == WSAEWOULDBLOCK )
+		return 0;
+	if ( received == SOCKET_ERROR )
+		wsa_perror("couldn't read from admin connection");
+	disconnect_operator(channel);
+	return 0;
+}
+
+static int
+parse_log_level
+(
+ const char * word,
+ unsigned long * level
+)
+{
+	for ( size_t i = 0 ; i != sizeof(log_levels) / sizeof(*log_levels) ; ++i )
+		if ( !strcmp(word, log_levels[i]) )
+		{
+			*level = (unsigned long)i;
+			return 1;
+		}
+	return 0;
+}
+
+/* Returns the error to answer with, NULL if the line parsed */
+static const char *
+parse_command
+(
+ char * line,
+ AdminCommand * command
+)
+{
+	char * words[4];
+	size_t words_n = 0;
+	
+	for ( char * word = strtok(line, " \t") ; word ; word = strtok(NULL, " \t") )
+	{
+		if ( words_n == sizeof(words) / sizeof(*words) )
+			return "too many arguments";
+		words[words_n++] = word;
+	}
+	
+	for ( size_t i = 0 ; i != sizeof(commands) / sizeof(*commands) ; ++i )
+	{
+		if ( strcmp(words[0], commands[i].name) )
+			continue;
+		
+		const size_t arguments_n = words_n - 1;
+		if ( arguments_n < commands[i].arguments_min || arguments_n > commands[i].arguments_max )
+			return commands[i].usage;
+		
+		command->verb = commands[i].verb;
+		command->arguments_n = arguments_n;
+		for ( size_t j = 0 ; j != arguments_n ; ++j )
+		{
+			char * end;
+			const char * const word = words[j + 1];
+			if ( command->verb == admin_log && parse_log_level(word, command->arguments + j) )
+				continue;
+			command->arguments[j] = strtoul(word, &end, 10);
+			if ( *word < '0' || *word > '9' || *end )
+				return commands[i].usage;
+		}
+		if ( command->verb == admin_log && arguments_n && command->arguments[0] > loglevel_debug )
+			return commands[i].usage;
+		return NULL;
+	}
+	return "unknown command; help lists them";
+}
+
+int
+admin_next_command
+(
+ AdminChannel * channel,
+ AdminCommand * command
+)
+{
+	while ( channel->operator != INVALID_SOCKET && !channel->quitting )
+	{
+		char * const end = memchr(channel->input, '\n', channel->input_n);
+		if ( !end )
+		{
+			if ( !read_more(channel) )
+				return 0;
+			continue;
+		}
+		
+		char line[admin_line_size];
+		const size_t length = (size_t)(end - channel->input);
+		memcpy(line, channel->input, length);
+		line[length] = '\0';
+		if ( length && line[length - 1] == '\r' )
+			line[length - 1] = '\0';
+		channel->input_n -= length + 1;
+		memmove(channel->input, end + 1, channel->input_n);
+		
+		if ( channel->overlong )
+		{
+			channel->overlong = 0;
+			admin_reply(channel, "error: line longer than %d bytes", admin_line_size - 1);
+			continue;
+		}
+		if ( !line[strspn(line, " \t")] )
+			continue;
+		
+		const char * const error = parse_command(line, command);
+		if ( error )
+		{
+			admin_reply(channel, "error: %s", error);
+			continue;
+		}
+		
+		switch ( command->verb )
+		{
+			case admin_help:
+				for ( size_t i = 0 ; i != sizeof(commands) / sizeof(*commands) ; ++i )
+					admin_reply(channel, "%s", commands[i].usage);
+				admin_reply(channel, "ok");
+				break;
+			case admin_log:
+				if ( command->arguments_n )
+				{
+					loglevel = (int)command->arguments[0];
+					logmsgf("log level set to %s\n", log_levels[loglevel]);
+				}
+				admin_reply(channel, "log level %s", log_levels[loglevel]);
+				admin_reply(channel, "ok");
+				break;
+			case admin_quit:
+				/* Once it's been sent everything, "ok" included */
+				channel->quitting = 1;
+				admin_reply(channel, "ok");
+				break;
+			default:
+				return 1;
+		}
+	}
+	return 0;
+}
+
+void
+admin_reply
+(
+ AdminChannel * channel,
+ const char * fmt,
+ ...
+)
+{
+	char reply[admin_reply_size];
+	va_list arguments;
+	
+	if ( channel->operator == INVALID_SOCKET )
+		return;
+	
+	va_start(arguments, fmt);
+	int length = vsnprintf(reply, sizeof(reply) - 1, fmt, arguments);
+	va_end(arguments);
+	if ( length < 0 )
+		return;
+	if ( length > (int)sizeof(reply) - 2 )
+		length = (int)sizeof(reply) - 2;
+	reply[length++] = '\n';
+	
+	/* A full socket buffer only has the replies kept, up to a point */
+	if ( channel->output_n - channel->output_sent + (size_t)length > admin_output_max )
+	{
+		logmsg("admin isn't reading the answers, disconnecting it");
+		disconnect_operator(channel);
+		return;
+	}
+	if ( channel->output_sent && channel->output_n + (size_t)length > channel->output_size )
+	{
+		channel->output_n -= channel->output_sent;
+		memmove(channel->output, channel->output + channel->output_sent, channel->output_n);
+		channel->output_sent = 0;
+	}
+	if ( channel->output_n + (size_t)length > channel->output_size )
+	{
+		size_t size = channel->output_size ? channel->output_size : admin_reply_size * 8;
+		while ( size < channel->output_n + (size_t)length )
+			size *= 2;
+		if ( size > admin_output_max )
+			size = admin_output_max;
+		char * const output = realloc(channel->output, size);
+		if ( !output )
+		{
+			logmsg("couldn't allocate memory for the answers to admin, disconnecting it");
+			disconnect_operator(channel);
+			return;
+		}
+		channel->output = output;
+		channel->output_size = size;
+	}
+	memcpy(channel->output + channel->output_n, reply, (size_t)length);
+	channel->output_n += (size_t)length;
+	flush_output(channel);
+}
@@ -0,0 +1,100 @@
+#ifndef ADMIN_H
+#define ADMIN_H
+
+#include <stddef.h>
+#include <winsock2.h> // SOCKET, WSAEVENT, u_short
+
+
+/* The admin channel: a TCP port bound to the loopback address only, for
+ * one operator at a time to tune the server and look into it while it
+ * runs, with a line-based text protocol anyone can speak with a plain
+ * TCP client. It's handled on the main thread, next to the server
+ * sockets, and never waits on the operator: its socket is non-blocking,
+ * the replies its side can't take yet are kept until it can, and an
+ * operator that lets more than admin_output_max of them pile up gets
+ * disconnected. Every command is answered with whatever it has to say
+ * and then a line of its own, "ok" or "error: " and why. */
+
+#define admin_line_size 256
+/* The replies kept for an operator at most, which a page of clients
+ * (admin_clients_page) is well within */
+#define admin_output_max (1 << 20)
+/* The clients listed at once when no count is given */
+#define admin_clients_page 1000
+
+enum AdminVerb {
+	admin_help,
+	admin_status,
+	admin_log, // the log level
+	admin_rate, // the rate limits, in messages and bytes per second
+	admin_budget, // the memory budgets, per client in KiB and in all in MiB
+	admin_threads, // the bounds of the thread pool
+	admin_clients, // the state of the clients, a page at a time
+	admin_kick, // a client, by connection ID
+	admin_quit
+};
+
+typedef struct {
+	enum AdminVerb verb;
+	size_t arguments_n; // 0 for commands that set something to show it
+	unsigned long arguments[2];
+} AdminCommand;
+
+typedef struct {
+	SOCKET listener;
+	SOCKET operator; // INVALID_SOCKET while there's none
+	WSAEVENT listener_event;
+	WSAEVENT operator_event;
+	/* What came in of the commands */
+	char input[admin_line_size];
+	size_t input_n;
+	char overlong; // the line being read is too long and gets skipped
+	char quitting; // to be disconnected once the replies have been sent
+	/* What's left to send of the replies, from output_sent to output_n,
+	 * NULL until there's been any */
+	char * output;
+	size_t output_n;
+	size_t output_sent;
+	size_t output_size;
+} AdminChannel;
+
+int admin_open
+(
+ AdminChannel *,
+ u_short port
+);
+
+void admin_close
+(
+ AdminChannel *
+);
+
+/* Sees to what the channel's events were set for: operators connecting,
+ * what they send and their side taking more of the replies. Operators
+ * that go over the line size or make the connection fail are let go
+ * of. */
+void admin_poll
+(
+ AdminChannel *
+);
+
+/* Takes the next complete command line, if any, and parses it, answering
+ * those that don't parse and the ones it takes care of itself; returns 1
+ * with the others, for the caller to answer with admin_reply */
+int admin_next_command
+(
+ AdminChannel *,
+ AdminCommand *
+);
+
+/* A line of the answer, without its line feed, sent as far as the
+ * operator's side takes it and kept for later otherwise. Does nothing
+ * if there's no operator anymore. */
+void admin_reply
+(
+ AdminChannel *,
+ const char * fmt,
+ ...
+);
+
+#endif
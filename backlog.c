@@ -0,0 +1,94 @@
+#include "backlog.h"
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include "frame.h"
+
+
+int
+backlog_init
+(
+ Backlog * backlog,
+ size_t max_messages
+)
+{
+	*backlog = (Backlog){0};
+	if ( !max_messages )
+		return 1;
+	
+	/* Each frame carries at least one message */
+	if ( !(backlog->entries = malloc(max_messages * sizeof(*backlog->entries))) )
+		return 0;
+	backlog->capacity = max_messages;
+	backlog->max_messages = max_messages;
+	return 1;
+}
+
+void
+backlog_cleanup
+(
+ Backlog * backlog
+)
+{
+	for ( size_t i = 0 ; i != backlog->n ; ++i )
+		frame_release(backlog->entries[(backlog->first + i) % backlog->capacity].frame);
+	free(backlog->entries);
+	*backlog = (Backlog){0};
+}
+
+void
+backlog_append
+(
+ Backlog * backlog,
+ uint64_t sequence,
+ Frame * frame
+)
+{
+	while ( backlog->n && (backlog->n == backlog->capacity || backlog->messages + frame->messages > backlog->max_messages) )
+	{
+		BacklogEntry * const oldest = backlog->entries + backlog->first;
+		backlog->messages -= oldest->frame->messages;
+		frame_release(oldest->frame);
+		backlog->first = (backlog->first + 1) % backlog->capacity;
+		--backlog->n;
+	}
+	
+	frame_retain(frame);
+	backlog->entries[(backlog->first + backlog->n) % backlog->capacity] = (BacklogEntry){sequence, frame};
+	backlog->messages += frame->messages;
+	++backlog->n;
+}
+
+size_t
+backlog_find
+(
+ const Backlog * backlog,
+ uint64_t sequence
+)
+{
+	size_t low = 0;
+	size_t high = backlog->n;
+	
+	/* The first entry whose messages don't all come before it */
+	while ( low != high )
+	{
+		const size_t middle = low + (high - low) / 2;
+		const BacklogEntry * const entry = backlog_entry(backlog, middle);
+		if ( entry->sequence + entry->frame->messages <= sequence )
+			low = middle + 1;
+		else
+			high = middle;
+	}
+	return low;
+}
+
+const BacklogEntry *
+backlog_entry
+(
+ const Backlog * backlog,
+ size_t index
+)
+{
+	return backlog->entries + (backlog->first + index) % backlog->capacity;
+}
@@ -0,0 +1,67 @@
+#ifndef BACKLOG_H
+#define BACKLOG_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include "frame.h"
+
+
+/* The messages broadcast most recently, kept for clients that come back
+ * after losing their connection to pick up where they left off. Every
+ * message broadcast gets the next sequence number, and the backlog holds
+ * the frames they went out in (the ones of encoding_v2_resumable, each
+ * starting with the sequence number of its first message), oldest
+ * first, up to a number of messages, past which the oldest frames are
+ * let go of. Since sequence numbers only ever go up, a client's place in
+ * it is found by binary search. Protected by the client pool lock. */
+
+typedef struct {
+	uint64_t sequence; // of the frame's first message
+	Frame * frame;
+} BacklogEntry;
+
+typedef struct {
+	BacklogEntry * entries; // a ring of capacity of them
+	size_t capacity;
+	size_t first;
+	size_t n;
+	size_t messages; // in all the frames together
+	size_t max_messages; // 0 if it's off
+} Backlog;
+
+int backlog_init
+(
+ Backlog *,
+ size_t max_messages
+);
+
+void backlog_cleanup
+(
+ Backlog *
+);
+
+/* The frame, which gets retained, carries the messages from the given
+ * sequence number on, which is to follow on from those before it */
+void backlog_append
+(
+ Backlog *,
+ uint64_t sequence,
+ Frame *
+);
+
+/* Returns the index of the oldest entry holding a message with the
+ * given sequence number or a later one, n if there's none */
+size_t backlog_find
+(
+ const Backlog *,
+ uint64_t sequence
+);
+
+/* Entries by index, 0 being the oldest */
+const BacklogEntry * backlog_entry
+(
+ const Backlog *,
+ size_t index
+);
+
+#endif
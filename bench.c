@@ -0,0 +1,2416 @@
+#include <stdint.h>
+#include <inttypes.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "core.h"
+#include "logmsg.h"
+#include "platform.h"
+#include "text.h"
+#include "filter.h"
+#include "scaler.h"
+#include "protocol.h"
+#include "stats.h"
+#if defined(__linux__)
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+/* Micro-benchmarks of the server core. Like lappenchat-sim, they run the
+ * core against an in-memory transport, but instead of checking anything
+ * they time one thing over and over:
+ *
+ *   broadcast  a message from one client to all of them: the walk over
+ *              the client store and the queueing of the frame for each,
+ *              then, timed apart, the completion of the sends it started
+ *   resume     the clients all reconnecting together after -r messages
+ *              were broadcast and each resuming from a point of its own
+ *              among them: their handshakes, which look them up in the
+ *              backlog, then, timed apart, catching them up
+ *   lanes      broadcasts of twice as many messages as the clients' sends
+ *              complete, with another client joining or leaving every
+ *              round, and how long the frames waited in each lane (see
+ *              core.h), control frames being the notices of those
+ *              joining and leaving. A notice waits for the send in
+ *              flight to its client, and the sends all complete
+ *              together at the end of each round, one client after
+ *              another, so control frames wait for up to a round of
+ *              that, which grows with the clients: with 1000 of them,
+ *              256 us at p50 and 512 us at p99; with the default 10000,
+ *              4 ms and 8 ms. Chat frames wait for many rounds.
+ *   presence   -c clients asking for notices of who's there all joining
+ *              over -r presence windows: the frames and bytes it takes
+ *              to tell them, against a notice for every join to every
+ *              client already there
+ *   memory     -r messages broadcast to -c clients, one in ten of which
+ *              never gets a send completed and one in ten sends the
+ *              start of the largest frame there may be and nothing
+ *              more: the memory that pins, and what the budgets of -q
+ *              and -Q do about it
+ *   batch      every one of -c clients sending -r messages, one per
+ *              round, their completions dequeued in batches of 1, 16
+ *              and 64, as the server's worker threads do (-d there):
+ *              the kernel transitions that takes per message delivered,
+ *              counting every dequeue, recv and send, and the messages
+ *              per second the core gets through. Every message going
+ *              to every client, it takes the square of the clients
+ *              times the rounds, so it has defaults of its own, 1000
+ *              clients and 100 rounds
+ *   fanout     broadcasts to audiences of 1000 clients up to -c, by
+ *              the thread the message came in on alone and fanned out
+ *              in chunks with -x threads helping (see core.h): the
+ *              time until the last of them has had its send started
+ *   zerocopy   a model of what copying sends costs (-Z in the server
+ *              turns it off): broadcasts of frames of 4 KiB up to
+ *              64 KiB to -c clients, every send memcpy'd into a buffer
+ *              as the kernel would copy it into the socket's, and not:
+ *              the time per byte delivered. The sockets themselves
+ *              aren't involved, so what the kernel does besides the
+ *              copy isn't in it, nor is the switch of SO_SNDBUF
+ *   idle       10000, 100000 and 500000 clients up to -c connected and
+ *              quiet, half of them speaking protocol v2, with and
+ *              without idle recvs (-z in the server): the memory the
+ *              core allocates per client, and what of it is pinned by
+ *              the recvs they have pending, in bytes and pages
+ *   utf8       the validation of message text (see text.h) by each of
+ *              the kernels the processor supports, the scalar one being
+ *              the baseline, on text of several sizes and scripts
+ *   filter     the moderation of messages against a list of -t random
+ *              terms (see filter.h), one message in ten having one of
+ *              them, in messages per second, once masking has been
+ *              checked on a few cases
+ *   drain      -c clients, every other one speaking protocol v2 and taking
+ *              notices, with -r messages broadcast to them and none of
+ *              the sends completed yet, then shut down as the server
+ *              does: the time until every frame has gone out, the
+ *              notices of the shutdown among them, and every client
+ *              has been let go of
+ *   elastic    the sizing of an elastic worker pool (see scaler.h) over
+ *              a simulated day of load, from a tenth of the peak at
+ *              night up to it at noon, against a pool of fixed size
+ *
+ * On Linux, the cache misses and references are counted as well, the
+ * way perf stat would, if the kernel lets us. */
+
+
+typedef struct {
+	int misses;
+	int references;
+} CacheCounters;
+
+#if defined(__linux__)
+
+static int
+open_counter
+(
+ uint64_t config,
+ int group
+)
+{
+	struct perf_event_attr attr;
+	
+	memset(&attr, 0, sizeof(attr));
+	attr.type = PERF_TYPE_HARDWARE;
+	attr.size = sizeof(attr);
+	attr.config = config;
+	attr.disabled = group == -1;
+	attr.exclude_kernel = 1;
+	attr.exclude_hv = 1;
+	attr.read_format = PERF_FORMAT_GROUP;
+	return (int)syscall(SYS_perf_event_open, &attr, 0, -1, group, 0);
+}
+
+static int
+counters_open
+(
+ CacheCounters * counters
+)
+{
+	counters->misses = open_counter(PERF_COUNT_HW_CACHE_MISSES, -1);
+	counters->references = counters->misses == -1 ? -1 : open_counter(PERF_COUNT_HW_CACHE_REFERENCES, counters->misses);
+	if ( counters->references == -1 )
+	{
+		if ( counters->misses != -1 )
+			close(counters->misses);
+		counters->misses = -1;
+		return 0;
+	}
+	return 1;
+}
+
+static void
+counters_start
+(
+ CacheCounters * counters
+)
+{
+	if ( counters->misses != -1 )
+		ioctl(counters->misses, PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
+}
+
+static void
+counters_stop
+(
+ CacheCounters * counters
+)
+{
+	if ( counters->misses != -1 )
+		ioctl(counters->misses, PERF_EVENT_IOC_DISABLE, PERF_IOC_FLAG_GROUP);
+}
+
+/* Misses and references counted so far */
+static int
+counters_read
+(
+ CacheCounters * counters,
+ uint64_t * misses,
+ uint64_t * references
+)
+{
+	uint64_t values[3];
+	
+	if ( counters->misses == -1 || read(counters->misses, values, sizeof(values)) != sizeof(values) )
+		return 0;
+	*misses = values[1];
+	*references = values[2];
+	return 1;
+}
+
+static void
+counters_close
+(
+ CacheCounters * counters
+)
+{
+	if ( counters->misses != -1 )
+	{
+		close(counters->references);
+		close(counters->misses);
+	}
+}
+
+#else
+
+static int
+counters_open
+(
+ CacheCounters * counters
+)
+{
+	counters->misses = counters->references = -1;
+	return 0;
+}
+
+static void
+counters_start
+(
+ CacheCounters * counters
+)
+{
+	(void)counters;
+}
+
+static void
+counters_stop
+(
+ CacheCounters * counters
+)
+{
+	(void)counters;
+}
+
+static int
+counters_read
+(
+ CacheCounters * counters,
+ uint64_t * misses,
+ uint64_t * references
+)
+{
+	(void)counters;
+	(void)misses;
+	(void)references;
+	return 0;
+}
+
+static void
+counters_close
+(
+ CacheCounters * counters
+)
+{
+	(void)counters;
+}
+
+#endif
+
+struct bench_options {
+	unsigned long clients;
+	unsigned long empty; // slots left free, in between the clients
+	unsigned long rounds;
+	unsigned long message_size;
+	unsigned long terms; // in the filter's list
+	/* As the server's -q and -Q */
+	unsigned long connection_budget; // KiB
+	unsigned long memory_budget; // MiB
+	unsigned long helpers; // threads helping fan broadcasts out
+};
+
+/* The in-memory transport, which just records what the core asks for */
+
+#define socket_buffers_n 256
+
+typedef struct {
+	Core core;
+	ClientData * * clients;
+	/* The recv each client has pending, and how large it is if that's
+	 * to be kept track of (NULL otherwise) */
+	unsigned char * * recv_buffers;
+	size_t * recv_sizes;
+	/* The clients with a send pending, and how long each send is */
+	ClientData * * sending;
+	size_t * send_sizes;
+	size_t sending_n;
+	/* For resuming clients, the sequence number each is to be sent
+	 * next (0 for the others), and how many times one was sent a
+	 * later one instead */
+	uint64_t * expected;
+	unsigned long gaps;
+	/* The client the presence window was started by, while it's
+	 * open, which only closes when the benchmark says so */
+	ClientData * presence_timer;
+	/* The clients whose sends never complete, and which of them
+	 * have one pending */
+	char * stalling;
+	char * stalled;
+	/* For the presence benchmark, the number of others each client
+	 * was told are there, and the notices sent altogether */
+	long * present;
+	uint64_t notice_frames;
+	uint64_t notice_bytes;
+	/* For broadcasts fanned out by several threads, how many sends
+	 * they started, and the times helpers were asked for */
+	volatile long sending_shared;
+	volatile long help_requested;
+	volatile long helpers_quit;
+	/* For copying sends, a ring of buffers as large as any frame
+	 * that every frame sent is copied into the next one of, as the
+	 * kernel copies sends into socket buffers; NULL for sends out
+	 * of the frames themselves */
+	unsigned char * socket_buffers;
+	size_t socket_buffer_size;
+	size_t socket_buffer_next;
+	uint64_t bytes_sent;
+} Bench;
+
+static int
+bench_recv
+(
+ void * context,
+ ClientData * client_data,
+ void * buffer,
+ size_t size
+)
+{
+	Bench * const bench = (Bench *)context;
+	
+	bench->recv_buffers[client_data->handle] = buffer;
+	if ( bench->recv_sizes )
+		bench->recv_sizes[client_data->handle] = size;
+	return 1;
+}
+
+/* Frames of encoding_v2_resumable, or the reply to the handshake */
+static void
+check_sequence
+(
+ Bench * bench,
+ uintptr_t client,
+ const unsigned char * frame,
+ size_t size
+)
+{
+	const unsigned char * const end = frame + size;
+	uint32_t length;
+	
+	if ( *frame == protocol_v2_marker )
+	{
+		if ( uint64_get(end - 8) > bench->expected[client] )
+			++bench->gaps;
+		return;
+	}
+	
+	frame += varint_get(frame, end, &length);
+	const uint64_t sequence = uint64_get(frame);
+	frame += 8;
+	frame += 1 + *frame;
+	uint64_t messages = 0;
+	for ( ; frame < end ; frame += length, ++messages )
+		frame += varint_get(frame, end, &length);
+	
+	if ( sequence > bench->expected[client] )
+		++bench->gaps;
+	if ( sequence + messages > bench->expected[client] )
+		bench->expected[client] = sequence + messages;
+}
+
+/* Control frames (see protocol.h) of clients that don't resume */
+static void
+count_present
+(
+ Bench * bench,
+ uintptr_t client,
+ const unsigned char * frame,
+ size_t size
+)
+{
+	const unsigned char * const end = frame + size;
+	uint32_t length;
+	
+	/* The reply to the handshake, which starts with protocol_v2_marker,
+	 * as may the length of a frame */
+	const int length_size = varint_get(frame, end, &length);
+	if ( length_size <= 0 || length_size + length != size )
+		return;
+	frame += length_size;
+	if ( *frame++ )
+		return;
+	
+	++bench->notice_frames;
+	bench->notice_bytes += size;
+	while ( frame < end )
+	{
+		const unsigned char notice = *frame++;
+		uint32_t n;
+		frame += varint_get(frame, end, &n);
+		bench->present[client] += notice == notice_leave ? -(long)n : (long)n;
+		/* Everyone there comes in a frame of its own */
+		if ( notice == notice_present )
+			break;
+		for ( uint32_t i = 0 ; i != n ; ++i )
+			frame += 1 + *frame;
+	}
+}
+
+static int
+bench_send
+(
+ void * context,
+ ClientData * client_data,
+ const TransportBuffer * buffers,
+ size_t buffers_n
+)
+{
+	Bench * const bench = (Bench *)context;
+	size_t size = 0;
+	
+	if ( bench->stalling && bench->stalling[client_data->handle] )
+	{
+		bench->stalled[client_data->handle] = 1;
+		return 1;
+	}
+	for ( size_t i = 0 ; i != buffers_n ; ++i )
+	{
+		size += buffers[i].len;
+		if ( bench->expected && bench->expected[client_data->handle] )
+			check_sequence(bench, client_data->handle, (const unsigned char *)buffers[i].buf, buffers[i].len);
+		if ( bench->present )
+			count_present(bench, client_data->handle, (const unsigned char *)buffers[i].buf, buffers[i].len);
+		if ( bench->socket_buffers )
+		{
+			memcpy(bench->socket_buffers + bench->socket_buffer_next * bench->socket_buffer_size, buffers[i].buf, buffers[i].len);
+			bench->socket_buffer_next = (bench->socket_buffer_next + 1) % socket_buffers_n;
+		}
+	}
+	bench->bytes_sent += size;
+	bench->sending[bench->sending_n] = client_data;
+	bench->send_sizes[bench->sending_n++] = size;
+	return 1;
+}
+
+/* As bench_send, for any number of threads at once */
+static int
+bench_send_shared
+(
+ void * context,
+ ClientData * client_data,
+ const TransportBuffer * buffers,
+ size_t buffers_n
+)
+{
+	Bench * const bench = (Bench *)context;
+	const long i = platform_increment(&bench->sending_shared) - 1;
+	size_t size = 0;
+	
+	for ( size_t j = 0 ; j != buffers_n ; ++j )
+		size += buffers[j].len;
+	bench->sending[i] = client_data;
+	bench->send_sizes[i] = size;
+	return 1;
+}
+
+static void
+bench_close
+(
+ void * context,
+ ClientData * client_data
+)
+{
+	(void)context;
+	(void)client_data;
+}
+
+static int
+bench_set_timer
+(
+ void * context,
+ ClientData * client_data,
+ enum CoreTimer timer,
+ uint32_t ms
+)
+{
+	Bench * const bench = (Bench *)context;
+	
+	(void)ms;
+	/* Nothing waits for a timer but the presence window */
+	if ( timer != timer_presence )
+		return 0;
+	bench->presence_timer = client_data;
+	return 1;
+}
+
+static void
+bench_release
+(
+ void * context,
+ ClientData * client_data
+)
+{
+	(void)context;
+	(void)client_data;
+}
+
+static uint64_t
+bench_now
+(
+ void * context
+)
+{
+	(void)context;
+	return 0;
+}
+
+/* Has the client's pending recv complete with the given bytes, once
+ * the recv of 0 bytes it's idling in, if it is, has completed */
+static void
+feed
+(
+ Bench * bench,
+ unsigned long client,
+ const void * bytes,
+ size_t size
+)
+{
+	if ( !bench->recv_buffers[client] )
+		core_recv_completed(&bench->core, bench->clients[client], 0);
+	memcpy(bench->recv_buffers[client], bytes, size);
+	core_recv_completed(&bench->core, bench->clients[client], size);
+}
+
+static void
+complete_sends
+(
+ Bench * bench
+)
+{
+	/* Sends started by these completions get completed too */
+	while ( bench->sending_n )
+	{
+		--bench->sending_n;
+		core_send_completed(&bench->core, bench->sending[bench->sending_n], bench->send_sizes[bench->sending_n]);
+	}
+}
+
+/* Only the sends pending so far; those they start are left pending */
+static void
+complete_pending_sends
+(
+ Bench * bench,
+ ClientData * * pending,
+ size_t * sizes
+)
+{
+	const size_t pending_n = bench->sending_n;
+	
+	memcpy(pending, bench->sending, pending_n * sizeof(*pending));
+	memcpy(sizes, bench->send_sizes, pending_n * sizeof(*sizes));
+	bench->sending_n = 0;
+	for ( size_t i = 0 ; i != pending_n ; ++i )
+		core_send_completed(&bench->core, pending[i], sizes[i]);
+}
+
+static void
+close_presence_window
+(
+ Bench * bench
+)
+{
+	ClientData * const client_data = bench->presence_timer;
+	
+	if ( client_data )
+	{
+		bench->presence_timer = NULL;
+		core_timer_fired(&bench->core, client_data, timer_presence);
+	}
+}
+
+static void
+free_bench
+(
+ Bench * bench
+)
+{
+	free(bench->clients);
+	free(bench->recv_buffers);
+	free(bench->recv_sizes);
+	free(bench->sending);
+	free(bench->send_sizes);
+	free(bench->expected);
+	free(bench->present);
+	free(bench->stalling);
+	free(bench->stalled);
+	free(bench->socket_buffers);
+}
+
+static int
+bench_broadcast
+(
+ const struct bench_options * options
+)
+{
+	const unsigned long capacity = options->clients + options->empty;
+	Bench bench = {0};
+	const Transport transport = {
+		.context = &bench,
+		.recv = bench_recv,
+		.send = bench_send,
+		.close = bench_close,
+		.set_timer = bench_set_timer,
+		.release = bench_release,
+		.now = bench_now
+	};
+	const CoreOptions core_options = {
+		.capacity = capacity
+	};
+	char message[255];
+	CacheCounters counters;
+	
+	bench.clients = calloc(capacity, sizeof(*bench.clients));
+	bench.recv_buffers = calloc(capacity, sizeof(*bench.recv_buffers));
+	bench.sending = calloc(capacity, sizeof(*bench.sending));
+	bench.send_sizes = calloc(capacity, sizeof(*bench.send_sizes));
+	if ( !bench.clients || !bench.recv_buffers || !bench.sending || !bench.send_sizes || !core_init(&bench.core, &transport, &core_options) )
+	{
+		logmsg("couldn't allocate memory for the benchmark");
+		free_bench(&bench);
+		return 0;
+	}
+	
+	/* Every slot is taken, and then the empty ones given back, so that
+	 * they're spread out among the clients */
+	for ( unsigned long i = 0 ; i != capacity ; ++i )
+	{
+		if ( !(bench.clients[i] = core_client_open(&bench.core, i)) )
+		{
+			logmsg("couldn't set up the clients");
+			core_cleanup(&bench.core);
+			free_bench(&bench);
+			return 0;
+		}
+	}
+	for ( unsigned long i = 0 ; i != capacity ; ++i )
+	{
+		if ( options->empty && i % (capacity / options->empty) == 0 && i / (capacity / options->empty) < options->empty )
+		{
+			core_client_abandon(&bench.core, bench.clients[i]);
+			bench.clients[i] = NULL;
+			continue;
+		}
+		
+		char nickname[1 + 16];
+		nickname[0] = (char)snprintf(nickname + 1, sizeof(nickname) - 1, "c%lu", i);
+		core_client_start(&bench.core, bench.clients[i]);
+		feed(&bench, i, nickname, 1);
+		feed(&bench, i, nickname + 1, (size_t)nickname[0]);
+	}
+	
+	memset(message, 'x', sizeof(message));
+	const unsigned char message_length = (unsigned char)options->message_size;
+	const int counting = counters_open(&counters);
+	uint64_t broadcast_ns = 0;
+	uint64_t completion_ns = 0;
+	unsigned long sender = 0;
+	
+	for ( unsigned long round = 0 ; round != options->rounds ; ++round )
+	{
+		while ( !bench.clients[sender] )
+			sender = (sender + 1) % capacity;
+		feed(&bench, sender, &message_length, 1);
+		
+		counters_start(&counters);
+		uint64_t start = platform_now_ns();
+		feed(&bench, sender, message, message_length);
+		broadcast_ns += platform_now_ns() - start;
+		counters_stop(&counters);
+		
+		start = platform_now_ns();
+		complete_sends(&bench);
+		completion_ns += platform_now_ns() - start;
+		
+		sender = (sender + 1) % capacity;
+	}
+	
+	const double deliveries = (double)options->rounds * options->clients;
+	logmsgf("broadcast to %lu clients (%lu slots), %lu rounds: %.1f us per broadcast, %.2f ns per recipient; send completions %.2f ns per recipient\n", options->clients, capacity, options->rounds, broadcast_ns / 1e3 / options->rounds, broadcast_ns / deliveries, completion_ns / deliveries);
+	
+	uint64_t misses;
+	uint64_t references;
+	if ( counting && counters_read(&counters, &misses, &references) )
+		logmsgf("cache misses: %.3f per recipient, %.1f%% of %.3f references per recipient\n", misses / deliveries, references ? 100. * misses / references : 0., references / deliveries);
+	else
+		logmsg("cache misses: no hardware counters available");
+	counters_close(&counters);
+	
+	/* Everybody hangs up */
+	for ( unsigned long i = 0 ; i != capacity ; ++i )
+		if ( bench.clients[i] )
+			core_recv_completed(&bench.core, bench.clients[i], 0);
+	core_cleanup(&bench.core);
+	free_bench(&bench);
+	
+	return 1;
+}
+
+static int
+bench_resume
+(
+ const struct bench_options * options
+)
+{
+	/* The clients resuming, and the one sending while they're away */
+	const unsigned long capacity = options->clients + 1;
+	const unsigned long sender = options->clients;
+	const unsigned long rounds = options->rounds ? options->rounds : 1;
+	Bench bench = {0};
+	const Transport transport = {
+		.context = &bench,
+		.recv = bench_recv,
+		.send = bench_send,
+		.close = bench_close,
+		.set_timer = bench_set_timer,
+		.release = bench_release,
+		.now = bench_now
+	};
+	const CoreOptions core_options = {
+		.capacity = capacity,
+		.backlog = rounds
+	};
+	char message[1 + 255];
+	
+	bench.clients = calloc(capacity, sizeof(*bench.clients));
+	bench.recv_buffers = calloc(capacity, sizeof(*bench.recv_buffers));
+	bench.sending = calloc(capacity, sizeof(*bench.sending));
+	bench.send_sizes = calloc(capacity, sizeof(*bench.send_sizes));
+	bench.expected = calloc(capacity, sizeof(*bench.expected));
+	if ( !bench.clients || !bench.recv_buffers || !bench.sending || !bench.send_sizes || !bench.expected || !core_init(&bench.core, &transport, &core_options) )
+	{
+		logmsg("couldn't allocate memory for the benchmark");
+		free_bench(&bench);
+		return 0;
+	}
+	
+	if ( !(bench.clients[sender] = core_client_open(&bench.core, sender)) )
+	{
+		logmsg("couldn't set up the clients");
+		core_cleanup(&bench.core);
+		free_bench(&bench);
+		return 0;
+	}
+	core_client_start(&bench.core, bench.clients[sender]);
+	feed(&bench, sender, "\1s", 1);
+	feed(&bench, sender, "s", 1);
+	
+	message[0] = (char)options->message_size;
+	memset(message + 1, 'x', sizeof(message) - 1);
+	for ( unsigned long round = 0 ; round != rounds ; ++round )
+	{
+		feed(&bench, sender, message, 1);
+		feed(&bench, sender, message + 1, options->message_size);
+		complete_sends(&bench);
+	}
+	
+	/* Each of them got a different number of them before
+	 * losing its connection */
+	uint64_t missed = 0;
+	uint64_t handshake_ns = 0;
+	for ( unsigned long i = 0 ; i != options->clients ; ++i )
+	{
+		if ( !(bench.clients[i] = core_client_open(&bench.core, i)) )
+		{
+			logmsg("couldn't set up the clients");
+			core_cleanup(&bench.core);
+			free_bench(&bench);
+			return 0;
+		}
+		
+		const uint64_t resume_after = i % rounds + 1;
+		unsigned char handshake[3 + 16 + 8];
+		size_t handshake_size = 0;
+		handshake[handshake_size++] = protocol_version;
+		handshake[handshake_size++] = capability_batch | capability_resume;
+		handshake[handshake_size] = (unsigned char)snprintf((char *)handshake + handshake_size + 1, 16, "c%lu", i);
+		handshake_size += 1 + handshake[handshake_size];
+		uint64_put(handshake + handshake_size, resume_after);
+		handshake_size += 8;
+		bench.expected[i] = resume_after + 1;
+		missed += rounds - resume_after;
+		
+		core_client_start(&bench.core, bench.clients[i]);
+		feed(&bench, i, "\xFF", 1);
+		const uint64_t start = platform_now_ns();
+		feed(&bench, i, handshake, handshake_size);
+		handshake_ns += platform_now_ns() - start;
+	}
+	
+	const uint64_t start = platform_now_ns();
+	complete_sends(&bench);
+	const uint64_t catch_up_ns = platform_now_ns() - start;
+	
+	unsigned long behind = 0;
+	for ( unsigned long i = 0 ; i != options->clients ; ++i )
+		if ( bench.expected[i] != rounds + 1 || bench.core.receiving[bench.clients[i] - bench.core.clients] != encoding_v2_resumable )
+			++behind;
+	
+	logmsgf("%lu clients resuming %.1f of %lu messages back on average: %.2f us per handshake, %.2f ns per message caught up, %.1f ms altogether\n", options->clients, (double)missed / options->clients, rounds, handshake_ns / 1e3 / options->clients, missed ? (double)catch_up_ns / missed : 0., (handshake_ns + catch_up_ns) / 1e6);
+	if ( behind || bench.gaps )
+		logmsgf("%lu clients weren't caught up, %lu gaps\n", behind, bench.gaps);
+	
+	for ( unsigned long i = 0 ; i != capacity ; ++i )
+		core_recv_completed(&bench.core, bench.clients[i], 0);
+	complete_sends(&bench);
+	core_cleanup(&bench.core);
+	free_bench(&bench);
+	
+	return !behind && !bench.gaps;
+}
+
+/* Connects a protocol v2 client, with the given capabilities */
+static int
+connect_v2
+(
+ Bench * bench,
+ unsigned long client,
+ unsigned capabilities
+)
+{
+	unsigned char handshake[3 + 16];
+	size_t handshake_size = 0;
+	
+	if ( !(bench->clients[client] = core_client_open(&bench->core, client)) )
+		return 0;
+	handshake[handshake_size++] = protocol_version;
+	handshake[handshake_size++] = (unsigned char)capabilities;
+	handshake[handshake_size] = (unsigned char)snprintf((char *)handshake + handshake_size + 1, 16, "c%lu", client);
+	handshake_size += 1 + handshake[handshake_size];
+	
+	core_client_start(&bench->core, bench->clients[client]);
+	feed(bench, client, "\xFF", 1);
+	/* The memory budget may have had it released already */
+	if ( bench->clients[client]->closing )
+	{
+		bench->clients[client] = NULL;
+		return 0;
+	}
+	feed(bench, client, handshake, handshake_size);
+	return 1;
+}
+
+static int
+bench_lanes
+(
+ const struct bench_options * options
+)
+{
+	/* The clients, the one sending and the one coming and going */
+	const unsigned long capacity = options->clients + 2;
+	const unsigned long sender = options->clients;
+	const unsigned long visitor = options->clients + 1;
+	const unsigned frames_per_send = 4;
+	const unsigned burst = 2 * frames_per_send;
+	Bench bench = {0};
+	const Transport transport = {
+		.context = &bench,
+		.recv = bench_recv,
+		.send = bench_send,
+		.close = bench_close,
+		.set_timer = bench_set_timer,
+		.release = bench_release,
+		.now = bench_now
+	};
+	const CoreOptions core_options = {
+		.capacity = capacity,
+		.frames_per_send = frames_per_send
+	};
+	ClientData * * const pending = calloc(capacity, sizeof(*pending));
+	size_t * const sizes = calloc(capacity, sizeof(*sizes));
+	char message[1 + 255];
+	
+	bench.clients = calloc(capacity, sizeof(*bench.clients));
+	bench.recv_buffers = calloc(capacity, sizeof(*bench.recv_buffers));
+	bench.sending = calloc(capacity, sizeof(*bench.sending));
+	bench.send_sizes = calloc(capacity, sizeof(*bench.send_sizes));
+	if ( !pending || !sizes || !bench.clients || !bench.recv_buffers || !bench.sending || !bench.send_sizes || !core_init(&bench.core, &transport, &core_options) )
+	{
+		logmsg("couldn't allocate memory for the benchmark");
+		free(pending);
+		free(sizes);
+		free_bench(&bench);
+		return 0;
+	}
+	
+	for ( unsigned long i = 0 ; i != options->clients ; ++i )
+	{
+		if ( !connect_v2(&bench, i, capability_notices) )
+		{
+			logmsg("couldn't set up the clients");
+			core_cleanup(&bench.core);
+			free(pending);
+			free(sizes);
+			free_bench(&bench);
+			return 0;
+		}
+	}
+	bench.clients[sender] = core_client_open(&bench.core, sender);
+	core_client_start(&bench.core, bench.clients[sender]);
+	feed(&bench, sender, "\1s", 1);
+	feed(&bench, sender, "s", 1);
+	close_presence_window(&bench);
+	complete_sends(&bench);
+	memset(bench.core.lane_waits, 0, sizeof(bench.core.lane_waits));
+	
+	/* Each round, a burst of messages goes out to every client, which
+	 * only get to send half of it, so that their queues fill up */
+	message[0] = (char)options->message_size;
+	memset(message + 1, 'x', sizeof(message) - 1);
+	const uint64_t start = platform_now_ns();
+	for ( unsigned long round = 0 ; round != options->rounds ; ++round )
+	{
+		for ( unsigned i = 0 ; i != burst ; ++i )
+		{
+			feed(&bench, sender, message, 1);
+			feed(&bench, sender, message + 1, options->message_size);
+		}
+		if ( round % 2 == 0 )
+			connect_v2(&bench, visitor, capability_notices);
+		else
+			core_recv_completed(&bench.core, bench.clients[visitor], 0);
+		close_presence_window(&bench);
+		complete_pending_sends(&bench, pending, sizes);
+	}
+	const uint64_t elapsed = platform_now_ns() - start;
+	
+	logmsgf("%lu clients, %lu rounds of %u messages and a notice in %.1f ms, %"PRIu64" messages dropped\n", options->clients, options->rounds, burst, elapsed / 1e6, bench.core.messages_dropped);
+	for ( unsigned lane = 0 ; lane != lanes ; ++lane )
+	{
+		const uint64_t * const waits = bench.core.lane_waits[lane];
+		uint64_t frames = 0;
+		for ( unsigned i = 0 ; i != lane_wait_buckets ; ++i )
+			frames += waits[i];
+		if ( frames )
+			logmsgf("%-8s %10"PRIu64" frames waited up to %6"PRIu64" us half of the time, %6"PRIu64" us 99%% of it, %6"PRIu64" us at most\n", stats_lane_name(lane), frames, stats_wait_percentile(waits, .5), stats_wait_percentile(waits, .99), stats_wait_percentile(waits, 1));
+	}
+	
+	for ( unsigned long i = 0 ; i != capacity ; ++i )
+		if ( bench.clients[i] && !bench.clients[i]->closing )
+			core_recv_completed(&bench.core, bench.clients[i], 0);
+	close_presence_window(&bench);
+	complete_sends(&bench);
+	core_cleanup(&bench.core);
+	free(pending);
+	free(sizes);
+	free_bench(&bench);
+	
+	return 1;
+}
+
+static int
+bench_presence
+(
+ const struct bench_options * options
+)
+{
+	const unsigned long windows = options->rounds ? options->rounds : 1;
+	const unsigned long per_window = (options->clients + windows - 1) / windows;
+	Bench bench = {0};
+	const Transport transport = {
+		.context = &bench,
+		.recv = bench_recv,
+		.send = bench_send,
+		.close = bench_close,
+		.set_timer = bench_set_timer,
+		.release = bench_release,
+		.now = bench_now
+	};
+	const CoreOptions core_options = {
+		.capacity = options->clients
+	};
+	
+	bench.clients = calloc(options->clients, sizeof(*bench.clients));
+	bench.recv_buffers = calloc(options->clients, sizeof(*bench.recv_buffers));
+	bench.sending = calloc(options->clients, sizeof(*bench.sending));
+	bench.send_sizes = calloc(options->clients, sizeof(*bench.send_sizes));
+	bench.present = calloc(options->clients, sizeof(*bench.present));
+	if ( !bench.clients || !bench.recv_buffers || !bench.sending || !bench.send_sizes || !bench.present || !core_init(&bench.core, &transport, &core_options) )
+	{
+		logmsg("couldn't allocate memory for the benchmark");
+		free_bench(&bench);
+		return 0;
+	}
+	
+	/* Without the window, each client joining would be told of those
+	 * there already in a frame of its own, and each of them of it in a
+	 * frame of the length, a nickname length of 0, the notice, a count
+	 * of 1 and the nickname */
+	uint64_t naive_frames = 0;
+	uint64_t naive_bytes = 0;
+	size_t names = 0;
+	for ( unsigned long i = 0 ; i != options->clients ; ++i )
+	{
+		char nickname[16];
+		const size_t nickname_length = (size_t)snprintf(nickname, sizeof(nickname), "c%lu", i);
+		const size_t payload = 1 + 1 + varint_size((uint32_t)i + 1) + names + 1 + nickname_length;
+		names += 1 + nickname_length;
+		naive_frames += i + 1;
+		naive_bytes += i * (4 + nickname_length) + varint_size((uint32_t)payload) + payload;
+	}
+	
+	uint64_t join_ns = 0;
+	uint64_t flush_ns = 0;
+	for ( unsigned long joined = 0 ; joined != options->clients ; )
+	{
+		uint64_t start = platform_now_ns();
+		for ( const unsigned long end = joined + per_window < options->clients ? joined + per_window : options->clients ; joined != end ; ++joined )
+		{
+			if ( !connect_v2(&bench, joined, capability_notices) )
+			{
+				logmsg("couldn't set up the clients");
+				core_cleanup(&bench.core);
+				free_bench(&bench);
+				return 0;
+			}
+		}
+		join_ns += platform_now_ns() - start;
+		complete_sends(&bench);
+		
+		start = platform_now_ns();
+		close_presence_window(&bench);
+		complete_sends(&bench);
+		flush_ns += platform_now_ns() - start;
+	}
+	
+	unsigned long wrong = 0;
+	for ( unsigned long i = 0 ; i != options->clients ; ++i )
+		wrong += bench.present[i] != (long)options->clients;
+	
+	logmsgf("%lu clients joining over %lu windows: %"PRIu64" frames of notices, %.2f MB, in %.2f us per join and %.2f ms per window\n", options->clients, windows, bench.notice_frames, bench.notice_bytes / 1e6, join_ns / 1e3 / options->clients, flush_ns / 1e6 / windows);
+	logmsgf("a frame for every join would have taken %"PRIu64" frames, %.2f MB\n", naive_frames, naive_bytes / 1e6);
+	if ( wrong )
+		logmsgf("%lu clients weren't told of everybody\n", wrong);
+	
+	for ( unsigned long i = 0 ; i != options->clients ; ++i )
+		core_recv_completed(&bench.core, bench.clients[i], 0);
+	close_presence_window(&bench);
+	complete_sends(&bench);
+	core_cleanup(&bench.core);
+	free_bench(&bench);
+	
+	return !wrong;
+}
+
+static int
+bench_memory
+(
+ const struct bench_options * options
+)
+{
+	const unsigned long capacity = options->clients + 1;
+	const unsigned long sender = options->clients;
+	Bench bench = {0};
+	const Transport transport = {
+		.context = &bench,
+		.recv = bench_recv,
+		.send = bench_send,
+		.close = bench_close,
+		.set_timer = bench_set_timer,
+		.release = bench_release,
+		.now = bench_now
+	};
+	const CoreOptions core_options = {
+		.capacity = capacity,
+		.connection_budget = (size_t)options->connection_budget << 10,
+		.memory_budget = (size_t)options->memory_budget << 20
+	};
+	unsigned char largest_frame[varint_max_size];
+	char message[1 + 255];
+	
+	bench.clients = calloc(capacity, sizeof(*bench.clients));
+	bench.recv_buffers = calloc(capacity, sizeof(*bench.recv_buffers));
+	bench.sending = calloc(capacity, sizeof(*bench.sending));
+	bench.send_sizes = calloc(capacity, sizeof(*bench.send_sizes));
+	bench.stalling = calloc(capacity, 1);
+	bench.stalled = calloc(capacity, 1);
+	if ( !bench.clients || !bench.recv_buffers || !bench.sending || !bench.send_sizes || !bench.stalling || !bench.stalled || !core_init(&bench.core, &transport, &core_options) )
+	{
+		logmsg("couldn't allocate memory for the benchmark");
+		free_bench(&bench);
+		return 0;
+	}
+	const size_t largest_frame_size = varint_put(largest_frame, bench.core.max_frame);
+	
+	/* Those the budgets don't let in are left out */
+	unsigned long refused = 0;
+	for ( unsigned long i = 0 ; i != options->clients ; ++i )
+	{
+		bench.stalling[i] = i % 10 == 0;
+		if ( !connect_v2(&bench, i, capability_batch) )
+		{
+			++refused;
+			continue;
+		}
+		complete_sends(&bench);
+		if ( i % 10 == 5 )
+		{
+			feed(&bench, i, largest_frame, largest_frame_size);
+			if ( bench.clients[i]->closing )
+			{
+				++refused;
+				bench.clients[i] = NULL;
+			}
+		}
+	}
+	bench.clients[sender] = core_client_open(&bench.core, sender);
+	if ( !bench.clients[sender] )
+	{
+		logmsg("the budget didn't let the sender in");
+		core_cleanup(&bench.core);
+		free_bench(&bench);
+		return 0;
+	}
+	core_client_start(&bench.core, bench.clients[sender]);
+	feed(&bench, sender, "\1s", 1);
+	feed(&bench, sender, "s", 1);
+	close_presence_window(&bench);
+	complete_sends(&bench);
+	
+	message[0] = (char)options->message_size;
+	memset(message + 1, 'x', sizeof(message) - 1);
+	for ( unsigned long round = 0 ; round != options->rounds ; ++round )
+	{
+		feed(&bench, sender, message, 1);
+		feed(&bench, sender, message + 1, options->message_size);
+		complete_sends(&bench);
+	}
+	
+	logmsgf("%lu clients, %lu messages: %.1f MiB in use at the end, %.1f MiB at most, on top of %.1f MiB for the slots\n", options->clients, options->rounds, core_memory_used(&bench.core) / 1048576., bench.core.memory_peak / 1048576., capacity * (sizeof(ClientData) + sizeof(ClientQueue)) / 1048576.);
+	logmsgf("%lu clients not let in, %"PRIu64" disconnected, %"PRIu64" frames dropped for the connection budget, %"PRIu64" messages delivered\n", refused, bench.core.clients_shed, bench.core.frames_shed, bench.core.messages_delivered);
+	
+	/* Every one of them still has a recv pending */
+	for ( unsigned long i = 0 ; i != capacity ; ++i )
+	{
+		if ( !bench.clients[i] )
+			continue;
+		if ( bench.stalled[i] )
+			core_send_failed(&bench.core, bench.clients[i]);
+		core_recv_completed(&bench.core, bench.clients[i], 0);
+	}
+	close_presence_window(&bench);
+	complete_sends(&bench);
+	core_cleanup(&bench.core);
+	free_bench(&bench);
+	
+	return 1;
+}
+
+/* A completion waiting to be dequeued: a recv of the client's next
+ * message or part of one, or one of its sends */
+typedef struct {
+	unsigned long client;
+	size_t size; // of the send
+	char send;
+} BenchCompletion;
+
+/* Runs every client sending a message per round through a completion
+ * queue dequeued up to batch_size completions at a time, as a worker
+ * thread would, and reports the kernel transitions that would take:
+ * the dequeues, and a call for every recv and every send posted */
+static int
+run_batches
+(
+ const struct bench_options * options,
+ unsigned long batch_size
+)
+{
+	const unsigned long capacity = options->clients;
+	/* Each client has a recv and a send at most pending */
+	const size_t queue_capacity = 2 * (size_t)capacity;
+	Bench bench = {0};
+	const Transport transport = {
+		.context = &bench,
+		.recv = bench_recv,
+		.send = bench_send,
+		.close = bench_close,
+		.set_timer = bench_set_timer,
+		.release = bench_release,
+		.now = bench_now
+	};
+	const CoreOptions core_options = {
+		.capacity = capacity
+	};
+	BenchCompletion * const queue = malloc(queue_capacity * sizeof(*queue));
+	unsigned long * const sent = calloc(capacity, sizeof(*sent));
+	char * const length_next = malloc(capacity);
+	CoreBatch batch = {0};
+	char message[1 + 255];
+	
+	bench.clients = calloc(capacity, sizeof(*bench.clients));
+	bench.recv_buffers = calloc(capacity, sizeof(*bench.recv_buffers));
+	bench.sending = calloc(capacity, sizeof(*bench.sending));
+	bench.send_sizes = calloc(capacity, sizeof(*bench.send_sizes));
+	if ( !queue || !sent || !length_next || !bench.clients || !bench.recv_buffers || !bench.sending || !bench.send_sizes || !core_init(&bench.core, &transport, &core_options) )
+	{
+		logmsg("couldn't allocate memory for the benchmark");
+		free(queue);
+		free(sent);
+		free(length_next);
+		free_bench(&bench);
+		return 0;
+	}
+	if ( batch_size > 1 && !core_batch_init(&bench.core, &batch) )
+	{
+		logmsg("couldn't allocate memory for the benchmark");
+		core_cleanup(&bench.core);
+		free(queue);
+		free(sent);
+		free(length_next);
+		free_bench(&bench);
+		return 0;
+	}
+	
+	for ( unsigned long i = 0 ; i != capacity ; ++i )
+	{
+		char nickname[1 + 16];
+		if ( !(bench.clients[i] = core_client_open(&bench.core, i)) )
+		{
+			logmsg("couldn't set up the clients");
+			core_cleanup(&bench.core);
+			core_batch_cleanup(&batch);
+			free(queue);
+			free(sent);
+			free(length_next);
+			free_bench(&bench);
+			return 0;
+		}
+		nickname[0] = (char)snprintf(nickname + 1, sizeof(nickname) - 1, "c%lu", i);
+		core_client_start(&bench.core, bench.clients[i]);
+		feed(&bench, i, nickname, 1);
+		feed(&bench, i, nickname + 1, (size_t)nickname[0]);
+	}
+	complete_sends(&bench);
+	
+	/* Everybody's first message has come in */
+	size_t head = 0, n = 0;
+	for ( unsigned long i = 0 ; i != capacity ; ++i )
+	{
+		length_next[i] = 1;
+		queue[n++] = (BenchCompletion){i, 0, 0};
+	}
+	message[0] = (char)options->message_size;
+	memset(message + 1, 'x', sizeof(message) - 1);
+	
+	const uint64_t sends_before = bench.core.sends;
+	const uint64_t delivered_before = bench.core.messages_delivered;
+	uint64_t dequeues = 0;
+	uint64_t recvs = 0;
+	const uint64_t start = platform_now_ns();
+	while ( n )
+	{
+		++dequeues;
+		if ( batch_size > 1 )
+			core_batch_begin(&bench.core, &batch);
+		for ( unsigned long harvested = 0 ; harvested != batch_size && n ; ++harvested )
+		{
+			const BenchCompletion completion = queue[head];
+			head = (head + 1) % queue_capacity;
+			--n;
+			if ( completion.send )
+			{
+				core_send_completed(&bench.core, bench.clients[completion.client], completion.size);
+				continue;
+			}
+			
+			/* The length, then the text, after which the next message
+			 * comes in for as long as there are rounds left */
+			++recvs;
+			const unsigned long client = completion.client;
+			if ( length_next[client] )
+				feed(&bench, client, message, 1);
+			else
+				feed(&bench, client, message + 1, options->message_size);
+			length_next[client] = !length_next[client];
+			if ( length_next[client] && ++sent[client] == options->rounds )
+				continue;
+			queue[(head + n++) % queue_capacity] = (BenchCompletion){client, 0, 0};
+		}
+		if ( batch_size > 1 )
+			core_batch_end(&bench.core, &batch);
+		
+		/* The sends started complete later on */
+		for ( size_t i = 0 ; i != bench.sending_n ; ++i )
+			queue[(head + n++) % queue_capacity] = (BenchCompletion){(unsigned long)bench.sending[i]->handle, bench.send_sizes[i], 1};
+		bench.sending_n = 0;
+	}
+	const uint64_t elapsed_ns = platform_now_ns() - start;
+	
+	const double messages = (double)capacity * options->rounds;
+	const uint64_t sends = bench.core.sends - sends_before;
+	const uint64_t delivered = bench.core.messages_delivered - delivered_before;
+	logmsgf("batches of %2lu: %.2f kernel transitions per message (%.2f dequeues, %.2f recvs, %.2f sends), %.0f messages/s, %.0f delivered/s, %.3f sends per delivered message\n", batch_size, (dequeues + recvs + sends) / messages, dequeues / messages, recvs / messages, sends / messages, messages / (elapsed_ns / 1e9), delivered / (elapsed_ns / 1e9), delivered ? (double)sends / delivered : 0.);
+	
+	for ( unsigned long i = 0 ; i != capacity ; ++i )
+		core_recv_completed(&bench.core, bench.clients[i], 0);
+	core_cleanup(&bench.core);
+	core_batch_cleanup(&batch);
+	free(queue);
+	free(sent);
+	free(length_next);
+	free_bench(&bench);
+	
+	return 1;
+}
+
+/* Its own defaults, as it takes the square of the clients */
+#define batch_clients 1000
+#define batch_rounds 100
+
+static int
+bench_batch
+(
+ const struct bench_options * options
+)
+{
+	static const unsigned long batch_sizes[] = {1, 16, 64};
+	
+	for ( size_t i = 0 ; i != sizeof(batch_sizes) / sizeof(*batch_sizes) ; ++i )
+		if ( !run_batches(options, batch_sizes[i]) )
+			return 0;
+	return 1;
+}
+
+/* The helpers spin rather than wait, as idle worker threads
+ * would be woken by the completion port */
+static void
+bench_request_help
+(
+ void * context,
+ size_t helpers
+)
+{
+	(void)helpers;
+	platform_increment(&((Bench *)context)->help_requested);
+}
+
+static void
+helper_thread
+(
+ void * argument
+)
+{
+	Bench * const bench = (Bench *)argument;
+	long seen = 0;
+	
+	while ( !platform_load_long(&bench->helpers_quit) )
+	{
+		if ( platform_load_long(&bench->help_requested) != seen )
+		{
+			seen = platform_load_long(&bench->help_requested);
+			core_help(&bench->core);
+		}
+		else
+			platform_yield();
+	}
+}
+
+/* The time from a message coming in until the last of the clients
+ * has had its send started, in nanoseconds per broadcast, with the
+ * given number of helper threads, none meaning broadcasts aren't
+ * fanned out at all */
+static int
+time_fan_out
+(
+ const struct bench_options * options,
+ unsigned long clients,
+ unsigned long helpers,
+ double * ns
+)
+{
+	Bench bench = {0};
+	const Transport transport = {
+		.context = &bench,
+		.recv = bench_recv,
+		.send = bench_send_shared,
+		.close = bench_close,
+		.set_timer = bench_set_timer,
+		.release = bench_release,
+		.now = bench_now,
+		.request_help = helpers ? bench_request_help : NULL
+	};
+	/* The sender's slot too */
+	const CoreOptions core_options = {
+		.capacity = clients + 1,
+		.fan_out_threshold = 1
+	};
+	PlatformThread * const threads = calloc(helpers ? helpers : 1, sizeof(*threads));
+	unsigned long started = 0;
+	char message[1 + 255];
+	int rv = 1;
+	
+	bench.clients = calloc(clients + 1, sizeof(*bench.clients));
+	bench.recv_buffers = calloc(clients + 1, sizeof(*bench.recv_buffers));
+	bench.sending = calloc(clients + 1, sizeof(*bench.sending));
+	bench.send_sizes = calloc(clients + 1, sizeof(*bench.send_sizes));
+	if ( !threads || !bench.clients || !bench.recv_buffers || !bench.sending || !bench.send_sizes || !core_init(&bench.core, &transport, &core_options) )
+	{
+		logmsg("couldn't allocate memory for the benchmark");
+		free(threads);
+		free_bench(&bench);
+		return 0;
+	}
+	
+	for ( unsigned long i = 0 ; i != clients + 1 ; ++i )
+	{
+		char nickname[1 + 16];
+		if ( !(bench.clients[i] = core_client_open(&bench.core, i)) )
+		{
+			logmsg("couldn't set up the clients");
+			rv = 0;
+			break;
+		}
+		nickname[0] = (char)snprintf(nickname + 1, sizeof(nickname) - 1, "c%lu", i);
+		core_client_start(&bench.core, bench.clients[i]);
+		feed(&bench, i, nickname, 1);
+		feed(&bench, i, nickname + 1, (size_t)nickname[0]);
+	}
+	for ( ; rv && started != helpers ; ++started )
+	{
+		if ( !platform_thread_start(threads + started, helper_thread, &bench) )
+		{
+			logmsg("couldn't start the helper threads");
+			rv = 0;
+		}
+	}
+	
+	message[0] = (char)options->message_size;
+	memset(message + 1, 'x', sizeof(message) - 1);
+	const uint64_t delivered_before = bench.core.messages_delivered;
+	uint64_t elapsed_ns = 0;
+	for ( unsigned long round = 0 ; rv && round != options->rounds ; ++round )
+	{
+		feed(&bench, clients, message, 1);
+		const uint64_t start = platform_now_ns();
+		feed(&bench, clients, message + 1, options->message_size);
+		elapsed_ns += platform_now_ns() - start;
+		
+		while ( bench.sending_shared )
+		{
+			bench.sending_n = (size_t)bench.sending_shared;
+			bench.sending_shared = 0;
+			complete_sends(&bench);
+		}
+	}
+	if ( rv && bench.core.messages_delivered - delivered_before != (uint64_t)(clients + 1) * options->rounds )
+	{
+		logmsgf("FAILED: %"PRIu64" messages delivered of %"PRIu64"\n", bench.core.messages_delivered - delivered_before, (uint64_t)(clients + 1) * options->rounds);
+		rv = 0;
+	}
+	
+	platform_store_long(&bench.helpers_quit, 1);
+	for ( unsigned long i = 0 ; i != started ; ++i )
+		platform_thread_join(threads[i]);
+	for ( unsigned long i = 0 ; i != clients + 1 ; ++i )
+		if ( bench.clients[i] )
+			core_recv_completed(&bench.core, bench.clients[i], 0);
+	core_cleanup(&bench.core);
+	free(threads);
+	free_bench(&bench);
+	
+	*ns = options->rounds ? (double)elapsed_ns / options->rounds : 0;
+	return rv;
+}
+
+static int
+bench_fan_out
+(
+ const struct bench_options * options
+)
+{
+	/* Audiences of 1000, 3000, 10000 and so on up to -c */
+	for ( unsigned long i = 0, clients = 1000 ; clients <= options->clients ; clients = ++i % 2 ? clients * 3 : clients / 3 * 10 )
+	{
+		double serial_ns, parallel_ns;
+		if ( !time_fan_out(options, clients, 0, &serial_ns) || !time_fan_out(options, clients, options->helpers, &parallel_ns) )
+			return 0;
+		logmsgf("%7lu clients: last recipient after %8.1f us by one thread, %8.1f us fanned out with %lu helpers (%.2fx)\n", clients, serial_ns / 1e3, parallel_ns / 1e3, options->helpers, serial_ns / parallel_ns);
+	}
+	return 1;
+}
+
+/* The sizes of the messages broadcast */
+#define zero_copy_smallest 4096
+#define zero_copy_largest 65536
+
+/* Has the whole of the bytes come in, in as many recvs as it takes,
+ * which the recv sizes are needed for */
+static void
+feed_stream
+(
+ Bench * bench,
+ unsigned long client,
+ const unsigned char * bytes,
+ size_t size
+)
+{
+	while ( size )
+	{
+		const size_t chunk = size < bench->recv_sizes[client] ? size : bench->recv_sizes[client];
+		feed(bench, client, bytes, chunk);
+		bytes += chunk;
+		size -= chunk;
+	}
+}
+
+/* The time the broadcast of a message of the given size to every
+ * client and the completion of the sends take, in nanoseconds per
+ * byte delivered, the sends being memcpy'd into buffers of their own
+ * as a model of the kernel's copy into socket buffers, or not */
+static int
+time_zero_copy
+(
+ const struct bench_options * options,
+ size_t message_size,
+ char copying,
+ double * ns
+)
+{
+	const unsigned long sender = options->clients;
+	Bench bench = {0};
+	const Transport transport = {
+		.context = &bench,
+		.recv = bench_recv,
+		.send = bench_send,
+		.close = bench_close,
+		.set_timer = bench_set_timer,
+		.release = bench_release,
+		.now = bench_now
+	};
+	const CoreOptions core_options = {
+		.capacity = options->clients + 1,
+		.max_frame = 2 * zero_copy_largest,
+		.text_policy = text_unchecked
+	};
+	unsigned char * const frame = malloc(2 * varint_max_size + message_size);
+	int rv = 1;
+	
+	bench.clients = calloc(options->clients + 1, sizeof(*bench.clients));
+	bench.recv_buffers = calloc(options->clients + 1, sizeof(*bench.recv_buffers));
+	bench.recv_sizes = calloc(options->clients + 1, sizeof(*bench.recv_sizes));
+	bench.sending = calloc(options->clients + 1, sizeof(*bench.sending));
+	bench.send_sizes = calloc(options->clients + 1, sizeof(*bench.send_sizes));
+	/* Room for the headers of the frame and of its message */
+	bench.socket_buffer_size = zero_copy_largest + 64;
+	if ( !frame || !bench.clients || !bench.recv_buffers || !bench.recv_sizes || !bench.sending || !bench.send_sizes || !core_init(&bench.core, &transport, &core_options) )
+	{
+		logmsg("couldn't allocate memory for the benchmark");
+		free(frame);
+		free_bench(&bench);
+		return 0;
+	}
+	
+	for ( unsigned long i = 0 ; rv && i != options->clients + 1 ; ++i )
+	{
+		if ( !connect_v2(&bench, i, 0) )
+		{
+			logmsg("couldn't set up the clients");
+			rv = 0;
+		}
+		complete_sends(&bench);
+	}
+	close_presence_window(&bench);
+	complete_sends(&bench);
+	/* Only the broadcasts get copied */
+	if ( rv && copying && !(bench.socket_buffers = malloc(socket_buffers_n * bench.socket_buffer_size)) )
+	{
+		logmsg("couldn't allocate memory for the benchmark");
+		rv = 0;
+	}
+	
+	/* A frame of the one message */
+	size_t frame_size = varint_put(frame + varint_max_size, (uint32_t)message_size);
+	memset(frame + varint_max_size + frame_size, 'x', message_size);
+	frame_size += message_size;
+	const size_t header = varint_put(frame, (uint32_t)frame_size);
+	memmove(frame + header, frame + varint_max_size, frame_size);
+	frame_size += header;
+	
+	const uint64_t delivered_before = bench.core.messages_delivered;
+	uint64_t elapsed_ns = 0;
+	bench.bytes_sent = 0;
+	for ( unsigned long round = 0 ; rv && round != options->rounds ; ++round )
+	{
+		const uint64_t start = platform_now_ns();
+		feed_stream(&bench, sender, frame, frame_size);
+		complete_sends(&bench);
+		elapsed_ns += platform_now_ns() - start;
+	}
+	if ( rv && bench.core.messages_delivered - delivered_before != (uint64_t)(options->clients + 1) * options->rounds )
+	{
+		logmsgf("FAILED: %"PRIu64" messages delivered of %"PRIu64"\n", bench.core.messages_delivered - delivered_before, (uint64_t)(options->clients + 1) * options->rounds);
+		rv = 0;
+	}
+	*ns = bench.bytes_sent ? (double)elapsed_ns / bench.bytes_sent : 0;
+	
+	for ( unsigned long i = 0 ; i != options->clients + 1 ; ++i )
+		if ( bench.clients[i] )
+			core_recv_completed(&bench.core, bench.clients[i], 0);
+	close_presence_window(&bench);
+	complete_sends(&bench);
+	core_cleanup(&bench.core);
+	free(frame);
+	free_bench(&bench);
+	return rv;
+}
+
+static int
+bench_zero_copy
+(
+ const struct bench_options * options
+)
+{
+	logmsg("a model: sends are memcpy'd as the kernel would copy them, the sockets aren't involved");
+	for ( size_t message_size = zero_copy_smallest ; message_size <= zero_copy_largest ; message_size *= 2 )
+	{
+		double copied_ns, zero_copy_ns;
+		if ( !time_zero_copy(options, message_size, 1, &copied_ns) || !time_zero_copy(options, message_size, 0, &zero_copy_ns) )
+			return 0;
+		logmsgf("%5zu byte messages to %lu clients: %.3f ns per byte delivered with a modelled copy of every send, %.3f ns without (%.1fx)\n", message_size, options->clients + 1, copied_ns, zero_copy_ns, zero_copy_ns ? copied_ns / zero_copy_ns : 0);
+	}
+	return 1;
+}
+
+/* Pending recvs lock the pages their buffers are on */
+#define page_size 4096
+/* Idle clients that send a message once they've been measured */
+#define idle_senders 10
+
+/* The memory of an idle client's, on average */
+typedef struct {
+	double allocated; // by the core, its slot included
+	double pinned; // in the buffers of pending recvs
+	double pages; // those buffers are on, which get locked
+} IdleMemory;
+
+/* Connects the clients, every other one speaking protocol v2, and
+ * leaves them be, then has a few send a message and fails unless
+ * those get broadcast */
+static int
+measure_idle
+(
+ unsigned long clients,
+ char idle_recvs,
+ IdleMemory * memory
+)
+{
+	Bench bench = {0};
+	const Transport transport = {
+		.context = &bench,
+		.recv = bench_recv,
+		.send = bench_send,
+		.close = bench_close,
+		.set_timer = bench_set_timer,
+		.release = bench_release,
+		.now = bench_now
+	};
+	const CoreOptions core_options = {
+		.capacity = clients,
+		.idle_recvs = idle_recvs
+	};
+	const unsigned char message[] = {1 + 16, 16, 'x', 'x', 'x', 'x', 'x', 'x', 'x', 'x', 'x', 'x', 'x', 'x', 'x', 'x', 'x', 'x'};
+	int rv = 1;
+	
+	bench.clients = calloc(clients, sizeof(*bench.clients));
+	bench.recv_buffers = calloc(clients, sizeof(*bench.recv_buffers));
+	bench.recv_sizes = calloc(clients, sizeof(*bench.recv_sizes));
+	bench.sending = calloc(clients, sizeof(*bench.sending));
+	bench.send_sizes = calloc(clients, sizeof(*bench.send_sizes));
+	if ( !bench.clients || !bench.recv_buffers || !bench.recv_sizes || !bench.sending || !bench.send_sizes || !core_init(&bench.core, &transport, &core_options) )
+	{
+		logmsg("couldn't allocate memory for the benchmark");
+		free_bench(&bench);
+		return 0;
+	}
+	const int64_t before = core_memory_used(&bench.core);
+	
+	for ( unsigned long i = 0 ; rv && i != clients ; ++i )
+	{
+		if ( i % 2 )
+		{
+			char nickname[1 + 16];
+			if ( (bench.clients[i] = core_client_open(&bench.core, i)) )
+			{
+				nickname[0] = (char)snprintf(nickname + 1, sizeof(nickname) - 1, "c%lu", i);
+				core_client_start(&bench.core, bench.clients[i]);
+				feed(&bench, i, nickname, 1);
+				feed(&bench, i, nickname + 1, (size_t)nickname[0]);
+			}
+		}
+		else
+			connect_v2(&bench, i, capability_batch);
+		if ( !bench.clients[i] )
+		{
+			logmsg("couldn't set up the clients");
+			rv = 0;
+		}
+		complete_sends(&bench);
+	}
+	close_presence_window(&bench);
+	complete_sends(&bench);
+	
+	if ( rv )
+	{
+		uint64_t pinned = 0, pages = 0;
+		for ( unsigned long i = 0 ; i != clients ; ++i )
+		{
+			const uintptr_t first = (uintptr_t)bench.recv_buffers[i];
+			if ( !bench.recv_sizes[i] )
+				continue;
+			pinned += bench.recv_sizes[i];
+			pages += (first + bench.recv_sizes[i] - 1) / page_size - first / page_size + 1;
+		}
+		memory->allocated = (double)(core_memory_used(&bench.core) - before) / clients + sizeof(ClientData) + sizeof(ClientQueue);
+		memory->pinned = (double)pinned / clients;
+		memory->pages = (double)pages / clients;
+		
+		/* A few of them, v2 and v1 by turns, wake up and
+		 * send something */
+		uint64_t sent = 0;
+		for ( unsigned long i = 0 ; i < clients ; i += clients / idle_senders + 1 )
+		{
+			if ( i % 2 )
+			{
+				feed(&bench, i, message + 1, 1);
+				feed(&bench, i, message + 2, 16);
+			}
+			else
+				feed(&bench, i, message, sizeof(message));
+			++sent;
+			complete_sends(&bench);
+		}
+		if ( bench.core.messages != sent )
+		{
+			logmsgf("FAILED: %"PRIu64" messages broadcast of %"PRIu64"\n", bench.core.messages, sent);
+			rv = 0;
+		}
+	}
+	
+	for ( unsigned long i = 0 ; i != clients ; ++i )
+		if ( bench.clients[i] )
+			core_recv_failed(&bench.core, bench.clients[i]);
+	close_presence_window(&bench);
+	complete_sends(&bench);
+	core_cleanup(&bench.core);
+	free_bench(&bench);
+	return rv;
+}
+
+static int
+bench_idle
+(
+ const struct bench_options * options
+)
+{
+	static const unsigned long counts[] = {10000, 100000, 500000};
+	
+	for ( size_t i = 0 ; i != sizeof(counts) / sizeof(*counts) && counts[i] <= options->clients ; ++i )
+	{
+		IdleMemory busy, idle;
+		if ( !measure_idle(counts[i], 0, &busy) || !measure_idle(counts[i], 1, &idle) )
+			return 0;
+		logmsgf("%6lu clients: %6.0f bytes each, %5.0f of them in %.2f pages pinned by recvs; with idle recvs %6.0f bytes each, %5.0f in %.2f pages\n", counts[i], busy.allocated, busy.pinned, busy.pages, idle.allocated, idle.pinned, idle.pages);
+	}
+	return 1;
+}
+
+/* Text of the given size in one of the scripts below, mostly
+ * made up of words of 2 to 8 characters */
+static void
+generate_text
+(
+ unsigned char * text,
+ size_t size,
+ int script,
+ uint64_t * random
+)
+{
+	/* ASCII, Latin with accents, CJK, and ASCII with emoji */
+	static const char * const extra[] = {"", "\xC3\xA9", "\xE4\xB8\xAD", "\xF0\x9F\x98\x80"};
+	static const unsigned every[] = {1, 6, 1, 12};
+	size_t used = 0;
+	
+	while ( used != size )
+	{
+		*random ^= *random << 13;
+		*random ^= *random >> 7;
+		*random ^= *random << 17;
+		const size_t length = script && *random % every[script] == 0 ? strlen(extra[script]) : 1;
+		if ( size - used < length )
+		{
+			text[used++] = ' ';
+			continue;
+		}
+		if ( length > 1 )
+			memcpy(text + used, extra[script], length);
+		else
+			text[used] = *random % 5 ? (unsigned char)('a' + *random % 26) : ' ';
+		used += length;
+	}
+}
+
+static int
+bench_utf8
+( void )
+{
+	static const char * const scripts[] = {"ascii", "latin", "cjk", "emoji"};
+	static const size_t sizes[] = {32, 255, 4096, 65536};
+	const size_t total = 64 << 20; // bytes checked per measurement
+	unsigned char * const text = malloc(sizes[sizeof(sizes) / sizeof(*sizes) - 1]);
+	uint64_t random = 0x9E3779B97F4A7C15ULL;
+	int rv = 1;
+	
+	if ( !text )
+	{
+		logmsg("couldn't allocate memory for the benchmark");
+		return 0;
+	}
+	
+	const enum TextKernel best = (text_init(), text_kernel());
+	logmsgf("GB/s by kernel; the server would use %s\n", text_kernel_name(best));
+	
+	for ( size_t script = 0 ; script != sizeof(scripts) / sizeof(*scripts) ; ++script )
+	{
+		for ( size_t size_index = 0 ; size_index != sizeof(sizes) / sizeof(*sizes) ; ++size_index )
+		{
+			const size_t size = sizes[size_index];
+			char line[256];
+			int line_length = snprintf(line, sizeof(line), "%-6s %6zu bytes:", scripts[script], size);
+			
+			generate_text(text, size, (int)script, &random);
+			for ( int kernel = 0 ; kernel != text_kernels ; ++kernel )
+			{
+				if ( !text_use((enum TextKernel)kernel) )
+					continue;
+				
+				int flaws = 0;
+				const uint64_t start = platform_now_ns();
+				for ( size_t checked = 0 ; checked < total ; checked += size )
+					flaws |= text_check(text, size);
+				const uint64_t elapsed = platform_now_ns() - start;
+				
+				if ( flaws )
+				{
+					logmsgf("FAILED: the %s kernel found flaws in valid text\n", text_kernel_name((enum TextKernel)kernel));
+					rv = 0;
+				}
+				line_length += snprintf(line + line_length, sizeof(line) - line_length, "  %s %6.2f", text_kernel_name((enum TextKernel)kernel), elapsed ? (double)total / elapsed : 0.);
+			}
+			logmsgf("%s\n", line);
+		}
+	}
+	
+	text_use(best);
+	free(text);
+	return rv;
+}
+
+/* Masking leaves alone whatever isn't masked, bytes that aren't
+ * UTF-8 included, as the text is unchecked by default */
+static int
+check_masking
+( void )
+{
+	static const char list[] = "mask bad\nmask \xC3\xA9t\xC3\xA9\nmask ad\n";
+	static const struct {
+		const char * in;
+		const char * out;
+	} cases[] = {
+		{"no terms \xFF here", "no terms \xFF here"},
+		{"\xFF bad \xFF", "\xFF *** \xFF"},
+		{"\xC3\xBF" "bad\xFF\xFE", "\xC3\xBF***\xFF\xFE"},
+		{"an \xC3\xA9t\xC3\xA9 \xFF", "an *** \xFF"},
+		{"\xFF" "bbad\xFF" "bad", "\xFF" "b***\xFF***"},
+		{"badad\xFF", "*****\xFF"}
+	};
+	Filter * const filter = filter_compile(list, sizeof(list) - 1);
+	int rv = 1;
+	
+	if ( !filter )
+		return 0;
+	for ( size_t i = 0 ; i != sizeof(cases) / sizeof(*cases) ; ++i )
+	{
+		unsigned char text[64];
+		size_t size = strlen(cases[i].in);
+		memcpy(text, cases[i].in, size);
+		filter_apply(filter, text, &size);
+		if ( size != strlen(cases[i].out) || memcmp(text, cases[i].out, size) )
+		{
+			logmsgf("FAILED: masking case %zu came out as \"%.*s\"\n", i, (int)size, text);
+			rv = 0;
+		}
+	}
+	filter_free(filter);
+	return rv;
+}
+
+static int
+bench_filter
+(
+ const struct bench_options * options
+)
+{
+	static const char * const actions[] = {"drop", "mask", "flag"};
+	static const size_t sizes[] = {32, 255, 4096};
+	const size_t messages_n = 1024;
+	const size_t total = 64 << 20; // bytes filtered per measurement
+	const size_t max_size = sizes[sizeof(sizes) / sizeof(*sizes) - 1];
+	/* Terms of 5 to 12 letters, which random text hardly ever has */
+	char * const list = malloc(options->terms * 18);
+	unsigned char * const messages = malloc(messages_n * max_size);
+	unsigned char * const scratch = malloc(max_size);
+	uint64_t random = 0x2545F4914F6CDD1DULL;
+	size_t list_size = 0;
+	int rv = 1;
+	
+	if ( !list || !messages || !scratch )
+	{
+		logmsg("couldn't allocate memory for the benchmark");
+		free(list);
+		free(messages);
+		free(scratch);
+		return 0;
+	}
+	
+	for ( unsigned long i = 0 ; i != options->terms ; ++i )
+	{
+		random ^= random << 13;
+		random ^= random >> 7;
+		random ^= random << 17;
+		list_size += (size_t)sprintf(list + list_size, "%s ", actions[i % 3]);
+		for ( uint64_t letters = 5 + random % 8, bits = random >> 3 ; letters ; --letters, bits = bits * 6364136223846793005ULL + 1442695040888963407ULL )
+			list[list_size++] = (char)('a' + (bits >> 33) % 26);
+		list[list_size++] = '\n';
+	}
+	
+	uint64_t start = platform_now_ns();
+	Filter * const filter = filter_compile(list, list_size);
+	const uint64_t compile_ns = platform_now_ns() - start;
+	if ( !filter )
+	{
+		free(list);
+		free(messages);
+		free(scratch);
+		return 0;
+	}
+	logmsgf("%zu terms compiled in %.1f ms into %zu KiB\n", filter_terms(filter), compile_ns / 1e6, filter_size(filter) >> 10);
+	if ( !check_masking() )
+		rv = 0;
+	
+	for ( size_t size_index = 0 ; size_index != sizeof(sizes) / sizeof(*sizes) ; ++size_index )
+	{
+		const size_t size = sizes[size_index];
+		
+		for ( size_t i = 0 ; i != messages_n ; ++i )
+		{
+			unsigned char * const message = messages + i * max_size;
+			generate_text(message, size, 0, &random);
+			if ( i % 10 == 0 )
+			{
+				/* Put one of the terms somewhere in it */
+				const char * term = list + random % list_size;
+				while ( term != list && term[-1] != '\n' )
+					--term;
+				term = strchr(term, ' ') + 1;
+				const size_t term_length = (size_t)(strchr(term, '\n') - term);
+				if ( term_length <= size )
+					memcpy(message + random % (size - term_length + 1), term, term_length);
+			}
+		}
+		
+		size_t filtered = 0;
+		int found[filter_drop * 2] = {0};
+		start = platform_now_ns();
+		for ( size_t done = 0 ; done < total ; done += size )
+		{
+			size_t message_size = size;
+			memcpy(scratch, messages + filtered++ % messages_n * max_size, size);
+			++found[filter_apply(filter, scratch, &message_size)];
+		}
+		const uint64_t elapsed = platform_now_ns() - start;
+		
+		logmsgf("%4zu bytes: %9.0f messages/s (%.2f GB/s), %.1f%% with terms to drop, %.1f%% to mask, %.1f%% to flag\n", size, elapsed ? filtered * 1e9 / elapsed : 0., elapsed ? (double)filtered * size / elapsed : 0., 100. * (found[4] + found[5] + found[6] + found[7]) / filtered, 100. * (found[2] + found[3]) / filtered, 100. * (found[1] + found[3]) / filtered);
+	}
+	
+	filter_free(filter);
+	free(list);
+	free(messages);
+	free(scratch);
+	return rv;
+}
+
+/* Sets up the clients, every other one taking notices, broadcasts to
+ * them with their sends left pending, and drains the core as the server
+ * does on shutdown, the sends completing as fast as they're started */
+static int
+bench_drain
+(
+ const struct bench_options * options
+)
+{
+	Bench bench = {0};
+	const Transport transport = {
+		.context = &bench,
+		.recv = bench_recv,
+		.send = bench_send,
+		.close = bench_close,
+		.set_timer = bench_set_timer,
+		.release = bench_release,
+		.now = bench_now
+	};
+	const CoreOptions core_options = {
+		.capacity = options->clients
+	};
+	const unsigned char message[] = {1 + 16, 16, 'x', 'x', 'x', 'x', 'x', 'x', 'x', 'x', 'x', 'x', 'x', 'x', 'x', 'x', 'x', 'x'};
+	int rv = 1;
+	
+	bench.clients = calloc(options->clients, sizeof(*bench.clients));
+	bench.recv_buffers = calloc(options->clients, sizeof(*bench.recv_buffers));
+	bench.recv_sizes = calloc(options->clients, sizeof(*bench.recv_sizes));
+	bench.sending = calloc(options->clients, sizeof(*bench.sending));
+	bench.send_sizes = calloc(options->clients, sizeof(*bench.send_sizes));
+	bench.present = calloc(options->clients, sizeof(*bench.present));
+	if ( !bench.clients || !bench.recv_buffers || !bench.recv_sizes || !bench.sending || !bench.send_sizes || !bench.present || !core_init(&bench.core, &transport, &core_options) )
+	{
+		logmsg("couldn't allocate memory for the benchmark");
+		free_bench(&bench);
+		return 0;
+	}
+	
+	for ( unsigned long i = 0 ; rv && i != options->clients ; ++i )
+	{
+		if ( i % 2 )
+		{
+			char nickname[1 + 16];
+			if ( (bench.clients[i] = core_client_open(&bench.core, i)) )
+			{
+				nickname[0] = (char)snprintf(nickname + 1, sizeof(nickname) - 1, "c%lu", i);
+				core_client_start(&bench.core, bench.clients[i]);
+				feed(&bench, i, nickname, 1);
+				feed(&bench, i, nickname + 1, (size_t)nickname[0]);
+			}
+		}
+		else
+			connect_v2(&bench, i, capability_batch | capability_notices);
+		if ( !bench.clients[i] )
+		{
+			logmsg("couldn't set up the clients");
+			rv = 0;
+		}
+		complete_sends(&bench);
+	}
+	close_presence_window(&bench);
+	complete_sends(&bench);
+	
+	/* Only the notices of the shutdown are counted from here on */
+	bench.notice_frames = 0;
+	bench.notice_bytes = 0;
+	for ( unsigned long round = 0 ; rv && round != options->rounds ; ++round )
+		feed(&bench, 0, message, sizeof(message));
+	
+	const uint64_t delivered_before = bench.core.messages_delivered;
+	const size_t pending_before = core_drain_pending(&bench.core);
+	bench.bytes_sent = 0;
+	const uint64_t start = platform_now_ns();
+	size_t pending = 0;
+	core_drain_begin(&bench.core);
+	while ( rv && (pending = core_drain_pending(&bench.core)) )
+	{
+		if ( !bench.sending_n )
+		{
+			logmsgf("FAILED: %zu clients still to be sent to, with no send pending\n", pending);
+			rv = 0;
+			break;
+		}
+		complete_sends(&bench);
+	}
+	const uint64_t flushed = platform_now_ns();
+	core_drain_end(&bench.core);
+	/* Their recvs failing, as closing their connections makes them */
+	for ( unsigned long i = 0 ; i != options->clients ; ++i )
+		if ( bench.clients[i] && bench.clients[i]->used )
+			core_recv_failed(&bench.core, bench.clients[i]);
+	const uint64_t released = platform_now_ns();
+	
+	if ( rv && bench.core.free_slots_n != bench.core.capacity )
+	{
+		logmsgf("FAILED: %zu clients not released\n", bench.core.capacity - bench.core.free_slots_n);
+		rv = 0;
+	}
+	if ( rv && bench.notice_frames != (options->clients + 1) / 2 )
+	{
+		logmsgf("FAILED: %"PRIu64" notices of the shutdown sent to %lu clients taking them\n", bench.notice_frames, (options->clients + 1) / 2);
+		rv = 0;
+	}
+	if ( rv )
+	{
+		logmsgf("%lu clients, %zu of them with frames waiting after %lu messages: drained in %.2f ms, released in %.2f ms more\n", options->clients, pending_before, options->rounds, (flushed - start) / 1e6, (released - flushed) / 1e6);
+		logmsgf("%"PRIu64" messages and %"PRIu64" notices of the shutdown sent in the drain, %.1f MB in all\n", bench.core.messages_delivered - delivered_before, bench.notice_frames, bench.bytes_sent / 1e6);
+	}
+	
+	core_cleanup(&bench.core);
+	free_bench(&bench);
+	return rv;
+}
+
+/* The pool is a queue served first come first served by however many
+ * workers there are, each completion taking its time; with everything
+ * that came before already assigned to a worker, one that comes in
+ * starts as soon as the first of the workers is free. */
+
+#define day_hours 24
+#define hour_s 60 // simulated
+#define service_mean_us 200
+#define wait_bucket_us 10
+#define wait_buckets 10000
+
+typedef struct {
+	size_t workers; // on average
+	double utilization;
+	uint64_t completions;
+	uint64_t wait_ns;
+	uint32_t waits[wait_buckets + 1];
+} PoolHour;
+
+static double
+next_uniform
+(
+ uint64_t * random
+)
+{
+	*random ^= *random << 13;
+	*random ^= *random >> 7;
+	*random ^= *random << 17;
+	return ((*random >> 11) + 1) * (1. / 9007199254740993.);
+}
+
+static double
+next_exponential
+(
+ uint64_t * random,
+ double mean
+)
+{
+	return -mean * log(next_uniform(random));
+}
+
+static uint64_t
+wait_percentile
+(
+ const uint32_t * waits,
+ uint64_t n,
+ double share
+)
+{
+	uint64_t seen = 0;
+	for ( size_t i = 0 ; i != wait_buckets + 1 ; ++i )
+		if ( (seen += waits[i]) >= n * share )
+			return (uint64_t)i * wait_bucket_us;
+	return wait_buckets * wait_bucket_us;
+}
+
+/* Returns the worker-seconds it took, having filled in the hours */
+static double
+simulate_pool
+(
+ size_t min,
+ size_t max,
+ double peak, // completions per second
+ PoolHour * hours,
+ Scaler * scaler
+)
+{
+	const uint64_t interval_ns = (uint64_t)scaler_interval_ms * 1000000;
+	const uint64_t day_ns = (uint64_t)day_hours * hour_s * 1000000000;
+	uint64_t * const free_at = calloc(max, sizeof(*free_at));
+	uint64_t random = 0x853C49E6748FEA9BULL;
+	size_t workers = min;
+	double worker_seconds = 0;
+	double arrival = 0;
+	
+	if ( !free_at )
+		return 0;
+	scaler_init(scaler, min, max);
+	
+	for ( uint64_t sample_start = 0 ; sample_start != day_ns ; sample_start += interval_ns )
+	{
+		PoolHour * const hour = hours + sample_start / ((uint64_t)hour_s * 1000000000);
+		ScalerSample sample = {.workers = workers, .interval_ns = interval_ns};
+		
+		/* The load peaks at noon and is at a tenth of that at midnight */
+		for ( ; arrival < sample_start + interval_ns ; )
+		{
+			const double day_share = arrival / day_ns;
+			const double rate = peak * (.1 + .9 * (1 - cos(2 * 3.14159265358979324 * day_share)) / 2);
+			arrival += next_exponential(&random, 1e9 / rate);
+			
+			size_t first = 0;
+			for ( size_t i = 1 ; i != workers ; ++i )
+				if ( free_at[i] < free_at[first] )
+					first = i;
+			const uint64_t arrived = (uint64_t)arrival;
+			const uint64_t start = free_at[first] > arrived ? free_at[first] : arrived;
+			const uint64_t service = (uint64_t)next_exponential(&random, service_mean_us * 1000.);
+			free_at[first] = start + service;
+			
+			const uint64_t wait_us = (start - arrived) / 1000;
+			++hour->waits[wait_us / wait_bucket_us < wait_buckets ? wait_us / wait_bucket_us : wait_buckets];
+			hour->wait_ns += start - arrived;
+			++hour->completions;
+			sample.busy_ns += service;
+			++sample.completions;
+		}
+		
+		/* What a probe posted now would wait for */
+		const uint64_t now = sample_start + interval_ns;
+		size_t first = 0;
+		for ( size_t i = 1 ; i != workers ; ++i )
+			if ( free_at[i] < free_at[first] )
+				first = i;
+		sample.wait_ns = free_at[first] > now ? free_at[first] - now : 0;
+		
+		hour->workers += workers;
+		hour->utilization += (double)sample.busy_ns / interval_ns / workers;
+		worker_seconds += workers * (scaler_interval_ms / 1000.);
+		
+		long change = scaler_sample(scaler, &sample);
+		for ( ; change > 0 ; --change )
+			free_at[workers++] = now;
+		/* Whichever worker is free first gets to retire */
+		for ( ; change < 0 ; ++change )
+		{
+			first = 0;
+			for ( size_t i = 1 ; i != workers ; ++i )
+				if ( free_at[i] < free_at[first] )
+					first = i;
+			free_at[first] = free_at[--workers];
+		}
+	}
+	
+	const size_t samples_per_hour = hour_s * 1000 / scaler_interval_ms;
+	for ( PoolHour * hour = hours ; hour != hours + day_hours ; ++hour )
+	{
+		hour->workers = (hour->workers + samples_per_hour / 2) / samples_per_hour;
+		hour->utilization /= samples_per_hour;
+	}
+	free(free_at);
+	return worker_seconds;
+}
+
+static int
+bench_elastic
+( void )
+{
+	const size_t max = 16;
+	const double peak = 6. * 1e6 / service_mean_us; // six workers' worth
+	PoolHour * const fixed = calloc(day_hours, sizeof(*fixed));
+	PoolHour * const elastic = calloc(day_hours, sizeof(*elastic));
+	uint32_t * const waits = calloc(wait_buckets + 1, sizeof(*waits));
+	Scaler fixed_scaler;
+	Scaler elastic_scaler;
+	int rv = 0;
+	
+	if ( fixed && elastic && waits )
+	{
+		/* Fixed at what it takes at the peak */
+		const double fixed_seconds = simulate_pool(8, 8, peak, fixed, &fixed_scaler);
+		const double elastic_seconds = simulate_pool(1, max, peak, elastic, &elastic_scaler);
+		
+		logmsgf("%.0f completions/s at the peak, %d us each on average; elastic pool of 1 to %zu workers against 8 of them\n", peak, service_mean_us, max);
+		logmsgf("hour  completions/s  workers  busy   mean wait  p99 wait   (fixed: busy, mean wait, p99 wait)\n");
+		for ( size_t i = 0 ; i != day_hours ; ++i )
+		{
+			const PoolHour * const e = elastic + i;
+			const PoolHour * const f = fixed + i;
+			logmsgf("%4zu  %13.0f  %7zu  %3.0f%%  %6.0f us  %5"PRIu64" us   (%3.0f%%, %6.0f us, %5"PRIu64" us)\n", i, (double)e->completions / hour_s, e->workers, e->utilization * 100, e->completions ? e->wait_ns / 1e3 / e->completions : 0., wait_percentile(e->waits, e->completions, .99), f->utilization * 100, f->completions ? f->wait_ns / 1e3 / f->completions : 0., wait_percentile(f->waits, f->completions, .99));
+		}
+		
+		for ( int pool = 0 ; pool != 2 ; ++pool )
+		{
+			const PoolHour * const hours = pool ? fixed : elastic;
+			uint64_t completions = 0;
+			uint64_t wait_ns = 0;
+			memset(waits, 0, (wait_buckets + 1) * sizeof(*waits));
+			for ( size_t i = 0 ; i != day_hours ; ++i )
+			{
+				completions += hours[i].completions;
+				wait_ns += hours[i].wait_ns;
+				for ( size_t j = 0 ; j != wait_buckets + 1 ; ++j )
+					waits[j] += hours[i].waits[j];
+			}
+			logmsgf("%s: %.0f worker-hours, mean wait %.0f us, p99 %"PRIu64" us, p99.9 %"PRIu64" us, grown %lu times, shrunk %lu times\n", pool ? "fixed  " : "elastic", (pool ? fixed_seconds : elastic_seconds) / 3600 * (3600. / hour_s), completions ? wait_ns / 1e3 / completions : 0., wait_percentile(waits, completions, .99), wait_percentile(waits, completions, .999), pool ? fixed_scaler.grown : elastic_scaler.grown, pool ? fixed_scaler.shrunk : elastic_scaler.shrunk);
+		}
+		rv = 1;
+	}
+	else
+		logmsg("couldn't allocate memory for the benchmark");
+	
+	free(fixed);
+	free(elastic);
+	free(waits);
+	return rv;
+}
+
+int main
+(
+ int argc,
+ char * * argv
+)
+{
+	char parameter = 0;
+	const char * name = NULL;
+	char clients_given = 0;
+	char rounds_given = 0;
+	struct bench_options options = {
+		.clients = 10000,
+		.rounds = 200,
+		.message_size = 32,
+		.terms = 10000,
+		.helpers = 3
+	};
+	int rv = 0;
+	
+	logout = stderr;
+	loglevel = loglevel_error;
+	
+	for ( char * * arg_cur = argv + 1, * * const argv_end = argv+argc ; arg_cur < argv_end ; ++arg_cur )
+	{
+		char * const arg = *arg_cur;
+		if ( parameter )
+		{
+			const unsigned long value = strtoul(arg, NULL, 10);
+			switch ( parameter )
+			{
+				case 'c':
+					options.clients = value ? value : 1;
+					clients_given = 1;
+					break;
+				case 'e':
+					options.empty = value;
+					break;
+				case 'r':
+					options.rounds = value;
+					rounds_given = 1;
+					break;
+				case 's':
+					options.message_size = value < 1 ? 1 : value > 255 ? 255 : value;
+					break;
+				case 't':
+					options.terms = value ? value : 1;
+					break;
+				case 'q':
+					options.connection_budget = value;
+					break;
+				case 'Q':
+					options.memory_budget = value;
+					break;
+				case 'x':
+					options.helpers = value;
+					break;
+			}
+			parameter = 0;
+		}
+		else
+		if ( *arg == '-' )
+			parameter = arg[1];
+		else
+			name = arg;
+	}
+	
+	if ( !name || !strcmp(name, "broadcast") )
+		rv = bench_broadcast(&options);
+	else
+	if ( !strcmp(name, "lanes") )
+		rv = bench_lanes(&options);
+	else
+	if ( !strcmp(name, "presence") )
+		rv = bench_presence(&options);
+	else
+	if ( !strcmp(name, "memory") )
+		rv = bench_memory(&options);
+	else
+	if ( !strcmp(name, "resume") )
+		rv = bench_resume(&options);
+	else
+	if ( !strcmp(name, "batch") )
+	{
+		if ( !clients_given )
+			options.clients = batch_clients;
+		if ( !rounds_given )
+			options.rounds = batch_rounds;
+		rv = bench_batch(&options);
+	}
+	else
+	if ( !strcmp(name, "fanout") )
+		rv = bench_fan_out(&options);
+	else
+	if ( !strcmp(name, "zerocopy") )
+		rv = bench_zero_copy(&options);
+	else
+	if ( !strcmp(name, "idle") )
+		rv = bench_idle(&options);
+	else
+	if ( !strcmp(name, "utf8") )
+		rv = bench_utf8();
+	else
+	if ( !strcmp(name, "filter") )
+		rv = bench_filter(&options);
+	else
+	if ( !strcmp(name, "drain") )
+		rv = bench_drain(&options);
+	else
+	if ( !strcmp(name, "elastic") )
+		rv = bench_elastic();
+	else
+		logmsgf("no such benchmark: %s\n", name);
+	
+	return !rv;
+}
@@ -0,0 +1,58 @@
+@echo off
+rem Compares the round-trip latency over loopback of the server as built
+rem with its workers waiting for completions, as they do by default, and
+rem with them busy polling for them first (-y), under the scenario of
+rem lappenchat-loadgen -L: a couple of clients sending short messages a
+rem millisecond apart, which leaves the workers idle in between.
+rem
+rem The logs and the report are kept in the directory given:
+rem
+rem   busypoll [directory] [microseconds] [port]
+
+setlocal EnableExtensions
+cd /d "%~dp0"
+
+set "BP_OUT=%~1"
+if "%BP_OUT%"=="" set "BP_OUT=%TEMP%\lappenchat-busypoll"
+set "BP_POLL=%~2"
+if "%BP_POLL%"=="" set "BP_POLL=50"
+set "BP_PORT=%~3"
+if "%BP_PORT%"=="" set "BP_PORT=3198"
+rem Seconds the server runs for each time, which the scenario is done in
+set BP_RUN=20
+
+if not exist "%BP_OUT%" mkdir "%BP_OUT%"
+if not exist lappenchat-server-command.exe (
+	echo build the server first
+	exit /b 1
+)
+
+echo running the server waiting for completions
+call :scenario "%BP_OUT%\blocking.txt" || goto failed
+echo running the server polling for them for %BP_POLL% us
+call :scenario "%BP_OUT%\polling.txt" -y %BP_POLL% || goto failed
+
+(
+	echo waiting:
+	findstr /c:"latency" "%BP_OUT%\blocking.txt"
+	echo.
+	echo busy polling for %BP_POLL% us:
+	findstr /c:"latency" "%BP_OUT%\polling.txt"
+) > "%BP_OUT%\report.txt"
+echo.
+type "%BP_OUT%\report.txt"
+exit /b 0
+
+:failed
+echo comparison failed
+exit /b 1
+
+rem Has the server run for BP_RUN seconds with the options given after
+rem the file, and the scenario started against it once it's listening,
+rem whose report goes to the file, and the server's log next to it
+:scenario
+set "BP_REPORT=%~1"
+shift
+start "" /b cmd /c "ping -n 3 127.0.0.1 >nul & lappenchat-loadgen.exe -L -p %BP_PORT% 2> "%BP_REPORT%""
+lappenchat-server-command.exe -p %BP_PORT% -e %BP_RUN% %1 %2 2> "%BP_REPORT%.server"
+exit /b %errorlevel%
@@ -0,0 +1,102 @@
+#include "capture.h"
+
+#include <stddef.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <string.h>
+#include "logmsg.h"
+#include "platform.h"
+
+
+volatile int capturing;
+
+static FILE * capture_file;
+static PlatformLock capture_lock;
+static uint64_t start; // microseconds
+static uint64_t frames_captured;
+
+int
+capture_open
+(
+ const char * path
+)
+{
+	if ( !(capture_file = fopen(path, "wb")) )
+	{
+		logmsgf("couldn't open capture file %s\n", path);
+		return 0;
+	}
+	
+	/* Records are small, so let them pile up a bit before
+	 * they get written out */
+	setvbuf(capture_file, NULL, _IOFBF, 1 << 20);
+	fwrite(capture_magic, 1, sizeof(capture_magic) - 1, capture_file);
+	
+	platform_lock_init(&capture_lock);
+	start = platform_now_us();
+	frames_captured = 0;
+	capturing = 1;
+	
+	logmsgf("capturing inbound traffic to %s\n", path);
+	return 1;
+}
+
+static void
+put_le
+(
+ unsigned char * out,
+ uint64_t value,
+ int size
+)
+{
+	for ( int i = 0 ; i != size ; ++i, value >>= 8 )
+		out[i] = (unsigned char)value;
+}
+
+/* The frame is recorded as the concatenation of header and body,
+ * which are as they were received. A size of 0 records the closing
+ * of the connection. */
+void
+capture_frame
+(
+ uint32_t connection,
+ const void * header,
+ size_t header_size,
+ const void * body,
+ size_t body_size
+)
+{
+	unsigned char record_header[capture_record_header_size];
+	
+	put_le(record_header, platform_now_us() - start, 8);
+	put_le(record_header + 8, connection, 4);
+	put_le(record_header + 12, header_size + body_size, 4);
+	
+	platform_lock_acquire(&capture_lock);
+	fwrite(record_header, 1, sizeof(record_header), capture_file);
+	if ( header_size )
+		fwrite(header, 1, header_size, capture_file);
+	if ( body_size )
+		fwrite(body, 1, body_size, capture_file);
+	++frames_captured;
+	platform_lock_release(&capture_lock);
+}
+
+/* To be called once no more frames can be captured */
+void
+capture_close
+( void )
+{
+	if ( !capturing )
+		return;
+	
+	capturing = 0;
+	
+	if ( fclose(capture_file) == 0 )
+		logmsgf("captured %"PRIu64" frames\n", frames_captured);
+	else
+		logmsg("couldn't write capture file");
+	
+	platform_lock_destroy(&capture_lock);
+}
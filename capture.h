@@ -0,0 +1,44 @@
+#ifndef CAPTURE_H
+#define CAPTURE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+
+/* Capture of the inbound traffic, for lappenchat-replay to play back.
+ * A capture file starts with the 8-byte magic capture_magic, followed
+ * by one record per frame received, each made up of (little-endian):
+ * 
+ *   uint64_t timestamp;  // microseconds since the capture started
+ *   uint32_t connection; // ID of the connection the frame came in on
+ *   uint32_t size;       // 0 when the connection was closed
+ *   char bytes[size];    // the frame as it was received
+ * 
+ * The first frame of every connection is the one carrying the
+ * nickname. Frames are always recorded in protocol v1, so protocol v2
+ * clients' nicknames and messages are recorded as if they had been
+ * sent that way (see protocol.h). */
+
+#define capture_magic "LCCAP01\n"
+#define capture_record_header_size 16
+
+extern volatile int capturing;
+
+int capture_open
+(
+ const char * path
+);
+
+void capture_frame
+(
+ uint32_t connection,
+ const void * header,
+ size_t header_size,
+ const void * body,
+ size_t body_size
+);
+
+void capture_close
+(void);
+
+#endif
@@ -4,6 +4,7 @@
 #include "error.h"
 #include "common.h"
 #include "server.h"
+#include "trace.h"
 
 
 static HANDLE stop_event;
@@ -17,11 +18,27 @@ BOOL WINAPI ConsoleCtrlHandler
 	{
 		case CTRL_C_EVENT:
 			return SetEvent(stop_event);
+		case CTRL_BREAK_EVENT:
+			/* Dump what has been traced so far */
+			trace_export();
+			return TRUE;
 		default:
 			return 0;
 	}
 }
 
+/* Runs on the default timer queue once the server has run for as long
+ * as it was to, stopping it the way CTRL-C would */
+static VOID CALLBACK
+run_over
+(
+ PVOID event,
+ BOOLEAN timer_fired
+)
+{
+	SetEvent((HANDLE)event);
+}
+
 int main
 (
  int argc,
@@ -31,6 +48,7 @@ int main
 	int rv = 0;
 	char parameter = 0;
 	struct lappenchat_server_options lcso = { 0 };
+	unsigned long run_for = 0; // seconds, 0 until stopped
 	
 	logout = stderr;
 	
@@ -53,6 +71,84 @@ int main
 				case 't':
 					lcso.threads = strtol(arg, NULL, 10);
 					break;
+				case 'c':
+					lcso.max_clients = strtoul(arg, NULL, 10);
+					break;
+				case 'r':
+					lcso.rate_messages = strtoul(arg, NULL, 10);
+					break;
+				case 'b':
+					lcso.rate_bytes = strtoul(arg, NULL, 10);
+					break;
+				case 'w':
+					lcso.coalescing_window = strtoul(arg, NULL, 10);
+					break;
+				case 'g':
+					lcso.frames_per_send = strtoul(arg, NULL, 10);
+					break;
+				case 'f':
+					lcso.max_frame = strtoul(arg, NULL, 10);
+					break;
+				case 'u':
+					lcso.text_policy = arg;
+					break;
+				case 'm':
+					lcso.filter_path = arg;
+					break;
+				case 'n':
+					lcso.threads_min = strtoul(arg, NULL, 10);
+					break;
+				case 'x':
+					lcso.threads_max = strtoul(arg, NULL, 10);
+					break;
+				case 'T':
+					lcso.trace_sample = strtoul(arg, NULL, 10);
+					break;
+				case 'o':
+					lcso.trace_path = arg;
+					break;
+				case 'C':
+					lcso.capture_path = arg;
+					break;
+				case 'k':
+					lcso.backlog = strtoul(arg, NULL, 10);
+					break;
+				case 'j':
+					lcso.presence_window = strtoul(arg, NULL, 10);
+					break;
+				case 'q':
+					lcso.connection_budget = strtoul(arg, NULL, 10);
+					break;
+				case 'Q':
+					lcso.memory_budget = strtoul(arg, NULL, 10);
+					break;
+				case 'd':
+					lcso.dequeue_batch = strtoul(arg, NULL, 10);
+					break;
+				case 'F':
+					lcso.fan_out_threshold = strtoul(arg, NULL, 10);
+					break;
+				case 'z':
+					lcso.idle_recvs = strtoul(arg, NULL, 10);
+					break;
+				case 'e':
+					run_for = strtoul(arg, NULL, 10);
+					break;
+				case 'Z':
+					lcso.zero_copy_threshold = strtoul(arg, NULL, 10);
+					break;
+				case 'a':
+					lcso.admin_port = (u_short)strtoul(arg, NULL, 10);
+					break;
+				case 'D':
+					lcso.drain_timeout = strtoul(arg, NULL, 10);
+					break;
+				case 'W':
+					lcso.websocket_port = (u_short)strtoul(arg, NULL, 10);
+					break;
+				case 'y':
+					lcso.busy_poll = strtoul(arg, NULL, 10);
+					break;
 			}
 			parameter = 0;
 		}
@@ -71,7 +167,14 @@ int main
 			if ( !lcso.threads )
 				lcso.threads = get_proc_n();
 			
+			HANDLE timer = NULL;
+			if ( run_for && !CreateTimerQueueTimer(&timer, NULL, run_over, stop_event, (DWORD)(run_for * 1000), 0, WT_EXECUTEONLYONCE) )
+				winapi_perror("couldn't set the timer to stop the server with");
+			
 			rv = start_server(lcso, stop_event);
+			
+			if ( timer )
+				DeleteTimerQueueTimer(NULL, timer, INVALID_HANDLE_VALUE);
 		}
 		else
 			winapi_perror("couldn't set console control handler");
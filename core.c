@@ -0,0 +1,2842 @@
+#include "core.h"
+
+#include <assert.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <stdlib.h>
+#include <string.h>
+#include "logmsg.h"
+#include "platform.h"
+#include "ratelimit.h"
+#include "frame.h"
+#include "pool.h"
+#include "protocol.h"
+#include "text.h"
+#include "filter.h"
+#include "backlog.h"
+#include "stats.h"
+#include "trace.h"
+#include "capture.h"
+#include "websocket.h"
+
+/* Protocol v2 clients' to begin with */
+#define stream_initial_size 4096
+/* Messages of a frame from a v2 client passed on together */
+#define max_messages_per_broadcast 64
+/* Disconnected at once when the memory budget is used up */
+#define max_clients_shed 16
+
+
+/* The calling thread's, while it's handling a batch */
+static thread_local CoreBatch * current_batch;
+/* And while it's fanning out a chunk of a broadcast */
+static thread_local FanOutChunk * current_chunk;
+
+/* One of the counters protected by the client pool lock, which a
+ * chunk of a parallel fan-out keeps its own of */
+#define counter(core, name) (*(current_chunk ? &current_chunk->name : &(core)->name))
+
+
+int
+core_init
+(
+ Core * core,
+ const Transport * transport,
+ const CoreOptions * options
+)
+{
+	core->clients = platform_alloc_aligned(options->capacity * sizeof(*core->clients));
+	core->queues = platform_alloc_aligned(options->capacity * sizeof(*core->queues));
+	core->receiving = malloc(options->capacity);
+	core->free_slots = malloc(options->capacity * sizeof(*core->free_slots));
+	if ( !core->clients || !core->queues || !core->receiving || !core->free_slots || !backlog_init(&core->backlog, options->backlog) )
+	{
+		logmsg("couldn't allocate memory for the client pool");
+		backlog_cleanup(&core->backlog);
+		platform_free_aligned(core->clients);
+		platform_free_aligned(core->queues);
+		free(core->receiving);
+		free(core->free_slots);
+		return 0;
+	}
+	
+	/* Slots are handed out lowest first */
+	memset(core->receiving, encoding_none, options->capacity);
+	for ( size_t i = 0 ; i != options->capacity ; ++i )
+		core->free_slots[i] = options->capacity - 1 - i;
+	core->free_slots_n = options->capacity;
+	
+	core->transport = *transport;
+	core->capacity = options->capacity;
+	core->messages = 0;
+	core->sends = 0;
+	core->messages_delivered = 0;
+	core->messages_dropped = 0;
+	memset(core->lane_waits, 0, sizeof(core->lane_waits));
+	core->presence = NULL;
+	core->presence_n = 0;
+	core->presence_capacity = 0;
+	core->memory_peak = 0;
+	core->clients_refused = 0;
+	core->clients_shed = 0;
+	core->frames_shed = 0;
+	core->fanned_out = 0;
+	core->next_connection_id = 0;
+	platform_lock_init(&core->client_pool_lock);
+	pool_init();
+	
+	core->coalescing_window = options->coalescing_window;
+	core->frames_per_send = options->frames_per_send && options->frames_per_send < max_frames_per_send ? options->frames_per_send : max_frames_per_send;
+	loginfof("up to %zu messages per send, coalescing window %"PRIu32" ms\n", core->frames_per_send, core->coalescing_window);
+	core->presence_window = options->presence_window ? options->presence_window : default_presence_window;
+	loginfof("joins and leaves told of every %"PRIu32" ms\n", core->presence_window);
+	
+	core->rate_messages = options->rate_messages;
+	core->rate_bytes = options->rate_bytes;
+	if ( core->rate_messages || core->rate_bytes )
+		loginfof("rate limit per client: %.0f messages/s, %.0f bytes/s (0 = unlimited)\n", core->rate_messages, core->rate_bytes);
+	
+	core->text_policy = options->text_policy;
+	core->messages_rejected = 0;
+	text_init();
+	if ( core->text_policy != text_unchecked )
+		loginfof("nicknames and messages checked for UTF-8 and control characters, which get %s (%s)\n", core->text_policy == text_strip ? "stripped" : "dropped", text_kernel_name(text_kernel()));
+	
+	core->filter = (FilterSlot){0};
+	core->messages_filtered = 0;
+	core->messages_masked = 0;
+	core->messages_flagged = 0;
+	
+	core->max_frame = !options->max_frame ? default_max_frame : options->max_frame < 256 ? 256 : options->max_frame > varint_max ? varint_max : options->max_frame;
+	loginfof("protocol v2 frames of up to %"PRIu32" bytes\n", core->max_frame);
+	if ( core->backlog.max_messages )
+		loginfof("the last %zu messages kept for clients to resume from\n", core->backlog.max_messages);
+	
+	core->connection_budget = options->connection_budget;
+	core->memory_budget = options->memory_budget;
+	core->client_memory = sizeof(RecvState) + sizeof(SendState) + options->transport_memory;
+	if ( core->connection_budget || core->memory_budget )
+		loginfof("memory budget of %zu KiB per client, %zu KiB in all (0 = unlimited)\n", core->connection_budget >> 10, core->memory_budget >> 10);
+	core->draining = 0;
+	core->idle_recvs = options->idle_recvs;
+	if ( core->idle_recvs )
+		loginfo("idle clients wait in recvs of 0 bytes, without buffers");
+	
+	core->fan_out = NULL;
+	core->fan_out_threshold = options->fan_out_threshold ? options->fan_out_threshold : default_fan_out_threshold;
+	const size_t chunk = options->fan_out_chunk ? options->fan_out_chunk : default_fan_out_chunk;
+	const size_t chunks_n = (options->capacity + chunk - 1) / chunk;
+	/* There's nothing to split up otherwise */
+	if ( transport->request_help && chunks_n > 1 && core->fan_out_threshold <= options->capacity )
+	{
+		FanOut * const fan_out = malloc(sizeof(*fan_out));
+		if ( fan_out && (fan_out->chunks = malloc(chunks_n * sizeof(*fan_out->chunks))) && workdeque_init(&fan_out->deque, chunks_n) )
+		{
+			for ( size_t i = 0 ; i != chunks_n ; ++i )
+			{
+				fan_out->chunks[i].first = i * chunk;
+				fan_out->chunks[i].end = i + 1 == chunks_n ? options->capacity : (i + 1) * chunk;
+			}
+			fan_out->chunks_n = chunks_n;
+			fan_out->open = 0;
+			fan_out->helpers = 0;
+			fan_out->remaining = 0;
+			core->fan_out = fan_out;
+			loginfof("broadcasts to %zu clients or more fanned out in parallel, %zu at a time\n", core->fan_out_threshold, chunk);
+		}
+		else
+		{
+			logmsg("couldn't allocate memory for fanning out broadcasts in parallel; they won't be");
+			if ( fan_out )
+				free(fan_out->chunks);
+			free(fan_out);
+		}
+	}
+	
+	return 1;
+}
+
+static ClientQueue *
+client_queue
+(
+ Core * core,
+ const ClientData * client_data
+)
+{
+	return core->queues + (client_data - core->clients);
+}
+
+int64_t
+core_memory_used
+(
+ const Core * core
+)
+{
+	return pool_in_use() + (int64_t)((core->capacity - core->free_slots_n) * core->client_memory);
+}
+
+void
+core_set_rate_limits
+(
+ Core * core,
+ double messages,
+ double bytes
+)
+{
+	core->rate_messages = messages;
+	core->rate_bytes = bytes;
+	logmsgf("rate limit per client set to %.0f messages/s, %.0f bytes/s (0 = unlimited)\n", messages, bytes);
+}
+
+void
+core_set_budgets
+(
+ Core * core,
+ size_t connection_budget,
+ size_t memory_budget
+)
+{
+	core->connection_budget = connection_budget;
+	core->memory_budget = memory_budget;
+	logmsgf("memory budget set to %zu KiB per client, %zu KiB in all (0 = unlimited)\n", connection_budget >> 10, memory_budget >> 10);
+}
+
+/* Keeps track of the peak, and returns whether the memory
+ * budget is used up. To be called with the client pool lock
+ * held. */
+static int
+over_memory_budget
+(
+ Core * core
+)
+{
+	const int64_t used = core_memory_used(core);
+	
+	if ( used > core->memory_peak )
+		core->memory_peak = used;
+	return core->memory_budget && used > (int64_t)core->memory_budget;
+}
+
+/* Lets go of the frames in the client's lanes, but not of those
+ * in flight */
+static void
+release_queued
+(
+ Core * core,
+ ClientData * client_data
+)
+{
+	ClientQueue * const queue = client_queue(core, client_data);
+	
+	for ( ; queue->n ; --queue->n )
+	{
+		queue->memory -= pool_capacity(queue->frames[queue->first]);
+		frame_release(queue->frames[queue->first]);
+		queue->first = (queue->first + 1) % outbound_queue_length;
+	}
+	for ( ; queue->control_n ; --queue->control_n )
+	{
+		queue->memory -= pool_capacity(queue->control[queue->control_first]);
+		frame_release(queue->control[queue->control_first]);
+		queue->control_first = (queue->control_first + 1) % control_lane_length;
+	}
+	for ( ; queue->backlog_n ; --queue->backlog_n )
+	{
+		queue->memory -= pool_capacity(queue->backlog[queue->backlog_first]);
+		frame_release(queue->backlog[queue->backlog_first]);
+		queue->backlog_first = (queue->backlog_first + 1) % backlog_lane_length;
+	}
+	queue->resume_next = 0;
+}
+
+static void
+free_client
+(
+ Core * core,
+ ClientData * client_data
+)
+{
+	ClientQueue * const queue = client_queue(core, client_data);
+	
+	release_queued(core, client_data);
+	queue->memory = 0;
+	
+	pool_free(client_data->recv_state->stream);
+	free(client_data->recv_state->websocket);
+	free(client_data->recv_state);
+	free(queue->send_state);
+	client_data->recv_state = NULL;
+	queue->send_state = NULL;
+	
+	client_data->nickname_length = 0;
+	client_data->used = 0;
+	core->receiving[client_data - core->clients] = encoding_none;
+	core->free_slots[core->free_slots_n++] = (size_t)(client_data - core->clients);
+}
+
+/* To be called once the transport is done with every client */
+void
+core_cleanup
+(
+ Core * core
+)
+{
+	for ( ClientData * cur = core->clients, * const end = cur + core->capacity ; cur != end ; ++cur )
+		if ( cur->used )
+			free_client(core, cur);
+	
+	platform_free_aligned(core->clients);
+	platform_free_aligned(core->queues);
+	free(core->receiving);
+	free(core->free_slots);
+	free(core->presence);
+	backlog_cleanup(&core->backlog);
+	if ( core->fan_out )
+	{
+		workdeque_cleanup(&core->fan_out->deque);
+		free(core->fan_out->chunks);
+		free(core->fan_out);
+		core->fan_out = NULL;
+	}
+	core->presence = NULL;
+	core->presence_n = 0;
+	core->clients = NULL;
+	core->queues = NULL;
+	core->receiving = NULL;
+	core->free_slots = NULL;
+	filter_free(filter_replace(&core->filter, NULL));
+	platform_lock_destroy(&core->client_pool_lock);
+}
+
+void
+core_replace_filter
+(
+ Core * core,
+ Filter * filter
+)
+{
+	filter_free(filter_replace(&core->filter, filter));
+}
+
+/* The functions below, up to announce, expect the client
+ * pool lock to be held */
+
+static void announce
+(
+ Core *,
+ ClientData *,
+ enum Notice
+);
+
+static void
+release_client
+(
+ Core * core,
+ ClientData * client_data
+)
+{
+	if ( client_data->throttled )
+		loginfof("%.*s had been throttled %lu times, %"PRIu64" ms in total\n", client_data->nickname_length, client_data->nickname, client_data->throttled, client_data->throttled_ms);
+	if ( client_queue(core, client_data)->dropped )
+		loginfof("%.*s missed %lu messages for being too slow a reader\n", client_data->nickname_length, client_data->nickname, client_queue(core, client_data)->dropped);
+	
+	core->transport.release(core->transport.context, client_data);
+	free_client(core, client_data);
+	
+	loginfo("client object released");
+}
+
+static void
+drop_client_reference
+(
+ Core * core,
+ ClientData * client_data
+)
+{
+	assert(client_data->references);
+	if ( --client_data->references == 0 )
+		release_client(core, client_data);
+}
+
+/* Closing the connection makes any operation still pending on it
+ * complete with an error, which is when their references get dropped */
+static void
+disconnect_client
+(
+ Core * core,
+ ClientData * client_data
+)
+{
+	if ( !client_data->closing )
+	{
+		loginfo("client disconnected");
+		if ( capturing )
+			capture_frame(client_data->connection_id, NULL, 0, NULL, 0);
+		client_data->closing = 1;
+		core->receiving[client_data - core->clients] = encoding_none;
+		core->transport.close(core->transport.context, client_data);
+		/* Nothing more is sent, so what's queued can go now,
+		 * rather than once the client is released */
+		release_queued(core, client_data);
+		/* Everyone is leaving anyway */
+		if ( client_data->announced && !core->draining )
+			announce(core, client_data, notice_leave);
+		/* There's no recv for its reference to go with */
+		if ( client_data->phase == phase_drained )
+			drop_client_reference(core, client_data);
+	}
+}
+
+static void
+end_send
+(
+ Core * core,
+ ClientData * client_data,
+ int delivered
+)
+{
+	ClientQueue * const queue = client_queue(core, client_data);
+	SendState * const send_state = queue->send_state;
+	
+	if ( delivered )
+	{
+		for ( size_t i = 0 ; i != send_state->frames_n ; ++i )
+		{
+			core->messages_delivered += send_state->frames[i]->messages;
+			stats_count_out(send_state->frames[i]->messages, send_state->frames[i]->size + (queue->websocket ? send_state->frames[i]->prefix_size : 0));
+		}
+		
+		if ( trace_enabled() )
+		{
+			const uint64_t now = trace_now();
+			for ( size_t i = 0 ; i != send_state->frames_n ; ++i )
+			{
+				const Frame * const frame = send_state->frames[i];
+				if ( frame->trace_id )
+				{
+					trace_complete("queued", frame->trace_id, frame->queued_at, send_state->started_at, (long)(client_data - core->clients));
+					trace_complete("send", frame->trace_id, send_state->started_at, now, (long)(client_data - core->clients));
+				}
+			}
+		}
+	}
+	
+	for ( size_t i = 0 ; i != send_state->frames_n ; ++i )
+	{
+		queue->memory -= pool_capacity(send_state->frames[i]);
+		frame_release(send_state->frames[i]);
+	}
+	send_state->frames_n = 0;
+	
+	queue->sending = 0;
+	drop_client_reference(core, client_data);
+}
+
+static void
+post_send
+(
+ Core * core,
+ ClientData * client_data
+)
+{
+	ClientQueue * const queue = client_queue(core, client_data);
+	SendState * const send_state = queue->send_state;
+	
+	++counter(core, sends);
+	
+	if ( !core->transport.send(core->transport.context, client_data, send_state->buffers + send_state->first_buffer, send_state->frames_n - send_state->first_buffer) )
+	{
+		/* No completion is coming for this one; disconnecting the
+		 * client is for the thread the fan-out is from, if any */
+		if ( current_chunk )
+		{
+			queue->sending = send_failed;
+			++current_chunk->sends_failed;
+			return;
+		}
+		disconnect_client(core, client_data);
+		end_send(core, client_data, 0);
+	}
+}
+
+/* Takes the frame to be sent next out of the client's lanes (see
+ * core.h), returning NULL if there's none, along with its lane and
+ * when it was queued */
+static Frame *
+next_frame
+(
+ ClientQueue * queue,
+ enum Lane * lane,
+ uint64_t * queued_at
+)
+{
+	static const int32_t quanta[2] = {chat_lane_weight * lane_quantum, backlog_lane_weight * lane_quantum};
+	
+	if ( queue->control_n )
+	{
+		Frame * const frame = queue->control[queue->control_first];
+		queue->control_first = (queue->control_first + 1) % control_lane_length;
+		--queue->control_n;
+		*lane = lane_control;
+		*queued_at = frame->queued_at;
+		return frame;
+	}
+	if ( (!queue->n && !queue->backlog_n) || queue->websocket == websocket_closing )
+		return NULL;
+	
+	for ( ;; )
+	{
+		const unsigned turn = queue->turn;
+		Frame * const frame = turn == lane_chat ? (queue->n ? queue->frames[queue->first] : NULL) : (queue->backlog_n ? queue->backlog[queue->backlog_first] : NULL);
+		
+		if ( frame && frame->size <= queue->deficit[turn] )
+		{
+			queue->deficit[turn] -= frame->size;
+			*lane = (enum Lane)turn;
+			if ( turn == lane_chat )
+			{
+				queue->first = (queue->first + 1) % outbound_queue_length;
+				--queue->n;
+				*queued_at = frame->queued_at;
+			}
+			else
+			{
+				*queued_at = queue->backlog_queued_at[queue->backlog_first];
+				queue->backlog_first = (queue->backlog_first + 1) % backlog_lane_length;
+				--queue->backlog_n;
+			}
+			return frame;
+		}
+		
+		/* The other lane's turn, which a lane with nothing
+		 * waiting doesn't keep anything of */
+		if ( !frame )
+			queue->deficit[turn] = 0;
+		queue->turn = (unsigned char)!turn;
+		if ( queue->turn == lane_chat ? queue->n : queue->backlog_n )
+			queue->deficit[queue->turn] += quanta[queue->turn];
+	}
+}
+
+static unsigned
+wait_bucket
+(
+ uint64_t us
+)
+{
+	unsigned bucket = 0;
+	for ( ; us && bucket != lane_wait_buckets - 1 ; us >>= 1 )
+		++bucket;
+	return bucket;
+}
+
+/* Sends everything queued for the client in as few sends as possible.
+ * The time in microseconds is the caller's to pass if it has it at hand,
+ * 0 otherwise. */
+static void
+start_send
+(
+ Core * core,
+ ClientData * client_data,
+ uint64_t now
+)
+{
+	ClientQueue * const queue = client_queue(core, client_data);
+	SendState * const send_state = queue->send_state;
+	size_t frames_n = 0;
+	Frame * frame;
+	enum Lane lane;
+	uint64_t queued_at;
+	
+	assert(!queue->sending);
+	
+	for ( ; frames_n != core->frames_per_send && (frame = next_frame(queue, &lane, &queued_at)) ; ++frames_n )
+	{
+		if ( !now )
+			now = platform_now_us();
+		/* Along with the header in front of it for WebSocket clients */
+		const size_t prefix_size = queue->websocket ? frame->prefix_size : 0;
+		send_state->frames[frames_n] = frame;
+		send_state->buffers[frames_n].buf = frame->data - prefix_size;
+		send_state->buffers[frames_n].len = frame->size + prefix_size;
+		++(current_chunk ? current_chunk->lane_waits : core->lane_waits)[lane][wait_bucket(now > queued_at ? now - queued_at : 0)];
+	}
+	
+	if ( frames_n )
+	{
+		send_state->frames_n = frames_n;
+		send_state->first_buffer = 0;
+		send_state->started_at = now;
+		
+		queue->sending = 1;
+		++client_data->references;
+		queue->last_send = core->transport.now(core->transport.context);
+		
+		post_send(core, client_data);
+	}
+}
+
+/* Fills the client's backlog lane with what it missed from the backlog,
+ * up to the first message it got broadcast. Whatever the backlog let go
+ * of before the client got to it is skipped. Sends are the caller's to
+ * start. */
+static void
+catch_up
+(
+ Core * core,
+ ClientData * client_data
+)
+{
+	ClientQueue * const queue = client_queue(core, client_data);
+	const uint64_t now = platform_now_us();
+	size_t i = backlog_find(&core->backlog, queue->resume_next);
+	
+	for ( ; i != core->backlog.n && backlog_entry(&core->backlog, i)->sequence < queue->resume_end && queue->backlog_n != backlog_lane_length ; ++i )
+	{
+		const BacklogEntry * const entry = backlog_entry(&core->backlog, i);
+		const unsigned short slot = (queue->backlog_first + queue->backlog_n) % backlog_lane_length;
+		/* There's always room for one, or it would never
+		 * catch up again */
+		if ( core->connection_budget && queue->backlog_n && queue->memory + pool_capacity(entry->frame) > core->connection_budget )
+			break;
+		queue->memory += pool_capacity(entry->frame);
+		frame_retain(entry->frame);
+		queue->backlog[slot] = entry->frame;
+		queue->backlog_queued_at[slot] = now;
+		++queue->backlog_n;
+		queue->resume_next = entry->sequence + entry->frame->messages;
+	}
+	
+	if ( i == core->backlog.n || backlog_entry(&core->backlog, i)->sequence >= queue->resume_end )
+		queue->resume_next = 0;
+}
+
+static int queue_frame
+(
+ Core *,
+ ClientData *,
+ Frame *,
+ uint64_t
+);
+
+/* Makes a frame of the WebSocket transport's own, which goes out to the
+ * client as it is, ahead of any messages */
+static Frame *
+websocket_frame
+(
+ const void * data,
+ size_t size
+)
+{
+	Frame * const frame = frame_create((int)size);
+	if ( !frame )
+	{
+		logmsg("couldn't allocate memory for a WebSocket frame");
+		return NULL;
+	}
+	memcpy(frame->data, data, size);
+	frame->prefix_size = 0;
+	frame->messages = 0;
+	frame->lane = lane_control;
+	frame->queued_at = platform_now_us();
+	return frame;
+}
+
+/* Queues such a frame, the client's connection getting to the given
+ * state with it. Once a Close is queued nothing else is, the Close
+ * being as good as answered then. Returns 0 if the frame couldn't be
+ * queued. */
+static int
+queue_websocket_frame
+(
+ Core * core,
+ ClientData * client_data,
+ Frame * frame,
+ enum WebSocketState state
+)
+{
+	ClientQueue * const queue = client_queue(core, client_data);
+	const char previous = queue->websocket;
+	
+	if ( previous == websocket_closing )
+		return 1;
+	/* Ahead of the send queue_frame may start, for a Close to go
+	 * out on its own */
+	queue->websocket = (char)state;
+	if ( client_data->closing || !queue_frame(core, client_data, frame, core->transport.now(core->transport.context)) )
+	{
+		queue->websocket = previous;
+		return 0;
+	}
+	return 1;
+}
+
+/* Sends the client a Close with the given status code, or none if 0,
+ * after which it's broadcast nothing more. Returns 0 if it couldn't be
+ * queued. */
+static int
+close_websocket
+(
+ Core * core,
+ ClientData * client_data,
+ unsigned short status
+)
+{
+	unsigned char close[websocket_close_size];
+	Frame * const frame = websocket_frame(close, websocket_put_close(close, status));
+	
+	if ( !frame )
+		return 0;
+	const int queued = queue_websocket_frame(core, client_data, frame, websocket_closing);
+	frame_release(frame);
+	if ( queued )
+		core->receiving[client_data - core->clients] = encoding_none;
+	return queued;
+}
+
+static void
+complete_send
+(
+ Core * core,
+ ClientData * client_data,
+ size_t size
+)
+{
+	SendState * const send_state = client_queue(core, client_data)->send_state;
+	TransportBuffer * buffer = send_state->buffers + send_state->first_buffer;
+	TransportBuffer * const buffers_end = send_state->buffers + send_state->frames_n;
+	
+	/* Sends normally complete in full, but should one not,
+	 * the rest of it has to be sent again */
+	for ( ; buffer != buffers_end && size >= buffer->len ; ++buffer )
+		size -= buffer->len;
+	
+	if ( buffer != buffers_end && !client_data->closing )
+	{
+		buffer->buf += size;
+		buffer->len -= size;
+		send_state->first_buffer = (size_t)(buffer - send_state->buffers);
+		post_send(core, client_data);
+	}
+	else
+	{
+		ClientQueue * const queue = client_queue(core, client_data);
+		const char closing = client_data->closing;
+		/* A WebSocket client's Close having gone out */
+		const int closed = !closing && queue->websocket == websocket_closing && !queue->control_n;
+		
+		if ( closed )
+			disconnect_client(core, client_data);
+		/* The client can't be released here unless it's closing */
+		end_send(core, client_data, buffer == buffers_end);
+		
+		/* Whatever got queued meanwhile goes out in one go, or if the
+		 * client is catching up, more of what it missed. WebSocket
+		 * clients are sent a Close once they've been sent everything
+		 * while the server drains. */
+		if ( !closing && !closed )
+		{
+			if ( queue->resume_next )
+				catch_up(core, client_data);
+			start_send(core, client_data, 0);
+			if ( core->draining && queue->websocket == websocket_open && !queue->sending && !queue->flush_pending )
+				close_websocket(core, client_data, websocket_going_away);
+		}
+	}
+}
+
+static void
+arm_flush_timer
+(
+ Core * core,
+ ClientData * client_data
+)
+{
+	if ( core->transport.set_timer(core->transport.context, client_data, timer_flush, core->coalescing_window) )
+	{
+		client_queue(core, client_data)->flush_pending = 1;
+		++client_data->references;
+	}
+	else
+		start_send(core, client_data, 0);
+}
+
+/* Returns 0 if the client's queue was full, or its connection budget
+ * used up, in which case it misses out on the frame rather than holding
+ * everybody else up */
+static int
+queue_frame
+(
+ Core * core,
+ ClientData * client_data,
+ Frame * frame,
+ uint64_t now
+)
+{
+	ClientQueue * const queue = client_queue(core, client_data);
+	
+	if ( frame->lane == lane_control )
+	{
+		if ( queue->control_n == control_lane_length )
+			return 0;
+		queue->memory += pool_capacity(frame);
+		frame_retain(frame);
+		queue->control[(queue->control_first + queue->control_n) % control_lane_length] = frame;
+		++queue->control_n;
+		
+		/* They don't wait for the coalescing window to be over */
+		if ( !queue->sending )
+			start_send(core, client_data, frame->queued_at);
+		return 1;
+	}
+	
+	if ( queue->n == outbound_queue_length )
+	{
+		queue->dropped += frame->messages;
+		counter(core, messages_dropped) += frame->messages;
+		return 0;
+	}
+	if ( core->connection_budget && queue->memory + pool_capacity(frame) > core->connection_budget )
+	{
+		queue->dropped += frame->messages;
+		counter(core, messages_dropped) += frame->messages;
+		++counter(core, frames_shed);
+		return 0;
+	}
+	
+	queue->memory += pool_capacity(frame);
+	/* A chunk of a parallel fan-out takes its references all at once */
+	if ( !current_chunk )
+		frame_retain(frame);
+	queue->frames[(queue->first + queue->n) % outbound_queue_length] = frame;
+	++queue->n;
+	
+	if ( !queue->sending && !queue->flush_pending )
+	{
+		if ( core->coalescing_window && now - queue->last_send < core->coalescing_window )
+			arm_flush_timer(core, client_data);
+		else
+		if ( current_batch && current_batch->n != current_batch->capacity )
+		{
+			if ( !queue->batched )
+			{
+				queue->batched = 1;
+				current_batch->slots[current_batch->n++] = (size_t)(client_data - core->clients);
+			}
+		}
+		else
+			start_send(core, client_data, frame->queued_at);
+	}
+	
+	return 1;
+}
+
+static unsigned char *
+put_nickname
+(
+ unsigned char * out,
+ const ClientData * sender
+)
+{
+	*out++ = sender->nickname_length;
+	memcpy(out, sender->nickname, sender->nickname_length);
+	return out + sender->nickname_length;
+}
+
+/* Disconnects the clients pinning the most memory, a few at a time,
+ * until the server is back within its memory budget or there's
+ * nobody left pinning any */
+static void
+shed_clients
+(
+ Core * core
+)
+{
+	for ( int shed = 0 ; shed != max_clients_shed ; ++shed )
+	{
+		const ClientQueue * heaviest = NULL;
+		for ( size_t i = 0 ; i != core->capacity ; ++i )
+			if ( core->clients[i].used && !core->clients[i].closing && (!heaviest || core->queues[i].memory > heaviest->memory) )
+				heaviest = core->queues + i;
+		if ( !heaviest || !heaviest->memory )
+			break;
+		
+		ClientData * const client_data = core->clients + (heaviest - core->queues);
+		logmsgf("memory budget used up, disconnecting %.*s, which pinned %zu KiB\n", client_data->nickname_length, client_data->nickname, heaviest->memory >> 10);
+		++core->clients_shed;
+		disconnect_client(core, client_data);
+		if ( !over_memory_budget(core) )
+			break;
+	}
+}
+
+/* The sender's messages as they go out to clients getting them in
+ * the given encoding (see protocol.h), the first of them having the
+ * given sequence number */
+static Frame *
+encode_frame
+(
+ enum Encoding encoding,
+ const ClientData * sender,
+ const Message * messages,
+ size_t messages_n,
+ uint64_t sequence
+)
+{
+	const size_t nickname_size = 1 + sender->nickname_length;
+	size_t size = 0;
+	size_t payload = 0; // of a batched frame
+	
+	for ( const Message * message = messages, * const end = messages + messages_n ; message != end ; ++message )
+	{
+		switch ( encoding )
+		{
+			case encoding_v1:
+			{
+				const size_t chunks = message->size ? (message->size + 254) / 255 : 1;
+				size += chunks * (nickname_size + 1) + message->size;
+				break;
+			}
+			case encoding_v2:
+			{
+				const size_t payload = nickname_size + varint_size((uint32_t)message->size) + message->size;
+				size += varint_size((uint32_t)payload) + payload;
+				break;
+			}
+			case encoding_v2_batched:
+			case encoding_v2_resumable:
+				size += varint_size((uint32_t)message->size) + message->size;
+				break;
+			default:
+				break;
+		}
+	}
+	if ( encoding == encoding_v2_batched || encoding == encoding_v2_resumable )
+	{
+		payload = (encoding == encoding_v2_resumable ? 8 : 0) + nickname_size + size;
+		size = varint_size((uint32_t)payload) + payload;
+	}
+	
+	Frame * const frame = frame_create((int)size);
+	if ( !frame )
+		return NULL;
+	frame->messages = (unsigned)messages_n;
+	
+	unsigned char * out = (unsigned char *)frame->data;
+	if ( encoding == encoding_v2_batched || encoding == encoding_v2_resumable )
+	{
+		out += varint_put(out, (uint32_t)payload);
+		if ( encoding == encoding_v2_resumable )
+		{
+			uint64_put(out, sequence);
+			out += 8;
+		}
+		out = put_nickname(out, sender);
+	}
+	for ( const Message * message = messages, * const end = messages + messages_n ; message != end ; ++message )
+	{
+		switch ( encoding )
+		{
+			case encoding_v1:
+			{
+				size_t offset = 0;
+				do
+				{
+					const size_t chunk = message->size - offset < 255 ? message->size - offset : 255;
+					out = put_nickname(out, sender);
+					*out++ = (unsigned char)chunk;
+					memcpy(out, message->text + offset, chunk);
+					out += chunk;
+					offset += chunk;
+				}
+				while ( offset != message->size );
+				break;
+			}
+			case encoding_v2:
+				out += varint_put(out, (uint32_t)(1 + sender->nickname_length + varint_size((uint32_t)message->size) + message->size));
+				out = put_nickname(out, sender);
+				/* Fall through */
+			case encoding_v2_batched:
+			case encoding_v2_resumable:
+				out += varint_put(out, (uint32_t)message->size);
+				memcpy(out, message->text, message->size);
+				out += message->size;
+				break;
+			default:
+				break;
+		}
+	}
+	
+	assert(out == (unsigned char *)frame->data + size);
+	return frame;
+}
+
+static Frame *
+broadcast_frame
+(
+ Frame * * frames,
+ enum Encoding encoding,
+ const ClientData * sender,
+ const Message * messages,
+ size_t messages_n,
+ uint64_t sequence,
+ uint64_t trace_id,
+ uint64_t queued_at
+)
+{
+	Frame * const frame = frames[encoding] = encode_frame(encoding, sender, messages, messages_n, sequence);
+	if ( !frame )
+	{
+		logmsg("couldn't allocate memory for message frame");
+		return NULL;
+	}
+	frame->queued_at = queued_at;
+	if ( trace_unlikely(trace_id) )
+		frame->trace_id = trace_id;
+	return frame;
+}
+
+static void
+fan_out_chunk
+(
+ Core * core,
+ FanOut * fan_out,
+ size_t index
+)
+{
+	FanOutChunk * const chunk = fan_out->chunks + index;
+	long queued[encodings] = {0};
+	
+	current_chunk = chunk;
+	for ( size_t i = chunk->first ; i != chunk->end ; ++i )
+	{
+		const unsigned char encoding = core->receiving[i];
+		if ( encoding != encoding_none && fan_out->frames[encoding] )
+			queued[encoding] += queue_frame(core, core->clients + i, fan_out->frames[encoding], fan_out->now);
+	}
+	current_chunk = NULL;
+	
+	/* The frames are the broadcast's own until the lock is let go of,
+	 * so nothing sent can have been released yet */
+	for ( size_t i = 0 ; i != encodings ; ++i )
+	{
+		if ( queued[i] )
+			frame_retain_many(fan_out->frames[i], queued[i]);
+		chunk->clients_sent += (size_t)queued[i];
+	}
+	platform_decrement(&fan_out->remaining);
+}
+
+/* Fans the frames out in parallel (see core.h), returning to how many
+ * clients, once every chunk is done and the counters are the core's
+ * again. There's a frame of every encoding, as the chunks would
+ * otherwise have to agree on who makes them. */
+static size_t
+fan_out_frames
+(
+ Core * core,
+ Frame * const * frames,
+ uint64_t now
+)
+{
+	FanOut * const fan_out = core->fan_out;
+	size_t clients_sent = 0;
+	size_t index;
+	
+	memcpy(fan_out->frames, frames, sizeof(fan_out->frames));
+	fan_out->now = now;
+	workdeque_reset(&fan_out->deque);
+	for ( size_t i = fan_out->chunks_n ; i-- ; )
+	{
+		FanOutChunk * const chunk = fan_out->chunks + i;
+		chunk->clients_sent = 0;
+		chunk->sends_failed = 0;
+		chunk->sends = 0;
+		chunk->messages_dropped = 0;
+		chunk->frames_shed = 0;
+		memset(chunk->lane_waits, 0, sizeof(chunk->lane_waits));
+		workdeque_push(&fan_out->deque, i);
+	}
+	platform_store_long(&fan_out->remaining, (long)fan_out->chunks_n);
+	platform_store_long(&fan_out->open, 1);
+	core->transport.request_help(core->transport.context, fan_out->chunks_n - 1);
+	
+	while ( workdeque_pop(&fan_out->deque, &index) )
+		fan_out_chunk(core, fan_out, index);
+	/* The helpers may be in the middle of the last of them, and
+	 * are to be out of the deque before it's used again */
+	while ( platform_load_long(&fan_out->remaining) )
+		platform_yield();
+	platform_store_long(&fan_out->open, 0);
+	platform_barrier();
+	while ( platform_load_long(&fan_out->helpers) )
+		platform_yield();
+	
+	++core->fanned_out;
+	for ( size_t i = 0 ; i != fan_out->chunks_n ; ++i )
+	{
+		const FanOutChunk * const chunk = fan_out->chunks + i;
+		clients_sent += chunk->clients_sent;
+		core->sends += chunk->sends;
+		core->messages_dropped += chunk->messages_dropped;
+		core->frames_shed += chunk->frames_shed;
+		for ( unsigned lane = 0 ; lane != lanes ; ++lane )
+			for ( unsigned bucket = 0 ; bucket != lane_wait_buckets ; ++bucket )
+				core->lane_waits[lane][bucket] += chunk->lane_waits[lane][bucket];
+		
+		for ( size_t slot = chunk->first ; chunk->sends_failed && slot != chunk->end ; ++slot )
+		{
+			if ( core->queues[slot].sending != send_failed )
+				continue;
+			core->queues[slot].sending = 1;
+			disconnect_client(core, core->clients + slot);
+			end_send(core, core->clients + slot, 0);
+		}
+	}
+	return clients_sent;
+}
+
+/* The messages are queued for every client, in a frame of the encoding
+ * it gets them in. Those that have no send in flight get it right away,
+ * unless they were sent something within the coalescing window, in
+ * which case whatever else gets broadcast until the window is over goes
+ * out to them together with it. The frame of resuming clients goes to
+ * the backlog as well, whether anybody is getting it now or not. */
+static size_t
+broadcast_message
+(
+ Core * core,
+ const ClientData * sender,
+ const Message * messages,
+ size_t messages_n,
+ uint64_t trace_id
+)
+{
+	size_t clients_sent = 0;
+	Frame * frames[encodings] = {NULL};
+	const uint64_t now = core->transport.now(core->transport.context);
+	const uint64_t sequence = core->messages + 1;
+	const uint64_t queued_at = platform_now_us();
+	
+	if ( over_memory_budget(core) )
+		shed_clients(core);
+	
+	core->messages += messages_n;
+	
+	if ( core->backlog.max_messages && broadcast_frame(frames, encoding_v2_resumable, sender, messages, messages_n, sequence, trace_id, queued_at) )
+		backlog_append(&core->backlog, sequence, frames[encoding_v2_resumable]);
+	
+	if ( core->fan_out && core->capacity - core->free_slots_n >= core->fan_out_threshold )
+	{
+		for ( size_t i = 0 ; i != encodings ; ++i )
+			if ( !frames[i] )
+				broadcast_frame(frames, (enum Encoding)i, sender, messages, messages_n, sequence, trace_id, queued_at);
+		clients_sent = fan_out_frames(core, frames, now);
+	}
+	else
+	{
+		/* Only the slots of clients getting the message are looked
+		 * any further into than core->receiving */
+		for ( size_t i = 0 ; i != core->capacity ; ++i )
+		{
+			const unsigned char encoding = core->receiving[i];
+			if ( encoding != encoding_none )
+			{
+				Frame * const frame = frames[encoding] ? frames[encoding] : broadcast_frame(frames, (enum Encoding)encoding, sender, messages, messages_n, sequence, trace_id, queued_at);
+				if ( frame )
+					clients_sent += queue_frame(core, core->clients + i, frame, now);
+			}
+		}
+	}
+	
+	for ( size_t i = 0 ; i != encodings ; ++i )
+		if ( frames[i] )
+			frame_release(frames[i]);
+	
+	return clients_sent;
+}
+
+/* The clients in a group of notices (see protocol.h): everyone there
+ * for notice_present, those who joined or left in the presence window
+ * otherwise. Returns how many, and adds the size of their nicknames. */
+static size_t
+count_presence
+(
+ const Core * core,
+ enum Notice notice,
+ size_t * size
+)
+{
+	size_t n = 0;
+	
+	if ( notice == notice_present )
+	{
+		for ( size_t i = 0 ; i != core->capacity ; ++i )
+		{
+			const ClientData * const client_data = core->clients + i;
+			if ( client_data->used && client_data->announced && !client_data->closing )
+			{
+				*size += 1 + client_data->nickname_length;
+				++n;
+			}
+		}
+	}
+	else
+	{
+		for ( size_t i = 0 ; i != core->presence_n ; ++i )
+		{
+			if ( core->presence[i].notice == notice )
+			{
+				*size += 1 + core->presence[i].nickname_length;
+				++n;
+			}
+		}
+	}
+	return n;
+}
+
+static unsigned char *
+put_presence
+(
+ unsigned char * out,
+ const Core * core,
+ enum Notice notice,
+ size_t n
+)
+{
+	*out++ = (unsigned char)notice;
+	out += varint_put(out, (uint32_t)n);
+	
+	if ( notice == notice_present )
+	{
+		for ( size_t i = 0 ; i != core->capacity ; ++i )
+		{
+			const ClientData * const client_data = core->clients + i;
+			if ( client_data->used && client_data->announced && !client_data->closing )
+				out = put_nickname(out, client_data);
+		}
+	}
+	else
+	{
+		for ( size_t i = 0 ; i != core->presence_n ; ++i )
+		{
+			const PresenceEvent * const event = core->presence + i;
+			if ( event->notice == notice )
+			{
+				*out++ = event->nickname_length;
+				memcpy(out, event->nickname, event->nickname_length);
+				out += event->nickname_length;
+			}
+		}
+	}
+	return out;
+}
+
+/* A control frame (see protocol.h) of everyone there, or of the joins
+ * and leaves of the presence window, with room for a sequence number
+ * or not */
+static Frame *
+encode_presence
+(
+ const Core * core,
+ int snapshot,
+ int sequenced
+)
+{
+	static const enum Notice groups[2][2] = {{notice_join, notice_leave}, {notice_present}};
+	size_t n[2] = {0};
+	size_t payload = (sequenced ? 8 : 0) + 1;
+	
+	for ( size_t i = 0 ; i != 2 && groups[snapshot][i] ; ++i )
+		if ( (n[i] = count_presence(core, groups[snapshot][i], &payload)) )
+			payload += 1 + varint_size((uint32_t)n[i]);
+	
+	Frame * const frame = frame_create((int)(varint_size((uint32_t)payload) + payload));
+	if ( !frame )
+		return NULL;
+	
+	unsigned char * out = (unsigned char *)frame->data;
+	out += varint_put(out, (uint32_t)payload);
+	if ( sequenced )
+	{
+		uint64_put(out, 0);
+		out += 8;
+	}
+	*out++ = 0;
+	for ( size_t i = 0 ; i != 2 && groups[snapshot][i] ; ++i )
+		if ( n[i] )
+			out = put_presence(out, core, groups[snapshot][i], n[i]);
+	
+	assert(out == (unsigned char *)frame->data + frame->size);
+	frame->messages = 0;
+	frame->lane = lane_control;
+	frame->queued_at = platform_now_us();
+	return frame;
+}
+
+/* A control frame of a notice concerning nobody in particular, with room
+ * for a sequence number or not */
+static Frame *
+encode_notice
+(
+ enum Notice notice,
+ int sequenced
+)
+{
+	/* The nickname length of 0, the notice and its count of 0 */
+	const size_t payload = (sequenced ? 8 : 0) + 3;
+	
+	Frame * const frame = frame_create((int)(varint_size((uint32_t)payload) + payload));
+	if ( !frame )
+		return NULL;
+	
+	unsigned char * out = (unsigned char *)frame->data;
+	out += varint_put(out, (uint32_t)payload);
+	if ( sequenced )
+	{
+		uint64_put(out, 0);
+		out += 8;
+	}
+	*out++ = 0;
+	*out++ = (unsigned char)notice;
+	out += varint_put(out, 0);
+	
+	assert(out == (unsigned char *)frame->data + frame->size);
+	frame->messages = 0;
+	frame->lane = lane_control;
+	frame->queued_at = platform_now_us();
+	return frame;
+}
+
+/* Closes the presence window: those who were there already are told of
+ * who joined and left in it, in a single frame for all of them, and
+ * those who joined in it of everyone there now, themselves included */
+static void
+flush_presence
+(
+ Core * core
+)
+{
+	Frame * frames[2][2] = {{NULL}}; // the changes and everyone, each without a sequence number and with one
+	const uint64_t now = core->transport.now(core->transport.context);
+	size_t changes = 0;
+	
+	for ( size_t i = 0 ; i != core->presence_n ; ++i )
+		changes += core->presence[i].notice != 0;
+	
+	for ( size_t i = 0 ; changes && i != core->capacity ; ++i )
+	{
+		const unsigned char encoding = core->receiving[i];
+		/* Those yet to be announced get everyone
+		 * once their own window is over */
+		if ( encoding == encoding_none || encoding == encoding_v1 || !(core->clients[i].capabilities & capability_notices) || !core->clients[i].announced )
+			continue;
+		
+		const int snapshot = core->clients[i].presence_join != 0;
+		const int sequenced = encoding == encoding_v2_resumable;
+		if ( !frames[snapshot][sequenced] && !(frames[snapshot][sequenced] = encode_presence(core, snapshot, sequenced)) )
+		{
+			logmsg("couldn't allocate memory for a notice");
+			continue;
+		}
+		queue_frame(core, core->clients + i, frames[snapshot][sequenced], now);
+	}
+	
+	for ( size_t i = 0 ; i != core->presence_n ; ++i )
+		if ( core->presence[i].notice == notice_join )
+			core->clients[core->presence[i].slot].presence_join = 0;
+	core->presence_n = 0;
+	
+	for ( size_t i = 0 ; i != 2 ; ++i )
+		for ( size_t j = 0 ; j != 2 ; ++j )
+			if ( frames[i][j] )
+				frame_release(frames[i][j]);
+}
+
+/* Has the others told of the client joining or leaving once the presence
+ * window is over, starting it if it isn't open. However many come and
+ * go during a window, each client is sent one frame at the end of it,
+ * rather than one for every one of them. A client leaving in the window
+ * it joined in is never told of at all. */
+static void
+announce
+(
+ Core * core,
+ ClientData * client_data,
+ enum Notice notice
+)
+{
+	if ( notice == notice_leave && client_data->presence_join )
+	{
+		core->presence[client_data->presence_join - 1].notice = 0;
+		client_data->presence_join = 0;
+		return;
+	}
+	
+	if ( core->presence_n == core->presence_capacity )
+	{
+		const size_t capacity = core->presence_capacity ? 2 * core->presence_capacity : 64;
+		PresenceEvent * const presence = realloc(core->presence, capacity * sizeof(*presence));
+		if ( !presence )
+		{
+			logmsg("couldn't allocate memory for a notice");
+			return;
+		}
+		core->presence = presence;
+		core->presence_capacity = capacity;
+	}
+	
+	PresenceEvent * const event = core->presence + core->presence_n++;
+	event->slot = (uint32_t)(client_data - core->clients);
+	event->notice = (unsigned char)notice;
+	event->nickname_length = client_data->nickname_length;
+	memcpy(event->nickname, client_data->nickname, client_data->nickname_length);
+	if ( notice == notice_join )
+		client_data->presence_join = (uint32_t)core->presence_n;
+	
+	/* The window was closed; the timer holds a reference,
+	 * as the flush timer does */
+	if ( core->presence_n == 1 )
+	{
+		if ( core->transport.set_timer(core->transport.context, client_data, timer_presence, core->presence_window) )
+			++client_data->references;
+		else
+			flush_presence(core);
+	}
+}
+
+/* The client's slot is reserved, but it takes no part in broadcasts
+ * until it's started. Returns NULL if there's no room for it. */
+ClientData *
+core_client_open
+(
+ Core * core,
+ uintptr_t handle
+)
+{
+	ClientData * client_data = NULL;
+	
+	platform_lock_acquire(&core->client_pool_lock);
+	
+	if ( core->free_slots_n && over_memory_budget(core) )
+	{
+		logmsg("memory budget used up, not letting new client in");
+		++core->clients_refused;
+	}
+	else
+	if ( core->free_slots_n )
+		client_data = core->clients + core->free_slots[core->free_slots_n - 1];
+	
+	if ( client_data )
+	{
+		/* calloc ensures that the memory chunks will be zero-filled */
+		RecvState * const recv_state = calloc(1, sizeof(*recv_state));
+		SendState * const send_state = calloc(1, sizeof(*send_state));
+		if ( recv_state && send_state )
+		{
+			const uint64_t now = core->transport.now(core->transport.context);
+			ClientQueue * const queue = client_queue(core, client_data);
+			
+			--core->free_slots_n;
+			client_data->used = 1;
+			client_data->closing = 1;
+			client_data->connection_id = core->next_connection_id++;
+			client_data->handle = handle;
+			client_data->transport_data = NULL;
+			client_data->phase = phase_getting_nickname_length;
+			client_data->protocol = 0;
+			client_data->capabilities = 0;
+			client_data->joined_at = 0;
+			client_data->nickname_length = 0;
+			client_data->announced = 0;
+			client_data->presence_join = 0;
+			client_data->references = 0;
+			client_data->recv_state = recv_state;
+			token_bucket_init(&client_data->message_bucket, core->rate_messages, now);
+			token_bucket_init(&client_data->byte_bucket, core->rate_bytes, now);
+			client_data->throttled = 0;
+			client_data->throttled_ms = 0;
+			queue->first = 0;
+			queue->n = 0;
+			queue->sending = 0;
+			queue->flush_pending = 0;
+			queue->last_send = 0;
+			queue->dropped = 0;
+			queue->send_state = send_state;
+			queue->resume_next = 0;
+			queue->resume_end = 0;
+			queue->control_first = 0;
+			queue->control_n = 0;
+			queue->backlog_first = 0;
+			queue->backlog_n = 0;
+			queue->turn = lane_chat;
+			queue->deficit[lane_chat] = 0;
+			queue->deficit[lane_backlog] = 0;
+			queue->memory = 0;
+			queue->batched = 0;
+			queue->websocket = websocket_none;
+		}
+		else
+		{
+			logmsg("couldn't allocate memory for new client's data");
+			free(recv_state);
+			free(send_state);
+			client_data = NULL;
+		}
+	}
+	else
+	if ( !core->free_slots_n )
+		logmsg("no free slot for new client's data");
+	
+	platform_lock_release(&core->client_pool_lock);
+	
+	return client_data;
+}
+
+/* Gives back the slot of a client that was opened but never started.
+ * Its connection is the transport's to close. */
+void
+core_client_abandon
+(
+ Core * core,
+ ClientData * client_data
+)
+{
+	platform_lock_acquire(&core->client_pool_lock);
+	free_client(core, client_data);
+	platform_lock_release(&core->client_pool_lock);
+}
+
+/* The slot is looked up under the lock, for the ID to tell the
+ * client from whoever may have taken its slot since */
+int
+core_client_kick
+(
+ Core * core,
+ uint32_t connection_id
+)
+{
+	int kicked = 0;
+	
+	platform_lock_acquire(&core->client_pool_lock);
+	for ( ClientData * cur = core->clients, * const end = cur + core->capacity ; cur != end ; ++cur )
+	{
+		if ( !cur->used || cur->closing || cur->connection_id != connection_id )
+			continue;
+		logmsgf("kicking %.*s (connection %"PRIu32")\n", cur->nickname_length, cur->nickname, connection_id);
+		disconnect_client(core, cur);
+		kicked = 1;
+		break;
+	}
+	platform_lock_release(&core->client_pool_lock);
+	
+	return kicked;
+}
+
+/* The client couldn't have another recv queued, or its last one failed,
+ * so it's not like we'll be getting any further message from it */
+void
+core_recv_failed
+(
+ Core * core,
+ ClientData * client_data
+)
+{
+	platform_lock_acquire(&core->client_pool_lock);
+	disconnect_client(core, client_data);
+	drop_client_reference(core, client_data);
+	platform_lock_release(&core->client_pool_lock);
+}
+
+static void
+queue_recv
+(
+ Core * core,
+ ClientData * client_data,
+ void * buffer,
+ size_t size
+)
+{
+	if ( !core->transport.recv(core->transport.context, client_data, buffer, size) )
+		core_recv_failed(core, client_data);
+}
+
+/* The client is sent every message broadcast from now on, in the given
+ * encoding, starting with the greeting if there is one. A resuming
+ * client is sent what it missed after resume_after first, and its
+ * greeting ends with room for the sequence number of the first message
+ * it's going to be sent, which only gets known here. */
+static void
+join_client
+(
+ Core * core,
+ ClientData * client_data,
+ enum Encoding encoding,
+ Frame * greeting,
+ uint64_t resume_after
+)
+{
+	ClientQueue * const queue = client_queue(core, client_data);
+	
+	platform_lock_acquire(&core->client_pool_lock);
+	
+	client_data->joined_at = core->messages;
+	uint64_t next = core->messages + 1;
+	if ( encoding == encoding_v2_resumable )
+	{
+		if ( resume_after && resume_after < core->messages )
+		{
+			const size_t i = backlog_find(&core->backlog, resume_after + 1);
+			if ( i != core->backlog.n )
+				next = backlog_entry(&core->backlog, i)->sequence;
+		}
+		uint64_put((unsigned char *)greeting->data + greeting->size - 8, next);
+	}
+	
+	if ( !client_data->closing )
+	{
+		core->receiving[client_data - core->clients] = (unsigned char)encoding;
+		if ( next <= core->messages )
+		{
+			loginfof("%.*s resumes %"PRIu64" messages back\n", client_data->nickname_length, client_data->nickname, core->messages - next + 1);
+			queue->resume_next = next;
+			queue->resume_end = core->messages + 1;
+			catch_up(core, client_data);
+		}
+	}
+	/* It goes out right away, along with what the
+	 * client is catching up on */
+	if ( greeting )
+		queue_frame(core, client_data, greeting, core->transport.now(core->transport.context));
+	
+	platform_lock_release(&core->client_pool_lock);
+}
+
+/* Has the others told of the client joining, once its nickname is known */
+static void
+announce_client
+(
+ Core * core,
+ ClientData * client_data
+)
+{
+	platform_lock_acquire(&core->client_pool_lock);
+	if ( !client_data->closing )
+	{
+		client_data->announced = 1;
+		announce(core, client_data, notice_join);
+	}
+	platform_lock_release(&core->client_pool_lock);
+}
+
+static void
+protocol_error
+(
+ Core * core,
+ ClientData * client_data,
+ const char * error
+)
+{
+	loginfof("%s, disconnecting it\n", error);
+	core_recv_failed(core, client_data);
+}
+
+/* Accounts for the client's stream buffer going from one capacity to
+ * another, unless it takes the client past its connection budget or
+ * the memory budget is used up, in which case it returns 0 */
+static int
+resize_stream
+(
+ Core * core,
+ ClientData * client_data,
+ size_t from,
+ size_t to
+)
+{
+	ClientQueue * const queue = client_queue(core, client_data);
+	
+	platform_lock_acquire(&core->client_pool_lock);
+	const int fits = (!core->connection_budget || queue->memory - from + to <= core->connection_budget) && !over_memory_budget(core);
+	if ( fits )
+		queue->memory = queue->memory - from + to;
+	platform_lock_release(&core->client_pool_lock);
+	
+	return fits;
+}
+
+/* Starts reading from the client, which gets every message broadcast
+ * once its first byte has told which protocol it speaks */
+void
+core_client_start
+(
+ Core * core,
+ ClientData * client_data
+)
+{
+	platform_lock_acquire(&core->client_pool_lock);
+	client_data->closing = 0;
+	client_data->references = 1;
+	platform_lock_release(&core->client_pool_lock);
+	
+	client_data->recv_state->received = 0;
+	queue_recv(core, client_data, &(client_data->nickname_length), 1);
+}
+
+static void
+queue_stream_recv
+(
+ Core * core,
+ ClientData * client_data
+)
+{
+	RecvState * const recv_state = client_data->recv_state;
+	
+	queue_recv(core, client_data, recv_state->stream + recv_state->stream_used, pool_capacity(recv_state->stream) - recv_state->stream_used);
+}
+
+/* Gives a v2 client an empty stream buffer. If that fails, the client
+ * is let go of, and it returns 0. */
+static int
+attach_stream
+(
+ Core * core,
+ ClientData * client_data
+)
+{
+	RecvState * const recv_state = client_data->recv_state;
+	
+	if ( !(recv_state->stream = pool_alloc(stream_initial_size)) )
+	{
+		logmsg("couldn't allocate memory for client's stream buffer");
+		core_recv_failed(core, client_data);
+		return 0;
+	}
+	recv_state->stream_used = 0;
+	if ( !resize_stream(core, client_data, 0, pool_capacity(recv_state->stream)) )
+	{
+		pool_free(recv_state->stream);
+		recv_state->stream = NULL;
+		protocol_error(core, client_data, "no memory budget left for client's stream buffer");
+		return 0;
+	}
+	return 1;
+}
+
+/* Gives an idle v2 client's empty stream buffer back to the pool */
+static void
+detach_stream
+(
+ Core * core,
+ ClientData * client_data
+)
+{
+	RecvState * const recv_state = client_data->recv_state;
+	
+	platform_lock_acquire(&core->client_pool_lock);
+	client_queue(core, client_data)->memory -= pool_capacity(recv_state->stream);
+	platform_lock_release(&core->client_pool_lock);
+	
+	pool_free(recv_state->stream);
+	recv_state->stream = NULL;
+}
+
+void
+core_client_start_websocket
+(
+ Core * core,
+ ClientData * client_data
+)
+{
+	WebSocketDecoder * const decoder = calloc(1, sizeof(*decoder));
+	
+	platform_lock_acquire(&core->client_pool_lock);
+	client_data->closing = 0;
+	client_data->references = 1;
+	client_queue(core, client_data)->websocket = websocket_upgrading;
+	platform_lock_release(&core->client_pool_lock);
+	
+	if ( !decoder )
+	{
+		logmsg("couldn't allocate memory for WebSocket client's state");
+		core_recv_failed(core, client_data);
+		return;
+	}
+	client_data->recv_state->websocket = decoder;
+	client_data->phase = phase_getting_upgrade;
+	if ( attach_stream(core, client_data) )
+		queue_stream_recv(core, client_data);
+}
+
+/* Queues the recv for whatever the client sends next. With idle recvs,
+ * a client that has nothing left to read waits in a recv of 0 bytes
+ * instead, which doesn't have the transport pin a buffer for however
+ * long it stays quiet, and the real one only follows once that
+ * completes. */
+static void
+queue_next_recv
+(
+ Core * core,
+ ClientData * client_data
+)
+{
+	RecvState * const recv_state = client_data->recv_state;
+	
+	/* Unless it was disconnected meanwhile, in which case
+	 * this was the last reference to go, as it would be with
+	 * a recv failing */
+	if ( core->draining )
+	{
+		platform_lock_acquire(&core->client_pool_lock);
+		if ( client_data->closing )
+			drop_client_reference(core, client_data);
+		else
+			client_data->phase = phase_drained;
+		platform_lock_release(&core->client_pool_lock);
+		return;
+	}
+	
+	if ( core->idle_recvs && client_data->phase != phase_idle && (client_data->protocol != 2 || !recv_state->stream_used) )
+	{
+		if ( recv_state->stream )
+			detach_stream(core, client_data);
+		client_data->phase = phase_idle;
+		queue_recv(core, client_data, NULL, 0);
+	}
+	else
+	if ( client_data->protocol == 2 )
+	{
+		if ( !recv_state->stream && !attach_stream(core, client_data) )
+			return;
+		client_data->phase = phase_getting_frames;
+		queue_stream_recv(core, client_data);
+	}
+	else
+	{
+		client_data->phase = phase_getting_message_length;
+		queue_recv(core, client_data, &(recv_state->message_length), 1);
+	}
+}
+
+/* The messages have been read already, so they still get broadcast;
+ * if that put the client over its limit, it's its next read that is
+ * held back. Returns for how long. */
+static uint32_t
+take_tokens
+(
+ Core * core,
+ ClientData * client_data,
+ size_t messages_n,
+ size_t bytes
+)
+{
+	const uint64_t now = core->transport.now(core->transport.context);
+	const double rate_messages = core->rate_messages;
+	const double rate_bytes = core->rate_bytes;
+	stats_count_in(messages_n, bytes);
+	if ( client_data->message_bucket.rate != rate_messages )
+		token_bucket_set_rate(&client_data->message_bucket, rate_messages, now);
+	if ( client_data->byte_bucket.rate != rate_bytes )
+		token_bucket_set_rate(&client_data->byte_bucket, rate_bytes, now);
+	uint32_t throttle_ms = token_bucket_take(&client_data->message_bucket, (double)messages_n, now);
+	const uint32_t byte_throttle_ms = token_bucket_take(&client_data->byte_bucket, (double)bytes, now);
+	
+	return byte_throttle_ms > throttle_ms ? byte_throttle_ms : throttle_ms;
+}
+
+static void
+read_on
+(
+ Core * core,
+ ClientData * client_data,
+ uint32_t throttle_ms
+)
+{
+	if ( throttle_ms )
+	{
+		++client_data->throttled;
+		client_data->throttled_ms += throttle_ms;
+		
+		logdebugf("worker thread #%lu: %.*s went over its rate limit, holding its reads back for %"PRIu32" ms (throttled %lu times, %"PRIu64" ms in total)\n", platform_thread_id(), client_data->nickname_length, client_data->nickname, throttle_ms, client_data->throttled, client_data->throttled_ms);
+		
+		/* Until the next recv is queued, nothing is read
+		 * from the client, so that its TCP window fills up
+		 * and the backpressure reaches the sender instead
+		 * of its messages piling up here */
+		client_data->phase = phase_throttled;
+		if ( core->transport.set_timer(core->transport.context, client_data, timer_resume, throttle_ms) )
+			return;
+	}
+	
+	queue_next_recv(core, client_data);
+}
+
+/* Nicknames aren't stripped; they pass or the client is let go of */
+static int
+nickname_acceptable
+(
+ const Core * core,
+ const ClientData * client_data
+)
+{
+	return core->text_policy == text_unchecked || !text_check((const unsigned char *)client_data->nickname, client_data->nickname_length);
+}
+
+/* Returns 0 if the message is to be dropped for its text, having
+ * stripped it of control characters if that's what the policy says */
+static int
+clean
+(
+ Core * core,
+ const ClientData * client_data,
+ Message * message
+)
+{
+	if ( core->text_policy == text_unchecked )
+		return 1;
+	
+	const int flaws = text_check((const unsigned char *)message->text, message->size);
+	if ( !flaws )
+		return 1;
+	
+	/* The text is in one of the client's recv buffers */
+	if ( flaws == text_controls && core->text_policy == text_strip && (message->size = text_strip_controls((unsigned char *)message->text, message->size)) )
+		return 1;
+	
+	platform_increment(&core->messages_rejected);
+	logdebugf("worker thread #%lu: dropping a message from %.*s, which %s\n", platform_thread_id(), client_data->nickname_length, client_data->nickname, flaws & text_malformed ? "isn't well-formed UTF-8" : core->text_policy == text_reject ? "has control characters" : "has nothing but control characters");
+	return 0;
+}
+
+/* Returns 0 if the message is to be dropped, having had its text
+ * cleaned up and run through the filter */
+static int
+acceptable
+(
+ Core * core,
+ const ClientData * client_data,
+ Message * message
+)
+{
+	if ( !clean(core, client_data, message) )
+		return 0;
+	if ( !core->filter.current )
+		return 1;
+	
+	long generation;
+	const Filter * const filter = filter_enter(&core->filter, &generation);
+	const int actions = filter ? filter_apply(filter, (unsigned char *)message->text, &message->size) : 0;
+	filter_leave(&core->filter, generation);
+	
+	if ( actions & filter_drop )
+	{
+		platform_increment(&core->messages_filtered);
+		logdebugf("worker thread #%lu: dropping a message from %.*s, which has a banned term\n", platform_thread_id(), client_data->nickname_length, client_data->nickname);
+		return 0;
+	}
+	if ( actions & filter_mask )
+		platform_increment(&core->messages_masked);
+	if ( actions & filter_flag )
+	{
+		platform_increment(&core->messages_flagged);
+		loginfof("message from %.*s (connection %"PRIu32") flagged: %.*s\n", client_data->nickname_length, client_data->nickname, client_data->connection_id, (int)message->size, message->text);
+	}
+	return 1;
+}
+
+/* Captures are of what came in, before anything is made of it, and in
+ * protocol v1, so longer messages are recorded the way v1 clients get
+ * them, split up */
+static void
+capture_message
+(
+ const ClientData * client_data,
+ const Message * message
+)
+{
+	size_t offset = 0;
+	do
+	{
+		const unsigned char chunk = (unsigned char)(message->size - offset < 255 ? message->size - offset : 255);
+		capture_frame(client_data->connection_id, &chunk, 1, message->text + offset, chunk);
+		offset += chunk;
+	}
+	while ( offset != message->size );
+}
+
+static void
+broadcast_messages
+(
+ Core * core,
+ ClientData * client_data,
+ const Message * messages,
+ size_t messages_n,
+ uint64_t trace_id,
+ uint64_t trace_time
+)
+{
+	platform_lock_acquire(&core->client_pool_lock);
+	
+	uint64_t locked_at = 0;
+	if ( trace_unlikely(trace_id) )
+		trace_complete("lock wait", trace_id, trace_time, locked_at = trace_now(), -1);
+	
+	size_t clients_sent = broadcast_message(core, client_data, messages, messages_n, trace_id);
+	
+	if ( trace_unlikely(trace_id) )
+		trace_complete("broadcast", trace_id, locked_at, trace_now(), -1);
+	
+	platform_lock_release(&core->client_pool_lock);
+	
+	if ( clients_sent )
+		logdebugf("worker thread #%lu: %zu messages sent to %zu clients\n", platform_thread_id(), messages_n, clients_sent);
+	else
+		logdebugf("worker thread #%lu: couldn't send message to any client\n", platform_thread_id());
+}
+
+static void
+take_message
+(
+ Core * core,
+ ClientData * client_data
+)
+{
+	RecvState * const recv_state = client_data->recv_state;
+	Message message = {recv_state->buffer, recv_state->message_length};
+	
+	uint64_t trace_time = 0;
+	if ( trace_unlikely(recv_state->trace_id) )
+	{
+		trace_instant("recv", recv_state->trace_id, trace_time = trace_now());
+		trace_complete("receiving", recv_state->trace_id, recv_state->trace_start, trace_time, -1);
+	}
+	
+	logdebugf("worker thread #%lu: got complete message from %.*s (%u bytes long): %.*s\n", platform_thread_id(), client_data->nickname_length, client_data->nickname, recv_state->message_length, recv_state->message_length, recv_state->buffer);
+	
+	const uint32_t throttle_ms = take_tokens(core, client_data, 1, message.size);
+	if ( capturing )
+		capture_message(client_data, &message);
+	if ( acceptable(core, client_data, &message) )
+		broadcast_messages(core, client_data, &message, 1, recv_state->trace_id, trace_time);
+	read_on(core, client_data, throttle_ms);
+}
+
+/* Returns how many bytes the handshake took, 0 if it isn't all there
+ * yet, or -1 if it's invalid */
+static int
+take_handshake
+(
+ ClientData * client_data,
+ const unsigned char * cur,
+ const unsigned char * end,
+ uint64_t * resume_after
+)
+{
+	const unsigned char * const start = cur;
+	uint32_t capabilities;
+	
+	if ( cur == end )
+		return 0;
+	if ( *cur++ < protocol_version )
+		return -1;
+	
+	const int varint = varint_get(cur, end, &capabilities);
+	if ( varint <= 0 )
+		return varint;
+	cur += varint;
+	
+	if ( cur == end )
+		return 0;
+	const unsigned char nickname_length = *cur++;
+	if ( !nickname_length || nickname_length > sizeof(client_data->nickname) )
+		return -1;
+	const size_t resume_size = capabilities & capability_resume ? 8 : 0;
+	if ( (size_t)(end - cur) < nickname_length + resume_size )
+		return 0;
+	
+	memcpy(client_data->nickname, cur, nickname_length);
+	client_data->nickname_length = nickname_length;
+	client_data->capabilities = capabilities & capabilities_supported;
+	cur += nickname_length;
+	*resume_after = resume_size ? uint64_get(cur) : 0;
+	
+	return (int)(cur + resume_size - start);
+}
+
+/* Answers the handshake, after which the client gets broadcasts */
+static int
+greet_client
+(
+ Core * core,
+ ClientData * client_data,
+ uint64_t resume_after
+)
+{
+	unsigned char reply[2 + 2 * varint_max_size + 8];
+	size_t reply_size = 0;
+	
+	if ( !core->backlog.max_messages || !(client_data->capabilities & capability_batch) )
+		client_data->capabilities &= ~capability_resume;
+	
+	reply[reply_size++] = protocol_v2_marker;
+	reply[reply_size++] = protocol_version;
+	reply_size += varint_put(reply + reply_size, client_data->capabilities);
+	reply_size += varint_put(reply + reply_size, core->max_frame);
+	if ( client_data->capabilities & capability_resume )
+		reply_size += 8; // filled in by join_client
+	
+	Frame * const greeting = frame_create((int)reply_size);
+	if ( !greeting )
+	{
+		logmsg("couldn't allocate memory for the handshake reply");
+		return 0;
+	}
+	memcpy(greeting->data, reply, reply_size);
+	greeting->messages = 0;
+	greeting->lane = lane_control;
+	greeting->queued_at = platform_now_us();
+	
+	join_client(core, client_data, client_data->capabilities & capability_resume ? encoding_v2_resumable : client_data->capabilities & capability_batch ? encoding_v2_batched : encoding_v2, greeting, resume_after);
+	frame_release(greeting);
+	
+	return 1;
+}
+
+/* Moves what's in the client's stream buffer into a larger one, as
+ * large as needed at least. If that fails, the client is let go of,
+ * and it returns 0. */
+static int
+grow_stream
+(
+ Core * core,
+ ClientData * client_data,
+ size_t needed
+)
+{
+	RecvState * const recv_state = client_data->recv_state;
+	unsigned char * const stream = pool_alloc(needed);
+	
+	if ( !stream )
+	{
+		logmsg("couldn't allocate memory for client's frame");
+		core_recv_failed(core, client_data);
+		return 0;
+	}
+	if ( !resize_stream(core, client_data, pool_capacity(recv_state->stream), pool_capacity(stream)) )
+	{
+		pool_free(stream);
+		protocol_error(core, client_data, "client's frame doesn't fit its memory budget");
+		return 0;
+	}
+	memcpy(stream, recv_state->stream, recv_state->stream_used);
+	pool_free(recv_state->stream);
+	recv_state->stream = stream;
+	return 1;
+}
+
+/* Sends a frame the WebSocket transport makes of its own (see
+ * queue_websocket_frame) */
+static void
+send_websocket_frame
+(
+ Core * core,
+ ClientData * client_data,
+ const void * data,
+ size_t size,
+ enum WebSocketState state
+)
+{
+	Frame * const frame = websocket_frame(data, size);
+	if ( !frame )
+		return;
+	
+	platform_lock_acquire(&core->client_pool_lock);
+	queue_websocket_frame(core, client_data, frame, state);
+	platform_lock_release(&core->client_pool_lock);
+	frame_release(frame);
+}
+
+/* Takes the WebSocket frames out of what the last recv put at the end
+ * of the stream buffer, leaving their payloads there instead, and
+ * answers pings. Returns 0 if the client is let go of. */
+static int
+unwrap_websocket
+(
+ Core * core,
+ ClientData * client_data,
+ size_t size
+)
+{
+	RecvState * const recv_state = client_data->recv_state;
+	WebSocketDecoder * const decoder = recv_state->websocket;
+	size_t payload;
+	
+	const char * const error = websocket_decode(decoder, recv_state->stream + recv_state->stream_used, size, &payload);
+	if ( error )
+	{
+		protocol_error(core, client_data, error);
+		return 0;
+	}
+	recv_state->stream_used += payload;
+	
+	if ( decoder->ping_pending )
+	{
+		unsigned char pong[2 + websocket_control_max];
+		pong[0] = 0x80 | websocket_pong;
+		pong[1] = decoder->ping_n;
+		memcpy(pong + 2, decoder->ping, decoder->ping_n);
+		decoder->ping_pending = 0;
+		send_websocket_frame(core, client_data, pong, 2 + (size_t)decoder->ping_n, websocket_open);
+	}
+	return 1;
+}
+
+/* Takes the handshake and every complete frame out of a v2 client's
+ * stream buffer, and then reads on into what's left of it */
+static void
+take_frames
+(
+ Core * core,
+ ClientData * client_data
+)
+{
+	RecvState * const recv_state = client_data->recv_state;
+	const unsigned char * cur = recv_state->stream;
+	const unsigned char * const end = cur + recv_state->stream_used;
+	size_t needed = 0; // by a frame that isn't all there yet
+	size_t messages_total = 0;
+	size_t bytes_total = 0;
+	
+	if ( client_data->phase == phase_getting_handshake )
+	{
+		/* A WebSocket client's stream starts with the byte a TCP
+		 * client would ask for protocol v2 with, the only one
+		 * there is for it */
+		if ( !client_data->protocol && cur != end )
+		{
+			if ( *cur++ != protocol_v2_marker )
+			{
+				protocol_error(core, client_data, "WebSocket client doesn't speak protocol v2");
+				return;
+			}
+			client_data->protocol = 2;
+		}
+		
+		uint64_t resume_after;
+		const int handshake = take_handshake(client_data, cur, end, &resume_after);
+		if ( handshake < 0 )
+		{
+			protocol_error(core, client_data, "client sent an invalid handshake");
+			return;
+		}
+		if ( handshake )
+		{
+			cur += handshake;
+			
+			if ( capturing )
+				capture_frame(client_data->connection_id, &client_data->nickname_length, 1, client_data->nickname, client_data->nickname_length);
+			
+			if ( !nickname_acceptable(core, client_data) )
+			{
+				protocol_error(core, client_data, "client sent an invalid nickname");
+				return;
+			}
+			
+			loginfof("new client connected: %.*s (protocol v2, capabilities %u)\n", client_data->nickname_length, client_data->nickname, client_data->capabilities);
+			
+			if ( !greet_client(core, client_data, resume_after) )
+			{
+				core_recv_failed(core, client_data);
+				return;
+			}
+			announce_client(core, client_data);
+			
+			client_data->phase = phase_getting_frames;
+		}
+	}
+	
+	while ( client_data->phase == phase_getting_frames && cur != end )
+	{
+		uint32_t length;
+		const int header = varint_get(cur, end, &length);
+		if ( header < 0 || (header && (!length || length > core->max_frame)) )
+		{
+			protocol_error(core, client_data, "client sent an invalid frame length");
+			return;
+		}
+		if ( !header )
+			break;
+		if ( (size_t)(end - cur) < header + length )
+		{
+			needed = header + length;
+			break;
+		}
+		
+		const unsigned char * const payload = cur + header;
+		const unsigned char * const payload_end = payload + length;
+		
+		/* The whole frame is checked before any of it is passed on */
+		for ( const unsigned char * message = payload ; message != payload_end ; )
+		{
+			uint32_t size;
+			const int varint = varint_get(message, payload_end, &size);
+			if ( varint <= 0 || size > (size_t)(payload_end - message) - varint )
+			{
+				protocol_error(core, client_data, "client sent a malformed frame");
+				return;
+			}
+			message += varint + size;
+		}
+		
+		const uint64_t trace_id = trace_enabled() ? trace_message() : 0;
+		uint64_t trace_time = 0;
+		if ( trace_unlikely(trace_id) )
+		{
+			trace_instant("recv", trace_id, recv_state->trace_start);
+			trace_complete("receiving", trace_id, recv_state->trace_start, trace_time = trace_now(), -1);
+		}
+		
+		Message messages[max_messages_per_broadcast];
+		size_t messages_n = 0;
+		for ( const unsigned char * message = payload ; message != payload_end ; )
+		{
+			uint32_t size;
+			message += varint_get(message, payload_end, &size);
+			messages[messages_n].text = (const char *)message;
+			messages[messages_n].size = size;
+			message += size;
+			bytes_total += size;
+			++messages_total;
+			
+			if ( capturing )
+				capture_message(client_data, messages + messages_n);
+			if ( acceptable(core, client_data, messages + messages_n) )
+				++messages_n;
+			if ( messages_n && (messages_n == max_messages_per_broadcast || message == payload_end) )
+			{
+				broadcast_messages(core, client_data, messages, messages_n, trace_id, trace_time);
+				messages_n = 0;
+			}
+		}
+		
+		cur = payload_end;
+	}
+	
+	/* What's left goes to the front, into a larger buffer if
+	 * the frame it's the start of wouldn't fit */
+	recv_state->stream_used = (size_t)(end - cur);
+	memmove(recv_state->stream, cur, recv_state->stream_used);
+	if ( needed > pool_capacity(recv_state->stream) && !grow_stream(core, client_data, needed) )
+		return;
+	
+	/* A WebSocket client closing the connection, once what it sent
+	 * before is taken, is read nothing more from and has its Close
+	 * echoed with the status code it gave, ahead of anything else;
+	 * the connection is closed once that's out */
+	if ( recv_state->websocket && recv_state->websocket->closed )
+	{
+		loginfof("%.*s closed its WebSocket connection\n", client_data->nickname_length, client_data->nickname);
+		platform_lock_acquire(&core->client_pool_lock);
+		if ( client_data->closing )
+			drop_client_reference(core, client_data);
+		else
+		{
+			client_data->phase = phase_drained;
+			if ( !close_websocket(core, client_data, recv_state->websocket->close_status) )
+				disconnect_client(core, client_data);
+		}
+		platform_lock_release(&core->client_pool_lock);
+		return;
+	}
+	
+	if ( client_data->phase == phase_getting_handshake )
+		queue_stream_recv(core, client_data);
+	else
+		read_on(core, client_data, messages_total ? take_tokens(core, client_data, messages_total, bytes_total) : 0);
+}
+
+/* Answers a WebSocket client's upgrade request once it's all there,
+ * after which the client goes on as a v2 client would after its first
+ * byte, only in the payloads of WebSocket frames */
+static void
+take_upgrade
+(
+ Core * core,
+ ClientData * client_data
+)
+{
+	RecvState * const recv_state = client_data->recv_state;
+	char accept[websocket_accept_size];
+	char reply[websocket_reply_size];
+	
+	const int request = websocket_take_upgrade((const char *)recv_state->stream, recv_state->stream_used, accept);
+	if ( request < 0 )
+	{
+		protocol_error(core, client_data, "client sent an invalid WebSocket upgrade request");
+		return;
+	}
+	if ( !request )
+	{
+		/* Requests have room to grow, up to a point */
+		if ( recv_state->stream_used == pool_capacity(recv_state->stream) )
+		{
+			if ( recv_state->stream_used >= websocket_request_max )
+			{
+				protocol_error(core, client_data, "client's WebSocket upgrade request is too long");
+				return;
+			}
+			if ( !grow_stream(core, client_data, websocket_request_max) )
+				return;
+		}
+		queue_stream_recv(core, client_data);
+		return;
+	}
+	
+	logdebug("new client upgraded to WebSocket");
+	send_websocket_frame(core, client_data, reply, websocket_put_reply(reply, accept), websocket_open);
+	client_data->phase = phase_getting_handshake;
+	
+	/* Whatever came after it, which the client wasn't to send
+	 * before the reply, is the start of its frames */
+	const size_t rest = recv_state->stream_used - (size_t)request;
+	memmove(recv_state->stream, recv_state->stream + request, rest);
+	recv_state->stream_used = 0;
+	if ( rest && !unwrap_websocket(core, client_data, rest) )
+		return;
+	take_frames(core, client_data);
+}
+
+void
+core_recv_completed
+(
+ Core * core,
+ ClientData * client_data,
+ size_t size
+)
+{
+	RecvState * const recv_state = client_data->recv_state;
+	
+	if ( client_data->closing )
+	{
+		/* The client's connection was closed after a failed send,
+		 * and this is the end of its last recv */
+		platform_lock_acquire(&core->client_pool_lock);
+		drop_client_reference(core, client_data);
+		platform_lock_release(&core->client_pool_lock);
+	}
+	else
+	if ( client_data->phase == phase_idle )
+	{
+		/* There's something to read now, or the connection
+		 * was closed, which the real recv is to tell */
+		queue_next_recv(core, client_data);
+	}
+	else
+	if ( size )
+	{
+		switch ( client_data->phase )
+		{
+			case phase_getting_nickname_length:
+			{
+				assert(size == 1);
+				
+				if ( client_data->nickname_length == protocol_v2_marker )
+				{
+					logdebug("new client asks for protocol v2");
+					
+					client_data->protocol = 2;
+					client_data->phase = phase_getting_handshake;
+					client_data->nickname_length = 0;
+					
+					if ( attach_stream(core, client_data) )
+						queue_stream_recv(core, client_data);
+					break;
+				}
+				
+				if ( !client_data->nickname_length || client_data->nickname_length > sizeof(client_data->nickname) )
+				{
+					protocol_error(core, client_data, "client sent an invalid nickname length");
+					break;
+				}
+				
+				logdebugf("new client's nickname length: %u\n", client_data->nickname_length);
+				
+				client_data->protocol = 1;
+				join_client(core, client_data, encoding_v1, NULL, 0);
+				
+				client_data->phase = phase_getting_nickname;
+				
+				recv_state->received = 0;
+				
+				/* Queue another recv to get the part of the nickname
+				 * that we are still missing */
+				queue_recv(core, client_data, client_data->nickname, client_data->nickname_length);
+				
+				break;
+			}
+			
+			case phase_getting_nickname:
+			{
+				recv_state->received += (unsigned char)size;
+				
+				logdebugf("received %zu additional bytes of nickname, until now: %.*s\n", size, recv_state->received, client_data->nickname);
+				
+				if ( recv_state->received == client_data->nickname_length )
+				{
+					if ( capturing )
+						capture_frame(client_data->connection_id, &client_data->nickname_length, 1, client_data->nickname, client_data->nickname_length);
+					
+					if ( !nickname_acceptable(core, client_data) )
+					{
+						protocol_error(core, client_data, "client sent an invalid nickname");
+						break;
+					}
+					
+					loginfof("new client connected: %.*s\n", client_data->nickname_length, client_data->nickname);
+					announce_client(core, client_data);
+					
+					/* Queue a recv for the client's first message */
+					queue_next_recv(core, client_data);
+				}
+				else
+				{
+					assert(recv_state->received < client_data->nickname_length);
+					
+					/* Queue another recv to get the part of the nickname
+					 * that we are still missing */
+					queue_recv(core, client_data, client_data->nickname + recv_state->received, client_data->nickname_length - recv_state->received);
+				}
+				
+				break;
+			}
+			
+			case phase_getting_message_length:
+			{
+				logdebugf("worker thread #%lu: %.*s reports having sent a message %i bytes long\n", platform_thread_id(), client_data->nickname_length, client_data->nickname, recv_state->message_length);
+				
+				/* Reset received for the next (first) message */
+				recv_state->received = 0;
+				
+				recv_state->trace_id = trace_enabled() ? trace_message() : 0;
+				if ( trace_unlikely(recv_state->trace_id) )
+				{
+					recv_state->trace_start = trace_now();
+					trace_instant("recv", recv_state->trace_id, recv_state->trace_start);
+				}
+				
+				client_data->phase = phase_getting_message;
+				
+				/* There's nothing more to read of an empty one */
+				if ( recv_state->message_length )
+					queue_recv(core, client_data, recv_state->buffer, recv_state->message_length);
+				else
+					take_message(core, client_data);
+				
+				break;
+			}
+			
+			case phase_getting_message:
+			{
+				recv_state->received += (unsigned char)size;
+				
+				if ( recv_state->received == recv_state->message_length )
+					take_message(core, client_data);
+				else
+				{
+					assert(recv_state->received < recv_state->message_length);
+					
+					if ( trace_unlikely(recv_state->trace_id) )
+						trace_instant("recv", recv_state->trace_id, trace_now());
+					
+					logdebugf("worker thread #%lu: getting message from %.*s: got %i bytes until now\n", platform_thread_id(), client_data->nickname_length, client_data->nickname, recv_state->received);
+					
+					queue_recv(core, client_data, recv_state->buffer + recv_state->received, recv_state->message_length - recv_state->received);
+				}
+				
+				break;
+			}
+			
+			case phase_getting_upgrade:
+			{
+				recv_state->stream_used += size;
+				take_upgrade(core, client_data);
+				
+				break;
+			}
+			
+			case phase_getting_handshake:
+			case phase_getting_frames:
+			{
+				if ( !recv_state->websocket )
+					recv_state->stream_used += size;
+				else
+				if ( !unwrap_websocket(core, client_data, size) )
+					break;
+				if ( trace_enabled() )
+					recv_state->trace_start = trace_now();
+				
+				take_frames(core, client_data);
+				
+				break;
+			}
+			
+			case phase_throttled:
+			case phase_idle:
+			case phase_drained:
+				/* Resumed by core_timer_fired, taken care of
+				 * above, and with no recv pending */
+				assert(0);
+				break;
+		}
+	}
+	else
+	{
+		platform_lock_acquire(&core->client_pool_lock);
+		disconnect_client(core, client_data);
+		drop_client_reference(core, client_data);
+		platform_lock_release(&core->client_pool_lock);
+	}
+}
+
+void
+core_send_completed
+(
+ Core * core,
+ ClientData * client_data,
+ size_t size
+)
+{
+	platform_lock_acquire(&core->client_pool_lock);
+	complete_send(core, client_data, size);
+	platform_lock_release(&core->client_pool_lock);
+}
+
+void
+core_send_failed
+(
+ Core * core,
+ ClientData * client_data
+)
+{
+	platform_lock_acquire(&core->client_pool_lock);
+	disconnect_client(core, client_data);
+	end_send(core, client_data, 0);
+	platform_lock_release(&core->client_pool_lock);
+}
+
+void
+core_timer_fired
+(
+ Core * core,
+ ClientData * client_data,
+ enum CoreTimer timer
+)
+{
+	switch ( timer )
+	{
+		case timer_resume:
+			/* The reference held by the recv held back goes
+			 * on to the one queued now */
+			if ( client_data->closing )
+			{
+				platform_lock_acquire(&core->client_pool_lock);
+				drop_client_reference(core, client_data);
+				platform_lock_release(&core->client_pool_lock);
+			}
+			else
+				queue_next_recv(core, client_data);
+			break;
+		
+		case timer_flush:
+			platform_lock_acquire(&core->client_pool_lock);
+			client_queue(core, client_data)->flush_pending = 0;
+			if ( !client_data->closing && !client_queue(core, client_data)->sending )
+				start_send(core, client_data, 0);
+			drop_client_reference(core, client_data);
+			platform_lock_release(&core->client_pool_lock);
+			break;
+		
+		case timer_presence:
+			platform_lock_acquire(&core->client_pool_lock);
+			flush_presence(core);
+			drop_client_reference(core, client_data);
+			platform_lock_release(&core->client_pool_lock);
+			break;
+		
+		case core_timers:
+			assert(0);
+			break;
+	}
+}
+
+/* Whoever gets here once the fan-out is over, or before the next one
+ * has started, finds nothing to take */
+void
+core_help
+(
+ Core * core
+)
+{
+	FanOut * const fan_out = core->fan_out;
+	size_t index;
+	
+	if ( !fan_out )
+		return;
+	platform_increment(&fan_out->helpers);
+	if ( platform_load_long(&fan_out->open) )
+		while ( workdeque_steal(&fan_out->deque, &index) )
+			fan_out_chunk(core, fan_out, index);
+	platform_decrement(&fan_out->helpers);
+}
+
+int
+core_batch_init
+(
+ Core * core,
+ CoreBatch * batch
+)
+{
+	batch->n = 0;
+	batch->capacity = core->capacity;
+	return (batch->slots = malloc(batch->capacity * sizeof(*batch->slots))) != NULL;
+}
+
+void
+core_batch_cleanup
+(
+ CoreBatch * batch
+)
+{
+	free(batch->slots);
+	batch->slots = NULL;
+}
+
+void
+core_batch_begin
+(
+ Core * core,
+ CoreBatch * batch
+)
+{
+	(void)core;
+	batch->n = 0;
+	current_batch = batch;
+}
+
+/* The clients may have been sent something meanwhile, or even have
+ * been released and their slots taken by others, which have had
+ * their flags reset */
+void
+core_batch_end
+(
+ Core * core,
+ CoreBatch * batch
+)
+{
+	current_batch = NULL;
+	if ( !batch->n )
+		return;
+	
+	const uint64_t now = platform_now_us();
+	platform_lock_acquire(&core->client_pool_lock);
+	for ( size_t i = 0 ; i != batch->n ; ++i )
+	{
+		ClientData * const client_data = core->clients + batch->slots[i];
+		ClientQueue * const queue = core->queues + batch->slots[i];
+		if ( !queue->batched )
+			continue;
+		queue->batched = 0;
+		if ( client_data->used && !client_data->closing && !queue->sending && !queue->flush_pending )
+			start_send(core, client_data, now);
+	}
+	platform_lock_release(&core->client_pool_lock);
+	batch->n = 0;
+}
+
+const char *
+core_phase_name
+(
+ enum Phase phase
+)
+{
+	static const char * const names[] = {"nickname length", "nickname", "message length", "message", "upgrade", "handshake", "frames", "throttled", "idle", "drained"};
+	return (size_t)phase < sizeof(names) / sizeof(*names) ? names[phase] : "?";
+}
+
+void
+core_drain_begin
+(
+ Core * core
+)
+{
+	Frame * notices[2] = {NULL}; // without a sequence number and with one
+	const uint64_t now = core->transport.now(core->transport.context);
+	
+	platform_lock_acquire(&core->client_pool_lock);
+	core->draining = 1;
+	for ( size_t i = 0 ; i != core->capacity ; ++i )
+	{
+		const unsigned char encoding = core->receiving[i];
+		if ( encoding == encoding_none || encoding == encoding_v1 || !(core->clients[i].capabilities & capability_notices) || !core->clients[i].announced )
+			continue;
+		
+		const int sequenced = encoding == encoding_v2_resumable;
+		if ( !notices[sequenced] && !(notices[sequenced] = encode_notice(notice_shutdown, sequenced)) )
+		{
+			logmsg("couldn't allocate memory for the notice of the shutdown");
+			break;
+		}
+		queue_frame(core, core->clients + i, notices[sequenced], now);
+	}
+	
+	/* WebSocket clients are sent a Close once they've been sent
+	 * everything, which those with nothing to send are now */
+	for ( size_t i = 0 ; i != core->capacity ; ++i )
+	{
+		const ClientQueue * const queue = core->queues + i;
+		if ( core->clients[i].used && !core->clients[i].closing && queue->websocket == websocket_open && !queue->sending && !queue->flush_pending )
+			close_websocket(core, core->clients + i, websocket_going_away);
+	}
+	platform_lock_release(&core->client_pool_lock);
+	
+	for ( size_t i = 0 ; i != 2 ; ++i )
+		if ( notices[i] )
+			frame_release(notices[i]);
+}
+
+size_t
+core_drain_pending
+(
+ const Core * core
+)
+{
+	size_t pending = 0;
+	
+	for ( size_t i = 0 ; i != core->capacity ; ++i )
+	{
+		const ClientQueue * const queue = core->queues + i;
+		if ( core->clients[i].used && !core->clients[i].closing && (queue->n || queue->control_n || queue->backlog_n || queue->sending || queue->flush_pending) )
+			++pending;
+	}
+	return pending;
+}
+
+size_t
+core_drain_end
+(
+ Core * core
+)
+{
+	size_t disconnected = 0;
+	
+	platform_lock_acquire(&core->client_pool_lock);
+	for ( ClientData * cur = core->clients, * const end = cur + core->capacity ; cur != end ; ++cur )
+	{
+		if ( !cur->used || cur->closing )
+			continue;
+		disconnect_client(core, cur);
+		++disconnected;
+	}
+	platform_lock_release(&core->client_pool_lock);
+	
+	return disconnected;
+}
@@ -0,0 +1,569 @@
+#ifndef CORE_H
+#define CORE_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include "platform.h"
+#include "ratelimit.h"
+#include "frame.h"
+#include "text.h"
+#include "filter.h"
+#include "backlog.h"
+#include "workdeque.h"
+#include "websocket.h"
+
+
+/* The server minus the network: the protocol, the broadcasting of
+ * messages and the lifetime of clients. Whatever moves the bytes (the
+ * completion port in server.c, the simulation in sim.c) is a Transport,
+ * which starts reads, sends and timers when the core asks for them and
+ * reports back with the core_* functions below as they complete, from
+ * any number of threads. */
+
+#define max_frames_per_send 64
+#define outbound_queue_length 256
+#define default_max_frame 65536
+#define default_presence_window 100
+#define default_fan_out_threshold 8192
+#define default_fan_out_chunk 1024
+
+enum Phase {
+	phase_getting_nickname_length,
+	phase_getting_nickname,
+	phase_getting_message_length,
+	phase_getting_message,
+	/* Protocol v2 reads whatever is there into a stream buffer
+	 * and takes frames out of it, as WebSocket clients do with
+	 * their upgrade request first */
+	phase_getting_upgrade,
+	phase_getting_handshake,
+	phase_getting_frames,
+	/* The client went over its rate limit and its next recv
+	 * is held back until its token buckets have refilled */
+	phase_throttled,
+	/* Waiting in a recv of 0 bytes for the client to send anything */
+	phase_idle,
+	/* Nothing more is read from the client, the server draining or
+	 * the client having closed its WebSocket connection. The client
+	 * holds on to the reference of its last recv until it's
+	 * disconnected. */
+	phase_drained
+};
+
+enum CoreTimer {
+	timer_resume, // the reads of a throttled client are to resume
+	timer_flush, // a client's coalescing window is over
+	timer_presence, // the presence window started by the client is over
+	core_timers
+};
+
+/* The ways messages get sent out, one frame of each being
+ * built for every broadcast that has recipients needing it */
+enum Encoding {
+	encoding_v1,
+	encoding_v2, // one message per frame
+	encoding_v2_batched,
+	encoding_v2_resumable, // batched, with sequence numbers
+	encodings,
+	encoding_none = encodings // the client isn't sent any
+};
+
+/* Where a WebSocket client's connection is at, as far as what goes out
+ * to it is concerned */
+enum WebSocketState {
+	websocket_none, // not a WebSocket client
+	websocket_upgrading, // yet to be sent the reply to its upgrade request
+	websocket_open,
+	/* A Close is in its control lane, which nothing is sent after;
+	 * the connection is closed once it has gone out */
+	websocket_closing
+};
+
+typedef struct {
+	char * buf;
+	size_t len;
+} TransportBuffer;
+
+typedef struct {
+	const char * text;
+	size_t size;
+} Message;
+
+/* What goes out to a client waits in one of these lanes. Control frames
+ * go first, and the chat and backlog lanes take turns by deficit round
+ * robin, in proportion to their weights: each turn, a lane gets its
+ * weight in quanta of bytes to send, and whatever it leaves unused is
+ * kept for its next turn as long as it has frames waiting. */
+enum Lane {
+	lane_chat, // messages broadcast
+	lane_backlog, // what a resuming client missed
+	lane_control, // handshake replies and notices
+	lanes
+};
+
+#define control_lane_length 16
+#define backlog_lane_length 32
+#define lane_quantum 1024
+#define chat_lane_weight 4
+#define backlog_lane_weight 1
+/* Of the time frames wait in each lane to be sent, in microseconds:
+ * bucket 0 is for less than 1, bucket b for up to 2^b, and the last
+ * one for anything longer */
+#define lane_wait_buckets 24
+
+/* A client joining or leaving, for the others to be told of at the end
+ * of the presence window, along with everyone else who did meanwhile.
+ * A join gets cancelled, its notice set to 0, if the client leaves
+ * before the window is over. */
+typedef struct {
+	uint32_t slot;
+	unsigned char notice;
+	unsigned char nickname_length;
+	char nickname[32];
+} PresenceEvent;
+
+/* The state of the recv in progress */
+typedef struct {
+	unsigned char message_length;
+	unsigned char received;
+	/* The trace ID of the message being received, 0 if it isn't
+	 * being traced, and when its first recv completed */
+	uint64_t trace_id;
+	uint64_t trace_start;
+	char buffer[255];
+	/* Protocol v2's, from the buffer pool. It gets replaced with a
+	 * larger one whenever a frame wouldn't fit. */
+	unsigned char * stream;
+	size_t stream_used;
+	/* NULL unless the client came in over WebSocket, in which case
+	 * the stream buffer only gets the payloads of its frames */
+	WebSocketDecoder * websocket;
+} RecvState;
+
+/* A single gather send of all the frames that were waiting
+ * for a client when it was issued (up to max_frames_per_send of them) */
+typedef struct {
+	size_t frames_n;
+	/* First buffer not completely sent yet, should the send
+	 * complete only partially */
+	size_t first_buffer;
+	uint64_t started_at; // in microseconds
+	Frame * frames[max_frames_per_send];
+	TransportBuffer buffers[max_frames_per_send];
+} SendState;
+
+/* A client's data is split by who touches it when. What the thread
+ * handling its recvs needs is in ClientData. Broadcasts walk
+ * Core::receiving, one byte per slot, and write to the ClientQueue of
+ * each client getting the message. Both ClientData and ClientQueue are
+ * cache-line aligned, so that no two clients share a cache line and no
+ * worker's writes invalidate a line another worker is reading. */
+
+typedef struct {
+	cache_aligned char used;
+	/* Set once the client's connection has been closed, and until
+	 * it has been started. The slot stays in use until every
+	 * operation still referring to it is over. */
+	char closing;
+	uint32_t connection_id;
+	uintptr_t handle; // the transport's, e.g. the client's socket
+	void * transport_data; // anything else the transport keeps per client
+	enum Phase phase;
+	unsigned char protocol; // 0 until the client's first byte is in
+	unsigned capabilities; // those agreed upon with a v2 client
+	uint64_t joined_at; // messages broadcast before it was sent any
+	char nickname[32];
+	unsigned char nickname_length;
+	char announced; // the others are to be told of it leaving
+	/* Its join's index among the presence events plus one, while
+	 * the window it joined in is open, 0 otherwise */
+	uint32_t presence_join;
+	/* The recv in progress (or held back), the send in flight and the
+	 * armed flush timer each hold a reference */
+	unsigned references;
+	RecvState * recv_state;
+	TokenBucket message_bucket;
+	TokenBucket byte_bucket;
+	unsigned long throttled; // times the client's reads were held back
+	uint64_t throttled_ms; // total time they were held back for
+} ClientData;
+
+/* What's on its way out to a client, protected by the client pool lock.
+ * The fields a broadcast and a send read come first, in a line of
+ * their own. */
+typedef struct {
+	/* The chat lane's */
+	cache_aligned unsigned first;
+	unsigned n;
+	char sending; // send_failed if it did in a parallel fan-out
+	char flush_pending;
+	/* Whose turn it is of the chat and backlog lanes */
+	unsigned char turn;
+	char batched; // its send is to be started at the end of a batch
+	/* Its enum WebSocketState; frames go out to it with their
+	 * WebSocket headers unless it's websocket_none */
+	char websocket;
+	/* The other lanes' */
+	unsigned short control_first;
+	unsigned short control_n;
+	unsigned short backlog_first;
+	unsigned short backlog_n;
+	uint64_t last_send; // when the last send to the client was issued
+	unsigned long dropped; // messages it missed because its queue was full
+	SendState * send_state;
+	int32_t deficit[2]; // what the chat and backlog lanes have left of their turns
+	/* Of the buffers the client pins: the frames in its lanes and
+	 * in flight, and its stream buffer */
+	size_t memory;
+	/* The next message to be sent from the backlog while the client
+	 * is catching up on what it missed, 0 otherwise, and the first
+	 * one it got broadcast */
+	uint64_t resume_next;
+	uint64_t resume_end;
+	Frame * control[control_lane_length];
+	Frame * backlog[backlog_lane_length];
+	uint64_t backlog_queued_at[backlog_lane_length];
+	/* Frames broadcast to the client while a send to it was
+	 * already in flight. They all go out together with the
+	 * next send. */
+	Frame * frames[outbound_queue_length];
+} ClientQueue;
+
+/* What the thread handling a batch of completions leaves to do until the
+ * end of it: the slots of the clients that were idle when something got
+ * queued for them, whose sends get started then, so that everything
+ * the batch broadcast goes out to each of them in one send */
+typedef struct {
+	size_t * slots;
+	size_t n;
+	size_t capacity;
+} CoreBatch;
+
+/* A chunk of the slots a broadcast goes to in a parallel fan-out, and
+ * what whichever thread took it did meanwhile to the core's counters
+ * that are protected by the client pool lock, which are the chunk's own
+ * until it's done. Sends that failed are left with sending set to
+ * send_failed, for the thread the broadcast is from to see to. */
+typedef struct {
+	size_t first;
+	size_t end;
+	size_t clients_sent;
+	size_t sends_failed;
+	uint64_t sends;
+	uint64_t messages_dropped;
+	uint64_t frames_shed;
+	uint64_t lane_waits[lanes][lane_wait_buckets];
+} FanOutChunk;
+
+#define send_failed 2
+
+/* A broadcast to more clients than the threshold is split into chunks of
+ * slots, which the thread it's from puts in a work-stealing deque and
+ * then takes from itself, while idle threads the transport was asked
+ * for steal from it. It holds on to the client pool lock until the last
+ * of them is done, so the clients get every message in the order they
+ * were broadcast in, as ever. */
+typedef struct {
+	WorkDeque deque; // of the chunks
+	FanOutChunk * chunks;
+	size_t chunks_n;
+	Frame * frames[encodings];
+	uint64_t now;
+	volatile long open; // while its chunks are up for taking
+	volatile long helpers; // the threads in core_help
+	volatile long remaining; // chunks not done yet
+} FanOut;
+
+/* Each operation either returns 1, in which case its completion is to
+ * be reported later on, or 0, in which case there's none coming. */
+typedef struct {
+	void * context;
+	/* Reads at most size bytes; the completion reports how many
+	 * came in, 0 meaning the client closed the connection. A recv
+	 * of 0 bytes, with no buffer, completes once there's something
+	 * to read or the connection was closed, reporting 0 either way. */
+	int (*recv)(void * context, ClientData *, void * buffer, size_t size);
+	int (*send)(void * context, ClientData *, const TransportBuffer * buffers, size_t buffers_n);
+	/* Operations still pending on the connection complete with
+	 * an error once it's closed */
+	void (*close)(void * context, ClientData *);
+	/* A timer of a client's that has fired may be set again */
+	int (*set_timer)(void * context, ClientData *, enum CoreTimer, uint32_t ms);
+	/* The client is gone, along with its timers */
+	void (*release)(void * context, ClientData *);
+	uint64_t (*now)(void * context); // milliseconds
+	/* Has up to that many idle threads call core_help, if there are
+	 * any; NULL if there are no threads to help fan out broadcasts */
+	void (*request_help)(void * context, size_t helpers);
+} Transport;
+
+typedef struct {
+	size_t capacity; // how many clients can be connected at once
+	double rate_messages;
+	double rate_bytes;
+	uint32_t coalescing_window;
+	size_t frames_per_send;
+	uint32_t max_frame; // largest v2 frame accepted, 0 for the default
+	enum TextPolicy text_policy;
+	size_t backlog; // messages kept for clients to resume from, 0 for none
+	uint32_t presence_window; // milliseconds, 0 for the default
+	/* In bytes, 0 for none; see below */
+	size_t connection_budget;
+	size_t memory_budget;
+	size_t transport_memory; // what the transport allocates per client
+	/* Clients a broadcast is fanned out to in parallel from, and slots
+	 * per chunk of it, 0 for the defaults */
+	size_t fan_out_threshold;
+	size_t fan_out_chunk;
+	/* Clients with nothing left to read wait in recvs of 0 bytes,
+	 * and v2 clients' stream buffers go back to the pool meanwhile */
+	char idle_recvs;
+} CoreOptions;
+
+/* The memory the server allocates as it goes is kept count of: every
+ * client's states, its stream buffer and the frames it has queued, and
+ * the frames in the backlog. A client's frames count in full against
+ * its connection budget, shared as they may be, and frames past it are
+ * dropped for it, although control frames are only ever limited by the
+ * length of their lane; a frame from it that wouldn't fit gets it
+ * disconnected. Once the memory budget is used up, no more clients are
+ * let in, and those pinning the most memory are disconnected until the
+ * server is back within it. */
+
+typedef struct {
+	Transport transport;
+	PlatformLock client_pool_lock;
+	/* These may be changed while the server runs (see below); clients
+	 * get the new rate limits at their next take of tokens */
+	volatile double rate_messages;
+	volatile double rate_bytes;
+	uint32_t coalescing_window;
+	uint32_t presence_window;
+	volatile size_t connection_budget;
+	volatile size_t memory_budget;
+	size_t client_memory; // the states of a client, its own and the transport's
+	size_t frames_per_send;
+	uint32_t max_frame;
+	enum TextPolicy text_policy;
+	char idle_recvs;
+	volatile char draining; // see core_drain_begin
+	volatile long messages_rejected; // for their text
+	/* Which messages get run through, once they've passed the
+	 * check of their text, and what the filter did about them */
+	FilterSlot filter;
+	volatile long messages_filtered; // dropped
+	volatile long messages_masked;
+	volatile long messages_flagged;
+	/* These are protected by the client pool lock */
+	uint64_t messages; // broadcast, and the latest one's sequence number
+	Backlog backlog;
+	uint64_t sends;
+	uint64_t messages_delivered;
+	uint64_t messages_dropped;
+	uint64_t lane_waits[lanes][lane_wait_buckets];
+	int64_t memory_peak;
+	uint64_t clients_refused; // for the memory budget
+	uint64_t clients_shed;
+	uint64_t frames_shed; // for their clients' connection budgets
+	/* NULL unless broadcasts to as many clients as the threshold
+	 * get fanned out in parallel */
+	FanOut * fan_out;
+	size_t fan_out_threshold;
+	uint64_t fanned_out; // broadcasts
+	/* Those joining and leaving since the presence window was
+	 * started, if it was */
+	PresenceEvent * presence;
+	size_t presence_n;
+	size_t presence_capacity;
+	uint32_t next_connection_id;
+	size_t capacity;
+	ClientData * clients;
+	ClientQueue * queues;
+	/* The encoding each slot's client gets broadcasts in, encoding_none
+	 * if it isn't getting any (yet or anymore, or the slot is free) */
+	unsigned char * receiving;
+	/* The free slots' indices, to be taken from the end */
+	size_t * free_slots;
+	size_t free_slots_n;
+} Core;
+
+int core_init
+(
+ Core *,
+ const Transport *,
+ const CoreOptions *
+);
+
+void core_cleanup
+(
+ Core *
+);
+
+/* The memory allocated for clients and messages, in bytes */
+int64_t core_memory_used
+(
+ const Core *
+);
+
+/* Per client, 0 for unlimited, from any thread */
+void core_set_rate_limits
+(
+ Core *,
+ double messages,
+ double bytes
+);
+
+/* In bytes, 0 for none, from any thread. Clients over the new
+ * budgets are seen to with the next message broadcast. */
+void core_set_budgets
+(
+ Core *,
+ size_t connection_budget,
+ size_t memory_budget
+);
+
+/* Disconnects the client with the given connection ID, if it's
+ * connected; returns whether it was */
+int core_client_kick
+(
+ Core *,
+ uint32_t connection_id
+);
+
+const char * core_phase_name
+(
+ enum Phase
+);
+
+/* Shutting down gracefully: once the server is draining, clients get
+ * nothing more read from them, though what was being read still gets
+ * broadcast, and those that take notices are sent one of the shutdown
+ * ahead of whatever is waiting to go out to them. WebSocket clients
+ * are sent a Close (websocket_going_away) once everything else has
+ * gone out to them, and disconnected once it has too. The transport is
+ * to go on until nothing is (core_drain_pending), or for as long as it
+ * cares to wait, and then have everyone disconnected (core_drain_end). */
+void core_drain_begin
+(
+ Core *
+);
+
+/* The clients with frames queued or in flight, read without the lock,
+ * as the stats are */
+size_t core_drain_pending
+(
+ const Core *
+);
+
+/* Disconnects every client still there, letting go of whatever is still
+ * queued for them; returns how many. They're released as the operations
+ * pending on their connections complete. */
+size_t core_drain_end
+(
+ Core *
+);
+
+ClientData * core_client_open
+(
+ Core *,
+ uintptr_t handle
+);
+
+/* Has the messages run through the filter, which may be NULL, from
+ * now on. The filter previously in use is freed once no worker is
+ * using it anymore, which this waits for. Not to be called from more
+ * than one thread at a time. */
+void core_replace_filter
+(
+ Core *,
+ Filter *
+);
+
+void core_client_start
+(
+ Core *,
+ ClientData *
+);
+
+/* As core_client_start, for a client that came in on the WebSocket
+ * listener, which it reads an upgrade request from first */
+void core_client_start_websocket
+(
+ Core *,
+ ClientData *
+);
+
+void core_client_abandon
+(
+ Core *,
+ ClientData *
+);
+
+void core_recv_completed
+(
+ Core *,
+ ClientData *,
+ size_t size
+);
+
+void core_recv_failed
+(
+ Core *,
+ ClientData *
+);
+
+void core_send_completed
+(
+ Core *,
+ ClientData *,
+ size_t size
+);
+
+void core_send_failed
+(
+ Core *,
+ ClientData *
+);
+
+void core_timer_fired
+(
+ Core *,
+ ClientData *,
+ enum CoreTimer
+);
+
+/* Takes chunks of the broadcast being fanned out, if any, until there
+ * are none left; for the threads the transport was asked for */
+void core_help
+(
+ Core *
+);
+
+/* A batch is the thread's own, and may be used for any number of them
+ * one after the other. Between core_batch_begin and core_batch_end,
+ * the completions reported by the calling thread have their sends
+ * started at the end. */
+int core_batch_init
+(
+ Core *,
+ CoreBatch *
+);
+
+void core_batch_cleanup
+(
+ CoreBatch *
+);
+
+void core_batch_begin
+(
+ Core *,
+ CoreBatch *
+);
+
+void core_batch_end
+(
+ Core *,
+ CoreBatch *
+);
+
+#endif
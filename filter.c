@@ -0,0 +1,534 @@
+#include "filter.h"
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "logmsg.h"
+#include "platform.h"
+#include "text.h"
+
+/* Spans of a message to be masked kept on the stack, beyond which
+ * they're kept on the heap */
+#define masked_spans_inline 16
+/* Set in the transitions to states where terms end, so that those
+ * that don't cost no more than the transition itself */
+#define transition_ends_terms 0x80000000u
+
+
+/* Bytes of a message to be masked, from start up to end, which are
+ * kept apart from the text rather than marked in it, as the text may
+ * hold any byte there is */
+typedef struct {
+	size_t start;
+	size_t end;
+} MaskedSpan;
+
+struct Filter {
+	size_t terms;
+	uint32_t states;
+	/* Bytes that are in no term are all class 0, which every state
+	 * goes back to the root on; the rest have one per byte, but
+	 * letters share theirs with their other case */
+	unsigned classes;
+	unsigned char byte_class[256];
+	/* States by classes. Once compiled, transitions are to the first
+	 * of the state's row instead of its index, and flagged with
+	 * transition_ends_terms. */
+	uint32_t * next;
+	/* Per state, the actions of every term ending there, and the
+	 * length of the longest of them to be masked */
+	unsigned char * actions;
+	uint32_t * mask_length;
+};
+
+static unsigned char
+fold
+(
+ unsigned char byte
+)
+{
+	return byte >= 'A' && byte <= 'Z' ? (unsigned char)(byte - 'A' + 'a') : byte;
+}
+
+/* Returns the line's action, 0 if it's to be skipped or -1 if it's
+ * invalid, and where its term is */
+static int
+parse_line
+(
+ const char * line,
+ size_t length,
+ const unsigned char ** term,
+ size_t * term_length
+)
+{
+	static const struct {
+		const char * name;
+		int action;
+	} actions[] = {{"drop ", filter_drop}, {"mask ", filter_mask}, {"flag ", filter_flag}};
+	
+	if ( length && line[length - 1] == '\r' )
+		--length;
+	if ( !length || *line == '#' )
+		return 0;
+	
+	for ( size_t i = 0 ; i != sizeof(actions) / sizeof(*actions) ; ++i )
+	{
+		if ( length > 5 && !memcmp(line, actions[i].name, 5) )
+		{
+			*term = (const unsigned char *)line + 5;
+			*term_length = length - 5;
+			return text_check(*term, *term_length) & text_malformed ? -1 : actions[i].action;
+		}
+	}
+	return -1;
+}
+
+/* Calls take on every term of the list, stopping at the first invalid
+ * line, which it logs. Returns whether there was none. */
+static int
+each_term
+(
+ const char * list,
+ size_t size,
+ void (*take)(void * context, int action, const unsigned char * term, size_t length),
+ void * context
+)
+{
+	const char * const end = list + size;
+	size_t line_number = 1;
+	
+	for ( const char * line = list ; line != end ; ++line_number )
+	{
+		const char * const newline = memchr(line, '\n', (size_t)(end - line));
+		const char * const line_end = newline ? newline : end;
+		const unsigned char * term;
+		size_t term_length;
+		
+		const int action = parse_line(line, (size_t)(line_end - line), &term, &term_length);
+		if ( action < 0 )
+		{
+			logmsgf("line %zu of the filter list isn't an action (drop, mask or flag) followed by a space and a term in UTF-8\n", line_number);
+			return 0;
+		}
+		if ( action )
+			take(context, action, term, term_length);
+		
+		line = newline ? newline + 1 : end;
+	}
+	return 1;
+}
+
+/* The first pass over the list sorts out the classes and how many
+ * states there could be at most */
+typedef struct {
+	size_t terms;
+	size_t bytes;
+	unsigned char used[256];
+} ListSummary;
+
+static void
+summarize_term
+(
+ void * context,
+ int action,
+ const unsigned char * term,
+ size_t length
+)
+{
+	ListSummary * const summary = context;
+	
+	(void)action;
+	++summary->terms;
+	summary->bytes += length;
+	for ( size_t i = 0 ; i != length ; ++i )
+		summary->used[fold(term[i])] = 1;
+}
+
+/* The second one builds the trie of the terms */
+static void
+insert_term
+(
+ void * context,
+ int action,
+ const unsigned char * term,
+ size_t length
+)
+{
+	Filter * const filter = context;
+	uint32_t state = 0;
+	
+	for ( size_t i = 0 ; i != length ; ++i )
+	{
+		uint32_t * const next = filter->next + (size_t)state * filter->classes + filter->byte_class[term[i]];
+		if ( !*next )
+			*next = filter->states++;
+		state = *next;
+	}
+	
+	filter->actions[state] |= (unsigned char)action;
+	if ( action == filter_mask )
+		filter->mask_length[state] = (uint32_t)length;
+}
+
+/* Turns the trie into the automaton, breadth first: each state's
+ * missing transitions are those of the longest proper suffix of
+ * it that is a state too, whose terms also end at it. The states are
+ * then renumbered in that order, so that the shallow ones, which most
+ * bytes lead to, are close together rather than spread all over. */
+static int
+complete
+(
+ Filter * filter
+)
+{
+	const unsigned classes = filter->classes;
+	const size_t transitions = (size_t)filter->states * classes;
+	uint32_t * const suffix = malloc(filter->states * sizeof(*suffix));
+	uint32_t * const order = malloc(filter->states * sizeof(*order));
+	uint32_t * const next = malloc(transitions * sizeof(*next));
+	unsigned char * const actions = malloc(filter->states * sizeof(*actions));
+	uint32_t * const mask_length = malloc(filter->states * sizeof(*mask_length));
+	size_t queued = 0;
+	
+	if ( !suffix || !order || !next || !actions || !mask_length )
+	{
+		free(suffix);
+		free(order);
+		free(next);
+		free(actions);
+		free(mask_length);
+		return 0;
+	}
+	
+	suffix[0] = 0;
+	order[queued++] = 0;
+	for ( size_t taken = 0 ; taken != queued ; ++taken )
+	{
+		const uint32_t state = order[taken];
+		uint32_t * const row = filter->next + (size_t)state * classes;
+		const uint32_t * const suffix_row = filter->next + (size_t)suffix[state] * classes;
+		
+		for ( unsigned c = 0 ; c != classes ; ++c )
+		{
+			/* Only the root's own transitions lead back to it */
+			if ( row[c] )
+			{
+				const uint32_t child = row[c];
+				suffix[child] = state ? suffix_row[c] : 0;
+				filter->actions[child] |= filter->actions[suffix[child]];
+				if ( filter->mask_length[suffix[child]] > filter->mask_length[child] )
+					filter->mask_length[child] = filter->mask_length[suffix[child]];
+				order[queued++] = child;
+			}
+			else
+				row[c] = state ? suffix_row[c] : 0;
+		}
+	}
+	
+	/* The suffixes make way for the new numbers */
+	uint32_t * const renumbered = suffix;
+	for ( uint32_t i = 0 ; i != filter->states ; ++i )
+		renumbered[order[i]] = i;
+	for ( uint32_t i = 0 ; i != filter->states ; ++i )
+	{
+		const uint32_t * const row = filter->next + (size_t)order[i] * classes;
+		for ( unsigned c = 0 ; c != classes ; ++c )
+			next[(size_t)i * classes + c] = renumbered[row[c]] * classes | (filter->actions[row[c]] ? transition_ends_terms : 0);
+		actions[i] = filter->actions[order[i]];
+		mask_length[i] = filter->mask_length[order[i]];
+	}
+	
+	free(filter->next);
+	free(filter->actions);
+	free(filter->mask_length);
+	filter->next = next;
+	filter->actions = actions;
+	filter->mask_length = mask_length;
+	free(suffix);
+	free(order);
+	return 1;
+}
+
+Filter *
+filter_compile
+(
+ const char * list,
+ size_t size
+)
+{
+	ListSummary summary = {0};
+	
+	if ( !each_term(list, size, summarize_term, &summary) )
+		return NULL;
+	if ( !summary.terms )
+	{
+		logmsg("the filter list has no terms");
+		return NULL;
+	}
+	
+	Filter * const filter = calloc(1, sizeof(*filter));
+	if ( !filter )
+	{
+		logmsg("couldn't allocate memory for the filter");
+		return NULL;
+	}
+	
+	filter->terms = summary.terms;
+	filter->classes = 1;
+	for ( unsigned byte = 0 ; byte != 256 ; ++byte )
+		if ( summary.used[byte] )
+			filter->byte_class[byte] = (unsigned char)filter->classes++;
+	for ( unsigned byte = 'A' ; byte <= 'Z' ; ++byte )
+		filter->byte_class[byte] = filter->byte_class[fold((unsigned char)byte)];
+	
+	/* A state per byte of the terms at most, plus the root; terms
+	 * share their prefixes, so there's usually fewer */
+	const size_t max_states = summary.bytes + 1;
+	if ( max_states > (transition_ends_terms - 1) / filter->classes )
+	{
+		logmsg("the filter list is too long");
+		free(filter);
+		return NULL;
+	}
+	filter->next = calloc(max_states * filter->classes, sizeof(*filter->next));
+	filter->actions = calloc(max_states, sizeof(*filter->actions));
+	filter->mask_length = calloc(max_states, sizeof(*filter->mask_length));
+	filter->states = 1;
+	
+	if ( !filter->next || !filter->actions || !filter->mask_length || (each_term(list, size, insert_term, filter), !complete(filter)) )
+	{
+		logmsg("couldn't allocate memory for the filter");
+		filter_free(filter);
+		return NULL;
+	}
+	
+	return filter;
+}
+
+Filter *
+filter_load
+(
+ const char * path
+)
+{
+	FILE * const file = fopen(path, "rb");
+	if ( !file )
+	{
+		logmsgf("couldn't open filter list %s\n", path);
+		return NULL;
+	}
+	
+	char * list = NULL;
+	size_t size = 0;
+	size_t capacity = 0;
+	int rv = 1;
+	
+	for ( ; ; )
+	{
+		if ( size == capacity )
+		{
+			char * const larger = realloc(list, capacity = capacity ? capacity * 2 : 1 << 16);
+			if ( !larger )
+			{
+				logmsg("couldn't allocate memory for the filter list");
+				rv = 0;
+				break;
+			}
+			list = larger;
+		}
+		const size_t read = fread(list + size, 1, capacity - size, file);
+		size += read;
+		if ( !read )
+			break;
+	}
+	if ( ferror(file) )
+	{
+		logmsgf("couldn't read filter list %s\n", path);
+		rv = 0;
+	}
+	fclose(file);
+	
+	Filter * const filter = rv ? filter_compile(list, size) : NULL;
+	free(list);
+	return filter;
+}
+
+void
+filter_free
+(
+ Filter * filter
+)
+{
+	if ( !filter )
+		return;
+	free(filter->next);
+	free(filter->actions);
+	free(filter->mask_length);
+	free(filter);
+}
+
+size_t
+filter_terms
+(
+ const Filter * filter
+)
+{
+	return filter->terms;
+}
+
+size_t
+filter_size
+(
+ const Filter * filter
+)
+{
+	return sizeof(*filter) + (size_t)filter->states * (filter->classes * sizeof(*filter->next) + sizeof(*filter->actions) + sizeof(*filter->mask_length));
+}
+
+/* Masks the spans, each character in them with a single asterisk,
+ * continuation bytes being squeezed out, and returns the new size */
+static size_t
+mask_spans
+(
+ unsigned char * text,
+ size_t size,
+ const MaskedSpan * spans,
+ size_t spans_n
+)
+{
+	unsigned char * out = text;
+	size_t kept_from = 0;
+	
+	for ( const MaskedSpan * span = spans, * const end = spans + spans_n ; span != end ; ++span )
+	{
+		memmove(out, text + kept_from, span->start - kept_from);
+		out += span->start - kept_from;
+		for ( size_t masked = span->start ; masked != span->end ; ++masked )
+			if ( (text[masked] & 0xC0) != 0x80 )
+				*out++ = '*';
+		kept_from = span->end;
+	}
+	memmove(out, text + kept_from, size - kept_from);
+	out += size - kept_from;
+	return (size_t)(out - text);
+}
+
+int
+filter_apply
+(
+ const Filter * filter,
+ unsigned char * text,
+ size_t * size
+)
+{
+	const uint32_t * const next = filter->next;
+	const unsigned char * const byte_class = filter->byte_class;
+	uint32_t row = 0;
+	int found = 0;
+	MaskedSpan inline_spans[masked_spans_inline];
+	MaskedSpan * spans = inline_spans;
+	size_t spans_n = 0;
+	size_t spans_capacity = masked_spans_inline;
+	
+	for ( size_t i = 0 ; i != *size ; ++i )
+	{
+		row = next[row + byte_class[text[i]]];
+		if ( !(row & transition_ends_terms) )
+			continue;
+		
+		row &= ~transition_ends_terms;
+		const uint32_t state = row / filter->classes;
+		const int actions = filter->actions[state];
+		found |= actions;
+		if ( actions & filter_drop )
+			break;
+		if ( !(actions & filter_mask) )
+			continue;
+		
+		/* Spans end in the order they're found, so the new one can only
+		 * overlap those found last, which it swallows */
+		size_t start = i + 1 - filter->mask_length[state];
+		for ( ; spans_n && start <= spans[spans_n - 1].end ; --spans_n )
+			if ( spans[spans_n - 1].start < start )
+				start = spans[spans_n - 1].start;
+		if ( spans_n == spans_capacity )
+		{
+			MaskedSpan * const larger = malloc(2 * spans_capacity * sizeof(*larger));
+			if ( !larger )
+			{
+				logmsg("couldn't allocate memory to mask a message, which gets dropped");
+				found |= filter_drop;
+				break;
+			}
+			memcpy(larger, spans, spans_n * sizeof(*spans));
+			if ( spans != inline_spans )
+				free(spans);
+			spans = larger;
+			spans_capacity *= 2;
+		}
+		spans[spans_n].start = start;
+		spans[spans_n].end = i + 1;
+		++spans_n;
+	}
+	
+	if ( spans_n && !(found & filter_drop) )
+		*size = mask_spans(text, *size, spans, spans_n);
+	if ( spans != inline_spans )
+		free(spans);
+	return found;
+}
+
+const Filter *
+filter_enter
+(
+ FilterSlot * slot,
+ long * generation
+)
+{
+	for ( ; ; )
+	{
+		const long entered = slot->generation;
+		platform_increment(slot->users + (entered & 1));
+		/* If the swap has closed it meanwhile, it might not have
+		 * seen us come in */
+		if ( slot->generation == entered )
+		{
+			*generation = entered;
+			return slot->current;
+		}
+		platform_decrement(slot->users + (entered & 1));
+	}
+}
+
+void
+filter_leave
+(
+ FilterSlot * slot,
+ long generation
+)
+{
+	platform_decrement(slot->users + (generation & 1));
+}
+
+Filter *
+filter_replace
+(
+ FilterSlot * slot,
+ Filter * filter
+)
+{
+	Filter * const replaced = slot->current;
+	const long closed = slot->generation;
+	
+	slot->current = filter;
+	platform_barrier();
+	slot->generation = closed + 1;
+	platform_barrier();
+	
+	/* It's only a filter_apply each that's left to wait for */
+	while ( slot->users[closed & 1] )
+		platform_yield();
+	return replaced;
+}
@@ -0,0 +1,104 @@
+#ifndef FILTER_H
+#define FILTER_H
+
+#include <stddef.h>
+
+
+/* Moderation of messages against a list of banned terms, compiled into
+ * an Aho-Corasick automaton: a DFA over classes of bytes, so that a
+ * message is checked against every term in a single pass of one table
+ * lookup per byte. Terms match anywhere in a message, ASCII letters
+ * regardless of case.
+ *
+ * The list is a text file with a term per line, each preceded by what's
+ * to be done about messages that contain it and a space:
+ *
+ *   drop  the message doesn't get broadcast
+ *   mask  the term is replaced with an asterisk per character
+ *   flag  the message gets broadcast and logged
+ *
+ * Blank lines and those starting with # are skipped. */
+
+/* What filter_apply finds, as flags */
+enum FilterAction {
+	filter_flag = 1,
+	filter_mask = 2,
+	filter_drop = 4
+};
+
+typedef struct Filter Filter;
+
+/* The list is of the format above. Returns NULL if it has none
+ * of the terms, or on any error, which it logs. */
+Filter * filter_compile
+(
+ const char * list,
+ size_t size
+);
+
+Filter * filter_load
+(
+ const char * path
+);
+
+void filter_free
+(
+ Filter *
+);
+
+size_t filter_terms
+(
+ const Filter *
+);
+
+/* Bytes taken up by the automaton */
+size_t filter_size
+(
+ const Filter *
+);
+
+/* Returns the actions of the terms found in the text. Terms to be
+ * masked are masked, unless one to be dropped is found, and size
+ * updated; whatever else is in the text is left as it is, bytes that
+ * aren't UTF-8 included. */
+int filter_apply
+(
+ const Filter *,
+ unsigned char * text,
+ size_t * size
+);
+
+/* The filter in use, which filter_replace swaps for another while
+ * workers go on using it. Those that are about to use it enter one of
+ * two generations, which the swap closes before waiting for everyone
+ * in it to leave: whoever is left in it might still be using the old
+ * filter, while whoever enters afterwards gets the new one. */
+typedef struct {
+	Filter * volatile current;
+	volatile long generation;
+	volatile long users[2];
+} FilterSlot;
+
+/* Returns the filter in use, NULL if there's none, to be used until
+ * filter_leave is called with the generation stored */
+const Filter * filter_enter
+(
+ FilterSlot *,
+ long * generation
+);
+
+void filter_leave
+(
+ FilterSlot *,
+ long generation
+);
+
+/* Returns the filter that was in use, which by then nobody is.
+ * Swaps are not to be made by more than one thread at a time. */
+Filter * filter_replace
+(
+ FilterSlot *,
+ Filter *
+);
+
+#endif
@@ -0,0 +1,58 @@
+#include "frame.h"
+
+#include <string.h>
+#include "platform.h"
+#include "pool.h"
+
+
+/* The frame is returned holding one reference, which
+ * belongs to the caller. It comes from the buffer pool. */
+Frame *
+frame_create
+(
+ int size
+)
+{
+	Frame * const frame = pool_alloc(sizeof(*frame) + size);
+	if ( frame )
+	{
+		frame->references = 1;
+		frame->trace_id = 0;
+		frame->messages = 1;
+		frame->lane = 0; // lane_chat
+		frame->queued_at = 0;
+		frame->size = size;
+		frame->prefix_size = (unsigned char)websocket_put_header((unsigned char *)frame->prefix, (uint64_t)size);
+		memmove(frame->data - frame->prefix_size, frame->prefix, frame->prefix_size);
+	}
+	return frame;
+}
+
+void
+frame_retain
+(
+ Frame * frame
+)
+{
+	platform_increment(&frame->references);
+}
+
+void
+frame_retain_many
+(
+ Frame * frame,
+ long n
+)
+{
+	platform_add_long(&frame->references, n);
+}
+
+void
+frame_release
+(
+ Frame * frame
+)
+{
+	if ( platform_decrement(&frame->references) == 0 )
+		pool_free(frame);
+}
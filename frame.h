@@ -0,0 +1,50 @@
+#ifndef FRAME_H
+#define FRAME_H
+
+#include <stdint.h>
+#include "websocket.h"
+
+
+/* A message as it goes out on the wire. A single frame is shared by
+ * all the clients a message is broadcast to, and it is freed when the
+ * last of them is done with it. Right in front of its data is the
+ * header that makes it a WebSocket message, written when it's created,
+ * so that it goes out to WebSocket clients without a copy as well. */
+typedef struct {
+	volatile long references;
+	/* The message's trace ID if it's being traced, 0 otherwise,
+	 * and when it was queued for its recipients, in microseconds */
+	uint64_t trace_id;
+	uint64_t queued_at;
+	unsigned messages; // how many messages the frame carries
+	unsigned char lane; // the outbound lane it goes in, see core.h
+	int size;
+	/* 0 for a frame of the WebSocket transport's own, which goes
+	 * out to its clients as it is */
+	unsigned char prefix_size;
+	char prefix[websocket_header_max];
+	char data[];
+} Frame;
+
+Frame * frame_create
+(
+ int size
+);
+
+void frame_retain
+(
+ Frame *
+);
+
+void frame_retain_many
+(
+ Frame *,
+ long n
+);
+
+void frame_release
+(
+ Frame *
+);
+
+#endif
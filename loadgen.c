@@ -0,0 +1,630 @@
+#include <winsock2.h>
+#include <ws2tcpip.h>
+#include <windows.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <stdlib.h>
+#include <string.h>
+#include "logmsg.h"
+#include "error.h"
+#include "protocol.h"
+
+/* A load generator for the server. It connects a number of clients,
+ * has each of them send a number of messages and counts the messages
+ * the server delivers back to them. Since the server broadcasts every
+ * message to every client, the sender included, each message sent
+ * should come back once per client. With -P 2 the clients speak
+ * protocol v2, asking for batching, and send -M messages per frame.
+ * -b makes a percentage of them slow readers, which only take a little
+ * of what there is to read every so often.
+ *
+ * Messages of 16 bytes or more start with the time they were sent, in
+ * hex, for the latency of every delivery to be measured. -S runs the
+ * scenario the profile-guided build is trained with (see pgo.cmd): a
+ * storm of v2 clients joining at once, then steady chat among them
+ * while some read slowly. -L runs the one the server's busy polling is
+ * compared with (see busypoll.cmd): a couple of v2 clients sending
+ * short messages a millisecond apart, each of which makes a round trip
+ * through an otherwise idle server. */
+
+/* What slow readers read at once, and how long they wait in between */
+#define slow_read_size 1024
+#define slow_read_pause_ms 20
+#define stamp_size 16
+
+
+enum ReadState {
+	reading_nickname_length,
+	reading_nickname,
+	reading_message_length,
+	reading_message
+};
+
+typedef struct {
+	SOCKET socket;
+	unsigned long messages_sent;
+	/* How much of the message being sent has gone out
+	 * already, should the socket's buffer have been full */
+	int frame_offset;
+	enum ReadState state;
+	unsigned left;
+	/* Protocol v2 frames are taken out of what's been received once
+	 * they're complete */
+	unsigned char * inbox;
+	size_t inbox_n;
+	size_t inbox_capacity;
+	char greeted;
+	uint64_t frames_received; // messages, actually
+	/* The start of the v1 message being read, for its time stamp */
+	unsigned message_length;
+	char stamp[stamp_size];
+	/* When the frame being sent was stamped */
+	uint64_t sent_at;
+	char slow;
+	uint64_t next_read; // of a slow reader's, in microseconds
+} Client;
+
+/* From each message being sent until each client got it */
+typedef struct {
+	uint32_t * samples; // microseconds
+	size_t n;
+	size_t capacity;
+} Latencies;
+
+struct loadgen_options {
+	const char * address;
+	u_short port;
+	unsigned long clients;
+	unsigned long messages;
+	unsigned long message_size;
+	unsigned long interval; // milliseconds between two rounds of messages
+	unsigned long protocol;
+	unsigned long messages_per_frame; // protocol v2 only
+	unsigned long slow_readers; // percent of the clients
+};
+
+static uint64_t
+now_us
+( void )
+{
+	static LARGE_INTEGER frequency;
+	LARGE_INTEGER counter;
+	if ( !frequency.QuadPart )
+		QueryPerformanceFrequency(&frequency);
+	QueryPerformanceCounter(&counter);
+	return (uint64_t)(counter.QuadPart / frequency.QuadPart * 1000000 + counter.QuadPart % frequency.QuadPart * 1000000 / frequency.QuadPart);
+}
+
+static void
+put_stamp
+(
+ char * out,
+ uint64_t time
+)
+{
+	for ( int i = stamp_size - 1 ; i >= 0 ; --i, time >>= 4 )
+		out[i] = "0123456789abcdef"[time & 15];
+}
+
+/* Records the latency of a delivery whose message starts with a stamp,
+ * unless it doesn't */
+static void
+take_stamp
+(
+ Latencies * latencies,
+ const char * in,
+ uint64_t now
+)
+{
+	uint64_t time = 0;
+	
+	for ( int i = 0 ; i != stamp_size ; ++i )
+	{
+		const char c = in[i];
+		if ( c >= '0' && c <= '9' )
+			time = time << 4 | (uint64_t)(c - '0');
+		else
+		if ( c >= 'a' && c <= 'f' )
+			time = time << 4 | (uint64_t)(c - 'a' + 10);
+		else
+			return;
+	}
+	if ( time > now )
+		return;
+	if ( latencies->n == latencies->capacity )
+	{
+		const size_t capacity = latencies->capacity ? latencies->capacity * 2 : 65536;
+		uint32_t * const samples = realloc(latencies->samples, capacity * sizeof(*samples));
+		if ( !samples )
+			return;
+		latencies->samples = samples;
+		latencies->capacity = capacity;
+	}
+	latencies->samples[latencies->n++] = (uint32_t)(now - time);
+}
+
+static int
+compare_latencies
+(
+ const void * a,
+ const void * b
+)
+{
+	const uint32_t x = *(const uint32_t *)a, y = *(const uint32_t *)b;
+	return (x > y) - (x < y);
+}
+
+static void
+parse_frames
+(
+ Client * client,
+ const unsigned char * cur,
+ const unsigned char * const end,
+ Latencies * latencies,
+ uint64_t now
+)
+{
+	while ( cur != end )
+	{
+		switch ( client->state )
+		{
+			case reading_nickname_length:
+				client->left = *cur++;
+				client->state = reading_nickname;
+				break;
+			case reading_message_length:
+				client->left = client->message_length = *cur++;
+				client->state = reading_message;
+				break;
+			case reading_nickname:
+			case reading_message:
+			{
+				const size_t skip = (size_t)(end - cur) < client->left ? (size_t)(end - cur) : client->left;
+				const size_t at = client->message_length - client->left;
+				if ( client->state == reading_message && at < stamp_size )
+					memcpy(client->stamp + at, cur, skip < stamp_size - at ? skip : stamp_size - at);
+				cur += skip;
+				client->left -= (unsigned)skip;
+				break;
+			}
+		}
+		
+		if ( !client->left )
+		{
+			if ( client->state == reading_nickname )
+				client->state = reading_message_length;
+			else
+			if ( client->state == reading_message )
+			{
+				client->state = reading_nickname_length;
+				++client->frames_received;
+				if ( client->message_length >= stamp_size )
+					take_stamp(latencies, client->stamp, now);
+			}
+		}
+	}
+}
+
+/* Returns how many bytes were taken, 0 if there isn't a whole
+ * frame (or the handshake reply) there yet */
+static size_t
+take_v2_frame
+(
+ Client * client,
+ const unsigned char * cur,
+ const unsigned char * end,
+ Latencies * latencies,
+ uint64_t now
+)
+{
+	const unsigned char * const start = cur;
+	uint32_t value;
+	int varint;
+	
+	if ( !client->greeted )
+	{
+		/* Marker, version, capabilities and largest frame */
+		if ( end - cur < 2 )
+			return 0;
+		cur += 2;
+		for ( int i = 0 ; i != 2 ; ++i, cur += varint )
+			if ( (varint = varint_get(cur, end, &value)) <= 0 )
+				return varint < 0 ? (size_t)(end - start) : 0;
+		client->greeted = 1;
+		return (size_t)(cur - start);
+	}
+	
+	if ( (varint = varint_get(cur, end, &value)) <= 0 )
+		return varint < 0 ? (size_t)(end - start) : 0;
+	if ( (size_t)(end - cur) < varint + value )
+		return 0;
+	
+	const unsigned char * payload = cur + varint;
+	const unsigned char * const payload_end = payload + value;
+	if ( value )
+		payload += 1 + *payload;
+	while ( payload < payload_end && (varint = varint_get(payload, payload_end, &value)) > 0 )
+	{
+		if ( value >= stamp_size && (size_t)(payload_end - payload) >= varint + stamp_size )
+			take_stamp(latencies, (const char *)payload + varint, now);
+		payload += varint + value;
+		++client->frames_received;
+	}
+	
+	return (size_t)(payload_end - start);
+}
+
+static int
+parse_v2_frames
+(
+ Client * client,
+ const unsigned char * cur,
+ const unsigned char * const end,
+ Latencies * latencies,
+ uint64_t now
+)
+{
+	const size_t size = (size_t)(end - cur);
+	
+	if ( client->inbox_n + size > client->inbox_capacity )
+	{
+		size_t capacity = client->inbox_capacity ? client->inbox_capacity * 2 : 65536;
+		if ( capacity < client->inbox_n + size )
+			capacity = client->inbox_n + size;
+		unsigned char * const inbox = realloc(client->inbox, capacity);
+		if ( !inbox )
+			return 0;
+		client->inbox = inbox;
+		client->inbox_capacity = capacity;
+	}
+	memcpy(client->inbox + client->inbox_n, cur, size);
+	client->inbox_n += size;
+	
+	const unsigned char * in = client->inbox;
+	const unsigned char * const in_end = in + client->inbox_n;
+	for ( size_t taken ; (taken = take_v2_frame(client, in, in_end, latencies, now)) ; )
+		in += taken;
+	
+	client->inbox_n = (size_t)(in_end - in);
+	memmove(client->inbox, in, client->inbox_n);
+	return 1;
+}
+
+static SOCKET
+connect_client
+(
+ const struct loadgen_options * options,
+ unsigned long index
+)
+{
+	SOCKET s = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+	if ( s != INVALID_SOCKET )
+	{
+		struct sockaddr_in server_address = {
+			.sin_family = AF_INET,
+			.sin_port = htons(options->port)
+		};
+		inet_pton(AF_INET, options->address, &server_address.sin_addr);
+		
+		if ( connect(s, (struct sockaddr *)&server_address, sizeof(server_address)) != SOCKET_ERROR )
+		{
+			char hello[3 + 1 + 16];
+			int hello_size = 0;
+			if ( options->protocol == 2 )
+			{
+				hello[hello_size++] = (char)protocol_v2_marker;
+				hello[hello_size++] = protocol_version;
+				hello[hello_size++] = capability_batch;
+			}
+			const int nickname_length = snprintf(hello + hello_size + 1, sizeof(hello) - hello_size - 1, "lg%lu", index);
+			hello[hello_size] = (char)nickname_length;
+			hello_size += 1 + nickname_length;
+			
+			setsockopt(s, IPPROTO_TCP, TCP_NODELAY, (const char *)(DWORD[]){1}, sizeof(DWORD));
+			
+			if ( send(s, hello, hello_size, 0) == hello_size && ioctlsocket(s, FIONBIO, (u_long[]){1}) == 0 )
+				return s;
+		}
+		
+		wsa_perror("couldn't connect client to the server");
+		closesocket(s);
+	}
+	else
+		wsa_perror("couldn't create client socket");
+	
+	return INVALID_SOCKET;
+}
+
+static int
+run
+(
+ const struct loadgen_options * options
+)
+{
+	Client * const clients = calloc(options->clients, sizeof(*clients));
+	WSAPOLLFD * const poll_fds = calloc(options->clients, sizeof(*poll_fds));
+	const unsigned long messages_per_frame = options->protocol == 2 && options->messages_per_frame ? options->messages_per_frame : 1;
+	const size_t record_size = (options->protocol == 2 ? varint_size((uint32_t)options->message_size) : 1) + options->message_size;
+	char * const frame = malloc(varint_max_size + messages_per_frame * record_size);
+	Latencies latencies = {0};
+	static unsigned char buffer[65536];
+	
+	if ( !clients || !poll_fds || !frame )
+	{
+		logmsg("couldn't allocate memory for the clients");
+		free(clients);
+		free(poll_fds);
+		free(frame);
+		return 0;
+	}
+	
+	unsigned char * out = (unsigned char *)frame;
+	if ( options->protocol == 2 )
+		out += varint_put(out, (uint32_t)(messages_per_frame * record_size));
+	/* Where the first message's text starts */
+	const size_t header_size = (size_t)(out - (unsigned char *)frame) + record_size - options->message_size;
+	for ( unsigned long i = 0 ; i != messages_per_frame ; ++i )
+	{
+		if ( options->protocol == 2 )
+			out += varint_put(out, (uint32_t)options->message_size);
+		else
+			*out++ = (unsigned char)options->message_size;
+		memset(out, 'x', options->message_size);
+		out += options->message_size;
+	}
+	const int frame_size = (int)(out - (unsigned char *)frame);
+	const int stamped = options->message_size >= stamp_size;
+	
+	/* All at once, as fast as they can */
+	unsigned long connected = 0;
+	const uint64_t storm_start = now_us();
+	for ( ; connected != options->clients ; ++connected )
+	{
+		if ( (clients[connected].socket = connect_client(options, connected)) == INVALID_SOCKET )
+			break;
+		poll_fds[connected].fd = clients[connected].socket;
+		poll_fds[connected].events = POLLRDNORM;
+		/* Spread out among the others */
+		clients[connected].slow = (connected + 1) * options->slow_readers / 100 != connected * options->slow_readers / 100;
+	}
+	const uint64_t storm_us = now_us() - storm_start;
+	logmsgf("%lu clients connected in %.3f s, %.0f joins/s\n", connected, storm_us / 1e6, storm_us ? connected * 1e6 / storm_us : 0.);
+	
+	/* Give the server time to accept everybody, so that the first
+	 * messages reach all of them */
+	Sleep(500);
+	
+	uint64_t messages_sent = 0;
+	uint64_t recv_calls = 0;
+	const uint64_t start = now_us();
+	uint64_t next_round = start;
+	uint64_t last_activity = start;
+	
+	for ( ; ; )
+	{
+		uint64_t now = now_us();
+		const int round_due = now >= next_round;
+		int sending = 0;
+		
+		if ( round_due )
+			next_round = now + options->interval * 1000;
+		
+		for ( Client * client = clients, * const end = clients + connected ; client != end ; ++client )
+		{
+			if ( client->messages_sent >= options->messages )
+				continue;
+			
+			sending = 1;
+			if ( client->frame_offset || round_due )
+			{
+				/* The frame is shared, so the stamps are put back
+				 * before what's left of one sent partially goes out */
+				if ( !client->frame_offset )
+					client->sent_at = now;
+				if ( stamped )
+					for ( unsigned long i = 0 ; i != messages_per_frame ; ++i )
+						put_stamp(frame + header_size + i * record_size, client->sent_at);
+				
+				const int rv = send(client->socket, frame + client->frame_offset, frame_size - client->frame_offset, 0);
+				if ( rv != SOCKET_ERROR )
+				{
+					client->frame_offset += rv;
+					if ( client->frame_offset == frame_size )
+					{
+						client->frame_offset = 0;
+						client->messages_sent += messages_per_frame;
+						messages_sent += messages_per_frame;
+					}
+				}
+				else
+				if ( WSAGetLastError() != WSAEWOULDBLOCK )
+				{
+					wsa_perror("couldn't send message");
+					client->messages_sent = options->messages;
+				}
+			}
+		}
+		
+		/* Slow readers aren't polled while they pause */
+		for ( unsigned long i = 0 ; i != connected ; ++i )
+			if ( clients[i].slow )
+				poll_fds[i].events = now >= clients[i].next_read ? POLLRDNORM : 0;
+		
+		const int ready = WSAPoll(poll_fds, connected, 1);
+		if ( ready > 0 )
+		{
+			now = now_us();
+			for ( unsigned long i = 0 ; i != connected ; ++i )
+			{
+				if ( poll_fds[i].revents & (POLLRDNORM | POLLERR | POLLHUP) )
+				{
+					const int rv = recv(poll_fds[i].fd, (char *)buffer, clients[i].slow ? slow_read_size : sizeof(buffer), 0);
+					++recv_calls;
+					if ( clients[i].slow )
+						clients[i].next_read = now + slow_read_pause_ms * 1000;
+					if ( rv > 0 )
+					{
+						if ( options->protocol != 2 )
+							parse_frames(clients + i, buffer, buffer + rv, &latencies, now);
+						else
+						if ( !parse_v2_frames(clients + i, buffer, buffer + rv, &latencies, now) )
+						{
+							logmsg("couldn't allocate memory for received frames");
+							poll_fds[i].fd = INVALID_SOCKET;
+						}
+					}
+					else
+					if ( rv == 0 || WSAGetLastError() != WSAEWOULDBLOCK )
+					{
+						logmsg("server closed a client's connection");
+						/* Negative descriptors are ignored by WSAPoll */
+						poll_fds[i].fd = INVALID_SOCKET;
+					}
+				}
+			}
+			last_activity = now;
+		}
+		else
+		if ( ready == SOCKET_ERROR )
+		{
+			wsa_perror("couldn't poll client sockets");
+			break;
+		}
+		
+		uint64_t received = 0;
+		for ( unsigned long i = 0 ; i != connected ; ++i )
+			received += clients[i].frames_received;
+		
+		/* Messages the server dropped for slow readers never come */
+		if ( !sending && (received == messages_sent * connected || now_us() - last_activity > 2000000) )
+			break;
+	}
+	
+	/* Up to the last of what came in */
+	const uint64_t elapsed = (last_activity > start ? last_activity : now_us()) - start;
+	uint64_t received = 0;
+	for ( unsigned long i = 0 ; i != connected ; ++i )
+	{
+		received += clients[i].frames_received;
+		closesocket(clients[i].socket);
+		free(clients[i].inbox);
+	}
+	
+	logmsgf("%"PRIu64" messages sent, %"PRIu64" of %"PRIu64" deliveries received in %.3f s\n", messages_sent, received, messages_sent * connected, elapsed / 1e6);
+	if ( received )
+		logmsgf("%.0f messages/s, %.0f deliveries/s, %.3f recv calls per delivered message\n", messages_sent * 1e6 / elapsed, received * 1e6 / elapsed, (double)recv_calls / received);
+	if ( latencies.n )
+	{
+		const uint32_t * const samples = latencies.samples;
+		qsort(latencies.samples, latencies.n, sizeof(*samples), compare_latencies);
+		logmsgf("latency (us): p50 %"PRIu32", p90 %"PRIu32", p99 %"PRIu32", p99.9 %"PRIu32", max %"PRIu32"\n", samples[latencies.n / 2], samples[latencies.n * 9 / 10], samples[latencies.n * 99 / 100], samples[latencies.n * 999 / 1000], samples[latencies.n - 1]);
+	}
+	logmsg("the server logs how many sends it took to deliver them when it shuts down");
+	
+	free(clients);
+	free(poll_fds);
+	free(frame);
+	free(latencies.samples);
+	
+	return connected == options->clients;
+}
+
+int main
+(
+ int argc,
+ char * * argv
+)
+{
+	int rv = 0;
+	char parameter = 0;
+	struct loadgen_options options = {
+		.address = "127.0.0.1",
+		.port = 3144,
+		.clients = 10,
+		.messages = 100,
+		.message_size = 32
+	};
+	WSADATA wsa_data;
+	
+	logout = stderr;
+	
+	for ( char * * arg_cur = argv, * * const argv_end = argv+argc ; arg_cur != argv_end ; ++arg_cur )
+	{
+		char * const arg = *arg_cur;
+		if ( parameter )
+		{
+			switch ( parameter )
+			{
+				case 'a':
+					options.address = arg;
+					break;
+				case 'p':
+					options.port = (u_short)strtol(arg, NULL, 10);
+					break;
+				case 'c':
+					options.clients = strtoul(arg, NULL, 10);
+					break;
+				case 'm':
+					options.messages = strtoul(arg, NULL, 10);
+					break;
+				case 's':
+					options.message_size = strtoul(arg, NULL, 10);
+					break;
+				case 'i':
+					options.interval = strtoul(arg, NULL, 10);
+					break;
+				case 'P':
+					options.protocol = strtoul(arg, NULL, 10);
+					break;
+				case 'M':
+					options.messages_per_frame = strtoul(arg, NULL, 10);
+					break;
+				case 'b':
+					options.slow_readers = strtoul(arg, NULL, 10);
+					break;
+			}
+			parameter = 0;
+		}
+		else
+		if ( !strcmp(arg, "-S") )
+		{
+			/* A busy room's worth of clients, options
+			 * given after it overriding its own */
+			options.clients = 60;
+			options.messages = 1000;
+			options.message_size = 64;
+			options.interval = 2;
+			options.protocol = 2;
+			options.slow_readers = 10;
+		}
+		else
+		if ( !strcmp(arg, "-L") )
+		{
+			/* Sparse enough for the workers to go idle in between */
+			options.clients = 2;
+			options.messages = 10000;
+			options.message_size = 32;
+			options.interval = 1;
+			options.protocol = 2;
+			options.slow_readers = 0;
+		}
+		else
+		if ( *arg == '-' )
+			parameter = arg[1];
+	}
+	
+	/* Longer messages need protocol v2, and as long as
+	 * they fit the server's largest frame */
+	if ( options.protocol != 2 && options.message_size > 255 )
+		options.message_size = 255;
+	
+	if ( WSAStartup(MAKEWORD(2,2), &wsa_data) == 0 )
+	{
+		rv = run(&options);
+		WSACleanup();
+	}
+	else
+		logmsg("couldn't initialize Winsock");
+	
+	return !rv;
+}
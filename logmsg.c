@@ -5,6 +5,7 @@
 
 
 FILE * logout;
+volatile int loglevel = loglevel_debug;
 
 void logmsg
 (
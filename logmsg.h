@@ -1,7 +1,22 @@
 #include <stdio.h>
 
 
+/* Errors always get logged; the rest only if loglevel is high
+ * enough. The per-message chatter is at loglevel_debug, which is
+ * the default. */
+enum LogLevel {
+	loglevel_error,
+	loglevel_info, // clients coming and going
+	loglevel_debug // every message and completion
+};
+
 extern FILE * logout;
+extern volatile int loglevel;
+
+#define loginfo(msg) do { if ( loglevel >= loglevel_info ) logmsg(msg); } while ( 0 )
+#define loginfof(...) do { if ( loglevel >= loglevel_info ) logmsgf(__VA_ARGS__); } while ( 0 )
+#define logdebug(msg) do { if ( loglevel >= loglevel_debug ) logmsg(msg); } while ( 0 )
+#define logdebugf(...) do { if ( loglevel >= loglevel_debug ) logmsgf(__VA_ARGS__); } while ( 0 )
 
 void logmsg
 (
@@ -0,0 +1,102 @@
+@echo off
+rem Profile-guided optimization of the server: builds it as usual and
+rem instrumented, trains the instrumented build with the load scenario of
+rem lappenchat-loadgen -S over loopback (a storm of clients joining, then
+rem steady chat among them while some read slowly), rebuilds it with the
+rem profile collected, and reports how the plain and the optimized build
+rem fare under the same scenario. The toolchain is whichever tup.config
+rem picks (see Tuprules.tup), which is left as it was afterwards.
+rem
+rem The profile, the two builds compared and the report are kept in the
+rem directory given, outside of the tree for tup not to mind them:
+rem
+rem   pgo [directory] [port]
+
+setlocal EnableExtensions
+cd /d "%~dp0"
+
+set "PGO_OUT=%~1"
+if "%PGO_OUT%"=="" set "PGO_OUT=%TEMP%\lappenchat-pgo"
+set "PGO_PORT=%~2"
+if "%PGO_PORT%"=="" set "PGO_PORT=3199"
+rem Seconds the server runs for each time, which the scenario is done in
+set PGO_RUN=20
+rem Where instrumented MSVC builds write their counts
+set "VCPROFILE_PATH=%PGO_OUT%\profile"
+
+if exist "%PGO_OUT%\profile" rmdir /s /q "%PGO_OUT%\profile"
+for %%d in ("%PGO_OUT%" "%PGO_OUT%\profile" "%PGO_OUT%\plain" "%PGO_OUT%\optimized") do if not exist "%%~d" mkdir "%%~d"
+set PGO_HAD_CONFIG=0
+if exist tup.config (
+	set PGO_HAD_CONFIG=1
+	copy /y tup.config "%PGO_OUT%\tup.config" >nul
+) else (
+	type nul > "%PGO_OUT%\tup.config"
+)
+
+echo building the server as usual
+call :configure
+tup || goto failed
+copy /y lappenchat-server-command.exe "%PGO_OUT%\plain" >nul || goto failed
+rem Every run is driven by the same load generator
+copy /y lappenchat-loadgen.exe "%PGO_OUT%\plain" >nul || goto failed
+
+echo building the server instrumented
+call :configure generate
+tup || goto failed
+echo training it
+call :scenario . "%PGO_OUT%\training.txt" || goto failed
+
+echo building the server with the profile
+call :configure use
+tup || goto failed
+copy /y lappenchat-server-command.exe "%PGO_OUT%\optimized" >nul || goto failed
+call :restore
+
+echo running the plain build
+call :scenario "%PGO_OUT%\plain" "%PGO_OUT%\plain.txt" || goto failed
+echo running the optimized build
+call :scenario "%PGO_OUT%\optimized" "%PGO_OUT%\optimized.txt" || goto failed
+
+(
+	echo plain build:
+	findstr /c:"joins/s" /c:"messages/s" /c:"latency" "%PGO_OUT%\plain.txt"
+	echo.
+	echo profile-guided build:
+	findstr /c:"joins/s" /c:"messages/s" /c:"latency" "%PGO_OUT%\optimized.txt"
+) > "%PGO_OUT%\report.txt"
+echo.
+type "%PGO_OUT%\report.txt"
+echo.
+echo the optimized server is %PGO_OUT%\optimized\lappenchat-server-command.exe
+exit /b 0
+
+:failed
+echo profile-guided build failed
+call :restore
+exit /b 1
+
+rem Has the server in the given directory run for PGO_RUN seconds, with
+rem the scenario started against it once it's listening, whose report
+rem goes to the given file, and the server's log next to it
+:scenario
+start "" /b cmd /c "ping -n 3 127.0.0.1 >nul & "%PGO_OUT%\plain\lappenchat-loadgen.exe" -S -p %PGO_PORT% 2> "%~2""
+"%~1\lappenchat-server-command.exe" -p %PGO_PORT% -e %PGO_RUN% 2> "%~2.server"
+exit /b %errorlevel%
+
+rem tup.config as it was, with CONFIG_PGO set to what's given, if anything
+:configure
+findstr /v /b /c:"CONFIG_PGO" "%PGO_OUT%\tup.config" > tup.config
+if not "%~1"=="" (
+	>>tup.config echo CONFIG_PGO=%~1
+	>>tup.config echo CONFIG_PGO_DIR=%PGO_OUT%\profile
+)
+exit /b 0
+
+:restore
+if %PGO_HAD_CONFIG%==1 (
+	copy /y "%PGO_OUT%\tup.config" tup.config >nul
+) else (
+	if exist tup.config del tup.config
+)
+exit /b 0
@@ -0,0 +1,504 @@
+#include "platform.h"
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#if defined(_WIN32)
+#include <intrin.h>
+#include <malloc.h>
+#include <windows.h>
+#else
+#include <pthread.h>
+#include <sched.h>
+#include <time.h>
+#include <unistd.h>
+#if defined(__linux__)
+#include <sys/syscall.h>
+#endif
+#endif
+
+
+typedef struct {
+	void (*function)(void *);
+	void * argument;
+} ThreadStart;
+
+#if defined(_WIN32)
+
+void
+platform_lock_init
+(
+ PlatformLock * lock
+)
+{
+	InitializeCriticalSection(lock);
+}
+
+void
+platform_lock_acquire
+(
+ PlatformLock * lock
+)
+{
+	EnterCriticalSection(lock);
+}
+
+void
+platform_lock_release
+(
+ PlatformLock * lock
+)
+{
+	LeaveCriticalSection(lock);
+}
+
+void
+platform_lock_destroy
+(
+ PlatformLock * lock
+)
+{
+	DeleteCriticalSection(lock);
+}
+
+long
+platform_increment
+(
+ volatile long * value
+)
+{
+	return InterlockedIncrement(value);
+}
+
+long
+platform_decrement
+(
+ volatile long * value
+)
+{
+	return InterlockedDecrement(value);
+}
+
+long
+platform_load_long
+(
+ const volatile long * value
+)
+{
+	const long loaded = *value;
+	platform_load_fence();
+	return loaded;
+}
+
+void
+platform_store_long
+(
+ volatile long * value,
+ long stored
+)
+{
+	platform_store_fence();
+	*value = stored;
+}
+
+long
+platform_add_long
+(
+ volatile long * value,
+ long addend
+)
+{
+	return InterlockedExchangeAdd(value, addend) + addend;
+}
+
+int
+platform_compare_exchange
+(
+ volatile long * value,
+ long expected,
+ long desired
+)
+{
+	return InterlockedCompareExchange(value, desired, expected) == expected;
+}
+
+int64_t
+platform_add
+(
+ volatile int64_t * value,
+ int64_t addend
+)
+{
+	return InterlockedExchangeAdd64((volatile LONG64 *)value, addend) + addend;
+}
+
+void
+platform_barrier
+( void )
+{
+	MemoryBarrier();
+}
+
+void
+platform_yield
+( void )
+{
+	SwitchToThread();
+}
+
+void
+platform_sleep_ms
+(
+ uint32_t ms
+)
+{
+	Sleep(ms);
+}
+
+uint64_t
+platform_now_ns
+( void )
+{
+	static LARGE_INTEGER frequency;
+	LARGE_INTEGER counter;
+	if ( !frequency.QuadPart )
+		QueryPerformanceFrequency(&frequency);
+	QueryPerformanceCounter(&counter);
+	return (uint64_t)(counter.QuadPart / frequency.QuadPart * 1000000000 + counter.QuadPart % frequency.QuadPart * 1000000000 / frequency.QuadPart);
+}
+
+unsigned long
+platform_thread_id
+( void )
+{
+	return GetCurrentThreadId();
+}
+
+unsigned long
+platform_process_id
+( void )
+{
+	return GetCurrentProcessId();
+}
+
+static DWORD WINAPI
+thread_start
+(
+ LPVOID data
+)
+{
+	const ThreadStart start = *(ThreadStart *)data;
+	
+	free(data);
+	start.function(start.argument);
+	return 0;
+}
+
+int
+platform_thread_start
+(
+ PlatformThread * thread,
+ void (*function)(void *),
+ void * argument
+)
+{
+	ThreadStart * const start = malloc(sizeof(*start));
+	
+	if ( !start )
+		return 0;
+	*start = (ThreadStart){function, argument};
+	if ( !(*thread = CreateThread(NULL, 0, thread_start, start, 0, NULL)) )
+	{
+		free(start);
+		return 0;
+	}
+	return 1;
+}
+
+void
+platform_thread_join
+(
+ PlatformThread thread
+)
+{
+	WaitForSingleObject(thread, INFINITE);
+	CloseHandle(thread);
+}
+
+void *
+platform_alloc_aligned
+(
+ size_t size
+)
+{
+	void * const memory = _aligned_malloc(size ? size : 1, cache_line_size);
+	if ( memory )
+		memset(memory, 0, size);
+	return memory;
+}
+
+void
+platform_free_aligned
+(
+ void * memory
+)
+{
+	_aligned_free(memory);
+}
+
+#else
+
+void
+platform_lock_init
+(
+ PlatformLock * lock
+)
+{
+	pthread_mutex_init(lock, NULL);
+}
+
+void
+platform_lock_acquire
+(
+ PlatformLock * lock
+)
+{
+	pthread_mutex_lock(lock);
+}
+
+void
+platform_lock_release
+(
+ PlatformLock * lock
+)
+{
+	pthread_mutex_unlock(lock);
+}
+
+void
+platform_lock_destroy
+(
+ PlatformLock * lock
+)
+{
+	pthread_mutex_destroy(lock);
+}
+
+long
+platform_increment
+(
+ volatile long * value
+)
+{
+	return __atomic_add_fetch(value, 1, __ATOMIC_SEQ_CST);
+}
+
+long
+platform_decrement
+(
+ volatile long * value
+)
+{
+	return __atomic_sub_fetch(value, 1, __ATOMIC_SEQ_CST);
+}
+
+long
+platform_load_long
+(
+ const volatile long * value
+)
+{
+	return __atomic_load_n(value, __ATOMIC_ACQUIRE);
+}
+
+void
+platform_store_long
+(
+ volatile long * value,
+ long stored
+)
+{
+	__atomic_store_n(value, stored, __ATOMIC_RELEASE);
+}
+
+long
+platform_add_long
+(
+ volatile long * value,
+ long addend
+)
+{
+	return __atomic_add_fetch(value, addend, __ATOMIC_SEQ_CST);
+}
+
+int
+platform_compare_exchange
+(
+ volatile long * value,
+ long expected,
+ long desired
+)
+{
+	return __atomic_compare_exchange_n(value, &expected, desired, 0, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);
+}
+
+int64_t
+platform_add
+(
+ volatile int64_t * value,
+ int64_t addend
+)
+{
+	return __atomic_add_fetch(value, addend, __ATOMIC_SEQ_CST);
+}
+
+void
+platform_barrier
+( void )
+{
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+}
+
+void
+platform_yield
+( void )
+{
+	sched_yield();
+}
+
+void
+platform_sleep_ms
+(
+ uint32_t ms
+)
+{
+	const struct timespec duration = {ms / 1000, (long)(ms % 1000) * 1000000};
+	nanosleep(&duration, NULL);
+}
+
+uint64_t
+platform_now_ns
+( void )
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (uint64_t)now.tv_sec * 1000000000 + (uint64_t)now.tv_nsec;
+}
+
+unsigned long
+platform_thread_id
+( void )
+{
+#if defined(__linux__)
+	return (unsigned long)syscall(SYS_gettid);
+#else
+	return (unsigned long)(uintptr_t)pthread_self();
+#endif
+}
+
+unsigned long
+platform_process_id
+( void )
+{
+	return (unsigned long)getpid();
+}
+
+static void *
+thread_start
+(
+ void * data
+)
+{
+	const ThreadStart start = *(ThreadStart *)data;
+	
+	free(data);
+	start.function(start.argument);
+	return NULL;
+}
+
+int
+platform_thread_start
+(
+ PlatformThread * thread,
+ void (*function)(void *),
+ void * argument
+)
+{
+	ThreadStart * const start = malloc(sizeof(*start));
+	
+	if ( !start )
+		return 0;
+	*start = (ThreadStart){function, argument};
+	if ( pthread_create(thread, NULL, thread_start, start) )
+	{
+		free(start);
+		return 0;
+	}
+	return 1;
+}
+
+void
+platform_thread_join
+(
+ PlatformThread thread
+)
+{
+	pthread_join(thread, NULL);
+}
+
+void *
+platform_alloc_aligned
+(
+ size_t size
+)
+{
+	void * memory;
+	if ( posix_memalign(&memory, cache_line_size, size ? size : 1) )
+		return NULL;
+	memset(memory, 0, size);
+	return memory;
+}
+
+void
+platform_free_aligned
+(
+ void * memory
+)
+{
+	free(memory);
+}
+
+#endif
+
+void
+platform_store_fence
+( void )
+{
+#if defined(__GNUC__)
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+#elif defined(_M_IX86) || defined(_M_X64)
+	_ReadWriteBarrier();
+#else
+	MemoryBarrier();
+#endif
+}
+
+void
+platform_load_fence
+( void )
+{
+#if defined(__GNUC__)
+	__atomic_thread_fence(__ATOMIC_ACQUIRE);
+#elif defined(_M_IX86) || defined(_M_X64)
+	_ReadWriteBarrier();
+#else
+	MemoryBarrier();
+#endif
+}
+
+uint64_t
+platform_now_us
+( void )
+{
+	return platform_now_ns() / 1000;
+}
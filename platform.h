@@ -0,0 +1,157 @@
+#ifndef PLATFORM_H
+#define PLATFORM_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* The little the server core needs from the operating system. On
+ * Windows it's the Win32 API; anywhere else it's POSIX, which is
+ * what lets lappenchat-sim run natively on Linux. */
+
+#if defined(_WIN32)
+#include <windows.h>
+typedef CRITICAL_SECTION PlatformLock;
+typedef HANDLE PlatformThread;
+#else
+#include <pthread.h>
+typedef pthread_mutex_t PlatformLock;
+typedef pthread_t PlatformThread;
+#endif
+
+#if defined(_MSC_VER)
+#define thread_local __declspec(thread)
+#define cache_aligned __declspec(align(64))
+#else
+#define thread_local _Thread_local
+#define cache_aligned _Alignas(64)
+#endif
+
+/* What cache_aligned aligns to */
+#define cache_line_size 64
+
+void platform_lock_init
+(
+ PlatformLock *
+);
+
+void platform_lock_acquire
+(
+ PlatformLock *
+);
+
+void platform_lock_release
+(
+ PlatformLock *
+);
+
+void platform_lock_destroy
+(
+ PlatformLock *
+);
+
+long platform_increment
+(
+ volatile long *
+);
+
+long platform_decrement
+(
+ volatile long *
+);
+
+/* Loads that nothing after them gets moved before, and stores that
+ * nothing before them gets moved after */
+long platform_load_long
+(
+ const volatile long *
+);
+
+void platform_store_long
+(
+ volatile long *,
+ long value
+);
+
+/* Returns the sum */
+long platform_add_long
+(
+ volatile long *,
+ long addend
+);
+
+/* Stores desired if the value is expected, returning whether it did */
+int platform_compare_exchange
+(
+ volatile long *,
+ long expected,
+ long desired
+);
+
+/* Returns the sum */
+int64_t platform_add
+(
+ volatile int64_t *,
+ int64_t addend
+);
+
+void platform_barrier
+(void);
+
+/* Gives up the rest of the thread's time slice */
+void platform_yield
+(void);
+
+void platform_sleep_ms
+(
+ uint32_t ms
+);
+
+/* Keep the stores before a call from being reordered with the ones
+ * after it, and likewise for loads, which on x86 only takes keeping
+ * the compiler from doing so */
+void platform_store_fence
+(void);
+
+void platform_load_fence
+(void);
+
+/* A monotonic clock */
+uint64_t platform_now_ns
+(void);
+
+uint64_t platform_now_us
+(void);
+
+/* Zero-filled and aligned to a cache line, to be freed
+ * with platform_free_aligned */
+void * platform_alloc_aligned
+(
+ size_t size
+);
+
+void platform_free_aligned
+(
+ void *
+);
+
+unsigned long platform_thread_id
+(void);
+
+unsigned long platform_process_id
+(void);
+
+/* Runs the function in a thread of its own, returning 0 if it
+ * couldn't be started */
+int platform_thread_start
+(
+ PlatformThread *,
+ void (*)(void *),
+ void * argument
+);
+
+void platform_thread_join
+(
+ PlatformThread
+);
+
+#endif
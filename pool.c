@@ -0,0 +1,142 @@
+#include "pool.h"
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include "platform.h"
+
+/* 64 bytes to 1 MiB */
+#define pool_classes 15
+/* Not from any class */
+#define pool_oversized pool_classes
+
+
+/* Every buffer is preceded by one of these, which is as large
+ * as malloc's alignment so that the buffer keeps it */
+typedef union PoolBlock {
+	struct {
+		union PoolBlock * next; // while on a free list
+		size_t size_class;
+		size_t capacity;
+	} header;
+	max_align_t alignment;
+} PoolBlock;
+
+typedef struct {
+	PlatformLock lock;
+	PoolBlock * free;
+	size_t cached; // blocks on the free list
+} PoolClass;
+
+static PoolClass classes[pool_classes];
+static char initialized;
+static volatile int64_t in_use;
+
+/* To be called before any other thread could be using the pool */
+void
+pool_init
+( void )
+{
+	if ( initialized )
+		return;
+	
+	for ( size_t i = 0 ; i != pool_classes ; ++i )
+		platform_lock_init(&classes[i].lock);
+	initialized = 1;
+}
+
+static size_t
+size_class
+(
+ size_t size
+)
+{
+	size_t class_index = 0;
+	for ( size_t class_size = pool_min_size ; class_size < size ; class_size <<= 1 )
+		if ( ++class_index == pool_classes )
+			return pool_oversized;
+	return class_index;
+}
+
+/* The buffer may turn out to be larger than asked for; pool_capacity
+ * tells how large */
+void *
+pool_alloc
+(
+ size_t size
+)
+{
+	const size_t class_index = size_class(size);
+	PoolBlock * block = NULL;
+	
+	if ( class_index != pool_oversized )
+	{
+		PoolClass * const pool_class = classes + class_index;
+		
+		platform_lock_acquire(&pool_class->lock);
+		if ( (block = pool_class->free) )
+		{
+			pool_class->free = block->header.next;
+			--pool_class->cached;
+		}
+		platform_lock_release(&pool_class->lock);
+		
+		size = (size_t)pool_min_size << class_index;
+	}
+	
+	if ( !block )
+	{
+		if ( !(block = malloc(sizeof(*block) + size)) )
+			return NULL;
+		block->header.size_class = class_index;
+		block->header.capacity = size;
+	}
+	
+	platform_add(&in_use, (int64_t)block->header.capacity);
+	return block + 1;
+}
+
+size_t
+pool_capacity
+(
+ const void * buffer
+)
+{
+	return ((const PoolBlock *)buffer - 1)->header.capacity;
+}
+
+void
+pool_free
+(
+ void * buffer
+)
+{
+	if ( !buffer )
+		return;
+	
+	PoolBlock * block = (PoolBlock *)buffer - 1;
+	platform_add(&in_use, -(int64_t)block->header.capacity);
+	if ( block->header.size_class != pool_oversized )
+	{
+		PoolClass * const pool_class = classes + block->header.size_class;
+		
+		platform_lock_acquire(&pool_class->lock);
+		if ( (pool_class->cached + 1) * block->header.capacity <= pool_cache_size || !pool_class->cached )
+		{
+			block->header.next = pool_class->free;
+			pool_class->free = block;
+			++pool_class->cached;
+			block = NULL;
+		}
+		platform_lock_release(&pool_class->lock);
+	}
+	
+	free(block);
+}
+
+int64_t
+pool_in_use
+( void )
+{
+	return in_use;
+}
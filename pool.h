@@ -0,0 +1,42 @@
+#ifndef POOL_H
+#define POOL_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+
+/* A pool of buffers in power-of-two size classes, from
+ * pool_min_size to pool_max_size. Freed buffers are kept on a list
+ * per class for the next allocation of that class, up to about
+ * pool_cache_size bytes of them per class. Larger allocations go
+ * straight to malloc and free. The capacity of the buffers handed out
+ * and not freed yet is kept count of, for the memory budget (see
+ * core.h). */
+
+#define pool_min_size 64
+#define pool_max_size (1 << 20)
+#define pool_cache_size (4 << 20)
+
+void pool_init
+(void);
+
+void * pool_alloc
+(
+ size_t size
+);
+
+size_t pool_capacity
+(
+ const void * buffer
+);
+
+void pool_free
+(
+ void * buffer
+);
+
+/* The capacity of the buffers in use, in bytes */
+int64_t pool_in_use
+(void);
+
+#endif
@@ -0,0 +1,79 @@
+#include "protocol.h"
+
+#include <stddef.h>
+#include <stdint.h>
+
+
+size_t
+varint_size
+(
+ uint32_t value
+)
+{
+	size_t size = 1;
+	for ( ; value >= 0x80 ; value >>= 7 )
+		++size;
+	return size;
+}
+
+size_t
+varint_put
+(
+ unsigned char * out,
+ uint32_t value
+)
+{
+	size_t size = 0;
+	for ( ; value >= 0x80 ; value >>= 7 )
+		out[size++] = (unsigned char)(value | 0x80);
+	out[size++] = (unsigned char)value;
+	return size;
+}
+
+/* Returns how many bytes the varint took, 0 if it isn't all there
+ * yet, or -1 if it's longer than varint_max_size */
+int
+varint_get
+(
+ const unsigned char * cur,
+ const unsigned char * end,
+ uint32_t * value
+)
+{
+	uint32_t result = 0;
+	for ( int i = 0 ; i != varint_max_size ; ++i )
+	{
+		if ( cur + i == end )
+			return 0;
+		result |= (uint32_t)(cur[i] & 0x7F) << (7 * i);
+		if ( !(cur[i] & 0x80) )
+		{
+			*value = result;
+			return i + 1;
+		}
+	}
+	return -1;
+}
+
+void
+uint64_put
+(
+ unsigned char * out,
+ uint64_t value
+)
+{
+	for ( int i = 0 ; i != 8 ; ++i, value >>= 8 )
+		out[i] = (unsigned char)value;
+}
+
+uint64_t
+uint64_get
+(
+ const unsigned char * in
+)
+{
+	uint64_t value = 0;
+	for ( int i = 8 ; i-- ; )
+		value = value << 8 | in[i];
+	return value;
+}
@@ -0,0 +1,141 @@
+#ifndef PROTOCOL_H
+#define PROTOCOL_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+
+/* The wire protocol. Version 1 is made up of a client's nickname,
+ * as a length byte (1 to 32) followed by that many bytes, and then of
+ * its messages, each a length byte followed by the text. The server
+ * sends every message out as the sender's nickname followed by the
+ * message, both in the same format.
+ *
+ * A client asks for version 2 by sending protocol_v2_marker where the
+ * nickname length would be, followed by:
+ *
+ *   uint8_t version;        // highest the client speaks, at least 2
+ *   varint capabilities;    // capability_* it would like
+ *   uint8_t nickname_length;
+ *   char nickname[nickname_length];
+ *   uint64_t resume_after;  // only when asking for capability_resume
+ *
+ * to which the server replies with protocol_v2_marker, the version they
+ * are going to speak, the capabilities it agrees to and the largest
+ * frame it accepts, as a varint. From then on, the client sends frames:
+ *
+ *   varint length;          // of what follows, 1 to the largest frame
+ *   one or more messages, each a varint length followed by the text
+ *
+ * and the server sends its own, which start with the nickname:
+ *
+ *   varint length;
+ *   uint8_t nickname_length;
+ *   char nickname[nickname_length];
+ *   one or more messages as above; just one without capability_batch
+ *
+ * Every message broadcast gets a sequence number, one more than the
+ * message before it. With capability_resume, the server's frames have
+ * the sequence number of their first message (uint64_t) in front of the
+ * nickname, and the messages after it follow on from it. A client that
+ * lost its connection may then reconnect with the last sequence number
+ * got every message up to as resume_after (0 for none), and it gets
+ * whatever it missed that the server still has in its backlog, taking
+ * turns with whatever gets broadcast meanwhile, so frames may come out
+ * of sequence until it has caught up. Its reply to the handshake ends
+ * with the sequence number of the first message the client is going to
+ * be sent (uint64_t): the frame it's in may hold messages the client
+ * was sent before, and if it's beyond the one after resume_after, the
+ * client has missed those in between. If it's not beyond resume_after,
+ * the server has started over.
+ *
+ * With capability_notices, the client is told who else is there in
+ * control frames, which start like the others up to the nickname, with
+ * a sequence number of 0 if there is one, and go on with a nickname
+ * length of 0 and then one or more groups of:
+ *
+ *   uint8_t notice;         // notice_*
+ *   varint count;
+ *   count nicknames, each a length byte followed by the nickname
+ *
+ * Clients joining and leaving are gathered over a short window, at the
+ * end of which those who were there already get a single frame of the
+ * notice_join and notice_leave groups, and those who joined in it one
+ * of a notice_present group of everyone there, themselves included.
+ * Nicknames needn't be unique, so they're to be counted rather than
+ * just kept. Someone who leaves in the window they joined in isn't
+ * told of at all.
+ *
+ * When the server shuts down, it sends a control frame of a single
+ * notice_shutdown group, with a count of 0 and no nicknames. Whatever
+ * was waiting to go out to the client still follows it, as far as the
+ * server gets to send it before closing the connection.
+ *
+ * Control frames are sent ahead of any messages still waiting to go
+ * out to the client.
+ *
+ * Clients that can only speak WebSocket, such as browsers, may speak
+ * version 2 over it, on a port of its own, starting with
+ * protocol_v2_marker like everybody else (see websocket.h).
+ *
+ * Varints are unsigned LEB128: 7 bits at a time, least significant
+ * first, the high bit set on all but the last byte, 4 bytes at most.
+ * Fixed-size integers are little-endian.
+ * Messages longer than 255 bytes reach version 1 clients split into
+ * as many messages as it takes. */
+
+#define protocol_v2_marker 0xFF
+#define protocol_version 2
+#define varint_max_size 4
+#define varint_max ((1UL << 28) - 1)
+
+enum Capability {
+	/* The client may be sent frames carrying several messages */
+	capability_batch = 1,
+	/* The client is sent sequence numbers and may resume where it
+	 * left off, which is only agreed to along with capability_batch,
+	 * and by a server that keeps a backlog */
+	capability_resume = 2,
+	/* The client is told of others joining and leaving */
+	capability_notices = 4
+};
+
+#define capabilities_supported (capability_batch | capability_resume | capability_notices)
+
+enum Notice {
+	notice_join = 1,
+	notice_leave = 2,
+	notice_present = 3,
+	notice_shutdown = 4
+};
+
+size_t varint_size
+(
+ uint32_t value
+);
+
+size_t varint_put
+(
+ unsigned char * out,
+ uint32_t value
+);
+
+int varint_get
+(
+ const unsigned char * cur,
+ const unsigned char * end,
+ uint32_t * value
+);
+
+void uint64_put
+(
+ unsigned char * out,
+ uint64_t value
+);
+
+uint64_t uint64_get
+(
+ const unsigned char * in
+);
+
+#endif
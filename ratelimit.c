@@ -0,0 +1,62 @@
+#include "ratelimit.h"
+
+#include <stdint.h>
+
+
+void token_bucket_init
+(
+ TokenBucket * bucket,
+ double rate,
+ uint64_t now
+)
+{
+	bucket->tokens = rate;
+	bucket->rate = rate;
+	bucket->last_refill = now;
+}
+
+void token_bucket_set_rate
+(
+ TokenBucket * bucket,
+ double rate,
+ uint64_t now
+)
+{
+	if ( bucket->rate == 0 )
+	{
+		token_bucket_init(bucket, rate, now);
+		return;
+	}
+	
+	bucket->tokens += (double)(now - bucket->last_refill) * bucket->rate / 1000;
+	bucket->last_refill = now;
+	bucket->rate = rate;
+	if ( bucket->tokens > rate )
+		bucket->tokens = rate;
+}
+
+/* Returns the number of milliseconds the caller should wait before
+ * taking from the bucket again, 0 if it is still within its limit. */
+uint32_t token_bucket_take
+(
+ TokenBucket * bucket,
+ double amount,
+ uint64_t now
+)
+{
+	if ( bucket->rate == 0 )
+		return 0;
+	
+	bucket->tokens += (double)(now - bucket->last_refill) * bucket->rate / 1000;
+	if ( bucket->tokens > bucket->rate )
+		bucket->tokens = bucket->rate;
+	bucket->last_refill = now;
+	
+	bucket->tokens -= amount;
+	if ( bucket->tokens >= 0 )
+		return 0;
+	
+	/* Round up so that the bucket is back to a non-negative
+	 * balance when the caller comes back */
+	return (uint32_t)(-bucket->tokens * 1000 / bucket->rate) + 1;
+}
@@ -0,0 +1,40 @@
+#ifndef RATELIMIT_H
+#define RATELIMIT_H
+
+#include <stdint.h>
+
+
+/* A token bucket refilled continuously at a fixed rate and holding
+ * at most one second's worth of tokens. Takes are allowed to push
+ * the balance below zero; the caller is then told how long to wait
+ * until the debt has been paid back. */
+typedef struct {
+	double tokens;
+	double rate; // tokens per second; 0 means unlimited
+	uint64_t last_refill; // milliseconds
+} TokenBucket;
+
+void token_bucket_init
+(
+ TokenBucket *,
+ double rate,
+ uint64_t now
+);
+
+/* What was taken before is paid back at the old rate; the bucket
+ * starts out full if it was unlimited */
+void token_bucket_set_rate
+(
+ TokenBucket *,
+ double rate,
+ uint64_t now
+);
+
+uint32_t token_bucket_take
+(
+ TokenBucket *,
+ double amount,
+ uint64_t now
+);
+
+#endif
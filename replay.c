@@ -0,0 +1,526 @@
+#include <winsock2.h>
+#include <ws2tcpip.h>
+#include <windows.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "logmsg.h"
+#include "error.h"
+#include "capture.h"
+
+/* Plays back traffic captured by the server (see capture.h) against a
+ * server, either with the recorded timing, sped up, or as fast as
+ * possible, and reports throughput and latency. Latency is measured
+ * from the time a message was due to be sent until its sender gets it
+ * back, as the server broadcasts every message to its sender too.
+ *
+ * To tell its own messages apart, every replayed connection goes by a
+ * nickname of its own (r followed by its connection ID) rather than by
+ * the recorded one. Everything else is sent exactly as recorded. */
+
+
+enum ReadState {
+	reading_nickname_length,
+	reading_nickname,
+	reading_message_length,
+	reading_message
+};
+
+typedef struct {
+	SOCKET socket;
+	char closed;
+	char nickname[16];
+	unsigned char nickname_length;
+	/* Bytes due to be sent that the socket couldn't take yet */
+	char * out;
+	size_t out_size;
+	size_t out_sent;
+	size_t out_capacity;
+	/* When the messages whose echo is still to come were due */
+	uint64_t * pending;
+	size_t pending_first;
+	size_t pending_n;
+	size_t pending_capacity;
+	/* Parsing of incoming frames */
+	enum ReadState state;
+	unsigned left;
+	unsigned char frame_nickname_length;
+	char frame_nickname[255];
+	char own; // whether the frame being read is an echo
+} Connection;
+
+struct replay_options {
+	const char * path;
+	const char * address;
+	u_short port;
+	double speed; // 0 means as fast as possible
+};
+
+static uint64_t
+now_us
+( void )
+{
+	static LARGE_INTEGER frequency;
+	LARGE_INTEGER counter;
+	if ( !frequency.QuadPart )
+		QueryPerformanceFrequency(&frequency);
+	QueryPerformanceCounter(&counter);
+	return (uint64_t)(counter.QuadPart / frequency.QuadPart * 1000000 + counter.QuadPart % frequency.QuadPart * 1000000 / frequency.QuadPart);
+}
+
+static uint64_t
+get_le
+(
+ const unsigned char * in,
+ int size
+)
+{
+	uint64_t value = 0;
+	while ( size-- )
+		value = value << 8 | in[size];
+	return value;
+}
+
+static int
+compare_latencies
+(
+ const void * a,
+ const void * b
+)
+{
+	const uint32_t x = *(const uint32_t *)a, y = *(const uint32_t *)b;
+	return (x > y) - (x < y);
+}
+
+static int
+append
+(
+ void * * array,
+ size_t * capacity,
+ size_t size,
+ size_t element_size,
+ size_t needed
+)
+{
+	if ( size + needed > *capacity )
+	{
+		size_t new_capacity = *capacity ? *capacity * 2 : 64;
+		while ( new_capacity < size + needed )
+			new_capacity *= 2;
+		void * const grown = realloc(*array, new_capacity * element_size);
+		if ( !grown )
+			return 0;
+		*array = grown;
+		*capacity = new_capacity;
+	}
+	return 1;
+}
+
+static SOCKET
+open_connection
+(
+ const struct replay_options * options,
+ Connection * connection,
+ uint32_t connection_id
+)
+{
+	SOCKET s = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+	if ( s != INVALID_SOCKET )
+	{
+		struct sockaddr_in server_address = {
+			.sin_family = AF_INET,
+			.sin_port = htons(options->port)
+		};
+		inet_pton(AF_INET, options->address, &server_address.sin_addr);
+		
+		if ( connect(s, (struct sockaddr *)&server_address, sizeof(server_address)) != SOCKET_ERROR )
+		{
+			char hello[1 + sizeof(connection->nickname)];
+			connection->nickname_length = (unsigned char)snprintf(connection->nickname, sizeof(connection->nickname), "r%"PRIu32, connection_id);
+			hello[0] = (char)connection->nickname_length;
+			memcpy(hello + 1, connection->nickname, connection->nickname_length);
+			
+			setsockopt(s, IPPROTO_TCP, TCP_NODELAY, (const char *)(DWORD[]){1}, sizeof(DWORD));
+			
+			if ( send(s, hello, 1 + connection->nickname_length, 0) == 1 + connection->nickname_length && ioctlsocket(s, FIONBIO, (u_long[]){1}) == 0 )
+				return s;
+		}
+		
+		wsa_perror("couldn't connect to the server");
+		closesocket(s);
+	}
+	else
+		wsa_perror("couldn't create socket");
+	
+	return INVALID_SOCKET;
+}
+
+/* Returns the number of echoes that came in */
+static size_t
+parse_frames
+(
+ Connection * connection,
+ const unsigned char * cur,
+ const unsigned char * const end,
+ uint32_t * * latencies,
+ size_t * latencies_n,
+ size_t * latencies_capacity,
+ uint64_t now
+)
+{
+	size_t frames = 0;
+	while ( cur != end )
+	{
+		switch ( connection->state )
+		{
+			case reading_nickname_length:
+				connection->left = connection->frame_nickname_length = *cur++;
+				connection->state = reading_nickname;
+				break;
+			case reading_message_length:
+				connection->own = connection->frame_nickname_length == connection->nickname_length && memcmp(connection->frame_nickname, connection->nickname, connection->nickname_length) == 0;
+				connection->left = *cur++;
+				connection->state = reading_message;
+				break;
+			case reading_nickname:
+			{
+				const size_t take = (size_t)(end - cur) < connection->left ? (size_t)(end - cur) : connection->left;
+				memcpy(connection->frame_nickname + connection->frame_nickname_length - connection->left, cur, take);
+				cur += take;
+				connection->left -= (unsigned)take;
+				break;
+			}
+			case reading_message:
+			{
+				const size_t skip = (size_t)(end - cur) < connection->left ? (size_t)(end - cur) : connection->left;
+				cur += skip;
+				connection->left -= (unsigned)skip;
+				break;
+			}
+		}
+		
+		if ( !connection->left )
+		{
+			if ( connection->state == reading_nickname )
+				connection->state = reading_message_length;
+			else
+			if ( connection->state == reading_message )
+			{
+				connection->state = reading_nickname_length;
+				++frames;
+				
+				if ( connection->own && connection->pending_n )
+				{
+					if ( append((void * *)latencies, latencies_capacity, *latencies_n, sizeof(**latencies), 1) )
+						(*latencies)[(*latencies_n)++] = (uint32_t)(now - connection->pending[connection->pending_first]);
+					++connection->pending_first;
+					if ( !--connection->pending_n )
+						connection->pending_first = 0;
+				}
+			}
+		}
+	}
+	return frames;
+}
+
+static int
+replay
+(
+ const struct replay_options * options,
+ const unsigned char * capture,
+ size_t capture_size
+)
+{
+	const unsigned char * const records_beg = capture + sizeof(capture_magic) - 1;
+	const unsigned char * const records_end = capture + capture_size;
+	uint32_t min_id = UINT32_MAX, max_id = 0;
+	size_t records_n = 0;
+	
+	/* Check the records and find out the range of connection IDs */
+	for ( const unsigned char * cur = records_beg ; cur != records_end ; ++records_n )
+	{
+		if ( records_end - cur < capture_record_header_size || (uint64_t)(records_end - cur - capture_record_header_size) < get_le(cur + 12, 4) )
+		{
+			logmsg("capture file truncated");
+			return 0;
+		}
+		const uint32_t id = (uint32_t)get_le(cur + 8, 4);
+		if ( id < min_id )
+			min_id = id;
+		if ( id > max_id )
+			max_id = id;
+		cur += capture_record_header_size + get_le(cur + 12, 4);
+	}
+	
+	if ( !records_n )
+	{
+		logmsg("nothing to replay");
+		return 1;
+	}
+	
+	Connection * * const by_id = calloc((size_t)max_id - min_id + 1, sizeof(*by_id));
+	Connection * * opened = NULL;
+	WSAPOLLFD * poll_fds = NULL;
+	size_t opened_n = 0, opened_capacity = 0, poll_fds_capacity = 0;
+	uint32_t * latencies = NULL;
+	size_t latencies_n = 0, latencies_capacity = 0;
+	uint64_t messages_sent = 0, frames_received = 0, lost = 0;
+	static unsigned char buffer[65536];
+	
+	if ( !by_id )
+	{
+		logmsg("couldn't allocate memory for the connections");
+		return 0;
+	}
+	
+	logmsgf("replaying %zu frames over %"PRIu32" connections\n", records_n, max_id - min_id + 1);
+	
+	const uint64_t first_timestamp = get_le(records_beg, 8);
+	const uint64_t start = now_us();
+	uint64_t last_activity = start;
+	const unsigned char * next = records_beg;
+	
+	for ( ; ; )
+	{
+		uint64_t now = now_us();
+		
+		/* Queue whatever is due */
+		for ( ; next != records_end ; next += capture_record_header_size + get_le(next + 12, 4) )
+		{
+			const uint64_t due = start + (options->speed ? (uint64_t)((get_le(next, 8) - first_timestamp) / options->speed) : 0);
+			if ( due > now )
+				break;
+			
+			const uint32_t id = (uint32_t)get_le(next + 8, 4);
+			const uint32_t size = (uint32_t)get_le(next + 12, 4);
+			Connection * connection = by_id[id - min_id];
+			
+			if ( !connection )
+			{
+				/* The first frame of a connection is the one carrying the
+				 * nickname, which gets replaced by one of its own */
+				if ( !size )
+					continue;
+				if ( !(connection = calloc(1, sizeof(*connection)))
+				  || !append((void * *)&opened, &opened_capacity, opened_n, sizeof(*opened), 1)
+				  || !append((void * *)&poll_fds, &poll_fds_capacity, opened_n, sizeof(*poll_fds), 1) )
+				{
+					logmsg("couldn't allocate memory for a connection");
+					free(connection);
+					continue;
+				}
+				by_id[id - min_id] = connection;
+				connection->socket = open_connection(options, connection, id);
+				connection->closed = connection->socket == INVALID_SOCKET;
+				opened[opened_n] = connection;
+				poll_fds[opened_n].fd = connection->socket;
+				poll_fds[opened_n].events = POLLRDNORM;
+				++opened_n;
+			}
+			else
+			if ( connection->closed )
+				continue;
+			else
+			if ( !size )
+			{
+				/* The echoes still to come won't */
+				lost += connection->pending_n;
+				connection->pending_n = 0;
+				closesocket(connection->socket);
+				connection->closed = 1;
+				for ( size_t i = 0 ; i != opened_n ; ++i )
+					if ( opened[i] == connection )
+						poll_fds[i].fd = INVALID_SOCKET;
+			}
+			else
+			if ( append((void * *)&connection->out, &connection->out_capacity, connection->out_size, 1, size)
+			  && append((void * *)&connection->pending, &connection->pending_capacity, connection->pending_first + connection->pending_n, sizeof(*connection->pending), 1) )
+			{
+				memcpy(connection->out + connection->out_size, next + capture_record_header_size, size);
+				connection->out_size += size;
+				/* As fast as possible, everything is due at once, so
+				 * rather measure from when it got queued */
+				connection->pending[connection->pending_first + connection->pending_n++] = options->speed ? due : now;
+				++messages_sent;
+			}
+		}
+		
+		/* Send as much of it as the sockets take */
+		int sending = 0;
+		for ( size_t i = 0 ; i != opened_n ; ++i )
+		{
+			Connection * const connection = opened[i];
+			if ( connection->closed || connection->out_sent == connection->out_size )
+				continue;
+			
+			const int rv = send(connection->socket, connection->out + connection->out_sent, (int)(connection->out_size - connection->out_sent), 0);
+			if ( rv != SOCKET_ERROR )
+			{
+				connection->out_sent += rv;
+				if ( connection->out_sent == connection->out_size )
+					connection->out_sent = connection->out_size = 0;
+			}
+			else
+			if ( WSAGetLastError() != WSAEWOULDBLOCK )
+			{
+				wsa_perror("couldn't send to the server");
+				connection->out_sent = connection->out_size = 0;
+			}
+			sending |= connection->out_size != 0;
+		}
+		
+		const int ready = WSAPoll(poll_fds, (ULONG)opened_n, next != records_end || sending ? 0 : 1);
+		if ( ready > 0 )
+		{
+			now = now_us();
+			for ( size_t i = 0 ; i != opened_n ; ++i )
+			{
+				if ( poll_fds[i].revents & (POLLRDNORM | POLLERR | POLLHUP) )
+				{
+					Connection * const connection = opened[i];
+					const int rv = recv(connection->socket, (char *)buffer, sizeof(buffer), 0);
+					if ( rv > 0 )
+						frames_received += parse_frames(connection, buffer, buffer + rv, &latencies, &latencies_n, &latencies_capacity, now);
+					else
+					if ( rv == 0 || WSAGetLastError() != WSAEWOULDBLOCK )
+					{
+						logmsg("server closed a connection");
+						lost += connection->pending_n;
+						connection->pending_n = 0;
+						connection->closed = 1;
+						poll_fds[i].fd = INVALID_SOCKET;
+					}
+				}
+			}
+			last_activity = now;
+		}
+		else
+		if ( ready == SOCKET_ERROR && opened_n )
+		{
+			wsa_perror("couldn't poll the connections");
+			break;
+		}
+		
+		if ( next == records_end && !sending )
+		{
+			size_t pending = 0;
+			for ( size_t i = 0 ; i != opened_n ; ++i )
+				pending += opened[i]->closed ? 0 : opened[i]->pending_n;
+			
+			if ( !pending )
+				break;
+			if ( now_us() - last_activity > 2000000 )
+			{
+				lost += pending;
+				break;
+			}
+		}
+	}
+	
+	const uint64_t elapsed = now_us() - start;
+	
+	logmsgf("%"PRIu64" messages sent in %.3f s: %.0f messages/s, %.0f deliveries/s\n", messages_sent, elapsed / 1e6, messages_sent * 1e6 / elapsed, frames_received * 1e6 / elapsed);
+	if ( latencies_n )
+	{
+		qsort(latencies, latencies_n, sizeof(*latencies), compare_latencies);
+		logmsgf("latency (us): p50 %"PRIu32", p90 %"PRIu32", p99 %"PRIu32", p99.9 %"PRIu32", max %"PRIu32"\n", latencies[latencies_n / 2], latencies[latencies_n * 9 / 10], latencies[latencies_n * 99 / 100], latencies[latencies_n * 999 / 1000], latencies[latencies_n - 1]);
+	}
+	if ( lost )
+		logmsgf("%"PRIu64" messages never came back to their sender\n", lost);
+	
+	for ( size_t i = 0 ; i != opened_n ; ++i )
+	{
+		if ( !opened[i]->closed )
+			closesocket(opened[i]->socket);
+		free(opened[i]->out);
+		free(opened[i]->pending);
+		free(opened[i]);
+	}
+	free(opened);
+	free(poll_fds);
+	free(latencies);
+	free(by_id);
+	
+	return 1;
+}
+
+int main
+(
+ int argc,
+ char * * argv
+)
+{
+	int rv = 0;
+	char parameter = 0;
+	struct replay_options options = {
+		.address = "127.0.0.1",
+		.port = 3144,
+		.speed = 1
+	};
+	WSADATA wsa_data;
+	
+	logout = stderr;
+	
+	for ( char * * arg_cur = argv, * * const argv_end = argv+argc ; arg_cur != argv_end ; ++arg_cur )
+	{
+		char * const arg = *arg_cur;
+		if ( parameter )
+		{
+			switch ( parameter )
+			{
+				case 'f':
+					options.path = arg;
+					break;
+				case 'a':
+					options.address = arg;
+					break;
+				case 'p':
+					options.port = (u_short)strtol(arg, NULL, 10);
+					break;
+				case 's':
+					options.speed = strtod(arg, NULL);
+					break;
+			}
+			parameter = 0;
+		}
+		else
+		if ( *arg == '-' )
+			parameter = arg[1];
+	}
+	
+	if ( !options.path )
+	{
+		logmsg("usage: lappenchat-replay -f captureFile [-s speed] [-a address] [-p port]");
+		return 1;
+	}
+	
+	FILE * const in = fopen(options.path, "rb");
+	if ( in )
+	{
+		unsigned char * capture = NULL;
+		size_t capture_size = 0, capture_capacity = 0, read;
+		
+		while ( append((void * *)&capture, &capture_capacity, capture_size, 1, 1 << 16) && (read = fread(capture + capture_size, 1, 1 << 16, in)) )
+			capture_size += read;
+		fclose(in);
+		
+		if ( capture_size < sizeof(capture_magic) - 1 || memcmp(capture, capture_magic, sizeof(capture_magic) - 1) )
+			logmsgf("%s isn't a capture file\n", options.path);
+		else
+		if ( WSAStartup(MAKEWORD(2,2), &wsa_data) == 0 )
+		{
+			rv = replay(&options, capture, capture_size);
+			WSACleanup();
+		}
+		else
+			logmsg("couldn't initialize Winsock");
+		
+		free(capture);
+	}
+	else
+		logmsgf("couldn't open %s\n", options.path);
+	
+	return !rv;
+}
@@ -0,0 +1,94 @@
+#include "scaler.h"
+
+#include <stddef.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include "logmsg.h"
+
+
+void
+scaler_init
+(
+ Scaler * scaler,
+ size_t min,
+ size_t max
+)
+{
+	*scaler = (Scaler){0};
+	scaler_set_bounds(scaler, min, max);
+}
+
+void
+scaler_set_bounds
+(
+ Scaler * scaler,
+ size_t min,
+ size_t max
+)
+{
+	scaler->min = min ? min : 1;
+	scaler->max = max < scaler->min ? scaler->min : max;
+}
+
+long
+scaler_sample
+(
+ Scaler * scaler,
+ const ScalerSample * sample
+)
+{
+	const size_t workers = sample->workers;
+	
+	if ( !workers || !sample->interval_ns )
+		return 0;
+	
+	scaler->utilization = (double)sample->busy_ns / ((double)sample->interval_ns * workers);
+	scaler->wait_us = sample->wait_ns / 1000;
+	scaler->depth = (double)sample->completions / sample->interval_ns * sample->wait_ns;
+	
+	/* Whatever happened before the bounds were in force is made up for
+	 * right away */
+	if ( workers < scaler->min || workers > scaler->max )
+		return (long)(workers < scaler->min ? scaler->min : scaler->max) - (long)workers;
+	
+	const int hot = scaler->utilization > scaler_hot_utilization || scaler->wait_us > scaler_hot_wait_us || scaler->depth > workers;
+	const int cold = scaler->utilization < scaler_cold_utilization && scaler->wait_us < scaler_hot_wait_us / 4;
+	scaler->hot = hot ? scaler->hot + 1 : 0;
+	scaler->cold = cold ? scaler->cold + 1 : 0;
+	
+	if ( scaler->cooldown )
+	{
+		--scaler->cooldown;
+		return 0;
+	}
+	
+	long change = 0;
+	if ( scaler->hot >= scaler_hot_samples && workers < scaler->max )
+	{
+		/* Enough of them to bring utilization down to the target,
+		 * at least one more if it's the queue wait that's too long */
+		const double exact = scaler->utilization * workers / scaler_target_utilization;
+		size_t needed = (size_t)exact;
+		if ( needed < exact )
+			++needed;
+		change = needed > workers ? (long)(needed - workers) : 1;
+		if ( workers + (size_t)change > scaler->max )
+			change = (long)(scaler->max - workers);
+		++scaler->grown;
+	}
+	else
+	if ( scaler->cold >= scaler_cold_samples && workers > scaler->min && scaler->utilization * workers / (workers - 1) < scaler_target_utilization )
+	{
+		change = -1;
+		++scaler->shrunk;
+	}
+	
+	if ( change )
+	{
+		loginfof("%s the worker pool from %zu to %zu threads (%.0f%% busy, probe waited %"PRIu64" us, %.1f completions queued)\n", change > 0 ? "growing" : "shrinking", workers, (size_t)((long)workers + change), scaler->utilization * 100, scaler->wait_us, scaler->depth);
+		scaler->hot = 0;
+		scaler->cold = 0;
+		scaler->cooldown = scaler_cooldown_samples;
+	}
+	return change;
+}
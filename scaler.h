@@ -0,0 +1,76 @@
+#ifndef SCALER_H
+#define SCALER_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+
+/* The sizing of an elastic pool of worker threads. Every so often the
+ * pool is sampled: how busy its workers were, how many completions they
+ * handled and how long a probe posted to the queue waited to be picked
+ * up. The scaler grows the pool as soon as it's running hot for a
+ * couple of samples in a row, and shrinks it only once it has been
+ * running cold for a good while, one worker at a time, and when one
+ * less wouldn't leave it hot; after any change it waits for a few
+ * samples before making another one. */
+
+/* How often the pool is to be sampled */
+#define scaler_interval_ms 500
+/* Busy beyond this share of the time, the pool is hot */
+#define scaler_hot_utilization 0.85
+/* Not to be gone over by shrinking */
+#define scaler_target_utilization 0.65
+#define scaler_cold_utilization 0.35
+/* Queue wait beyond which the pool is hot, whatever its utilization */
+#define scaler_hot_wait_us 2000
+#define scaler_hot_samples 2
+#define scaler_cold_samples 20
+#define scaler_cooldown_samples 4
+
+typedef struct {
+	size_t workers; // during the interval
+	uint64_t interval_ns;
+	uint64_t busy_ns; // of all of them together
+	uint64_t completions;
+	uint64_t wait_ns; // of the latest probe
+} ScalerSample;
+
+typedef struct {
+	size_t min;
+	size_t max;
+	unsigned hot; // samples in a row
+	unsigned cold;
+	unsigned cooldown;
+	/* The decisions made so far */
+	unsigned long grown;
+	unsigned long shrunk;
+	/* What the latest sample came to. The queue depth is an estimate,
+	 * by Little's law, of the completions waiting on average. */
+	double utilization;
+	double depth;
+	uint64_t wait_us;
+} Scaler;
+
+void scaler_init
+(
+ Scaler *,
+ size_t min,
+ size_t max
+);
+
+/* Bounds set while the pool runs are made up for with the next sample */
+void scaler_set_bounds
+(
+ Scaler *,
+ size_t min,
+ size_t max
+);
+
+/* Returns how many workers to start, or to retire if negative */
+long scaler_sample
+(
+ Scaler *,
+ const ScalerSample *
+);
+
+#endif
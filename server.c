@@ -3,13 +3,38 @@
 #include <assert.h>
 #include <stdint.h>
 #include <inttypes.h>
+#include <stdlib.h>
+#include <string.h>
 #include <winsock2.h>
 #include <ws2tcpip.h>
 #include "logmsg.h"
 #include "error.h"
+#include "core.h"
+#include "filter.h"
+#include "trace.h"
+#include "capture.h"
+#include "scaler.h"
+#include "stats.h"
+#include "admin.h"
 
-#define SERVER_SOCKETS 2
-#define max_clients 62
+#define SERVER_SOCKETS 4
+/* Clients connected at once by default; each of them takes up about
+ * 3 KiB from the start, whether it's connected or not */
+#define default_max_clients 10000
+/* Completions dequeued at once by a worker thread */
+#define default_dequeue_batch 16
+#define max_dequeue_batch 256
+/* Busy polling for completions goes down to the window over two to the
+ * power of this while it keeps coming up empty */
+#define busy_poll_backoff 6
+/* Of the drain on shutdown: how long clients get by default, how often
+ * it's checked on and reported on, and how long the clients' last
+ * operations then get to complete and the workers to exit */
+#define default_drain_timeout 5000
+#define drain_poll_ms 10
+#define drain_report_ms 500
+#define drain_release_ms 1000
+#define worker_exit_ms 2000
 
 
 static void
@@ -23,59 +48,53 @@ close_socket
 		wsa_perror(error_msg);
 }
 
-enum Phase {
-	phase_getting_nickname_length,
-	phase_getting_nickname,
-	phase_getting_message_length,
-	phase_getting_message
+enum OperationType {
+	operation_recv,
+	operation_send,
+	/* Posted by one of a client's timers once it has fired */
+	operation_timer,
+	/* Posted by the main thread: to time how long completions wait to
+	 * be dequeued, and to have whichever worker gets it exit */
+	operation_probe,
+	operation_retire,
+	/* Posted by a worker fanning a broadcast out, for idle ones
+	 * to help it with (see core_help) */
+	operation_help
 };
 
-/* This structure contains information about
- * a single client. It is thus to be associated
- * to the client handle when it (the client handle)
- * gets attached to the completion port (with
- * CreateIoCompletionPort). */
+/* Every overlapped structure handed to Winsock or posted to the
+ * completion port starts with one of these, so that the worker
+ * threads can tell what it is that completed. */
 typedef struct {
-	char used;
-	SOCKET socket;
-	enum Phase phase;
-	char nickname[32];
-	unsigned char nickname_length;
-} ClientData;
+	/* This member must be the first one - either
+	 * that, or use CONTAINING_RECORD */
+	WSAOVERLAPPED wsa_overlapped;
+	enum OperationType type;
+} Operation;
 
-static size_t
-broadcast_message
-(
- ClientData * cur,
- const char * buffer,
- const int size
-)
-{
-	size_t clients_sent = 0;
-	for ( ClientData * const end = cur + max_clients ; cur != end ; ++cur )
-	{
-		if ( cur->used )
-		{
-			int rv;
-			size_t sent = 0;
-send_more:
-			if ( (rv = send(cur->socket, buffer, size, 0)) != SOCKET_ERROR )
-			{
-				sent += rv;
-				if ( sent == size )
-					++clients_sent;
-				else
-				{
-					assert(sent < size);
-					goto send_more;
-				}
-			}
-			else
-				wsa_perror("couldn't send message to client");
-		}
-	}
-	return clients_sent;
-}
+typedef struct {
+	Operation operation;
+	ClientData * client_data;
+	HANDLE completion_port;
+	HANDLE timer;
+} TimerOperation;
+
+/* What the completion port side keeps of a client, next to the
+ * core's ClientData, which is the key the client's socket gets
+ * attached to the completion port with (CreateIoCompletionPort) */
+typedef struct {
+	Operation recv_operation;
+	Operation send_operation;
+	TimerOperation timers[core_timers];
+	WSABUF buffers[max_frames_per_send];
+	/* Whether the socket's send buffer is 0 for zero-copy sends, and
+	 * its size otherwise, 0 until that was needed */
+	char zero_copy;
+	/* Set once the switch failed, for the socket to be left as it is
+	 * rather than have every send try again */
+	char zero_copy_failed;
+	int send_buffer;
+} Connection;
 
 static SOCKET
 get_ipv4_socket
@@ -147,293 +166,858 @@ get_ipv6_socket
 	return ss_ipv6;
 }
 
-/* An object of this structure is passed to
- * send and receive routines and got back with
- * GetQueuedCompletionPortStatus. It contains
- * information pertaining to an I/O operation. */
+struct SharedStructures;
+
+/* A worker thread's slot. Its counters are in its block of the stats
+ * segment, which is its own to write, for the main thread to sample
+ * when the pool is elastic. */
 typedef struct {
-	/* This member must be the first one - either
-	 * that, or use CONTAINING_RECORD */
-	WSAOVERLAPPED wsa_overlapped;
-	unsigned char message_length;
-	unsigned char received;
-	char buffer[290];
-} OperationData;
+	StatsWorker * stats;
+	volatile LONG retired; // it's done with everything but returning
+	HANDLE handle; // NULL if the slot is free
+	/* The main thread's */
+	uint64_t sampled_busy_ns;
+	uint64_t sampled_completions;
+	struct SharedStructures * shared;
+} Worker;
 
 /* An object of this type shall be shared
  * by the main thread and the worker threads. */
-typedef struct {
+typedef struct SharedStructures {
 	HANDLE completion_port;
-	HANDLE client_pool_mutex;
-	ClientData clients[max_clients];
+	/* Client timers live in their own queue so that they can all
+	 * be waited for at once on shutdown */
+	HANDLE timer_queue;
+	Core core;
+	StatsSegment * stats;
+	ULONG dequeue_batch;
+	/* How long workers poll for completions before waiting for them,
+	 * 0 if they never do */
+	uint64_t busy_poll_ns;
+	/* Sends of at least this many bytes go out of the frames
+	 * themselves, 0 if they're always copied */
+	size_t zero_copy_threshold;
+	Worker * workers;
+	size_t workers_max;
+	/* Those asked to retire that haven't yet */
+	size_t retiring;
+	Operation probe;
+	Operation retire;
+	Operation help;
+	volatile LONG help_pending; // posted and not yet dequeued
+	uint64_t probe_posted;
+	volatile uint64_t probe_wait;
+	volatile LONG probe_pending;
 } SharedStructures;
 
+/* The transport the core is driven by: overlapped Winsock I/O whose
+ * completions, and the firing of the timers, get dequeued from the
+ * completion port by the worker threads */
+
+static int
+transport_recv
+(
+ void * context,
+ ClientData * client_data,
+ void * buffer,
+ size_t size
+)
+{
+	Connection * const connection = (Connection *)client_data->transport_data;
+	DWORD flags = 0;
+	WSABUF buffer_info = {
+		.buf = buffer,
+		.len = (ULONG)size
+	};
+	
+	memset(&(connection->recv_operation.wsa_overlapped), 0, sizeof(connection->recv_operation.wsa_overlapped));
+	if ( WSARecv((SOCKET)client_data->handle, &buffer_info, 1, NULL, &flags, &(connection->recv_operation.wsa_overlapped), NULL) == SOCKET_ERROR )
+	{
+		int error_code = WSAGetLastError();
+		if ( error_code != WSA_IO_PENDING )
+		{
+			win_perror("couldn't queue next recv", error_code);
+			return 0;
+		}
+	}
+	
+	return 1;
+}
+
+/* With no send buffer, Winsock sends overlapped sends straight out of
+ * the buffers they were given, which stay locked until they complete,
+ * rather than copying them into the socket's send buffer first. The
+ * frames are held on to by the core until then anyway, however many
+ * clients they go out to. Not to be called with a send in flight. */
+static void
+set_zero_copy
+(
+ ClientData * client_data,
+ Connection * connection,
+ char zero_copy
+)
+{
+	const SOCKET client_socket = (SOCKET)client_data->handle;
+	int length = sizeof(connection->send_buffer);
+	
+	if ( !connection->send_buffer && getsockopt(client_socket, SOL_SOCKET, SO_SNDBUF, (char *)&(connection->send_buffer), &length) == SOCKET_ERROR )
+	{
+		wsa_perror("couldn't get the size of client socket's send buffer");
+		connection->send_buffer = 0;
+		connection->zero_copy_failed = 1;
+		return;
+	}
+	if ( setsockopt(client_socket, SOL_SOCKET, SO_SNDBUF, (const char *)(zero_copy ? &(int){0} : &(connection->send_buffer)), sizeof(int)) == SOCKET_ERROR )
+	{
+		wsa_perror("couldn't resize client socket's send buffer");
+		connection->zero_copy_failed = 1;
+		return;
+	}
+	connection->zero_copy = zero_copy;
+}
+
+static int
+transport_send
+(
+ void * context,
+ ClientData * client_data,
+ const TransportBuffer * buffers,
+ size_t buffers_n
+)
+{
+	const SharedStructures * const shared = (const SharedStructures *)context;
+	Connection * const connection = (Connection *)client_data->transport_data;
+	size_t size = 0;
+	
+	for ( size_t i = 0 ; i != buffers_n ; ++i )
+	{
+		connection->buffers[i].buf = buffers[i].buf;
+		connection->buffers[i].len = (ULONG)buffers[i].len;
+		size += buffers[i].len;
+	}
+	
+	/* The socket only gets switched over when the size of the
+	 * sends to it crosses the threshold */
+	if ( shared->zero_copy_threshold && !connection->zero_copy_failed && (size >= shared->zero_copy_threshold) != connection->zero_copy )
+		set_zero_copy(client_data, connection, size >= shared->zero_copy_threshold);
+	
+	memset(&(connection->send_operation.wsa_overlapped), 0, sizeof(connection->send_operation.wsa_overlapped));
+	if ( WSASend((SOCKET)client_data->handle, connection->buffers, (DWORD)buffers_n, NULL, 0, &(connection->send_operation.wsa_overlapped), NULL) == SOCKET_ERROR )
+	{
+		int error_code = WSAGetLastError();
+		if ( error_code != WSA_IO_PENDING )
+		{
+			win_perror("couldn't send message to client", error_code);
+			return 0;
+		}
+	}
+	
+	return 1;
+}
+
+static void
+transport_close
+(
+ void * context,
+ ClientData * client_data
+)
+{
+	close_socket((SOCKET)client_data->handle, "couldn't close client socket");
+}
+
+/* Runs on a thread of the timer queue. Whatever is to happen next is
+ * done by whichever worker thread gets this posted packet.
+ * 
+ * The timer itself is disposed of by the worker threads, either when
+ * setting up the next one or when the client is released. */
+static VOID CALLBACK
+timer_fired
+(
+ PVOID data,
+ BOOLEAN timer_fired
+)
+{
+	TimerOperation * const timer_operation = (TimerOperation *)data;
+	
+	if ( !PostQueuedCompletionStatus(timer_operation->completion_port, 0, (ULONG_PTR)timer_operation->client_data, &(timer_operation->operation.wsa_overlapped)) )
+		winapi_perror("couldn't post the firing of a client's timer");
+}
+
+static int
+transport_set_timer
+(
+ void * context,
+ ClientData * client_data,
+ enum CoreTimer timer,
+ uint32_t ms
+)
+{
+	SharedStructures * const shared = (SharedStructures *)context;
+	TimerOperation * const timer_operation = ((Connection *)client_data->transport_data)->timers + timer;
+	
+	/* The previous timer, if any, has fired already,
+	 * so this won't block */
+	if ( timer_operation->timer )
+		DeleteTimerQueueTimer(shared->timer_queue, timer_operation->timer, NULL);
+	
+	if ( CreateTimerQueueTimer(&(timer_operation->timer), shared->timer_queue, timer_fired, timer_operation, ms, 0, WT_EXECUTEONLYONCE) )
+		return 1;
+	
+	winapi_perror("couldn't set up client timer");
+	timer_operation->timer = NULL;
+	return 0;
+}
+
+static void
+transport_release
+(
+ void * context,
+ ClientData * client_data
+)
+{
+	SharedStructures * const shared = (SharedStructures *)context;
+	Connection * const connection = (Connection *)client_data->transport_data;
+	
+	/* Each of its timers held a reference from when it was set until
+	 * it fired, so they all have by now, and none of this blocks */
+	for ( TimerOperation * cur = connection->timers, * const end = cur + core_timers ; cur != end ; ++cur )
+		if ( cur->timer )
+			DeleteTimerQueueTimer(shared->timer_queue, cur->timer, NULL);
+	
+	free(connection);
+	client_data->transport_data = NULL;
+}
+
+static uint64_t
+transport_now
+(
+ void * context
+)
+{
+	return GetTickCount64();
+}
+
+/* There's no telling which workers are idle, but those that are pick
+ * the packets up first; no more get posted than there are workers
+ * besides the one asking, counting those still waiting */
+static void
+transport_request_help
+(
+ void * context,
+ size_t helpers
+)
+{
+	SharedStructures * const shared = (SharedStructures *)context;
+	
+	for ( ; helpers && (size_t)shared->help_pending < shared->workers_max - 1 ; --helpers )
+	{
+		InterlockedIncrement(&shared->help_pending);
+		if ( !PostQueuedCompletionStatus(shared->completion_port, 0, 0, &(shared->help.wsa_overlapped)) )
+		{
+			InterlockedDecrement(&shared->help_pending);
+			winapi_perror("couldn't post a request for help to the completion port");
+			break;
+		}
+	}
+}
+
+/* The policy of the given name, -1 if there's none of that name; none
+ * at all means it's off, which lets everything through as it is */
+static int
+text_policy
+(
+ const char * name
+)
+{
+	if ( !name || !strcmp(name, "off") )
+		return text_unchecked;
+	if ( !strcmp(name, "strip") )
+		return text_strip;
+	if ( !strcmp(name, "reject") )
+		return text_reject;
+	return -1;
+}
+
+/* When the filter list was last written to, which tells its changes
+ * from those of the other files in its directory */
+static int
+filter_list_written
+(
+ const char * path,
+ FILETIME * written
+)
+{
+	WIN32_FILE_ATTRIBUTE_DATA attributes;
+	if ( !GetFileAttributesExA(path, GetFileExInfoStandard, &attributes) )
+		return 0;
+	*written = attributes.ftLastWriteTime;
+	return 1;
+}
+
+/* Returns a change notification for the directory of the filter
+ * list, which is as close as it gets to watching the file itself */
+static HANDLE
+watch_filter_list
+(
+ const char * path
+)
+{
+	char directory[MAX_PATH] = ".";
+	size_t length = 0;
+	
+	for ( const char * cur = path ; *cur ; ++cur )
+		if ( *cur == '\\' || *cur == '/' )
+			length = (size_t)(cur - path) + 1;
+	if ( length )
+	{
+		if ( length >= sizeof(directory) )
+		{
+			logmsg("the filter list's path is too long for it to be watched");
+			return INVALID_HANDLE_VALUE;
+		}
+		memcpy(directory, path, length);
+		directory[length] = '\0';
+	}
+	
+	/* Editors that save by renaming don't change the last
+	 * write time of anything that's still there */
+	const HANDLE watch = FindFirstChangeNotificationA(directory, FALSE, FILE_NOTIFY_CHANGE_LAST_WRITE | FILE_NOTIFY_CHANGE_FILE_NAME);
+	if ( watch == INVALID_HANDLE_VALUE )
+		winapi_perror("couldn't watch the filter list for changes");
+	return watch;
+}
+
+static void
+use_filter
+(
+ Core * core,
+ Filter * filter,
+ const char * path
+)
+{
+	core_replace_filter(core, filter);
+	logmsgf("filtering messages for the %zu terms of %s (%zu KiB)\n", filter_terms(filter), path, filter_size(filter) >> 10);
+}
+
+/* As GetQueuedCompletionStatusEx, polling the port for as long as the
+ * worker's window says before waiting for the completions. The window
+ * halves every time polling comes up empty, down to a floor, and doubles
+ * back up to what it's set to every time it pays off, or would have if it
+ * had been that long, so that idle workers mostly sleep and busy ones
+ * mostly poll. The polling doesn't count as being busy, so it doesn't
+ * make the elastic pool grow. */
+static BOOL
+dequeue_completions
+(
+ SharedStructures * shared,
+ OVERLAPPED_ENTRY * entries,
+ ULONG * dequeued,
+ uint64_t * window_ns
+)
+{
+	if ( *window_ns )
+	{
+		const uint64_t polling_since = platform_now_ns();
+		do
+		{
+			if ( GetQueuedCompletionStatusEx(shared->completion_port, entries, shared->dequeue_batch, dequeued, 0, FALSE) )
+			{
+				if ( *window_ns < shared->busy_poll_ns )
+					*window_ns <<= 1;
+				return TRUE;
+			}
+			if ( GetLastError() != WAIT_TIMEOUT )
+				return FALSE;
+			YieldProcessor();
+		}
+		while ( platform_now_ns() - polling_since < *window_ns );
+		
+		if ( *window_ns > shared->busy_poll_ns >> busy_poll_backoff )
+			*window_ns >>= 1;
+	}
+	
+	if ( !shared->busy_poll_ns )
+		return GetQueuedCompletionStatusEx(shared->completion_port, entries, shared->dequeue_batch, dequeued, INFINITE, FALSE);
+	
+	const uint64_t waiting_since = platform_now_ns();
+	const BOOL rv = GetQueuedCompletionStatusEx(shared->completion_port, entries, shared->dequeue_batch, dequeued, INFINITE, FALSE);
+	if ( rv && *window_ns < shared->busy_poll_ns && platform_now_ns() - waiting_since < shared->busy_poll_ns )
+		*window_ns <<= 1;
+	return rv;
+}
+
 DWORD WINAPI
 worker_thread
 (
  LPVOID data
 )
 {
-	SharedStructures * shared = (SharedStructures *)data;
+	Worker * const worker = (Worker *)data;
+	SharedStructures * shared = worker->shared;
+	Core * const core = &(shared->core);
 	DWORD thread_id = GetCurrentThreadId();
-	DWORD flags = 0;
+	OVERLAPPED_ENTRY entries[max_dequeue_batch];
+	CoreBatch batch;
+	const int batching = shared->dequeue_batch > 1 && core_batch_init(core, &batch);
+	int retiring = 0;
+	uint64_t busy_poll_window = shared->busy_poll_ns;
 	
 	logmsgf("worker thread #%"PRIuLEAST32": ready\n", thread_id);
 	
-	for ( ; ; )
+	/* The completions get dequeued up to dequeue_batch at a time, and
+	 * the sends to clients that were idle until then started after all
+	 * of them have been handled */
+	while ( !retiring )
 	{
-		DWORD size;
-		ClientData * client_data;
-		OperationData * operation_data;
-		if ( GetQueuedCompletionStatus(shared->completion_port, &size, (PULONG_PTR)&client_data, (LPOVERLAPPED *)&operation_data, INFINITE) )
+		ULONG dequeued;
+		if ( !dequeue_completions(shared, entries, &dequeued, &busy_poll_window) )
 		{
-			logmsgf("worker thread #%"PRIuLEAST32": completion notification dequeued successfully\n", thread_id);
-			if ( size )
+			DWORD error_code = GetLastError();
+			switch ( error_code )
 			{
-				switch ( client_data->phase )
-				{
-					case phase_getting_nickname_length:
-					{
-						assert(size == 1);
-						
-						logmsgf("new client's nickname length: %zu\n", client_data->nickname_length);
-						
-						client_data->phase = phase_getting_nickname;
-						
-						operation_data->received = 0;
-						
-						/* Queue another recv to get the part of the nickname
-						 * that we are still missing */
-						WSABUF buffer_info = {
-							.buf = client_data->nickname,
-							.len = client_data->nickname_length
-						};
-						if ( WSARecv(client_data->socket, &buffer_info, 1, NULL, &flags, &(operation_data->wsa_overlapped), NULL) == SOCKET_ERROR )
-						{
-							int error_code = WSAGetLastError();
-							if ( error_code != WSA_IO_PENDING )
-							{
-								win_perror("couldn't queue next recv", error_code);
-								/* FIXME: disconnect client. We couldn't queue another
-								 * recv operation, so it's not like we'll be getting
-								 * any further message from this client. */
-							}
-						}
-						
-						break;
-					}
-					
-					case phase_getting_nickname:
+				case ERROR_ABANDONED_WAIT_0:
+					logmsgf("worker thread #%"PRIuLEAST32": received request to shut down\n", thread_id);
+					stats_write_begin(&worker->stats->sequence);
+					worker->stats->running = 0;
+					stats_write_end(&worker->stats->sequence);
+					if ( batching )
+						core_batch_cleanup(&batch);
+					return EXIT_SUCCESS;
+				default:
+					win_perror("couldn't retrieve completion packets from the completion port queue", error_code);
+			}
+			continue;
+		}
+		const uint64_t busy_since = platform_now_ns();
+		
+		if ( batching )
+			core_batch_begin(core, &batch);
+		for ( ULONG i = 0 ; i != dequeued ; ++i )
+		{
+			ClientData * const client_data = (ClientData *)entries[i].lpCompletionKey;
+			Operation * const operation = (Operation *)entries[i].lpOverlapped;
+			DWORD size = entries[i].dwNumberOfBytesTransferred;
+			DWORD flags;
+			
+			switch ( operation->type )
+			{
+				case operation_probe:
+					shared->probe_wait = busy_since - shared->probe_posted;
+					shared->probe_pending = 0;
+					continue;
+				case operation_retire:
+					/* Once it's done with the rest of the batch */
+					retiring = 1;
+					continue;
+				case operation_help:
+					InterlockedDecrement(&shared->help_pending);
+					core_help(core);
+					break;
+				case operation_recv:
+				case operation_send:
+					/* The status of each is in its overlapped structure */
+					if ( !WSAGetOverlappedResult((SOCKET)client_data->handle, &operation->wsa_overlapped, &size, FALSE, &flags) )
 					{
-						operation_data->received += (char)size;
-						
-						logmsgf("received %zu additional bytes of nickname, until now: %.*s\n", operation_data->received, operation_data->received, client_data->nickname);
+						const int error_code = WSAGetLastError();
+						if ( error_code != WSAECONNRESET && error_code != WSAECONNABORTED && error_code != WSA_OPERATION_ABORTED )
+							win_perror("operation on client socket failed", error_code);
 						
-						if ( operation_data->received == client_data->nickname_length )
-						{
-							logmsgf("new client connected: %.*s\n", client_data->nickname_length, client_data->nickname);
-							
-							client_data->phase = phase_getting_message_length;
-							
-							/* Queue a recv for the client's first message */
-							WSABUF buffer_info = {
-								.buf = &(operation_data->message_length),
-								.len = 1
-							};
-							if ( WSARecv(client_data->socket, &buffer_info, 1, NULL, &flags, &(operation_data->wsa_overlapped), NULL) == SOCKET_ERROR )
-							{
-								int error_code = WSAGetLastError();
-								if ( error_code != WSA_IO_PENDING )
-								{
-									win_perror("couldn't queue next recv", error_code);
-									/* FIXME: disconnect client. We couldn't queue another
-									 * recv operation, so it's not like we'll be getting
-									 * any further message from this client. */
-								}
-							}
-						}
+						if ( operation->type == operation_send )
+							core_send_failed(core, client_data);
 						else
-						{
-							assert(operation_data->received < client_data->nickname_length);
-							
-							/* Queue another recv to get the part of the nickname
-							 * that we are still missing */
-							WSABUF buffer_info = {
-								.buf = client_data->nickname + operation_data->received,
-								.len = client_data->nickname_length - operation_data->received
-							};
-							int error_code = WSARecv(client_data->socket, &buffer_info, 1, NULL, &flags, &(operation_data->wsa_overlapped), NULL);
-							assert(error_code == SOCKET_ERROR);
-							error_code = WSAGetLastError();
-							if ( error_code != WSA_IO_PENDING )
-							{
-								win_perror("couldn't queue next recv", error_code);
-								/* FIXME: disconnect client. We couldn't queue another
-								 * recv operation, so it's not like we'll be getting
-								 * any further message from this client. */
-							}
-						}
-						
+							core_recv_failed(core, client_data);
 						break;
 					}
-					
-					case phase_getting_message_length:
-					{
-						logmsgf("worker thread #%"PRIuLEAST32": %.*s reports having sent a message %i bytes long\n", thread_id, client_data->nickname_length, client_data->nickname, operation_data->message_length);
-						
-						/* Reset received for the next (first) message */
-						operation_data->received = 0;
-						
-						client_data->phase = phase_getting_message;
-						
-						WSABUF buffer_info = {
-							.buf = operation_data->buffer + sizeof(client_data->nickname) + 2,
-							.len = operation_data->message_length
-						};
-						if ( WSARecv(client_data->socket, &buffer_info, 1, NULL, &flags, &(operation_data->wsa_overlapped), NULL) == SOCKET_ERROR )
-						{
-							int error_code = WSAGetLastError();
-							if ( error_code != WSA_IO_PENDING )
-							{
-								win_perror("couldn't queue next recv", error_code);
-								/* FIXME: disconnect client. We couldn't queue another
-								 * recv operation, so it's not like we'll be getting
-								 * any further message from this client. */
-							}
-						}
-						
-						break;
-					}
-					
-					case phase_getting_message:
+					logdebugf("worker thread #%"PRIuLEAST32": completion notification dequeued successfully\n", thread_id);
+					if ( operation->type == operation_recv )
+						core_recv_completed(core, client_data, size);
+					else
+						core_send_completed(core, client_data, size);
+					break;
+				case operation_timer:
+				{
+					const Connection * const connection = (const Connection *)client_data->transport_data;
+					core_timer_fired(core, client_data, (enum CoreTimer)((TimerOperation *)operation - connection->timers));
+					break;
+				}
+				default:
+					break;
+			}
+			++stats_local.completions;
+		}
+		if ( batching )
+			core_batch_end(core, &batch);
+		
+		stats_local.busy_ns += platform_now_ns() - busy_since;
+		++stats_local.dequeues;
+		stats_publish_worker(worker->stats);
+	}
+	
+	logmsgf("worker thread #%"PRIuLEAST32": retiring\n", thread_id);
+	stats_write_begin(&worker->stats->sequence);
+	worker->stats->running = 0;
+	stats_write_end(&worker->stats->sequence);
+	if ( batching )
+		core_batch_cleanup(&batch);
+	worker->retired = 1;
+	return EXIT_SUCCESS;
+}
+
+static int
+start_worker
+(
+ SharedStructures * shared
+)
+{
+	for ( Worker * cur = shared->workers, * const end = cur + shared->workers_max ; cur != end ; ++cur )
+	{
+		if ( cur->handle )
+			continue;
+		
+		/* A new thread's own counters start out at 0 */
+		cur->stats = shared->stats->workers + (cur - shared->workers);
+		stats_write_begin(&cur->stats->sequence);
+		cur->stats->counters = (StatsCounters){0};
+		cur->stats->running = 1;
+		stats_write_end(&cur->stats->sequence);
+		cur->sampled_busy_ns = 0;
+		cur->sampled_completions = 0;
+		cur->retired = 0;
+		cur->shared = shared;
+		if ( cur->handle = CreateThread(NULL, 0, worker_thread, cur, 0, NULL) )
+			return 1;
+		winapi_perror("couldn't create worker thread");
+		return 0;
+	}
+	return 0;
+}
+
+/* Has the workers' counters sampled for the scaler and the pool grown
+ * or shrunk as it says. Workers that have retired meanwhile are seen to
+ * the end and their slots freed. */
+static void
+sample_workers
+(
+ SharedStructures * shared,
+ Scaler * scaler,
+ uint64_t interval_ns
+)
+{
+	ScalerSample sample = {.interval_ns = interval_ns};
+	size_t running = 0;
+	
+	for ( Worker * cur = shared->workers, * const end = cur + shared->workers_max ; cur != end ; ++cur )
+	{
+		if ( !cur->handle )
+			continue;
+		
+		StatsCounters counters;
+		if ( stats_read(&(cur->stats->sequence), &(cur->stats->counters), &counters, sizeof(counters)) )
+		{
+			sample.busy_ns += counters.busy_ns - cur->sampled_busy_ns;
+			sample.completions += counters.completions - cur->sampled_completions;
+			cur->sampled_busy_ns = counters.busy_ns;
+			cur->sampled_completions = counters.completions;
+		}
+		
+		if ( cur->retired )
+		{
+			WaitForSingleObject(cur->handle, INFINITE);
+			CloseHandle(cur->handle);
+			cur->handle = NULL;
+			--shared->retiring;
+		}
+		else
+			++running;
+	}
+	
+	/* A probe that's still waiting has been for at least this long */
+	const uint64_t now = platform_now_ns();
+	sample.wait_ns = shared->probe_pending ? now - shared->probe_posted : shared->probe_wait;
+	sample.workers = running - shared->retiring;
+	if ( !shared->probe_pending )
+	{
+		shared->probe_posted = now;
+		shared->probe_pending = 1;
+		if ( !PostQueuedCompletionStatus(shared->completion_port, 0, 0, &(shared->probe.wsa_overlapped)) )
+		{
+			winapi_perror("couldn't post a probe to the completion port");
+			shared->probe_pending = 0;
+		}
+	}
+	
+	long change = scaler_sample(scaler, &sample);
+	for ( ; change > 0 && start_worker(shared) ; --change )
+		;
+	for ( ; change < 0 ; ++change )
+	{
+		if ( PostQueuedCompletionStatus(shared->completion_port, 0, 0, &(shared->retire.wsa_overlapped)) )
+			++shared->retiring;
+		else
+			winapi_perror("couldn't post the retirement of a worker to the completion port");
+	}
+}
+
+/* Those running that haven't been asked to retire */
+static size_t
+running_workers
+(
+ const SharedStructures * shared
+)
+{
+	size_t running = 0;
+	for ( const Worker * cur = shared->workers, * const end = cur + shared->workers_max ; cur != end ; ++cur )
+		if ( cur->handle && !cur->retired )
+			++running;
+	return running - shared->retiring;
+}
+
+/* Publishes what isn't the workers' own to. Most of it is protected by
+ * the client pool lock, which isn't taken for it: the figures may be a
+ * little off, but the workers are never held up. */
+static void
+publish_stats
+(
+ SharedStructures * shared,
+ const Scaler * scaler, // NULL if the pool isn't elastic
+ size_t workers_min,
+ size_t workers_max,
+ ULONGLONG started
+)
+{
+	const Core * const core = &(shared->core);
+	StatsServer server = {
+		.uptime_ms = GetTickCount64() - started,
+		.capacity = (uint32_t)core->capacity,
+		.clients = (uint32_t)(core->capacity - core->free_slots_n),
+		.workers_min = (uint32_t)workers_min,
+		.workers_max = (uint32_t)workers_max,
+		.probe_wait_us = shared->probe_wait / 1000,
+		.messages_broadcast = core->messages,
+		.messages_delivered = core->messages_delivered,
+		.sends = core->sends,
+		.dropped_queue_full = core->messages_dropped,
+		.dropped_text = (uint64_t)core->messages_rejected,
+		.dropped_filter = (uint64_t)core->messages_filtered,
+		.masked = (uint64_t)core->messages_masked,
+		.flagged = (uint64_t)core->messages_flagged,
+		.pool_grown = scaler ? scaler->grown : 0,
+		.pool_shrunk = scaler ? scaler->shrunk : 0,
+		.memory_used = (uint64_t)core_memory_used(core),
+		.memory_peak = (uint64_t)core->memory_peak,
+		.memory_budget = core->memory_budget,
+		.clients_refused = core->clients_refused,
+		.clients_shed = core->clients_shed,
+		.frames_shed = core->frames_shed
+	};
+	memcpy(server.lane_waits, core->lane_waits, sizeof(server.lane_waits));
+	
+	for ( size_t i = 0 ; i != core->capacity ; ++i )
+	{
+		if ( !core->clients[i].used )
+			continue;
+		const uint32_t queued = core->queues[i].n;
+		server.queued += queued;
+		if ( queued > server.queued_most )
+			server.queued_most = queued;
+	}
+	server.workers = (uint32_t)running_workers(shared);
+	
+	stats_write_begin(&(shared->stats->sequence));
+	shared->stats->server = server;
+	stats_write_end(&(shared->stats->sequence));
+}
+
+static void
+reply_threads
+(
+ const SharedStructures * shared,
+ AdminChannel * admin,
+ const Scaler * scaler // NULL if the pool isn't elastic
+)
+{
+	const size_t running = running_workers(shared);
+	admin_reply(admin, "threads %zu, %zu to %zu", running + 1, (scaler ? scaler->min : running) + 1, (scaler ? scaler->max : running) + 1);
+}
+
+/* Carries out a command from the admin channel. The settings of the
+ * core's are taken up by the workers as they go, and the pool is the
+ * main thread's anyway, so nothing holds the workers up but kicking a
+ * client, which takes the client pool lock once. Thread counts are in
+ * the terms of the options, the main thread included, and the pool
+ * can't get larger than it was started to be at most. */
+static void
+run_admin_command
+(
+ SharedStructures * shared,
+ AdminChannel * admin,
+ const AdminCommand * command,
+ Scaler * scaler,
+ int * elastic,
+ uint64_t * next_sample
+)
+{
+	Core * const core = &(shared->core);
+	
+	switch ( command->verb )
+	{
+		case admin_status:
+			admin_reply(admin, "clients %zu of %zu, memory %"PRId64" KiB, at most %"PRId64" KiB", core->capacity - core->free_slots_n, core->capacity, core_memory_used(core) >> 10, core->memory_peak >> 10);
+			reply_threads(shared, admin, *elastic ? scaler : NULL);
+			admin_reply(admin, "rate limit %.0f messages/s, %.0f bytes/s per client (0 = unlimited)", core->rate_messages, core->rate_bytes);
+			admin_reply(admin, "memory budget %zu KiB per client, %zu MiB in all (0 = unlimited)", core->connection_budget >> 10, core->memory_budget >> 20);
+			break;
+		case admin_rate:
+			if ( command->arguments_n == 1 )
+			{
+				admin_reply(admin, "error: both rates are to be given");
+				return;
+			}
+			if ( command->arguments_n )
+				core_set_rate_limits(core, (double)command->arguments[0], (double)command->arguments[1]);
+			admin_reply(admin, "rate limit %.0f messages/s, %.0f bytes/s per client (0 = unlimited)", core->rate_messages, core->rate_bytes);
+			break;
+		case admin_budget:
+			if ( command->arguments_n == 1 )
+			{
+				admin_reply(admin, "error: both budgets are to be given");
+				return;
+			}
+			if ( command->arguments_n )
+				core_set_budgets(core, (size_t)command->arguments[0] << 10, (size_t)command->arguments[1] << 20);
+			admin_reply(admin, "memory budget %zu KiB per client, %zu MiB in all (0 = unlimited)", core->connection_budget >> 10, core->memory_budget >> 20);
+			break;
+		case admin_threads:
+			if ( command->arguments_n )
+			{
+				const size_t min = command->arguments[0];
+				const size_t max = command->arguments_n == 2 ? command->arguments[1] : min;
+				if ( min < 2 || max < min || max > shared->workers_max + 1 )
+				{
+					admin_reply(admin, "error: the pool takes 2 to %zu threads", shared->workers_max + 1);
+					return;
+				}
+				/* The scaler gets the pool within the bounds with its
+				 * next sample, and keeps it there */
+				if ( *elastic )
+					scaler_set_bounds(scaler, min - 1, max - 1);
+				else
+				{
+					/* Its samples start from now */
+					for ( Worker * cur = shared->workers, * const end = cur + shared->workers_max ; cur != end ; ++cur )
 					{
-						operation_data->received += size;
-						
-						if ( operation_data->received == operation_data->message_length )
+						StatsCounters counters;
+						if ( cur->handle && stats_read(&(cur->stats->sequence), &(cur->stats->counters), &counters, sizeof(counters)) )
 						{
-							logmsgf("worker thread #%"PRIuLEAST32": got complete message from %.*s (%u bytes long): %.*s\n", thread_id, client_data->nickname_length, client_data->nickname, operation_data->message_length, operation_data->message_length, operation_data->buffer+1+sizeof(client_data->nickname)+1);
-							
-							*(operation_data->buffer + sizeof(client_data->nickname) - client_data->nickname_length) = client_data->nickname_length;
-							memcpy(operation_data->buffer + sizeof(client_data->nickname) - client_data->nickname_length + 1, client_data->nickname, client_data->nickname_length);
-							*(operation_data->buffer + sizeof(client_data->nickname) + 1) = operation_data->message_length;
-							
-							if ( WaitForSingleObject(shared->client_pool_mutex, INFINITE) == WAIT_OBJECT_0 )
-							{
-								size_t clients_sent = broadcast_message(shared->clients, operation_data->buffer + sizeof(client_data->nickname) - client_data->nickname_length, 1 + client_data->nickname_length + 1 + operation_data->message_length);
-								
-								ReleaseMutex(shared->client_pool_mutex);
-								
-								if ( clients_sent )
-									logmsgf("worker thread #%"PRIuLEAST32": message sent to %zu clients\n", thread_id, clients_sent);
-								else
-									logmsgf("worker thread #%"PRIuLEAST32": couldn't send message to any client\n", thread_id);
-							}
-							else
-								winapi_perror("couldn't lock client pool mutex");
-							
-							client_data->phase = phase_getting_message_length;
-							
-							/* Queue a recv for the client's next message */
-							WSABUF buffer_info = {
-								.buf = &(operation_data->message_length),
-								.len = 1
-							};
-							if ( WSARecv(client_data->socket, &buffer_info, 1, NULL, &flags, &(operation_data->wsa_overlapped), NULL) == SOCKET_ERROR )
-							{
-								int error_code = WSAGetLastError();
-								if ( error_code != WSA_IO_PENDING )
-								{
-									win_perror("couldn't queue next recv", error_code);
-									/* FIXME: disconnect client. We couldn't queue another
-									 * recv operation, so it's not like we'll be getting
-									 * any further message from this client. */
-								}
-							}
+							cur->sampled_busy_ns = counters.busy_ns;
+							cur->sampled_completions = counters.completions;
 						}
-						else
-						{
-							assert(operation_data->received < operation_data->message_length);
-							
-							logmsgf("worker thread #%"PRIuLEAST32": getting message from %.*s: got %i bytes until now\n", thread_id, client_data->nickname_length, client_data->nickname, operation_data->received);
-							
-							WSABUF buffer_info = {
-								.buf = operation_data->buffer + sizeof(client_data->nickname) + 2 + operation_data->received,
-								.len = operation_data->message_length - operation_data->received
-							};
-							if ( WSARecv(client_data->socket, &buffer_info, 1, NULL, &flags, &(operation_data->wsa_overlapped), NULL) == SOCKET_ERROR )
-							{
-								int error_code = WSAGetLastError();
-								if ( error_code != WSA_IO_PENDING )
-								{
-									win_perror("couldn't queue next recv", error_code);
-									/* FIXME: disconnect client. We couldn't queue another
-									 * recv operation, so it's not like we'll be getting
-									 * any further message from this client. */
-								}
-							}
-						}
-						
-						break;
 					}
+					scaler_init(scaler, min - 1, max - 1);
+					*elastic = 1;
+					*next_sample = GetTickCount64() + scaler_interval_ms;
 				}
+				logmsgf("worker pool of %zu to %zu threads\n", scaler->min, scaler->max);
 			}
-			else
+			reply_threads(shared, admin, *elastic ? scaler : NULL);
+			break;
+		case admin_clients:
+		{
+			/* Read without the lock, as the stats are, a page at a
+			 * time for the replies not to pile up; clients coming and
+			 * going meanwhile may shift the pages */
+			const size_t from = command->arguments_n ? command->arguments[0] : 0;
+			const size_t count = command->arguments_n == 2 ? command->arguments[1] : admin_clients_page;
+			if ( count > admin_clients_page )
 			{
-				logmsg("client disconnected");
-				if ( WaitForSingleObject(shared->client_pool_mutex, INFINITE) == WAIT_OBJECT_0 )
+				admin_reply(admin, "error: at most %d clients at once", admin_clients_page);
+				return;
+			}
+			admin_reply(admin, "%10s %-32s %-15s %2s %5s %7s %7s %7s %10s %8s %9s", "id", "nickname", "phase", "v", "chat", "control", "backlog", "sending", "pinned", "dropped", "throttled");
+			size_t skipped = 0;
+			size_t listed = 0;
+			for ( size_t i = 0 ; i != core->capacity ; ++i )
+			{
+				const ClientData * const client_data = core->clients + i;
+				const ClientQueue * const queue = core->queues + i;
+				if ( !client_data->used )
+					continue;
+				if ( skipped != from )
+				{
+					++skipped;
+					continue;
+				}
+				if ( listed == count )
 				{
-					client_data->used = 0;
-					closesocket(client_data->socket);
-					
-					ReleaseMutex(shared->client_pool_mutex);
-					
-					free(operation_data);
-					
-					logmsg("client object released");
+					admin_reply(admin, "more: clients %zu %zu", from + count, count);
+					break;
 				}
+				++listed;
+				admin_reply(admin, "%10"PRIu32" %-32.*s %-15s %2u %5u %7u %7u %7s %10zu %8lu %9lu", client_data->connection_id, (int)client_data->nickname_length, client_data->nickname, client_data->closing ? "closing" : core_phase_name(client_data->phase), (unsigned)client_data->protocol, queue->n, (unsigned)queue->control_n, (unsigned)queue->backlog_n, queue->sending ? "yes" : "no", queue->memory, queue->dropped, client_data->throttled);
 			}
+			break;
 		}
-		else
-		{
-			DWORD error_code = GetLastError();
-			switch ( error_code )
+		case admin_kick:
+			if ( command->arguments[0] > UINT32_MAX || !core_client_kick(core, (uint32_t)command->arguments[0]) )
 			{
-				case ERROR_ABANDONED_WAIT_0:
-					logmsgf("worker thread #%"PRIuLEAST32": received request to shut down\n", thread_id);
-					return EXIT_SUCCESS;
-				case ERROR_NETNAME_DELETED:
-					logmsg("client disconnected");
-					if ( WaitForSingleObject(shared->client_pool_mutex, INFINITE) == WAIT_OBJECT_0 )
-					{
-						client_data->used = 0;
-						client_data->nickname_length = 0;
-						closesocket(client_data->socket);
-						
-						ReleaseMutex(shared->client_pool_mutex);
-						
-						free(operation_data);
-						
-						logmsg("client object released");
-					}
-					break;
-				default:
-					win_perror("couldn't retrieve completion packet from the completion port queue", error_code);
+				admin_reply(admin, "error: no client with connection ID %lu", command->arguments[0]);
+				return;
 			}
-		}
+			break;
+		default:
+			admin_reply(admin, "error: not supported");
+			return;
 	}
+	admin_reply(admin, "ok");
 }
 
-static ClientData *
-find_free_slot
+/* No more clients are let in, the main loop being over. The clients
+ * are sent what's waiting to go out to them, and nothing more is read
+ * from them, until there's nothing left or the deadline has passed;
+ * then their connections are closed, and the workers given a moment to
+ * let go of them. */
+static void
+drain
 (
- ClientData * cur
+ SharedStructures * shared,
+ const struct lappenchat_server_options * lcso
 )
 {
-	for ( ClientData * const end = cur + max_clients ; cur != end ; ++cur )
-		if ( !cur->used )
-			return cur;
+	Core * const core = &(shared->core);
+	const ULONGLONG started = GetTickCount64();
+	const ULONGLONG deadline = started + (lcso->drain_timeout ? lcso->drain_timeout : default_drain_timeout);
+	const size_t clients = core->capacity - core->free_slots_n;
+	ULONGLONG next_report = started;
+	ULONGLONG now = started;
+	size_t pending;
 	
-	return NULL;
+	if ( clients )
+		logmsgf("draining %zu clients\n", clients);
+	core_drain_begin(core);
+	while ( (pending = core_drain_pending(core)) && now < deadline )
+	{
+		if ( lcso->stopping && now >= next_report )
+		{
+			lcso->stopping(lcso->stopping_context, (unsigned long)(deadline - now) + drain_release_ms + worker_exit_ms);
+			next_report = now + drain_report_ms;
+		}
+		Sleep(drain_poll_ms);
+		now = GetTickCount64();
+	}
+	if ( pending )
+		logmsgf("drain timed out after %"PRIu64" ms, with %zu clients still to be sent to\n", (uint64_t)(now - started), pending);
+	else
+	if ( clients )
+		logmsgf("%zu clients drained in %"PRIu64" ms\n", clients, (uint64_t)(now - started));
+	
+	if ( lcso->stopping )
+		lcso->stopping(lcso->stopping_context, drain_release_ms + worker_exit_ms);
+	if ( core_drain_end(core) )
+	{
+		const ULONGLONG released_by = GetTickCount64() + drain_release_ms;
+		while ( core->free_slots_n != core->capacity && GetTickCount64() < released_by )
+			Sleep(drain_poll_ms);
+	}
 }
 
 static int
@@ -442,11 +1026,14 @@ lappenchat_server_inner_completionport
  HANDLE stop_event,
  SOCKET * server_sockets,
  DWORD server_sockets_n,
- size_t threads
+ DWORD websocket_first, // of the sockets, the first to take WebSocket clients
+ const struct lappenchat_server_options * lcso
 )
 {
 	int rv = 1;
-	WSAEVENT event_handles[SERVER_SOCKETS + 1];
+	/* The stop event, those of the server sockets, the filter
+	 * list's change notification and the admin channel's two */
+	WSAEVENT event_handles[SERVER_SOCKETS + 4];
 	SharedStructures shared = {0};
 	SOCKET * const sockets_end = server_sockets + server_sockets_n;
 	WSAEVENT * const server_event_handles = event_handles + 1;
@@ -454,10 +1041,23 @@ lappenchat_server_inner_completionport
 	/* We create threads-1 threads because our main thread does do something
 	 * and shall thus count as well. What it does is handle incoming connection
 	 * requests and accept them. This we could handle in the worker threads too
-	 * if we used AcceptEx. */
-	const DWORD threads_to_create = (DWORD)threads-1;
-	HANDLE * thread_handles_beg;
-	HANDLE * thread_handles_end = NULL; // Not actually necessary; just to placate the compiler
+	 * if we used AcceptEx. The same goes for the bounds of an elastic pool. */
+	const size_t threads_min = lcso->threads_min ? lcso->threads_min : lcso->threads;
+	const size_t threads_max = lcso->threads_max > threads_min ? lcso->threads_max : lcso->threads > threads_min ? lcso->threads : threads_min;
+	/* The admin channel may have the pool made elastic later on */
+	int elastic = threads_max > threads_min;
+	const size_t threads_to_create = (lcso->threads < threads_min ? threads_min : lcso->threads > threads_max ? threads_max : lcso->threads) - 1;
+	Scaler scaler;
+	uint64_t next_sample = 0;
+	const ULONGLONG started = GetTickCount64();
+	ULONGLONG next_publication = started;
+	int core_ready = 0;
+	HANDLE filter_watch = INVALID_HANDLE_VALUE;
+	FILETIME filter_written = {0};
+	AdminChannel admin;
+	int admin_ready = 0;
+	/* Whatever the workers use is only let go of if they have */
+	int workers_ended = 1;
 	
 	{
 		WSAEVENT * event_handles_ptr = server_event_handles;
@@ -479,23 +1079,36 @@ lappenchat_server_inner_completionport
 		}
 	}
 	
-	if ( shared.completion_port = CreateIoCompletionPort(INVALID_HANDLE_VALUE, NULL, 0, 0) )
+	/* The port lets as many workers run at once as there could be, rather
+	 * than as many as there are processors, which is what the pool
+	 * growing past that would be for: making up for blocked workers */
+	shared.workers_max = threads_max - 1 < stats_max_workers ? threads_max - 1 : stats_max_workers;
+	shared.dequeue_batch = (ULONG)(!lcso->dequeue_batch ? default_dequeue_batch : lcso->dequeue_batch > max_dequeue_batch ? max_dequeue_batch : lcso->dequeue_batch);
+	shared.busy_poll_ns = (uint64_t)lcso->busy_poll * 1000;
+	if ( shared.busy_poll_ns )
+		logmsgf("workers poll for completions for up to %lu us before waiting for them\n", lcso->busy_poll);
+	shared.zero_copy_threshold = lcso->zero_copy_threshold;
+	if ( shared.zero_copy_threshold )
+		logmsgf("sends of %zu bytes or more go out without being copied\n", shared.zero_copy_threshold);
+	shared.probe.type = operation_probe;
+	shared.retire.type = operation_retire;
+	shared.help.type = operation_help;
+	if ( !(shared.stats = stats_create(lcso->port)) )
 	{
-		
-		thread_handles_beg = calloc(threads_to_create, sizeof(*thread_handles_beg));
-		if ( thread_handles_beg )
+		logmsg("couldn't allocate memory for the stats");
+		rv = 0;
+	}
+	else
+	if ( shared.completion_port = CreateIoCompletionPort(INVALID_HANDLE_VALUE, NULL, 0, (DWORD)shared.workers_max) )
+	{
+		shared.workers = platform_alloc_aligned(shared.workers_max * sizeof(*shared.workers));
+		if ( shared.workers )
 		{
-			thread_handles_end = thread_handles_beg + threads_to_create;
-			
 			size_t created = 0;
 			
-			for ( HANDLE * cur = thread_handles_beg ; cur != thread_handles_end ; ++cur )
-			{
-				if ( *cur = CreateThread(NULL, 0, worker_thread, &shared, 0, NULL) )
+			for ( size_t i = 0 ; i != threads_to_create ; ++i )
+				if ( start_worker(&shared) )
 					++created;
-				else
-					winapi_perror("couldn't create worker thread");
-			}
 			
 			/* Don't fail if at least one thread could be created */
 			if ( created )
@@ -505,10 +1118,17 @@ lappenchat_server_inner_completionport
 				logmsg("error: couldn't create any worker threads");
 				rv = 0;
 			}
+			
+			if ( elastic )
+			{
+				scaler_init(&scaler, threads_min - 1, shared.workers_max);
+				next_sample = GetTickCount64() + scaler_interval_ms;
+				logmsgf("elastic worker pool of %zu to %zu threads\n", scaler.min, scaler.max);
+			}
 		}
 		else
 		{
-			logmsg("couldn't allocate memory for the thread handles");
+			logmsg("couldn't allocate memory for the worker threads");
 			rv = 0;
 		}
 	}
@@ -516,15 +1136,66 @@ lappenchat_server_inner_completionport
 	{
 		winapi_perror("couldn't create completion port");
 		rv = 0;
-		thread_handles_beg = NULL;
 	}
 	
-	if ( !(shared.client_pool_mutex = CreateMutex(NULL, FALSE, NULL)) )
+	if ( !(shared.timer_queue = CreateTimerQueue()) )
 	{
-		winapi_perror("couldn't create mutex for the client pool");
+		winapi_perror("couldn't create timer queue");
 		rv = 0;
 	}
 	
+	{
+		const Transport transport = {
+			.context = &shared,
+			.recv = transport_recv,
+			.send = transport_send,
+			.close = transport_close,
+			.set_timer = transport_set_timer,
+			.release = transport_release,
+			.now = transport_now,
+			.request_help = transport_request_help
+		};
+		const CoreOptions core_options = {
+			.capacity = lcso->max_clients ? lcso->max_clients : default_max_clients,
+			.rate_messages = lcso->rate_messages,
+			.rate_bytes = lcso->rate_bytes,
+			.coalescing_window = lcso->coalescing_window,
+			.frames_per_send = lcso->frames_per_send,
+			.max_frame = lcso->max_frame,
+			.text_policy = (enum TextPolicy)text_policy(lcso->text_policy),
+			.backlog = lcso->backlog,
+			.presence_window = (uint32_t)lcso->presence_window,
+			.connection_budget = (size_t)lcso->connection_budget << 10,
+			.memory_budget = (size_t)lcso->memory_budget << 20,
+			.fan_out_threshold = lcso->fan_out_threshold,
+			.idle_recvs = lcso->idle_recvs != 0,
+			.transport_memory = sizeof(Connection)
+		};
+		if ( !(core_ready = core_init(&shared.core, &transport, &core_options)) )
+			rv = 0;
+	}
+	
+	if ( core_ready && lcso->filter_path )
+	{
+		filter_list_written(lcso->filter_path, &filter_written);
+		Filter * const filter = filter_load(lcso->filter_path);
+		if ( filter )
+		{
+			use_filter(&shared.core, filter, lcso->filter_path);
+			filter_watch = watch_filter_list(lcso->filter_path);
+		}
+		else
+			rv = 0;
+	}
+	
+	trace_init(lcso->trace_sample, lcso->trace_path ? lcso->trace_path : "lappenchat-trace.json");
+	
+	if ( lcso->capture_path && !capture_open(lcso->capture_path) )
+		rv = 0;
+	
+	if ( lcso->admin_port && !(admin_ready = admin_open(&admin, lcso->admin_port)) )
+		rv = 0;
+	
 	if ( rv )
 	{
 		/* Set the sockets in listening state */
@@ -552,17 +1223,44 @@ lappenchat_server_inner_completionport
 		if ( rv )
 		{
 			DWORD events_n = server_sockets_n + 1;
-			DWORD max_to_compare = WSA_WAIT_EVENT_0 + events_n + 1;
-			DWORD flags = 0; // FIXME !!!
+			/* 0, the stop event's, if there's none */
+			DWORD filter_index = 0;
+			DWORD admin_index = 0;
 			
 			*event_handles = stop_event;
+			if ( filter_watch != INVALID_HANDLE_VALUE )
+				event_handles[filter_index = events_n++] = filter_watch;
+			if ( admin_ready )
+			{
+				admin_index = events_n;
+				event_handles[events_n++] = admin.listener_event;
+				event_handles[events_n++] = admin.operator_event;
+			}
+			
+			DWORD max_to_compare = WSA_WAIT_EVENT_0 + events_n + 1;
 			
 			/* Perhaps we should report SERVICE_RUNNING now */
 			
 			for ( ; ; )
 			{
 				assert(event_handles[0] == stop_event);
-				DWORD poll_code = WSAWaitForMultipleEvents(events_n, event_handles, FALSE, WSA_INFINITE, FALSE);
+				/* Whatever is due first of sampling the pool
+				 * and publishing the stats */
+				const ULONGLONG due = elastic && next_sample < next_publication ? next_sample : next_publication;
+				ULONGLONG now = GetTickCount64();
+				DWORD poll_code = WSAWaitForMultipleEvents(events_n, event_handles, FALSE, due > now ? (DWORD)(due - now) : 0, FALSE);
+				
+				now = GetTickCount64();
+				if ( elastic && now >= next_sample )
+				{
+					sample_workers(&shared, &scaler, (uint64_t)scaler_interval_ms * 1000000);
+					next_sample = now + scaler_interval_ms;
+				}
+				if ( now >= next_publication )
+				{
+					publish_stats(&shared, elastic ? &scaler : NULL, elastic ? scaler.min : threads_min - 1, elastic ? scaler.max : shared.workers_max, started);
+					next_publication = now + stats_interval_ms;
+				}
 				if ( poll_code >= WSA_WAIT_EVENT_0 && poll_code <= max_to_compare )
 				{
 					const size_t event_index = poll_code - WSA_WAIT_EVENT_0;
@@ -572,6 +1270,33 @@ lappenchat_server_inner_completionport
 						break;
 					}
 					else
+					if ( admin_index && (event_index == admin_index || event_index == admin_index + 1) )
+					{
+						AdminCommand command;
+						admin_poll(&admin);
+						while ( admin_next_command(&admin, &command) )
+							run_admin_command(&shared, &admin, &command, &scaler, &elastic, &next_sample);
+					}
+					else
+					if ( filter_index && event_index == filter_index )
+					{
+						/* The workers go on with the list in use
+						 * while the new one is compiled */
+						FILETIME written;
+						if ( !FindNextChangeNotification(filter_watch) )
+							winapi_perror("couldn't go on watching the filter list for changes");
+						if ( filter_list_written(lcso->filter_path, &written) && CompareFileTime(&written, &filter_written) )
+						{
+							filter_written = written;
+							logmsgf("filter list %s changed\n", lcso->filter_path);
+							Filter * const filter = filter_load(lcso->filter_path);
+							if ( filter )
+								use_filter(&shared.core, filter, lcso->filter_path);
+							else
+								logmsg("keeping the filter list in use");
+						}
+					}
+					else
 					{
 						SOCKET * server_socket;
 						WSAEVENT * event_handle;
@@ -586,75 +1311,55 @@ lappenchat_server_inner_completionport
 							{
 								logmsg("received connection request");
 								
-								if ( WaitForSingleObject(shared.client_pool_mutex, INFINITE) == WAIT_OBJECT_0 )
+								SOCKET client_socket = accept(*server_socket, NULL, NULL);
+								if ( client_socket != INVALID_SOCKET )
 								{
-									ClientData * const client_data = find_free_slot(shared.clients);
-									if ( client_data )
+									/* FIXME: log connector address ("accepted connection attempt from x.x.x.x / y:y:y: ...") */
+									logmsg("accepted connection request");
+									
+									ClientData * const client_data = core_client_open(&shared.core, (uintptr_t)client_socket);
+									Connection * const connection = client_data ? calloc(1, sizeof(*connection)) : NULL;
+									if ( connection )
 									{
-										client_data->phase = phase_getting_nickname_length;
-										client_data->socket = accept(*server_socket, NULL, NULL);
-										if ( client_data->socket != INVALID_SOCKET )
+										connection->recv_operation.type = operation_recv;
+										connection->send_operation.type = operation_send;
+										for ( TimerOperation * cur = connection->timers, * const end = cur + core_timers ; cur != end ; ++cur )
+										{
+											cur->operation.type = operation_timer;
+											cur->client_data = client_data;
+											cur->completion_port = shared.completion_port;
+										}
+										client_data->transport_data = connection;
+										
+										if ( CreateIoCompletionPort((HANDLE)client_socket, shared.completion_port, (ULONG_PTR)client_data, 0) )
 										{
-											/* FIXME: log connector address ("accepted connection attempt from x.x.x.x / y:y:y: ...") */
-											logmsg("accepted connection request");
-											
-											if ( CreateIoCompletionPort((HANDLE)client_data->socket, shared.completion_port, (ULONG_PTR)client_data, 0) )
-											{
-												/* calloc ensures that the memory chunk will be zero-filled */
-												OperationData * const operation_data = calloc(1, sizeof(*operation_data));
-												if ( operation_data )
-												{
-													logmsg("new client attached to the completion port");
-													
-													WSABUF buffer_info = {
-														.buf = &(client_data->nickname_length),
-														.len = 1
-													};
-													
-													operation_data->received = 0;
-													
-													switch ( WSARecv(client_data->socket, &buffer_info, 1, NULL, &flags, &(operation_data->wsa_overlapped), NULL) )
-													{
-														case SOCKET_ERROR:
-															{
-																int error_code = WSAGetLastError();
-																if ( error_code == WSA_IO_PENDING )
-																{
-														case 0:
-																	client_data->used = 1;
-																}
-																else
-																{
-																	win_perror("couldn't queue initial recv", error_code);
-																	closesocket(client_data->socket);
-																	free(operation_data);
-																}
-															}
-													}
-												}
-												else
-												{
-													logmsg("couldn't allocate memory for initial recv's data");
-													closesocket(client_data->socket);
-												}
-											}
+											logmsg("new client attached to the completion port");
+											if ( (DWORD)(server_socket - server_sockets) >= websocket_first )
+												core_client_start_websocket(&shared.core, client_data);
 											else
-											{
-												winapi_perror("couldn't attach client connection socket to the completion port");
-												closesocket(client_data->socket);
-											}
+												core_client_start(&shared.core, client_data);
 										}
 										else
 										{
-											wsa_perror("couldn't accept connection request");
+											winapi_perror("couldn't attach client connection socket to the completion port");
+											free(connection);
+											core_client_abandon(&shared.core, client_data);
+											closesocket(client_socket);
 										}
 									}
 									else
 									{
-										logmsg("no free slot for new client's data");
+										if ( client_data )
+										{
+											logmsg("couldn't allocate memory for new client's connection");
+											core_client_abandon(&shared.core, client_data);
+										}
+										closesocket(client_socket);
 									}
-									
-									ReleaseMutex(shared.client_pool_mutex);
+								}
+								else
+								{
+									wsa_perror("couldn't accept connection request");
 								}
 							}
 						}
@@ -663,14 +1368,15 @@ lappenchat_server_inner_completionport
 			}
 			
 			logmsg("main server loop exited");
+			drain(&shared, lcso);
 		}
 	}
 	
-	if ( shared.client_pool_mutex )
-	{
-		if ( !CloseHandle(shared.client_pool_mutex) )
-			winapi_perror("couldn't dispose of client pool mutex");
-	}
+	if ( filter_watch != INVALID_HANDLE_VALUE )
+		FindCloseChangeNotification(filter_watch);
+	
+	if ( admin_ready )
+		admin_close(&admin);
 	
 	if ( shared.completion_port )
 	{
@@ -679,26 +1385,88 @@ lappenchat_server_inner_completionport
 		else
 			winapi_perror("couldn't dispose of completion port");
 		
-		if ( thread_handles_beg )
+		if ( shared.workers )
 		{
-			switch ( WaitForMultipleObjects(threads_to_create, thread_handles_beg, TRUE, INFINITE) )
+			/* One stuck in a call mustn't hold the shutdown up
+			 * past what the service told the SCM */
+			const ULONGLONG exit_by = GetTickCount64() + worker_exit_ms;
+			for ( Worker * cur = shared.workers, * const end = cur + shared.workers_max ; cur != end ; ++cur )
 			{
-				case WAIT_OBJECT_0:
-				case WAIT_ABANDONED_0:
-					logmsg("all worker threads ended");
-					break;
-				case WAIT_FAILED:
+				if ( !cur->handle )
+					continue;
+				const ULONGLONG now = GetTickCount64();
+				const DWORD waited = WaitForSingleObject(cur->handle, now < exit_by ? (DWORD)(exit_by - now) : 0);
+				if ( waited == WAIT_FAILED )
+				{
 					winapi_perror("couldn't wait for worker threads to exit");
+					workers_ended = 0;
+				}
+				else
+				if ( waited == WAIT_TIMEOUT )
+				{
+					logmsg("a worker thread didn't exit in time, leaving it to the end of the process");
+					workers_ended = 0;
+				}
+				CloseHandle(cur->handle);
 			}
 			
-			for ( HANDLE * cur = thread_handles_beg ; cur != thread_handles_end ; ++cur )
+			if ( workers_ended )
 			{
-				HANDLE thread_handle = *cur;
-				if ( thread_handle )
-					CloseHandle(thread_handle);
+				logmsg("all worker threads ended");
+				if ( elastic )
+					logmsgf("worker pool grown %lu times and shrunk %lu times\n", scaler.grown, scaler.shrunk);
+				if ( shared.core.messages_rejected )
+					logmsgf("%ld messages dropped for their text\n", shared.core.messages_rejected);
+				if ( lcso->filter_path )
+					logmsgf("filter: %ld messages dropped, %ld masked, %ld flagged\n", shared.core.messages_filtered, shared.core.messages_masked, shared.core.messages_flagged);
+				if ( shared.core.messages_delivered )
+					logmsgf("%"PRIu64" messages delivered in %"PRIu64" sends (%.3f sends per delivered message), %"PRIu64" dropped\n", shared.core.messages_delivered, shared.core.sends, (double)shared.core.sends / shared.core.messages_delivered, shared.core.messages_dropped);
+				if ( shared.core.fanned_out )
+					logmsgf("%"PRIu64" broadcasts fanned out in parallel\n", shared.core.fanned_out);
+				logmsgf("memory: %"PRId64" KiB at most, %"PRIu64" clients not let in and %"PRIu64" disconnected for the memory budget, %"PRIu64" frames dropped for the connection budget\n", shared.core.memory_peak >> 10, shared.core.clients_refused, shared.core.clients_shed, shared.core.frames_shed);
+				for ( unsigned lane = 0 ; lane != lanes ; ++lane )
+				{
+					const uint64_t * const waits = shared.core.lane_waits[lane];
+					if ( stats_wait_percentile(waits, 1) )
+						logmsgf("%s lane: frames waited up to %"PRIu64" us half of the time, %"PRIu64" us 99%% of it, %"PRIu64" us at most\n", stats_lane_name(lane), stats_wait_percentile(waits, .5), stats_wait_percentile(waits, .99), stats_wait_percentile(waits, 1));
+				}
 			}
 		}
 	}
+	/* Once the workers, which set timers for as long as they run, are
+	 * over; one that didn't exit in time may still, so the queue is
+	 * left to the end of the process then, as the workers are */
+	if ( shared.timer_queue && workers_ended )
+	{
+		/* Wait for any timer callback still running to return; one
+		 * firing now finds the completion port closed, which only
+		 * gets logged */
+		if ( !DeleteTimerQueueEx(shared.timer_queue, INVALID_HANDLE_VALUE) )
+			winapi_perror("couldn't dispose of timer queue");
+	}
+	
+	if ( workers_ended )
+	{
+		platform_free_aligned(shared.workers);
+		stats_close(shared.stats);
+	}
+	
+	if ( core_ready && workers_ended )
+	{
+		/* Clients still connected at this point are simply let go of */
+		for ( ClientData * cur = shared.core.clients, * const end = cur + shared.core.capacity ; cur != end ; ++cur )
+		{
+			if ( cur->used && !cur->closing )
+				closesocket((SOCKET)cur->handle);
+			if ( cur->used )
+				free(cur->transport_data);
+		}
+		core_cleanup(&shared.core);
+	}
+	
+	trace_export();
+	trace_cleanup();
+	capture_close();
 	
 	for ( WSAEVENT * cur = server_event_handles ; cur != event_handles_end ; ++cur )
 	{
@@ -719,6 +1487,9 @@ int lappenchat_server
 )
 {
 	int rv = 0;
+	if ( text_policy(lcso.text_policy) < 0 )
+		logmsgf("unknown text policy %s (-u), which is to be off, strip or reject\n", lcso.text_policy);
+	else
 	if ( LOBYTE(lcso.wsa_data.wVersion) == 2 && HIBYTE(lcso.wsa_data.wVersion) == 2 )
 	{
 		/* The server handles connections over a variety of protocols,
@@ -736,11 +1507,24 @@ int lappenchat_server
 		if ( ss_ipv6 != INVALID_SOCKET )
 			*server_sockets_entry++ = ss_ipv6;
 		
+		/* Those for WebSocket clients come last */
+		SOCKET * const websocket_sockets = server_sockets_entry;
+		if ( lcso.websocket_port )
+		{
+			SOCKET ss_websocket_ipv4 = get_ipv4_socket(lcso.websocket_port);
+			if ( ss_websocket_ipv4 != INVALID_SOCKET )
+				*server_sockets_entry++ = ss_websocket_ipv4;
+			
+			SOCKET ss_websocket_ipv6 = get_ipv6_socket(lcso.websocket_port);
+			if ( ss_websocket_ipv6 != INVALID_SOCKET )
+				*server_sockets_entry++ = ss_websocket_ipv6;
+		}
+		
 		if ( server_sockets_entry != server_sockets )
 		{
 			/* At least one socket has been set up successfully */
 			
-			rv = lappenchat_server_inner_completionport(stop_event, server_sockets, (DWORD)(server_sockets_entry-server_sockets), lcso.threads);
+			rv = lappenchat_server_inner_completionport(stop_event, server_sockets, (DWORD)(server_sockets_entry-server_sockets), (DWORD)(websocket_sockets-server_sockets), &lcso);
 			
 			if ( ss_ipv4 != INVALID_SOCKET )
 			{
@@ -756,6 +1540,13 @@ int lappenchat_server
 				else
 					wsa_perror("couldn't close IPv6 socket");
 			}
+			for ( SOCKET * cur = websocket_sockets ; cur != server_sockets_entry ; ++cur )
+			{
+				if ( closesocket(*cur) != SOCKET_ERROR )
+					logmsg("successfully closed WebSocket socket");
+				else
+					wsa_perror("couldn't close WebSocket socket");
+			}
 		}
 		else
 			logmsg("couldn't establish any socket for the server");
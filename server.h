@@ -10,6 +10,71 @@ struct lappenchat_server_options {
 	WSADATA wsa_data;
 	u_short port;
 	size_t threads;
+	/* Clients connected at once, beyond which connections are closed as
+	 * soon as they're accepted; 0 means the default */
+	size_t max_clients;
+	/* Bounds of the thread count, which varies with the load between
+	 * them if they're apart; 0 means the same as threads */
+	size_t threads_min;
+	size_t threads_max;
+	/* Per-client rate limits; 0 means unlimited */
+	unsigned long rate_messages;
+	unsigned long rate_bytes;
+	/* Outbound message coalescing */
+	unsigned long coalescing_window; // milliseconds
+	unsigned long frames_per_send;
+	/* Largest protocol v2 frame accepted; 0 means the default */
+	unsigned long max_frame;
+	/* "off" (the default), "strip" or "reject"; the server doesn't
+	 * start with anything else */
+	const char * text_policy;
+	/* Messages kept for clients to resume from after reconnecting;
+	 * 0 means they can't */
+	unsigned long backlog;
+	/* Joins and leaves are gathered over this long before the
+	 * clients are told of them; 0 means the default */
+	unsigned long presence_window; // milliseconds
+	/* Memory budgets per client and in all; 0 means unlimited */
+	unsigned long connection_budget; // KiB
+	unsigned long memory_budget; // MiB
+	/* Completions each worker thread dequeues at once, up to 256;
+	 * 0 means the default */
+	unsigned long dequeue_batch;
+	/* How long worker threads poll for completions before they wait
+	 * for them, for lower latency at the cost of CPU time; 0 means
+	 * they never do */
+	unsigned long busy_poll; // microseconds
+	/* Clients a broadcast is fanned out to by several worker threads
+	 * from; 0 means the default */
+	unsigned long fan_out_threshold;
+	/* Whether idle clients wait in recvs of 0 bytes, which pin no
+	 * buffer, rather than in ones for what they send next */
+	unsigned long idle_recvs;
+	/* Sends at least this large go out of the frames themselves
+	 * rather than getting copied by the system; 0 means never */
+	unsigned long zero_copy_threshold; // bytes
+	/* List of terms to filter messages for, if any, which gets
+	 * reloaded whenever it changes */
+	const char * filter_path;
+	/* Tracing of one message in trace_sample; 0 turns it off */
+	unsigned long trace_sample;
+	const char * trace_path;
+	/* File to capture the inbound traffic to, if any */
+	const char * capture_path;
+	/* Loopback port of the admin channel (see admin.h); 0 means
+	 * there's none */
+	u_short admin_port;
+	/* Port WebSocket clients connect to, on IPv4 and IPv6 alike (see
+	 * websocket.h); 0 means they can't */
+	u_short websocket_port;
+	/* How long clients get on shutdown to be sent what's waiting to
+	 * go out to them; 0 means the default */
+	unsigned long drain_timeout; // milliseconds
+	/* Called every so often while shutting down, with how much longer
+	 * it may take at most, for a service to tell the SCM; NULL if
+	 * there's nobody to tell */
+	void (*stopping)(void * context, unsigned long remaining_ms);
+	void * stopping_context;
 };
 
 int lappenchat_server
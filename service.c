@@ -6,6 +6,14 @@
 #include "error.h"
 #include "common.h"
 #include "server.h"
+#include "trace.h"
+
+/* User-defined control code (sc control lappenchat-server 128)
+ * to dump what has been traced so far */
+#define SERVICE_CONTROL_EXPORT_TRACE 128
+/* The wait hint reported along with the stop request, until the server
+ * says how long its drain may take */
+#define stop_wait_hint_ms 3000
 
 
 typedef struct
@@ -30,6 +38,8 @@ DWORD WINAPI ServiceCtrlHandler
 		case SERVICE_CONTROL_STOP:
 		case SERVICE_CONTROL_SHUTDOWN:
 			service_stuff->status.dwCurrentState = SERVICE_STOP_PENDING;
+			service_stuff->status.dwCheckPoint = 1;
+			service_stuff->status.dwWaitHint = stop_wait_hint_ms;
 			SetServiceStatus(service_stuff->status_handle, &service_stuff->status);
 			
 			logmsg("received stop request from the Service Control Manager");
@@ -52,11 +62,31 @@ DWORD WINAPI ServiceCtrlHandler
 			}
 		case SERVICE_CONTROL_INTERROGATE:
 			return NO_ERROR;
+		case SERVICE_CONTROL_EXPORT_TRACE:
+			trace_export();
+			return NO_ERROR;
 		default:
 			return ERROR_CALL_NOT_IMPLEMENTED;
 	}
 }
 
+/* Called by the server while it drains, so that the SCM knows it's
+ * getting somewhere, and how much longer to wait for it at most */
+static void
+report_stopping
+(
+ void * data,
+ unsigned long remaining_ms
+)
+{
+	ServiceStuff * const service_stuff = (ServiceStuff *)data;
+	
+	service_stuff->status.dwCurrentState = SERVICE_STOP_PENDING;
+	++service_stuff->status.dwCheckPoint;
+	service_stuff->status.dwWaitHint = (DWORD)remaining_ms;
+	SetServiceStatus(service_stuff->status_handle, &service_stuff->status);
+}
+
 VOID WINAPI
 ServiceMain
 (
@@ -109,6 +139,81 @@ ServiceMain
 						case 't':
 							lcso.threads = strtol(arg, NULL, 10);
 							break;
+						case 'c':
+							lcso.max_clients = strtoul(arg, NULL, 10);
+							break;
+						case 'r':
+							lcso.rate_messages = strtoul(arg, NULL, 10);
+							break;
+						case 'b':
+							lcso.rate_bytes = strtoul(arg, NULL, 10);
+							break;
+						case 'w':
+							lcso.coalescing_window = strtoul(arg, NULL, 10);
+							break;
+						case 'g':
+							lcso.frames_per_send = strtoul(arg, NULL, 10);
+							break;
+						case 'f':
+							lcso.max_frame = strtoul(arg, NULL, 10);
+							break;
+						case 'u':
+							lcso.text_policy = arg;
+							break;
+						case 'm':
+							lcso.filter_path = arg;
+							break;
+						case 'n':
+							lcso.threads_min = strtoul(arg, NULL, 10);
+							break;
+						case 'x':
+							lcso.threads_max = strtoul(arg, NULL, 10);
+							break;
+						case 'T':
+							lcso.trace_sample = strtoul(arg, NULL, 10);
+							break;
+						case 'o':
+							lcso.trace_path = arg;
+							break;
+						case 'C':
+							lcso.capture_path = arg;
+							break;
+						case 'k':
+							lcso.backlog = strtoul(arg, NULL, 10);
+							break;
+						case 'j':
+							lcso.presence_window = strtoul(arg, NULL, 10);
+							break;
+						case 'q':
+							lcso.connection_budget = strtoul(arg, NULL, 10);
+							break;
+						case 'Q':
+							lcso.memory_budget = strtoul(arg, NULL, 10);
+							break;
+						case 'd':
+							lcso.dequeue_batch = strtoul(arg, NULL, 10);
+							break;
+						case 'F':
+							lcso.fan_out_threshold = strtoul(arg, NULL, 10);
+							break;
+						case 'z':
+							lcso.idle_recvs = strtoul(arg, NULL, 10);
+							break;
+						case 'Z':
+							lcso.zero_copy_threshold = strtoul(arg, NULL, 10);
+							break;
+						case 'a':
+							lcso.admin_port = (u_short)strtoul(arg, NULL, 10);
+							break;
+						case 'D':
+							lcso.drain_timeout = strtoul(arg, NULL, 10);
+							break;
+						case 'W':
+							lcso.websocket_port = (u_short)strtoul(arg, NULL, 10);
+							break;
+						case 'y':
+							lcso.busy_poll = strtoul(arg, NULL, 10);
+							break;
 					}
 					parameter = 0;
 				}
@@ -123,6 +228,9 @@ ServiceMain
 			if ( !lcso.threads )
 				lcso.threads = get_proc_n();
 			
+			lcso.stopping = report_stopping;
+			lcso.stopping_context = &service_stuff;
+			
 			/* FIXME: we should report SERVICE_RUNNING only when (if) everything
 			 * has been set up properly. The problem is that there is still setup
 			 * work to do on the server side, so it would have to be reported from
@@ -161,6 +269,8 @@ ServiceMain
 		winapi_perror("couldn't register service control handler");
 	
 	service_stuff.status.dwCurrentState = SERVICE_STOPPED;
+	service_stuff.status.dwCheckPoint = 0;
+	service_stuff.status.dwWaitHint = 0;
 	SetServiceStatus(service_stuff.status_handle, &service_stuff.status);
 }
 
@@ -0,0 +1,1487 @@
+#include <ctype.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "core.h"
+#include "logmsg.h"
+#include "platform.h"
+#include "protocol.h"
+#include "websocket.h"
+
+/* A deterministic simulation of the server: the very core the server
+ * runs (core.c), driven by an in-memory transport instead of sockets
+ * and a completion port, and by a scheduler instead of worker threads.
+ * Every completion that could happen next is equally likely to be
+ * the next one, as picked by a pseudo-random generator, so a given
+ * seed always plays out the same way and different seeds make for
+ * different interleavings. Time is virtual: timers fire when the
+ * simulation gets to their time, not when the wall clock does.
+ *
+ * Clients can be made to have their reads complete a few bytes at a
+ * time, to hang up in the middle of a frame, to have their connection
+ * reset (as in ERROR_NETNAME_DELETED) or to be slow readers whose sends
+ * complete late and partially. Some of them can speak protocol v2,
+ * with or without batching, and send several messages per frame, and
+ * some of those can come in over WebSocket, with their frames split
+ * into WebSocket frames at random and pings in between. Once
+ * the clients are done sending, it's
+ * checked that every well-behaved client got every message either
+ * delivered or dropped, those of each sender in order; then that the
+ * WebSocket clients get a Close, whether they close their connection
+ * or the server drains, and nothing after it; and once everybody hangs
+ * up, that every client object got released.
+ *
+ * As nothing but the core and the simulation run, it also measures
+ * what the core costs per message, without the kernel's share. */
+
+
+/* The senders whose messages get checked for order */
+#define checked_senders 64
+/* Slots per chunk of broadcasts fanned out in parallel, so that even
+ * a few clients make for several */
+#define chunk_slots 8
+/* WebSocket clients' upgrade request, and the reply it is to get,
+ * both as in RFC 6455 */
+#define websocket_request "GET /chat HTTP/1.1\r\nHost: server.example.com\r\nUpgrade: websocket\r\nConnection: Upgrade\r\nSec-WebSocket-Key: dGhlIHNhbXBsZSBub25jZQ==\r\nSec-WebSocket-Version: 13\r\n\r\n"
+#define websocket_reply "HTTP/1.1 101 Switching Protocols\r\nUpgrade: websocket\r\nConnection: Upgrade\r\nSec-WebSocket-Accept: s3pPLMBiTxaQ9kYGzzhZRbK+xOo=\r\n\r\n"
+/* The pieces a WebSocket client's frames are split into, at most */
+#define websocket_fragments 3
+/* The status code WebSocket clients close their connection with */
+#define websocket_normal_closure 1000
+
+typedef struct {
+	ClientData * client_data;
+	/* Everything the client is ever going to send; the server can
+	 * read as far as written */
+	unsigned char * stream;
+	size_t stream_size;
+	size_t written;
+	size_t read;
+	size_t reset_at; // SIZE_MAX if the connection is never reset
+	char hangs_up; // once its whole stream is written
+	char faulty; // hangs up or gets reset, so it's left out of the checks
+	char slow;
+	char hung_up;
+	char closed; // by the server
+	char released;
+	char v2; // speaks protocol v2
+	char batch; // and asks for capability_batch
+	char websocket; // and comes in over WebSocket
+	/* Where each frame it sends ends, for paced clients to write
+	 * them one at a time */
+	size_t * frame_ends;
+	size_t frames_n;
+	size_t frames_written;
+	/* The recv pending, if any */
+	char recv_pending;
+	char recv_ready; // there's an event in the ready list for it
+	unsigned char * recv_buffer;
+	size_t recv_size;
+	/* The send pending, if any */
+	char send_pending;
+	size_t send_buffers_n;
+	TransportBuffer send_buffers[max_frames_per_send];
+	/* What the server sent that hasn't been made sense of yet */
+	unsigned char * inbox;
+	size_t inbox_n;
+	size_t inbox_capacity;
+	char greeted; // v2 clients get the handshake reply first
+	/* Of what a WebSocket client is sent: how much of the reply to
+	 * its upgrade request is in, and the header and what's left of
+	 * the payload of the WebSocket frame being read */
+	size_t upgrade_n;
+	unsigned char ws_header[websocket_header_max];
+	size_t ws_header_n;
+	uint64_t ws_remaining;
+	unsigned char ws_opcode;
+	unsigned long pings; // sent
+	unsigned long pongs; // got back
+	unsigned long closes; // got from the server
+	unsigned close_status; // that they came with
+	uint64_t frames_received; // messages, not counting pieces of them
+	unsigned long * last_seq; // per checked sender
+} SimClient;
+
+enum EventType {
+	event_recv,
+	event_send,
+	event_timer
+};
+
+/* A completion ready to be delivered */
+typedef struct {
+	uint32_t client;
+	unsigned char type;
+	unsigned char timer;
+} Event;
+
+enum TimedType {
+	timed_timer, // a client's timer fires
+	timed_send, // a slow reader's send becomes ready to complete
+	timed_write // a client writes its next message
+};
+
+/* Something due at some point of virtual time. The timed things
+ * make up a heap ordered by due time, ties being broken by the
+ * order they were scheduled in. */
+typedef struct {
+	uint64_t due;
+	uint64_t order;
+	uint32_t client;
+	unsigned char type;
+	unsigned char timer;
+} Timed;
+
+struct sim_options {
+	unsigned long clients;
+	unsigned long messages;
+	unsigned long message_size;
+	unsigned long seed;
+	unsigned long runs;
+	unsigned long recv_chunk; // at most this many bytes per recv, 0 for as many as there are
+	unsigned long disconnects; // percent of the clients
+	unsigned long resets; // percent of the clients
+	unsigned long slow_readers; // percent of the clients
+	unsigned long slow_latency; // microseconds
+	unsigned long interval; // microseconds between a client's messages
+	unsigned long step; // microseconds each completion takes
+	unsigned long rate_messages;
+	unsigned long rate_bytes;
+	unsigned long coalescing_window;
+	unsigned long frames_per_send;
+	unsigned long max_frame;
+	unsigned long v2_clients; // percent of the clients
+	unsigned long websocket_clients; // percent of the v2 clients
+	unsigned long messages_per_frame; // sent by v2 clients
+	unsigned long dequeue_batch; // completions delivered at once
+	unsigned long fan_out_threshold; // 0 if broadcasts aren't fanned out
+	unsigned long idle_recvs;
+	enum TextPolicy text_policy;
+	unsigned long unicode; // messages padded with non-ASCII text
+};
+
+typedef struct {
+	Core core;
+	CoreBatch batch; // slots NULL unless completions get batched
+	const struct sim_options * options;
+	SimClient * clients;
+	Event * ready;
+	size_t ready_n;
+	size_t ready_capacity;
+	Timed * timed;
+	size_t timed_n;
+	size_t timed_capacity;
+	uint64_t order;
+	uint64_t now; // virtual microseconds
+	uint64_t random;
+	uint64_t completions;
+	uint64_t idle_recvs; // of 0 bytes
+	uint64_t core_ns; // real time spent in the core
+	uint64_t received; // frames got by the clients
+	uint64_t out_of_order;
+	uint64_t garbled;
+	int out_of_memory;
+} Sim;
+
+static uint64_t
+next_random
+(
+ Sim * sim
+)
+{
+	/* xorshift64* */
+	sim->random ^= sim->random >> 12;
+	sim->random ^= sim->random << 25;
+	sim->random ^= sim->random >> 27;
+	return sim->random * 2685821657736338717ULL;
+}
+
+static void
+push_ready
+(
+ Sim * sim,
+ uint32_t client,
+ enum EventType type,
+ enum CoreTimer timer
+)
+{
+	if ( sim->ready_n == sim->ready_capacity )
+	{
+		const size_t capacity = sim->ready_capacity ? sim->ready_capacity * 2 : 1024;
+		Event * const ready = realloc(sim->ready, capacity * sizeof(*ready));
+		if ( !ready )
+		{
+			sim->out_of_memory = 1;
+			return;
+		}
+		sim->ready = ready;
+		sim->ready_capacity = capacity;
+	}
+	
+	sim->ready[sim->ready_n++] = (Event){
+		.client = client,
+		.type = (unsigned char)type,
+		.timer = (unsigned char)timer
+	};
+}
+
+static int
+timed_before
+(
+ const Timed * a,
+ const Timed * b
+)
+{
+	return a->due < b->due || (a->due == b->due && a->order < b->order);
+}
+
+static void
+push_timed
+(
+ Sim * sim,
+ uint64_t due,
+ uint32_t client,
+ enum TimedType type,
+ enum CoreTimer timer
+)
+{
+	if ( sim->timed_n == sim->timed_capacity )
+	{
+		const size_t capacity = sim->timed_capacity ? sim->timed_capacity * 2 : 1024;
+		Timed * const timed = realloc(sim->timed, capacity * sizeof(*timed));
+		if ( !timed )
+		{
+			sim->out_of_memory = 1;
+			return;
+		}
+		sim->timed = timed;
+		sim->timed_capacity = capacity;
+	}
+	
+	size_t i = sim->timed_n++;
+	const Timed entry = {
+		.due = due,
+		.order = sim->order++,
+		.client = client,
+		.type = (unsigned char)type,
+		.timer = (unsigned char)timer
+	};
+	for ( ; i && timed_before(&entry, sim->timed + (i - 1) / 2) ; i = (i - 1) / 2 )
+		sim->timed[i] = sim->timed[(i - 1) / 2];
+	sim->timed[i] = entry;
+}
+
+static Timed
+pop_timed
+(
+ Sim * sim
+)
+{
+	const Timed top = sim->timed[0];
+	const Timed last = sim->timed[--sim->timed_n];
+	size_t i = 0;
+	
+	for ( ; ; )
+	{
+		size_t child = 2 * i + 1;
+		if ( child >= sim->timed_n )
+			break;
+		if ( child + 1 < sim->timed_n && timed_before(sim->timed + child + 1, sim->timed + child) )
+			++child;
+		if ( !timed_before(sim->timed + child, &last) )
+			break;
+		sim->timed[i] = sim->timed[child];
+		i = child;
+	}
+	if ( sim->timed_n )
+		sim->timed[i] = last;
+	
+	return top;
+}
+
+/* A pending recv can complete once there's something to read, or once
+ * the connection has been closed at either end */
+static void
+check_recv_ready
+(
+ Sim * sim,
+ SimClient * client
+)
+{
+	if ( client->recv_pending && !client->recv_ready && (client->written > client->read || client->hung_up || client->closed) )
+	{
+		client->recv_ready = 1;
+		push_ready(sim, (uint32_t)(client - sim->clients), event_recv, 0);
+	}
+}
+
+/* The in-memory transport */
+
+static int
+sim_recv
+(
+ void * context,
+ ClientData * client_data,
+ void * buffer,
+ size_t size
+)
+{
+	Sim * const sim = (Sim *)context;
+	SimClient * const client = sim->clients + client_data->handle;
+	
+	if ( client->closed )
+		return 0;
+	
+	client->recv_pending = 1;
+	client->recv_buffer = buffer;
+	client->recv_size = size;
+	if ( !size )
+		++sim->idle_recvs;
+	check_recv_ready(sim, client);
+	return 1;
+}
+
+static int
+sim_send
+(
+ void * context,
+ ClientData * client_data,
+ const TransportBuffer * buffers,
+ size_t buffers_n
+)
+{
+	Sim * const sim = (Sim *)context;
+	SimClient * const client = sim->clients + client_data->handle;
+	
+	if ( client->closed )
+		return 0;
+	
+	client->send_pending = 1;
+	client->send_buffers_n = buffers_n;
+	memcpy(client->send_buffers, buffers, buffers_n * sizeof(*buffers));
+	
+	if ( client->slow )
+		push_timed(sim, sim->now + sim->options->slow_latency, (uint32_t)client_data->handle, timed_send, 0);
+	else
+		push_ready(sim, (uint32_t)client_data->handle, event_send, 0);
+	return 1;
+}
+
+/* Broadcasts get fanned out in chunks, which there's only the one thread
+ * for, so either it takes them all as a helper would, or they're left to
+ * the thread broadcasting */
+static void
+sim_request_help
+(
+ void * context,
+ size_t helpers
+)
+{
+	Sim * const sim = (Sim *)context;
+	
+	(void)helpers;
+	if ( next_random(sim) & 1 )
+		core_help(&sim->core);
+}
+
+static void
+sim_close
+(
+ void * context,
+ ClientData * client_data
+)
+{
+	Sim * const sim = (Sim *)context;
+	SimClient * const client = sim->clients + client_data->handle;
+	
+	client->closed = 1;
+	check_recv_ready(sim, client);
+}
+
+static int
+sim_set_timer
+(
+ void * context,
+ ClientData * client_data,
+ enum CoreTimer timer,
+ uint32_t ms
+)
+{
+	Sim * const sim = (Sim *)context;
+	
+	push_timed(sim, sim->now + (uint64_t)ms * 1000, (uint32_t)client_data->handle, timed_timer, timer);
+	return 1;
+}
+
+static void
+sim_release
+(
+ void * context,
+ ClientData * client_data
+)
+{
+	Sim * const sim = (Sim *)context;
+	
+	sim->clients[client_data->handle].released = 1;
+}
+
+static uint64_t
+sim_now
+(
+ void * context
+)
+{
+	return ((Sim *)context)->now / 1000;
+}
+
+/* Every nickname is c followed by the client's index */
+static unsigned long
+sender_index
+(
+ const unsigned char * nickname,
+ size_t nickname_length
+)
+{
+	char field[16];
+	
+	if ( !nickname_length || nickname_length >= sizeof(field) || nickname[0] != 'c' )
+		return (unsigned long)-1;
+	memcpy(field, nickname + 1, nickname_length - 1);
+	field[nickname_length - 1] = 0;
+	return strtoul(field, NULL, 10);
+}
+
+static void
+check_message
+(
+ Sim * sim,
+ SimClient * client,
+ unsigned long sender,
+ const unsigned char * text,
+ size_t size
+)
+{
+	char field[24];
+	size_t digits = 0;
+	
+	/* Longer messages reach v1 clients split up, and the pieces after
+	 * the first one start with the padding */
+	if ( !client->v2 && size && !isdigit(text[0]) )
+		return;
+	
+	/* Every message starts with its sequence number */
+	for ( ; digits != size && digits != sizeof(field) - 1 && isdigit(text[digits]) ; ++digits )
+		field[digits] = (char)text[digits];
+	field[digits] = 0;
+	const unsigned long seq = strtoul(field, NULL, 10);
+	
+	if ( sender >= sim->options->clients || !seq || seq > sim->options->messages )
+		++sim->garbled;
+	else
+	if ( sender < checked_senders )
+	{
+		if ( seq <= client->last_seq[sender] )
+			++sim->out_of_order;
+		client->last_seq[sender] = seq;
+	}
+	
+	++client->frames_received;
+	++sim->received;
+}
+
+/* Returns how many bytes the frame took, 0 if it isn't all there yet */
+static size_t
+take_v1_frame
+(
+ Sim * sim,
+ SimClient * client,
+ const unsigned char * cur,
+ const unsigned char * end
+)
+{
+	const size_t available = (size_t)(end - cur);
+	
+	if ( !available || available < 2 + (size_t)cur[0] )
+		return 0;
+	const size_t nickname_length = cur[0];
+	const size_t message_length = cur[1 + nickname_length];
+	if ( available < 2 + nickname_length + message_length )
+		return 0;
+	
+	check_message(sim, client, sender_index(cur + 1, nickname_length), cur + 2 + nickname_length, message_length);
+	return 2 + nickname_length + message_length;
+}
+
+static size_t
+take_v2_frame
+(
+ Sim * sim,
+ SimClient * client,
+ const unsigned char * cur,
+ const unsigned char * end
+)
+{
+	const unsigned char * const start = cur;
+	uint32_t value;
+	int varint;
+	
+	if ( !client->greeted )
+	{
+		uint32_t capabilities;
+		
+		if ( end - cur < 2 )
+			return 0;
+		const int valid = cur[0] == protocol_v2_marker && cur[1] == protocol_version;
+		cur += 2;
+		if ( (varint = varint_get(cur, end, &capabilities)) <= 0 )
+			return varint < 0 ? (size_t)(end - start) : 0;
+		cur += varint;
+		if ( (varint = varint_get(cur, end, &value)) <= 0 )
+			return varint < 0 ? (size_t)(end - start) : 0;
+		cur += varint;
+		
+		if ( !valid || capabilities != (client->batch ? capability_batch : 0) || value != sim->core.max_frame )
+			++sim->garbled;
+		client->greeted = 1;
+		return (size_t)(cur - start);
+	}
+	
+	if ( (varint = varint_get(cur, end, &value)) <= 0 )
+	{
+		if ( varint < 0 )
+		{
+			++sim->garbled;
+			return (size_t)(end - start);
+		}
+		return 0;
+	}
+	if ( (size_t)(end - cur) < varint + value )
+		return 0;
+	
+	const unsigned char * payload = cur + varint;
+	const unsigned char * const payload_end = payload + value;
+	const size_t nickname_length = value ? *payload++ : 0;
+	unsigned long messages_n = 0;
+	
+	if ( !value || (size_t)(payload_end - payload) < nickname_length )
+		++sim->garbled;
+	else
+	{
+		const unsigned long sender = sender_index(payload, nickname_length);
+		for ( payload += nickname_length ; payload != payload_end ; ++messages_n )
+		{
+			uint32_t size;
+			if ( (varint = varint_get(payload, payload_end, &size)) <= 0 || size > (size_t)(payload_end - payload) - varint )
+			{
+				++sim->garbled;
+				break;
+			}
+			check_message(sim, client, sender, payload + varint, size);
+			payload += varint + size;
+		}
+		if ( !messages_n || (messages_n > 1 && !client->batch) )
+			++sim->garbled;
+	}
+	
+	return (size_t)(payload_end - start);
+}
+
+static void
+append_inbox
+(
+ Sim * sim,
+ SimClient * client,
+ const unsigned char * cur,
+ size_t size
+)
+{
+	if ( client->inbox_n + size > client->inbox_capacity )
+	{
+		size_t capacity = client->inbox_capacity ? client->inbox_capacity * 2 : 256;
+		if ( capacity < client->inbox_n + size )
+			capacity = client->inbox_n + size;
+		unsigned char * const inbox = realloc(client->inbox, capacity);
+		if ( !inbox )
+		{
+			sim->out_of_memory = 1;
+			return;
+		}
+		client->inbox = inbox;
+		client->inbox_capacity = capacity;
+	}
+	memcpy(client->inbox + client->inbox_n, cur, size);
+	client->inbox_n += size;
+}
+
+/* Takes the reply to the upgrade request and the headers of the
+ * WebSocket frames out of what the server sends a WebSocket client,
+ * the payloads of binary frames going to its inbox, and counts the
+ * pongs */
+static void
+unwrap_websocket
+(
+ Sim * sim,
+ SimClient * client,
+ const unsigned char * cur,
+ const unsigned char * const end
+)
+{
+	static const char reply[] = websocket_reply;
+	
+	for ( ; cur != end && client->upgrade_n != sizeof(reply) - 1 ; ++cur )
+		if ( *cur != (unsigned char)reply[client->upgrade_n++] )
+		{
+			++sim->garbled;
+			client->upgrade_n = sizeof(reply) - 1;
+		}
+	
+	while ( cur != end )
+	{
+		if ( !client->ws_remaining && client->ws_header_n < 2 )
+		{
+			client->ws_header[client->ws_header_n++] = *cur++;
+			continue;
+		}
+		if ( client->ws_header_n )
+		{
+			const unsigned char length = client->ws_header[1] & 0x7F;
+			const size_t header_size = 2 + (length == 127 ? 8 : length == 126 ? 2 : 0);
+			if ( client->ws_header_n != header_size )
+			{
+				client->ws_header[client->ws_header_n++] = *cur++;
+				if ( client->ws_header_n != header_size )
+					continue;
+			}
+			
+			/* Never fragmented nor masked, and nothing after a Close */
+			const unsigned char opcode = client->ws_header[0] & 0x0F;
+			if ( !(client->ws_header[0] & 0x80) || client->ws_header[1] & 0x80 || (opcode != websocket_binary && opcode != websocket_pong && opcode != websocket_close) || client->closes )
+				++sim->garbled;
+			client->ws_remaining = length < 126 ? length : 0;
+			for ( size_t i = 2 ; i != header_size ; ++i )
+				client->ws_remaining = client->ws_remaining << 8 | client->ws_header[i];
+			client->ws_opcode = opcode;
+			client->pongs += opcode == websocket_pong;
+			client->closes += opcode == websocket_close;
+			client->ws_header_n = 0;
+			continue;
+		}
+		
+		const size_t n = client->ws_remaining < (uint64_t)(end - cur) ? (size_t)client->ws_remaining : (size_t)(end - cur);
+		if ( client->ws_opcode == websocket_binary )
+			append_inbox(sim, client, cur, n);
+		else
+		if ( client->ws_opcode == websocket_close )
+			for ( size_t i = 0 ; i != n ; ++i )
+				client->close_status = client->close_status << 8 | cur[i];
+		client->ws_remaining -= n;
+		cur += n;
+	}
+}
+
+/* What a client makes of what the server sends it */
+static void
+parse_frames
+(
+ Sim * sim,
+ SimClient * client,
+ const unsigned char * cur,
+ const unsigned char * const end
+)
+{
+	if ( client->websocket )
+		unwrap_websocket(sim, client, cur, end);
+	else
+		append_inbox(sim, client, cur, (size_t)(end - cur));
+	/* As with nothing but the reply to the upgrade request in */
+	if ( !client->inbox_n )
+		return;
+	
+	const unsigned char * in = client->inbox;
+	const unsigned char * const in_end = in + client->inbox_n;
+	for ( size_t taken ; (taken = client->v2 ? take_v2_frame(sim, client, in, in_end) : take_v1_frame(sim, client, in, in_end)) ; )
+		in += taken;
+	
+	client->inbox_n = (size_t)(in_end - in);
+	memmove(client->inbox, in, client->inbox_n);
+}
+
+static void
+deliver_recv
+(
+ Sim * sim,
+ SimClient * client
+)
+{
+	ClientData * const client_data = client->client_data;
+	const uint64_t start = platform_now_ns();
+	
+	client->recv_pending = 0;
+	client->recv_ready = 0;
+	
+	if ( client->closed || client->read == client->reset_at )
+	{
+		/* Aborted, or reset by the peer */
+		core_recv_failed(&sim->core, client_data);
+	}
+	else
+	if ( client->written > client->read )
+	{
+		size_t size = client->written - client->read;
+		if ( size > client->recv_size )
+			size = client->recv_size;
+		if ( sim->options->recv_chunk )
+		{
+			const size_t chunk = 1 + next_random(sim) % sim->options->recv_chunk;
+			if ( size > chunk )
+				size = chunk;
+		}
+		if ( client->reset_at != SIZE_MAX && size > client->reset_at - client->read )
+			size = client->reset_at - client->read;
+		
+		if ( size )
+			memcpy(client->recv_buffer, client->stream + client->read, size);
+		client->read += size;
+		core_recv_completed(&sim->core, client_data, size);
+	}
+	else
+		core_recv_completed(&sim->core, client_data, 0);
+	
+	sim->core_ns += platform_now_ns() - start;
+}
+
+static void
+deliver_send
+(
+ Sim * sim,
+ SimClient * client
+)
+{
+	ClientData * const client_data = client->client_data;
+	uint64_t start;
+	
+	client->send_pending = 0;
+	
+	if ( client->closed )
+	{
+		start = platform_now_ns();
+		core_send_failed(&sim->core, client_data);
+	}
+	else
+	{
+		size_t total = 0;
+		for ( size_t i = 0 ; i != client->send_buffers_n ; ++i )
+			total += client->send_buffers[i].len;
+		
+		/* Slow readers' sends only go through partially */
+		size_t size = client->slow ? 1 + next_random(sim) % total : total;
+		for ( size_t i = 0, left = size ; left ; ++i )
+		{
+			const size_t part = left < client->send_buffers[i].len ? left : client->send_buffers[i].len;
+			parse_frames(sim, client, (const unsigned char *)client->send_buffers[i].buf, (const unsigned char *)client->send_buffers[i].buf + part);
+			left -= part;
+		}
+		
+		start = platform_now_ns();
+		core_send_completed(&sim->core, client_data, size);
+	}
+	
+	sim->core_ns += platform_now_ns() - start;
+}
+
+static void
+write_next
+(
+ Sim * sim,
+ SimClient * client
+)
+{
+	while ( client->frames_written != client->frames_n && client->frame_ends[client->frames_written] <= client->written )
+		++client->frames_written;
+	client->written = client->frames_written != client->frames_n && client->frame_ends[client->frames_written] < client->stream_size ? client->frame_ends[client->frames_written] : client->stream_size;
+	if ( client->written != client->stream_size )
+		push_timed(sim, sim->now + sim->options->interval, (uint32_t)(client - sim->clients), timed_write, 0);
+	else
+	if ( client->hangs_up )
+		client->hung_up = 1;
+	
+	check_recv_ready(sim, client);
+}
+
+/* Delivers completions until there's none left to come */
+static void
+run_until_quiet
+(
+ Sim * sim
+)
+{
+	while ( !sim->out_of_memory )
+	{
+		while ( sim->timed_n && sim->timed[0].due <= sim->now )
+		{
+			const Timed timed = pop_timed(sim);
+			SimClient * const client = sim->clients + timed.client;
+			switch ( timed.type )
+			{
+				case timed_timer:
+					push_ready(sim, timed.client, event_timer, timed.timer);
+					break;
+				case timed_send:
+					push_ready(sim, timed.client, event_send, 0);
+					break;
+				case timed_write:
+					write_next(sim, client);
+					break;
+			}
+		}
+		
+		if ( sim->ready_n )
+		{
+			/* As the server's workers harvest them: as many as there
+			 * are, up to a batch, which is done with as a whole */
+			size_t harvest = sim->batch.slots ? sim->options->dequeue_batch : 1;
+			if ( sim->batch.slots )
+				core_batch_begin(&sim->core, &sim->batch);
+			
+			for ( ; harvest && sim->ready_n ; --harvest )
+			{
+				const size_t i = next_random(sim) % sim->ready_n;
+				const Event event = sim->ready[i];
+				SimClient * const client = sim->clients + event.client;
+				sim->ready[i] = sim->ready[--sim->ready_n];
+				
+				switch ( event.type )
+				{
+					case event_recv:
+						deliver_recv(sim, client);
+						break;
+					case event_send:
+						deliver_send(sim, client);
+						break;
+					case event_timer:
+					{
+						const uint64_t start = platform_now_ns();
+						core_timer_fired(&sim->core, client->client_data, (enum CoreTimer)event.timer);
+						sim->core_ns += platform_now_ns() - start;
+						break;
+					}
+				}
+				
+				++sim->completions;
+				sim->now += sim->options->step;
+			}
+			
+			if ( sim->batch.slots )
+			{
+				const uint64_t start = platform_now_ns();
+				core_batch_end(&sim->core, &sim->batch);
+				sim->core_ns += platform_now_ns() - start;
+			}
+		}
+		else
+		if ( sim->timed_n )
+			sim->now = sim->timed[0].due;
+		else
+			break;
+	}
+}
+
+static unsigned char *
+put_masked_frame
+(
+ Sim * sim,
+ unsigned char * out,
+ unsigned char first_byte,
+ const unsigned char * payload,
+ size_t size
+)
+{
+	const uint64_t mask = next_random(sim);
+	
+	*out++ = first_byte;
+	if ( size < 126 )
+		*out++ = (unsigned char)(0x80 | size);
+	else
+	if ( size <= 0xFFFF )
+	{
+		*out++ = 0x80 | 126;
+		*out++ = (unsigned char)(size >> 8);
+		*out++ = (unsigned char)size;
+	}
+	else
+	{
+		*out++ = 0x80 | 127;
+		for ( int shift = 56 ; shift >= 0 ; shift -= 8 )
+			*out++ = (unsigned char)((uint64_t)size >> shift);
+	}
+	for ( size_t i = 0 ; i != 4 ; ++i )
+		out[i] = (unsigned char)(mask >> 8 * i);
+	for ( size_t i = 0 ; i != size ; ++i )
+		out[4 + i] = payload[i] ^ out[i & 3];
+	return out + 4 + size;
+}
+
+/* Has the client send its stream in WebSocket frames after the upgrade
+ * request, each of its own frames split into up to websocket_fragments
+ * of them, with a ping before the last one now and then. Returns 0 if
+ * it's out of memory. */
+static int
+wrap_websocket
+(
+ Sim * sim,
+ SimClient * client,
+ size_t * nickname_frame_size
+)
+{
+	static const unsigned char ping[] = "ping";
+	const size_t segments_n = 1 + client->frames_n;
+	unsigned char * const stream = malloc(sizeof(websocket_request) - 1 + segments_n * (2 + 4 + sizeof(ping) - 1 + websocket_fragments * 14) + client->stream_size);
+	
+	if ( !stream )
+		return 0;
+	
+	unsigned char * out = stream;
+	memcpy(out, websocket_request, sizeof(websocket_request) - 1);
+	out += sizeof(websocket_request) - 1;
+	
+	for ( size_t segment = 0, start = 0 ; segment != segments_n ; ++segment )
+	{
+		const size_t end = segment ? client->frame_ends[segment - 1] : *nickname_frame_size;
+		size_t fragments = 1 + next_random(sim) % websocket_fragments;
+		if ( fragments > end - start )
+			fragments = end - start;
+		const int pinging = next_random(sim) % 4 == 0;
+		
+		/* None of them empty, so that the frame is all there
+		 * exactly when the last of them is */
+		for ( size_t i = 0, offset = start ; i != fragments ; ++i )
+		{
+			const int last = i + 1 == fragments;
+			const size_t size = last ? end - offset : 1 + next_random(sim) % (end - offset - (fragments - i - 1));
+			if ( last && pinging )
+			{
+				out = put_masked_frame(sim, out, 0x80 | websocket_ping, ping, sizeof(ping) - 1);
+				++client->pings;
+			}
+			out = put_masked_frame(sim, out, (unsigned char)((last ? 0x80 : 0) | (i ? websocket_continuation : websocket_binary)), client->stream + offset, size);
+			offset += size;
+		}
+		
+		if ( segment )
+			client->frame_ends[segment - 1] = (size_t)(out - stream);
+		else
+			*nickname_frame_size = (size_t)(out - stream);
+		start = end;
+	}
+	
+	free(client->stream);
+	client->stream = stream;
+	client->stream_size = (size_t)(out - stream);
+	return 1;
+}
+
+/* Has a WebSocket client close its connection with the given status
+ * code, after everything else it sent */
+static void
+write_close
+(
+ Sim * sim,
+ SimClient * client,
+ unsigned short status
+)
+{
+	const unsigned char payload[2] = {(unsigned char)(status >> 8), (unsigned char)status};
+	unsigned char * const stream = realloc(client->stream, client->stream_size + 2 + 4 + sizeof(payload));
+	
+	if ( !stream )
+	{
+		sim->out_of_memory = 1;
+		return;
+	}
+	client->stream = stream;
+	client->stream_size = (size_t)(put_masked_frame(sim, stream + client->stream_size, 0x80 | websocket_close, payload, sizeof(payload)) - stream);
+	client->written = client->stream_size;
+	check_recv_ready(sim, client);
+}
+
+/* Fills what follows a message's sequence number: dots, or with
+ * unicode, accented Latin, CJK and emoji, in whole characters, for the
+ * text checks to have something to chew on */
+static void
+put_padding
+(
+ unsigned char * text,
+ size_t size,
+ unsigned long unicode
+)
+{
+	static const char * const characters[] = {"\xC3\xA9", "\xE4\xB8\xAD", "\xF0\x9F\x98\x80", "\xC3\xBC", "\xE3\x81\x82"};
+	size_t used = 0;
+	
+	for ( size_t i = 0 ; unicode ; i = (i + 1) % (sizeof(characters) / sizeof(*characters)) )
+	{
+		const size_t length = strlen(characters[i]);
+		if ( size - used < length )
+			break;
+		memcpy(text + used, characters[i], length);
+		used += length;
+	}
+	memset(text + used, '.', size - used);
+}
+
+/* Lays out what the client is going to send: its nickname, then its
+ * messages, each starting with its sequence number, in frames of one
+ * message each, or of up to messages_per_frame of them for v2 clients.
+ * Returns how many of them the server gets in full. */
+static unsigned long
+set_up_client
+(
+ Sim * sim,
+ SimClient * client,
+ unsigned long index
+)
+{
+	const struct sim_options * const options = sim->options;
+	unsigned char * cur;
+	
+	client->v2 = next_random(sim) % 100 < options->v2_clients;
+	client->batch = client->v2 && next_random(sim) % 2;
+	client->websocket = client->v2 && options->websocket_clients && next_random(sim) % 100 < options->websocket_clients;
+	
+	/* Version 1 can't carry longer messages, and version 2 not
+	 * longer than a frame */
+	size_t message_size = options->message_size;
+	if ( !client->v2 && message_size > 255 )
+		message_size = 255;
+	if ( client->v2 && message_size > sim->core.max_frame - varint_max_size )
+		message_size = sim->core.max_frame - varint_max_size;
+	
+	const size_t record_size = client->v2 ? varint_size((uint32_t)message_size) + message_size : 1 + message_size;
+	size_t per_frame = client->v2 && options->messages_per_frame ? options->messages_per_frame : 1;
+	if ( per_frame > sim->core.max_frame / record_size )
+		per_frame = sim->core.max_frame / record_size;
+	
+	client->frames_n = (options->messages + per_frame - 1) / per_frame;
+	client->stream = malloc(2 + varint_max_size + 1 + 16 + client->frames_n * varint_max_size + options->messages * record_size);
+	client->frame_ends = malloc((client->frames_n ? client->frames_n : 1) * sizeof(*client->frame_ends));
+	client->last_seq = calloc(checked_senders, sizeof(*client->last_seq));
+	if ( !client->stream || !client->frame_ends || !client->last_seq )
+		return 0;
+	
+	cur = client->stream;
+	if ( client->v2 )
+	{
+		*cur++ = protocol_v2_marker;
+		*cur++ = protocol_version;
+		cur += varint_put(cur, client->batch ? capability_batch : 0);
+	}
+	*cur = (unsigned char)sprintf((char *)cur + 1, "c%lu", index);
+	cur += 1 + *cur;
+	size_t nickname_frame_size = (size_t)(cur - client->stream);
+	
+	for ( unsigned long seq = 1, frame = 0 ; seq <= options->messages ; ++frame )
+	{
+		const size_t messages_n = options->messages - seq + 1 < per_frame ? options->messages - seq + 1 : per_frame;
+		if ( client->v2 )
+			cur += varint_put(cur, (uint32_t)(messages_n * record_size));
+		for ( const unsigned long last = seq + messages_n ; seq != last ; ++seq )
+		{
+			char digits[24];
+			const int digits_n = sprintf(digits, "%lu", seq);
+			if ( client->v2 )
+				cur += varint_put(cur, (uint32_t)message_size);
+			else
+				*cur++ = (unsigned char)message_size;
+			memcpy(cur, digits, digits_n);
+			put_padding(cur + digits_n, message_size - digits_n, options->unicode);
+			cur += message_size;
+		}
+		client->frame_ends[frame] = (size_t)(cur - client->stream);
+	}
+	client->stream_size = (size_t)(cur - client->stream);
+	client->reset_at = SIZE_MAX;
+	if ( client->websocket && !wrap_websocket(sim, client, &nickname_frame_size) )
+		return 0;
+	
+	const unsigned long fault = (unsigned long)(next_random(sim) % 100);
+	size_t cut = client->stream_size;
+	if ( fault < options->disconnects )
+	{
+		/* Hangs up somewhere in the middle */
+		cut = 1 + next_random(sim) % (client->stream_size - 1);
+		client->stream_size = cut;
+		client->hangs_up = 1;
+		client->faulty = 1;
+	}
+	else
+	if ( fault < options->disconnects + options->resets )
+	{
+		cut = client->reset_at = next_random(sim) % client->stream_size;
+		client->faulty = 1;
+	}
+	client->slow = next_random(sim) % 100 < options->slow_readers;
+	
+	/* Paced clients start off with just their nickname written */
+	client->written = options->interval && nickname_frame_size < client->stream_size ? nickname_frame_size : client->stream_size;
+	client->hung_up = client->hangs_up && client->written == client->stream_size;
+	
+	unsigned long complete = 0;
+	for ( size_t frame = 0 ; frame != client->frames_n && client->frame_ends[frame] <= cut ; ++frame )
+		complete += frame + 1 == client->frames_n ? options->messages - frame * per_frame : per_frame;
+	return complete;
+}
+
+static void
+free_sim
+(
+ Sim * sim
+)
+{
+	if ( sim->clients )
+	{
+		for ( unsigned long i = 0 ; i != sim->options->clients ; ++i )
+		{
+			free(sim->clients[i].stream);
+			free(sim->clients[i].frame_ends);
+			free(sim->clients[i].inbox);
+			free(sim->clients[i].last_seq);
+		}
+	}
+	core_batch_cleanup(&sim->batch);
+	free(sim->clients);
+	free(sim->ready);
+	free(sim->timed);
+}
+
+static int
+run
+(
+ const struct sim_options * options,
+ unsigned long seed
+)
+{
+	Sim sim = {
+		.options = options,
+		.random = 0x9E3779B97F4A7C15ULL ^ seed
+	};
+	const Transport transport = {
+		.context = &sim,
+		.recv = sim_recv,
+		.send = sim_send,
+		.close = sim_close,
+		.set_timer = sim_set_timer,
+		.release = sim_release,
+		.now = sim_now,
+		.request_help = options->fan_out_threshold ? sim_request_help : NULL
+	};
+	const CoreOptions core_options = {
+		.capacity = options->clients,
+		.rate_messages = options->rate_messages,
+		.rate_bytes = options->rate_bytes,
+		.coalescing_window = (uint32_t)options->coalescing_window,
+		.frames_per_send = options->frames_per_send,
+		.max_frame = (uint32_t)options->max_frame,
+		.text_policy = options->text_policy,
+		.fan_out_threshold = options->fan_out_threshold,
+		.fan_out_chunk = chunk_slots,
+		.idle_recvs = options->idle_recvs != 0
+	};
+	uint64_t expected = 0;
+	int rv = 1;
+	
+	if ( !(sim.clients = calloc(options->clients, sizeof(*sim.clients))) || !core_init(&sim.core, &transport, &core_options) )
+	{
+		logmsg("couldn't allocate memory for the simulation");
+		free_sim(&sim);
+		return 0;
+	}
+	if ( options->dequeue_batch > 1 && !core_batch_init(&sim.core, &sim.batch) )
+	{
+		logmsg("couldn't allocate memory for the simulation");
+		core_cleanup(&sim.core);
+		free_sim(&sim);
+		return 0;
+	}
+	
+	for ( unsigned long i = 0 ; i != options->clients ; ++i )
+	{
+		SimClient * const client = sim.clients + i;
+		
+		expected += set_up_client(&sim, client, i);
+		if ( !client->stream || !client->frame_ends || !client->last_seq || !(client->client_data = core_client_open(&sim.core, i)) )
+		{
+			logmsg("couldn't set up the simulated clients");
+			core_cleanup(&sim.core);
+			free_sim(&sim);
+			return 0;
+		}
+	}
+	
+	/* Everybody is connected before anybody gets to send anything */
+	for ( unsigned long i = 0 ; i != options->clients ; ++i )
+	{
+		if ( sim.clients[i].websocket )
+			core_client_start_websocket(&sim.core, sim.clients[i].client_data);
+		else
+			core_client_start(&sim.core, sim.clients[i].client_data);
+		if ( sim.clients[i].written != sim.clients[i].stream_size )
+			push_timed(&sim, next_random(&sim) % options->interval, (uint32_t)i, timed_write, 0);
+	}
+	
+	run_until_quiet(&sim);
+	
+	const uint64_t virtual_time = sim.now;
+	const uint64_t completions = sim.completions;
+	const uint64_t core_ns = sim.core_ns;
+	unsigned long lost = 0;
+	unsigned long disconnected = 0;
+	unsigned long unanswered = 0; // WebSocket clients whose pings weren't
+	
+	for ( unsigned long i = 0 ; i != options->clients ; ++i )
+	{
+		const SimClient * const client = sim.clients + i;
+		if ( client->faulty )
+			continue;
+		
+		if ( client->released || client->client_data->closing )
+			++disconnected;
+		else
+		/* It gets what's broadcast from when it has said which
+		 * protocol it speaks */
+		if ( client->frames_received + sim.core.queues[i].dropped != sim.core.messages - client->client_data->joined_at )
+			++lost;
+		
+		/* Only the latest ping of those read together is answered */
+		if ( client->pongs > client->pings || (client->pings && !client->pongs) )
+			++unanswered;
+	}
+	
+	logmsgf("seed %lu: %"PRIu64" of %"PRIu64" messages broadcast to %lu clients, %"PRIu64" delivered in %"PRIu64" sends (%.3f sends per delivered message), %"PRIu64" dropped; %"PRIu64" completions in %.3f s of virtual time\n", seed, sim.core.messages, expected, options->clients, sim.core.messages_delivered, sim.core.sends, sim.core.messages_delivered ? (double)sim.core.sends / sim.core.messages_delivered : 0., sim.core.messages_dropped, completions, virtual_time / 1e6);
+	if ( sim.core.fanned_out )
+		logmsgf("%"PRIu64" broadcasts fanned out in parallel\n", sim.core.fanned_out);
+	if ( sim.idle_recvs )
+		logmsgf("%"PRIu64" recvs of 0 bytes for idle clients\n", sim.idle_recvs);
+	if ( sim.core.messages && sim.core.messages_delivered )
+		logmsgf("core: %.3f ms, %.0f ns per message broadcast, %.1f ns per message delivered\n", core_ns / 1e6, (double)core_ns / sim.core.messages, (double)core_ns / sim.core.messages_delivered);
+	
+	if ( sim.out_of_memory )
+	{
+		logmsg("FAILED: ran out of memory");
+		rv = 0;
+	}
+	if ( sim.core.messages != expected )
+	{
+		logmsgf("FAILED: %"PRIu64" messages were to be broadcast\n", expected);
+		rv = 0;
+	}
+	if ( disconnected )
+	{
+		logmsgf("FAILED: %lu well-behaved clients were disconnected\n", disconnected);
+		rv = 0;
+	}
+	if ( lost )
+	{
+		logmsgf("FAILED: %lu well-behaved clients neither got nor missed some messages\n", lost);
+		rv = 0;
+	}
+	if ( unanswered )
+	{
+		logmsgf("FAILED: %lu WebSocket clients got no pong or too many\n", unanswered);
+		rv = 0;
+	}
+	if ( sim.out_of_order || sim.garbled )
+	{
+		logmsgf("FAILED: %"PRIu64" messages out of order, %"PRIu64" garbled\n", sim.out_of_order, sim.garbled);
+		rv = 0;
+	}
+	
+	/* Then every other WebSocket client closes its connection, having
+	 * its Close echoed, and the server drains, which has the others
+	 * sent one; either way the server closes the connection once the
+	 * Close is out */
+	for ( unsigned long i = 0 ; i != options->clients ; ++i )
+		if ( sim.clients[i].websocket && !sim.clients[i].faulty && i % 2 )
+			write_close(&sim, sim.clients + i, websocket_normal_closure);
+	run_until_quiet(&sim);
+	core_drain_begin(&sim.core);
+	run_until_quiet(&sim);
+	
+	unsigned long unclosed = 0;
+	for ( unsigned long i = 0 ; i != options->clients ; ++i )
+	{
+		const SimClient * const client = sim.clients + i;
+		if ( client->websocket && !client->faulty && (client->closes != 1 || client->close_status != (i % 2 ? websocket_normal_closure : websocket_going_away) || !client->closed) )
+			++unclosed;
+	}
+	if ( unclosed )
+	{
+		logmsgf("FAILED: %lu WebSocket clients weren't sent the Close they were to be, or weren't disconnected after it\n", unclosed);
+		rv = 0;
+	}
+	core_drain_end(&sim.core);
+	
+	/* Then everybody hangs up */
+	for ( unsigned long i = 0 ; i != options->clients ; ++i )
+	{
+		sim.clients[i].hung_up = 1;
+		check_recv_ready(&sim, sim.clients + i);
+	}
+	run_until_quiet(&sim);
+	
+	unsigned long leaked = 0;
+	for ( unsigned long i = 0 ; i != options->clients ; ++i )
+		if ( !sim.clients[i].released || sim.core.clients[i].used )
+			++leaked;
+	if ( leaked )
+	{
+		logmsgf("FAILED: %lu client objects weren't released\n", leaked);
+		rv = 0;
+	}
+	
+	core_cleanup(&sim.core);
+	free_sim(&sim);
+	
+	return rv;
+}
+
+int main
+(
+ int argc,
+ char * * argv
+)
+{
+	char parameter = 0;
+	struct sim_options options = {
+		.clients = 100,
+		.messages = 20,
+		.message_size = 16,
+		.seed = 1,
+		.runs = 1,
+		.slow_latency = 2000,
+		.step = 1,
+		.text_policy = text_unchecked
+	};
+	unsigned long failed = 0;
+	
+	logout = stderr;
+	loglevel = loglevel_error;
+	
+	for ( char * * arg_cur = argv, * * const argv_end = argv+argc ; arg_cur != argv_end ; ++arg_cur )
+	{
+		char * const arg = *arg_cur;
+		if ( parameter )
+		{
+			const unsigned long value = strtoul(arg, NULL, 10);
+			switch ( parameter )
+			{
+				case 'c':
+					options.clients = value ? value : 1;
+					break;
+				case 'm':
+					options.messages = value;
+					break;
+				case 's':
+					/* Room for the sequence number is needed */
+					options.message_size = value < 12 ? 12 : value > varint_max ? varint_max : value;
+					break;
+				case 'S':
+					options.seed = value;
+					break;
+				case 'n':
+					options.runs = value;
+					break;
+				case 'r':
+					options.recv_chunk = value;
+					break;
+				case 'd':
+					options.disconnects = value;
+					break;
+				case 'e':
+					options.resets = value;
+					break;
+				case 'b':
+					options.slow_readers = value;
+					break;
+				case 'l':
+					options.slow_latency = value;
+					break;
+				case 'i':
+					options.interval = value;
+					break;
+				case 'k':
+					options.step = value;
+					break;
+				case 'R':
+					options.rate_messages = value;
+					break;
+				case 'B':
+					options.rate_bytes = value;
+					break;
+				case 'w':
+					options.coalescing_window = value;
+					break;
+				case 'g':
+					options.frames_per_send = value;
+					break;
+				case 'f':
+					options.max_frame = value;
+					break;
+				case 'P':
+					options.v2_clients = value;
+					break;
+				case 'M':
+					options.messages_per_frame = value;
+					break;
+				case 'W':
+					options.websocket_clients = value;
+					break;
+				case 'D':
+					options.dequeue_batch = value;
+					break;
+				case 'F':
+					options.fan_out_threshold = value;
+					break;
+				case 'z':
+					options.idle_recvs = value;
+					break;
+				case 'U':
+					options.unicode = value;
+					break;
+				case 'u':
+					if ( !strcmp(arg, "off") )
+						options.text_policy = text_unchecked;
+					else
+					if ( !strcmp(arg, "strip") )
+						options.text_policy = text_strip;
+					else
+					if ( !strcmp(arg, "reject") )
+						options.text_policy = text_reject;
+					else
+					{
+						/* As the server doesn't start with it either */
+						logmsgf("unknown text policy %s (-u), which is to be off, strip or reject\n", arg);
+						return 2;
+					}
+					break;
+				case 'v':
+					loglevel = (int)value;
+					break;
+			}
+			parameter = 0;
+		}
+		else
+		if ( *arg == '-' )
+			parameter = arg[1];
+	}
+	
+	for ( unsigned long run_n = 0 ; run_n != options.runs ; ++run_n )
+		if ( !run(&options, options.seed + run_n) )
+			++failed;
+	
+	if ( options.runs > 1 )
+		logmsgf("%lu of %lu runs failed\n", failed, options.runs);
+	
+	return failed != 0;
+}
@@ -0,0 +1,271 @@
+#include "stats.h"
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include "logmsg.h"
+#include "platform.h"
+#if defined(_WIN32)
+#include <windows.h>
+#include <sddl.h>
+#if defined(_MSC_VER)
+#pragma comment(lib, "advapi32.lib")
+#endif
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
+/* Readers give up on a block after this many tries */
+#define read_attempts 64
+
+
+thread_local StatsCounters stats_local;
+
+/* The segment mapped by this process, if any */
+static const StatsSegment * mapped;
+static int created;
+#if defined(_WIN32)
+static HANDLE mapping;
+#else
+static char shm_name[64];
+#endif
+
+#if defined(_WIN32)
+
+/* Services' segments are in the global namespace, for any session
+ * to see, which takes a privilege the server run from the command
+ * line may not have, in which case it's the session's own */
+static const char * const namespaces[] = {"Global\\", "Local\\"};
+
+static StatsSegment *
+map_segment
+(
+ unsigned port,
+ int create
+)
+{
+	char name[64];
+	
+	for ( size_t i = 0 ; i != sizeof(namespaces) / sizeof(*namespaces) ; ++i )
+	{
+		snprintf(name, sizeof(name), "%slappenchat-stats-%u", namespaces[i], port);
+		if ( create )
+		{
+			/* Anyone logged on may read it, only the server write to it */
+			SECURITY_ATTRIBUTES attributes = {sizeof(attributes), NULL, FALSE};
+			if ( !ConvertStringSecurityDescriptorToSecurityDescriptorA("D:P(A;;GA;;;SY)(A;;GA;;;BA)(A;;GA;;;OW)(A;;GR;;;AU)", SDDL_REVISION_1, &attributes.lpSecurityDescriptor, NULL) )
+				return NULL;
+			mapping = CreateFileMappingA(INVALID_HANDLE_VALUE, &attributes, PAGE_READWRITE, 0, sizeof(StatsSegment), name);
+			LocalFree(attributes.lpSecurityDescriptor);
+		}
+		else
+			mapping = OpenFileMappingA(FILE_MAP_READ, FALSE, name);
+		
+		if ( mapping )
+		{
+			StatsSegment * const segment = MapViewOfFile(mapping, create ? FILE_MAP_WRITE : FILE_MAP_READ, 0, 0, sizeof(StatsSegment));
+			if ( segment )
+				return segment;
+			CloseHandle(mapping);
+			mapping = NULL;
+		}
+	}
+	return NULL;
+}
+
+static void
+unmap_segment
+( void )
+{
+	UnmapViewOfFile((LPCVOID)mapped);
+	CloseHandle(mapping);
+}
+
+#else
+
+static StatsSegment *
+map_segment
+(
+ unsigned port,
+ int create
+)
+{
+	snprintf(shm_name, sizeof(shm_name), "/lappenchat-stats-%u", port);
+	
+	const int fd = shm_open(shm_name, create ? O_CREAT | O_RDWR : O_RDONLY, 0644);
+	if ( fd == -1 )
+		return NULL;
+	if ( create && ftruncate(fd, sizeof(StatsSegment)) )
+	{
+		close(fd);
+		return NULL;
+	}
+	
+	void * const segment = mmap(NULL, sizeof(StatsSegment), create ? PROT_READ | PROT_WRITE : PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	return segment == MAP_FAILED ? NULL : segment;
+}
+
+static void
+unmap_segment
+( void )
+{
+	munmap((void *)mapped, sizeof(StatsSegment));
+	if ( created )
+		shm_unlink(shm_name);
+}
+
+#endif
+
+StatsSegment *
+stats_create
+(
+ unsigned port
+)
+{
+	StatsSegment * segment = map_segment(port, 1);
+	
+	if ( segment )
+	{
+		mapped = segment;
+		created = 1;
+		logmsgf("publishing stats for lappenchat-top -p %u\n", port);
+	}
+	else
+	{
+		logmsg("couldn't create the shared memory segment for stats; they won't be published");
+		if ( !(segment = platform_alloc_aligned(sizeof(*segment))) )
+			return NULL;
+	}
+	
+	/* It may be left over from a server that was on the same port,
+	 * and kept around by a reader */
+	segment->magic = 0;
+	platform_store_fence();
+	memset((char *)segment + sizeof(segment->magic), 0, sizeof(*segment) - sizeof(segment->magic));
+	segment->version = stats_version;
+	segment->size = sizeof(*segment);
+	segment->workers_max = stats_max_workers;
+	segment->process_id = (uint32_t)platform_process_id();
+	segment->port = port;
+	platform_store_fence();
+	segment->magic = stats_magic;
+	return segment;
+}
+
+const StatsSegment *
+stats_open
+(
+ unsigned port
+)
+{
+	const StatsSegment * const segment = map_segment(port, 0);
+	if ( segment )
+		mapped = segment;
+	return segment;
+}
+
+void
+stats_close
+(
+ const StatsSegment * segment
+)
+{
+	if ( segment && segment == mapped )
+	{
+		/* For readers to tell the server is gone */
+		if ( created )
+			((StatsSegment *)segment)->magic = 0;
+		unmap_segment();
+		mapped = NULL;
+	}
+	else
+		platform_free_aligned((void *)segment);
+}
+
+void
+stats_write_begin
+(
+ volatile uint32_t * sequence
+)
+{
+	*sequence += 1;
+	platform_store_fence();
+}
+
+void
+stats_write_end
+(
+ volatile uint32_t * sequence
+)
+{
+	platform_store_fence();
+	*sequence += 1;
+}
+
+void
+stats_publish_worker
+(
+ StatsWorker * worker
+)
+{
+	stats_write_begin(&worker->sequence);
+	worker->counters = stats_local;
+	stats_write_end(&worker->sequence);
+}
+
+int
+stats_read
+(
+ const volatile uint32_t * sequence,
+ const void * block,
+ void * copy,
+ size_t size
+)
+{
+	for ( int attempt = 0 ; attempt != read_attempts ; ++attempt )
+	{
+		const uint32_t before = *sequence;
+		platform_load_fence();
+		memcpy(copy, block, size);
+		platform_load_fence();
+		if ( !(before & 1) && *sequence == before )
+			return 1;
+		platform_yield();
+	}
+	return 0;
+}
+
+const char *
+stats_lane_name
+(
+ unsigned lane
+)
+{
+	static const char * const names[stats_lanes] = {"chat", "backlog", "control"};
+	return lane < stats_lanes ? names[lane] : "?";
+}
+
+uint64_t
+stats_wait_percentile
+(
+ const uint64_t * buckets,
+ double share
+)
+{
+	uint64_t total = 0;
+	for ( unsigned i = 0 ; i != stats_wait_buckets ; ++i )
+		total += buckets[i];
+	
+	uint64_t seen = 0;
+	for ( unsigned i = 0 ; i != stats_wait_buckets ; ++i )
+	{
+		seen += buckets[i];
+		if ( seen && seen >= share * total )
+			return (uint64_t)1 << i;
+	}
+	return 0;
+}
@@ -0,0 +1,163 @@
+#ifndef STATS_H
+#define STATS_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include "platform.h"
+
+
+/* Live counters of the server's, published in a named shared memory
+ * segment for lappenchat-top to read without asking the server
+ * anything. Every block in it has a sequence number of its own, which
+ * its one writer makes odd while it's updating the block and even
+ * again once it's done (a seqlock). Readers copy a block out and check
+ * that the sequence number was even and the same before and after;
+ * they never write to the segment, so they can't hold the writers up.
+ *
+ * Each worker thread's counters are bumped by the core in a block of
+ * thread-local memory, and copied to the thread's block in the segment
+ * after every batch of completions. The rest is published by the main thread a
+ * few times a second. */
+
+#define stats_magic 0x5453434Cu // "LCST"
+#define stats_version 4
+#define stats_max_workers 256
+#define stats_interval_ms 250
+/* The outbound lanes and the buckets of their queue-time
+ * histograms, as in core.h */
+#define stats_lanes 3
+#define stats_wait_buckets 24
+
+typedef struct {
+	uint64_t messages_in;
+	uint64_t bytes_in; // message text
+	uint64_t messages_out;
+	uint64_t bytes_out; // frames, as sent
+	uint64_t completions;
+	uint64_t dequeues; // of batches of completions
+	uint64_t busy_ns;
+} StatsCounters;
+
+typedef struct {
+	cache_aligned volatile uint32_t sequence;
+	uint32_t running; // 0 once the thread has exited
+	StatsCounters counters;
+} StatsWorker;
+
+typedef struct {
+	uint64_t uptime_ms;
+	uint32_t clients;
+	uint32_t capacity;
+	uint32_t workers;
+	uint32_t workers_min;
+	uint32_t workers_max;
+	/* Frames waiting to be sent, altogether and to the
+	 * client with the most of them */
+	uint32_t queued;
+	uint32_t queued_most;
+	uint64_t probe_wait_us; // of the elastic pool, see scaler.h
+	uint64_t messages_broadcast;
+	uint64_t messages_delivered;
+	uint64_t sends;
+	/* Messages dropped because a client's queue was full, for their
+	 * text, and by the filter */
+	uint64_t dropped_queue_full;
+	uint64_t dropped_text;
+	uint64_t dropped_filter;
+	uint64_t masked;
+	uint64_t flagged;
+	uint64_t pool_grown;
+	uint64_t pool_shrunk;
+	/* Of the memory allocated for clients and messages, in bytes,
+	 * and what was done about the budgets (see core.h) */
+	uint64_t memory_used;
+	uint64_t memory_peak;
+	uint64_t memory_budget; // 0 if there's none
+	uint64_t clients_refused;
+	uint64_t clients_shed;
+	uint64_t frames_shed;
+	/* Frames sent from each lane, by how long they had waited */
+	uint64_t lane_waits[stats_lanes][stats_wait_buckets];
+} StatsServer;
+
+/* The layout itself, which readers check before anything else: any
+ * change to it is to come with a new stats_version */
+typedef struct {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t size; // of the whole segment
+	uint32_t workers_max;
+	uint32_t process_id;
+	uint32_t port;
+	cache_aligned volatile uint32_t sequence;
+	StatsServer server;
+	StatsWorker workers[stats_max_workers];
+} StatsSegment;
+
+/* The calling thread's, for the core to add to */
+extern thread_local StatsCounters stats_local;
+
+#define stats_count_in(messages, bytes) (stats_local.messages_in += (messages), stats_local.bytes_in += (bytes))
+#define stats_count_out(messages, bytes) (stats_local.messages_out += (messages), stats_local.bytes_out += (bytes))
+
+/* Creates the segment for the server on the given port, or if that
+ * fails, which it logs, private memory to the same effect, so that
+ * it's never NULL unless there's no memory at all */
+StatsSegment * stats_create
+(
+ unsigned port
+);
+
+/* Opens the segment of the server on the given port to be read,
+ * NULL if there's none */
+const StatsSegment * stats_open
+(
+ unsigned port
+);
+
+void stats_close
+(
+ const StatsSegment *
+);
+
+void stats_write_begin
+(
+ volatile uint32_t * sequence
+);
+
+void stats_write_end
+(
+ volatile uint32_t * sequence
+);
+
+/* Copies the thread's counters to its block */
+void stats_publish_worker
+(
+ StatsWorker *
+);
+
+const char * stats_lane_name
+(
+ unsigned lane
+);
+
+/* The wait within which the given share of the frames in a histogram
+ * of lane waits were sent, as the upper bound of its bucket in
+ * microseconds, the last bucket's being open-ended */
+uint64_t stats_wait_percentile
+(
+ const uint64_t * buckets,
+ double share
+);
+
+/* Copies a block out of the segment, returning 0 if it was being
+ * written to every time it tried */
+int stats_read
+(
+ const volatile uint32_t * sequence,
+ const void * block,
+ void * copy,
+ size_t size
+);
+
+#endif
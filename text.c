@@ -0,0 +1,565 @@
+#include "text.h"
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__) || defined(_M_X64) || defined(_M_IX86)
+#define text_x86 1
+#include <immintrin.h>
+#if defined(_MSC_VER)
+#include <intrin.h>
+#define target_avx2
+#define target_ssse3
+#define target_sse2
+#else
+#include <cpuid.h>
+#define target_avx2 __attribute__((target("avx2")))
+#define target_ssse3 __attribute__((target("ssse3")))
+#define target_sse2 __attribute__((target("sse2")))
+#endif
+#endif
+
+
+/* Takes the character the text starts with, returning how many bytes it
+ * took and adding to the flaws whatever is wrong with it */
+static size_t
+take_character
+(
+ const unsigned char * cur,
+ const unsigned char * end,
+ int * flaws
+)
+{
+	const unsigned char lead = *cur;
+	size_t length;
+	uint32_t code_point;
+	
+	if ( lead < 0x80 )
+	{
+		if ( (lead < 0x20 && lead != '\t' && lead != '\n') || lead == 0x7F )
+			*flaws |= text_controls;
+		return 1;
+	}
+	
+	if ( lead >= 0xC2 && lead <= 0xDF )
+		length = 2, code_point = lead & 0x1F;
+	else
+	if ( (lead & 0xF0) == 0xE0 )
+		length = 3, code_point = lead & 0x0F;
+	else
+	if ( lead >= 0xF0 && lead <= 0xF4 )
+		length = 4, code_point = lead & 0x07;
+	else
+	{
+		*flaws |= text_malformed;
+		return 1;
+	}
+	
+	for ( size_t i = 1 ; i != length ; ++i )
+	{
+		if ( cur + i == end || (cur[i] & 0xC0) != 0x80 )
+		{
+			*flaws |= text_malformed;
+			return i;
+		}
+		code_point = code_point << 6 | (cur[i] & 0x3F);
+	}
+	
+	/* Overlong, a surrogate, or beyond Unicode */
+	if ( (length == 3 && code_point < 0x800) || (length == 4 && (code_point < 0x10000 || code_point > 0x10FFFF)) || (code_point >= 0xD800 && code_point <= 0xDFFF) )
+		*flaws |= text_malformed;
+	else
+	if ( code_point <= 0x9F )
+		*flaws |= text_controls;
+	
+	return length;
+}
+
+static int
+check_scalar
+(
+ const unsigned char * text,
+ size_t size
+)
+{
+	const unsigned char * const end = text + size;
+	int flaws = 0;
+	
+	for ( const unsigned char * cur = text ; cur != end ; )
+		cur += take_character(cur, end, &flaws);
+	return flaws;
+}
+
+#if defined(text_x86)
+
+/* Chat is mostly ASCII, which gets checked 16 bytes at a time; the
+ * rest a character at a time */
+target_sse2 static int
+check_sse2
+(
+ const unsigned char * text,
+ size_t size
+)
+{
+	const unsigned char * const end = text + size;
+	const __m128i space = _mm_set1_epi8(0x20);
+	const __m128i tab = _mm_set1_epi8('\t');
+	const __m128i line_feed = _mm_set1_epi8('\n');
+	const __m128i del = _mm_set1_epi8(0x7F);
+	int flaws = 0;
+	
+	for ( const unsigned char * cur = text ; cur != end ; )
+	{
+		if ( end - cur >= 16 )
+		{
+			const __m128i input = _mm_loadu_si128((const __m128i *)cur);
+			/* Signed comparison, which is only of any use once the
+			 * bytes have turned out to be ASCII */
+			const __m128i controls = _mm_or_si128(_mm_andnot_si128(_mm_or_si128(_mm_cmpeq_epi8(input, tab), _mm_cmpeq_epi8(input, line_feed)), _mm_cmplt_epi8(input, space)), _mm_cmpeq_epi8(input, del));
+			if ( !_mm_movemask_epi8(_mm_or_si128(input, controls)) )
+			{
+				cur += 16;
+				continue;
+			}
+		}
+		cur += take_character(cur, end, &flaws);
+	}
+	return flaws;
+}
+
+/* The lookup algorithm of Keiser and Lemire, "Validating UTF-8 In Less
+ * Than One Instruction Per Byte" (2021): three table lookups on the
+ * nibbles of each byte and of the one before it flag every error that
+ * shows within two bytes, and the rest are continuation bytes that are
+ * or aren't expected. */
+
+#define too_short (1 << 0) // a lead byte followed by something else than a continuation
+#define too_long (1 << 1) // ASCII followed by a continuation
+#define overlong_3 (1 << 2)
+#define too_large (1 << 3)
+#define surrogate (1 << 4)
+#define overlong_2 (1 << 5)
+#define too_large_1000 (1 << 6)
+#define overlong_4 (1 << 6)
+#define two_conts (1 << 7) // two continuations, which may or may not be fine
+#define carry (too_short | too_long | two_conts)
+
+/* The three lookup tables, by the nibble looked up */
+#define byte_1_high_table \
+	too_long, too_long, too_long, too_long, \
+	too_long, too_long, too_long, too_long, \
+	two_conts, two_conts, two_conts, two_conts, \
+	too_short | overlong_2, \
+	too_short, \
+	too_short | overlong_3 | surrogate, \
+	too_short | too_large | too_large_1000 | overlong_4
+#define byte_1_low_table \
+	carry | overlong_3 | overlong_2 | overlong_4, \
+	carry | overlong_2, \
+	carry, \
+	carry, \
+	carry | too_large, \
+	carry | too_large | too_large_1000, \
+	carry | too_large | too_large_1000, \
+	carry | too_large | too_large_1000, \
+	carry | too_large | too_large_1000, \
+	carry | too_large | too_large_1000, \
+	carry | too_large | too_large_1000, \
+	carry | too_large | too_large_1000, \
+	carry | too_large | too_large_1000, \
+	carry | too_large | too_large_1000 | surrogate, \
+	carry | too_large | too_large_1000, \
+	carry | too_large | too_large_1000
+#define byte_2_high_table \
+	too_short, too_short, too_short, too_short, \
+	too_short, too_short, too_short, too_short, \
+	(char)(too_long | overlong_2 | two_conts | overlong_3 | too_large_1000 | overlong_4), \
+	(char)(too_long | overlong_2 | two_conts | overlong_3 | too_large), \
+	(char)(too_long | overlong_2 | two_conts | surrogate | too_large), \
+	(char)(too_long | overlong_2 | two_conts | surrogate | too_large), \
+	too_short, too_short, too_short, too_short
+/* What's subtracted from the last bytes of a block to tell lead bytes
+ * too close to its end for their continuations */
+#define incomplete_tail (char)(0xF0 - 1), (char)(0xE0 - 1), (char)(0xC0 - 1)
+
+/* The same algorithm on 16 bytes at a time, for processors without
+ * AVX2; pshufb is all it takes over SSE2 */
+
+typedef struct {
+	__m128i error;
+	__m128i controls;
+	__m128i previous;
+	__m128i previous_incomplete;
+} Ssse3State;
+
+target_ssse3 static inline __m128i
+at_most_ssse3
+(
+ __m128i input,
+ char value
+)
+{
+	return _mm_cmpeq_epi8(_mm_min_epu8(input, _mm_set1_epi8(value)), input);
+}
+
+target_ssse3 static inline __m128i
+ascii_controls_ssse3
+(
+ __m128i input
+)
+{
+	const __m128i exempt = _mm_or_si128(_mm_cmpeq_epi8(input, _mm_set1_epi8('\t')), _mm_cmpeq_epi8(input, _mm_set1_epi8('\n')));
+	return _mm_or_si128(_mm_andnot_si128(exempt, at_most_ssse3(input, 0x1F)), _mm_cmpeq_epi8(input, _mm_set1_epi8(0x7F)));
+}
+
+target_ssse3 static inline void
+check_ssse3_block
+(
+ Ssse3State * state,
+ __m128i input
+)
+{
+	if ( !_mm_movemask_epi8(input) )
+	{
+		state->error = _mm_or_si128(state->error, state->previous_incomplete);
+		state->controls = _mm_or_si128(state->controls, ascii_controls_ssse3(input));
+		state->previous_incomplete = _mm_setzero_si128();
+		state->previous = input;
+		return;
+	}
+	
+	const __m128i low_nibble_mask = _mm_set1_epi8(0x0F);
+	const __m128i previous1 = _mm_alignr_epi8(input, state->previous, 16 - 1);
+	const __m128i byte_1_high = _mm_shuffle_epi8(_mm_setr_epi8(byte_1_high_table), _mm_and_si128(_mm_srli_epi16(previous1, 4), low_nibble_mask));
+	const __m128i byte_1_low = _mm_shuffle_epi8(_mm_setr_epi8(byte_1_low_table), _mm_and_si128(previous1, low_nibble_mask));
+	const __m128i byte_2_high = _mm_shuffle_epi8(_mm_setr_epi8(byte_2_high_table), _mm_and_si128(_mm_srli_epi16(input, 4), low_nibble_mask));
+	const __m128i special_cases = _mm_and_si128(_mm_and_si128(byte_1_high, byte_1_low), byte_2_high);
+	
+	const __m128i third = _mm_subs_epu8(_mm_alignr_epi8(input, state->previous, 16 - 2), _mm_set1_epi8((char)(0xE0 - 0x80)));
+	const __m128i fourth = _mm_subs_epu8(_mm_alignr_epi8(input, state->previous, 16 - 3), _mm_set1_epi8((char)(0xF0 - 0x80)));
+	const __m128i expected = _mm_and_si128(_mm_or_si128(third, fourth), _mm_set1_epi8((char)0x80));
+	
+	state->error = _mm_or_si128(state->error, _mm_xor_si128(expected, special_cases));
+	
+	const __m128i c1 = _mm_and_si128(_mm_cmpeq_epi8(previous1, _mm_set1_epi8((char)0xC2)), _mm_cmpeq_epi8(_mm_and_si128(input, _mm_set1_epi8((char)0xE0)), _mm_set1_epi8((char)0x80)));
+	state->controls = _mm_or_si128(state->controls, _mm_or_si128(ascii_controls_ssse3(input), c1));
+	
+	state->previous_incomplete = _mm_subs_epu8(input, _mm_setr_epi8(
+		-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+		incomplete_tail
+	));
+	state->previous = input;
+}
+
+target_ssse3 static int
+check_ssse3
+(
+ const unsigned char * text,
+ size_t size
+)
+{
+	Ssse3State state = {
+		_mm_setzero_si128(),
+		_mm_setzero_si128(),
+		_mm_setzero_si128(),
+		_mm_setzero_si128()
+	};
+	size_t offset = 0;
+	
+	for ( ; offset + 16 <= size ; offset += 16 )
+		check_ssse3_block(&state, _mm_loadu_si128((const __m128i *)(text + offset)));
+	if ( offset != size )
+	{
+		unsigned char tail[16];
+		memset(tail, ' ', sizeof(tail));
+		memcpy(tail, text + offset, size - offset);
+		check_ssse3_block(&state, _mm_loadu_si128((const __m128i *)tail));
+	}
+	state.error = _mm_or_si128(state.error, state.previous_incomplete);
+	
+	return (_mm_movemask_epi8(_mm_cmpeq_epi8(state.error, _mm_setzero_si128())) == 0xFFFF ? 0 : text_malformed) | (_mm_movemask_epi8(_mm_cmpeq_epi8(state.controls, _mm_setzero_si128())) == 0xFFFF ? 0 : text_controls);
+}
+
+#define table16(...) _mm256_setr_epi8(__VA_ARGS__, __VA_ARGS__)
+
+typedef struct {
+	__m256i error;
+	__m256i controls;
+	__m256i previous;
+	__m256i previous_incomplete;
+} Avx2State;
+
+target_avx2 static inline __m256i
+high_nibbles
+(
+ __m256i input
+)
+{
+	return _mm256_and_si256(_mm256_srli_epi16(input, 4), _mm256_set1_epi8(0x0F));
+}
+
+/* The input shifted by n bytes, the previous input's last ones
+ * coming first */
+#define shifted(input, previous, n) _mm256_alignr_epi8(input, _mm256_permute2x128_si256(previous, input, 0x21), 16 - (n))
+
+target_avx2 static inline __m256i
+at_most
+(
+ __m256i input,
+ char value
+)
+{
+	return _mm256_cmpeq_epi8(_mm256_min_epu8(input, _mm256_set1_epi8(value)), input);
+}
+
+target_avx2 static inline __m256i
+ascii_controls
+(
+ __m256i input
+)
+{
+	const __m256i exempt = _mm256_or_si256(_mm256_cmpeq_epi8(input, _mm256_set1_epi8('\t')), _mm256_cmpeq_epi8(input, _mm256_set1_epi8('\n')));
+	return _mm256_or_si256(_mm256_andnot_si256(exempt, at_most(input, 0x1F)), _mm256_cmpeq_epi8(input, _mm256_set1_epi8(0x7F)));
+}
+
+target_avx2 static inline void
+check_avx2_block
+(
+ Avx2State * state,
+ __m256i input
+)
+{
+	if ( !_mm256_movemask_epi8(input) )
+	{
+		/* ASCII, which only a character left incomplete can make
+		 * malformed */
+		state->error = _mm256_or_si256(state->error, state->previous_incomplete);
+		state->controls = _mm256_or_si256(state->controls, ascii_controls(input));
+		state->previous_incomplete = _mm256_setzero_si256();
+		state->previous = input;
+		return;
+	}
+	
+	const __m256i previous1 = shifted(input, state->previous, 1);
+	const __m256i byte_1_high = _mm256_shuffle_epi8(table16(byte_1_high_table), high_nibbles(previous1));
+	const __m256i byte_1_low = _mm256_shuffle_epi8(table16(byte_1_low_table), _mm256_and_si256(previous1, _mm256_set1_epi8(0x0F)));
+	const __m256i byte_2_high = _mm256_shuffle_epi8(table16(byte_2_high_table), high_nibbles(input));
+	const __m256i special_cases = _mm256_and_si256(_mm256_and_si256(byte_1_high, byte_1_low), byte_2_high);
+	
+	/* Continuations two and three bytes after a lead byte */
+	const __m256i third = _mm256_subs_epu8(shifted(input, state->previous, 2), _mm256_set1_epi8((char)(0xE0 - 0x80)));
+	const __m256i fourth = _mm256_subs_epu8(shifted(input, state->previous, 3), _mm256_set1_epi8((char)(0xF0 - 0x80)));
+	const __m256i expected = _mm256_and_si256(_mm256_or_si256(third, fourth), _mm256_set1_epi8((char)0x80));
+	
+	state->error = _mm256_or_si256(state->error, _mm256_xor_si256(expected, special_cases));
+	
+	/* C1 controls are 0xC2 followed by 0x80 to 0x9F */
+	const __m256i c1 = _mm256_and_si256(_mm256_cmpeq_epi8(previous1, _mm256_set1_epi8((char)0xC2)), _mm256_cmpeq_epi8(_mm256_and_si256(input, _mm256_set1_epi8((char)0xE0)), _mm256_set1_epi8((char)0x80)));
+	state->controls = _mm256_or_si256(state->controls, _mm256_or_si256(ascii_controls(input), c1));
+	
+	/* A lead byte too close to the end for its continuations */
+	state->previous_incomplete = _mm256_subs_epu8(input, _mm256_setr_epi8(
+		-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+		-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+		incomplete_tail
+	));
+	state->previous = input;
+}
+
+target_avx2 static int
+check_avx2
+(
+ const unsigned char * text,
+ size_t size
+)
+{
+	Avx2State state = {
+		_mm256_setzero_si256(),
+		_mm256_setzero_si256(),
+		_mm256_setzero_si256(),
+		_mm256_setzero_si256()
+	};
+	size_t offset = 0;
+	
+	for ( ; offset + 32 <= size ; offset += 32 )
+		check_avx2_block(&state, _mm256_loadu_si256((const __m256i *)(text + offset)));
+	if ( offset != size )
+	{
+		/* Padded with spaces, which are neither controls
+		 * nor continuations */
+		unsigned char tail[32];
+		memset(tail, ' ', sizeof(tail));
+		memcpy(tail, text + offset, size - offset);
+		check_avx2_block(&state, _mm256_loadu_si256((const __m256i *)tail));
+	}
+	state.error = _mm256_or_si256(state.error, state.previous_incomplete);
+	
+	return (_mm256_testz_si256(state.error, state.error) ? 0 : text_malformed) | (_mm256_testz_si256(state.controls, state.controls) ? 0 : text_controls);
+}
+
+static void
+cpuid
+(
+ int leaf,
+ int subleaf,
+ unsigned registers[4]
+)
+{
+#if defined(_MSC_VER)
+	__cpuidex((int *)registers, leaf, subleaf);
+#else
+	__cpuid_count(leaf, subleaf, registers[0], registers[1], registers[2], registers[3]);
+#endif
+}
+
+static int
+supports
+(
+ enum TextKernel kernel
+)
+{
+	unsigned registers[4];
+	
+	cpuid(0, 0, registers);
+	const unsigned max_leaf = registers[0];
+	cpuid(1, 0, registers);
+	
+	switch ( kernel )
+	{
+		case text_kernel_sse2:
+			return (registers[3] >> 26) & 1;
+		
+		case text_kernel_ssse3:
+			return (registers[2] >> 9) & 1;
+		
+		case text_kernel_avx2:
+		{
+			/* The OS has to save the YMM registers as well */
+			if ( !((registers[2] >> 27) & 1) || !((registers[2] >> 28) & 1) || max_leaf < 7 )
+				return 0;
+#if defined(_MSC_VER)
+			const uint64_t xcr0 = _xgetbv(0);
+#else
+			uint32_t eax, edx;
+			__asm__ ("xgetbv" : "=a"(eax), "=d"(edx) : "c"(0));
+			const uint64_t xcr0 = (uint64_t)edx << 32 | eax;
+#endif
+			if ( (xcr0 & 6) != 6 )
+				return 0;
+			cpuid(7, 0, registers);
+			return (registers[1] >> 5) & 1;
+		}
+		
+		default:
+			return 1;
+	}
+}
+
+#else
+
+static int
+supports
+(
+ enum TextKernel kernel
+)
+{
+	return kernel == text_kernel_scalar;
+}
+
+#endif
+
+static int (*check)(const unsigned char *, size_t) = check_scalar;
+static enum TextKernel kernel = text_kernel_scalar;
+
+int
+text_use
+(
+ enum TextKernel new_kernel
+)
+{
+	if ( new_kernel >= text_kernels || !supports(new_kernel) )
+		return 0;
+	
+	switch ( new_kernel )
+	{
+#if defined(text_x86)
+		case text_kernel_avx2:
+			check = check_avx2;
+			break;
+		case text_kernel_ssse3:
+			check = check_ssse3;
+			break;
+		case text_kernel_sse2:
+			check = check_sse2;
+			break;
+#endif
+		default:
+			check = check_scalar;
+			break;
+	}
+	kernel = new_kernel;
+	return 1;
+}
+
+/* To be called before any other thread could be checking text */
+void
+text_init
+( void )
+{
+	for ( int candidate = text_kernels - 1 ; candidate >= 0 ; --candidate )
+		if ( text_use((enum TextKernel)candidate) )
+			break;
+}
+
+const char *
+text_kernel_name
+(
+ enum TextKernel name_of
+)
+{
+	static const char * const names[text_kernels] = {"scalar", "SSE2", "SSSE3", "AVX2"};
+	return name_of < text_kernels ? names[name_of] : "unknown";
+}
+
+enum TextKernel
+text_kernel
+( void )
+{
+	return kernel;
+}
+
+/* Returns the text's flaws, 0 if there's none */
+int
+text_check
+(
+ const unsigned char * text,
+ size_t size
+)
+{
+	return check(text, size);
+}
+
+size_t
+text_strip_controls
+(
+ unsigned char * text,
+ size_t size
+)
+{
+	const unsigned char * const end = text + size;
+	unsigned char * out = text;
+	
+	for ( const unsigned char * cur = text ; cur != end ; )
+	{
+		int flaws = 0;
+		const size_t length = take_character(cur, end, &flaws);
+		if ( !flaws )
+		{
+			memmove(out, cur, length);
+			out += length;
+		}
+		cur += length;
+	}
+	return (size_t)(out - text);
+}
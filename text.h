@@ -0,0 +1,66 @@
+#ifndef TEXT_H
+#define TEXT_H
+
+#include <stddef.h>
+
+
+/* Validation of what clients send, so that nothing but well-formed UTF-8
+ * without terminal control sequences gets broadcast. Control characters
+ * are C0 but tab and line feed, DEL, and C1 (U+0080 to U+009F). The
+ * check runs as one of several kernels, the best the processor supports
+ * being picked by text_init: AVX2 and SSSE3, which validate 32 and 16
+ * bytes at a time whatever they are, SSE2, which only skips over plain
+ * ASCII 16 bytes at a time, or scalar code. */
+
+/* What's to become of a message that doesn't pass */
+enum TextPolicy {
+	text_strip, // control characters are stripped, malformed UTF-8 dropped
+	text_reject, // both get dropped
+	text_unchecked
+};
+
+/* What text_check finds wrong, as flags */
+enum TextFlaw {
+	text_malformed = 1,
+	text_controls = 2
+};
+
+enum TextKernel {
+	text_kernel_scalar,
+	text_kernel_sse2,
+	text_kernel_ssse3,
+	text_kernel_avx2,
+	text_kernels
+};
+
+void text_init
+(void);
+
+/* Switches to the given kernel, if the processor supports it */
+int text_use
+(
+ enum TextKernel
+);
+
+const char * text_kernel_name
+(
+ enum TextKernel
+);
+
+enum TextKernel text_kernel
+(void);
+
+int text_check
+(
+ const unsigned char * text,
+ size_t size
+);
+
+/* To be called on well-formed text only; returns its new size */
+size_t text_strip_controls
+(
+ unsigned char * text,
+ size_t size
+);
+
+#endif
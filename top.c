@@ -0,0 +1,237 @@
+#include <stddef.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "logmsg.h"
+#include "platform.h"
+#include "stats.h"
+
+#if defined(_WIN32) && !defined(ENABLE_VIRTUAL_TERMINAL_PROCESSING)
+#define ENABLE_VIRTUAL_TERMINAL_PROCESSING 0x0004
+#endif
+
+/* Shows what a running server is up to, like top, from the stats it
+ * publishes in shared memory (see stats.h): it only ever reads the
+ * segment, so however often it's refreshed, the server isn't slowed
+ * down by it. Rates are worked out from the difference between two
+ * snapshots. */
+
+
+struct top_options {
+	unsigned port;
+	uint32_t interval_ms;
+	unsigned long count; // of refreshes, 0 for no end
+	char batch; // one snapshot after another, without clearing the screen
+};
+
+typedef struct {
+	uint64_t taken_ns;
+	StatsServer server;
+	StatsWorker workers[stats_max_workers];
+} Snapshot;
+
+static int
+take_snapshot
+(
+ const StatsSegment * segment,
+ Snapshot * snapshot
+)
+{
+	snapshot->taken_ns = platform_now_ns();
+	if ( !stats_read(&(segment->sequence), &(segment->server), &(snapshot->server), sizeof(snapshot->server)) )
+		return 0;
+	for ( uint32_t i = 0 ; i != segment->workers_max ; ++i )
+	{
+		const StatsWorker * const worker = segment->workers + i;
+		if ( !stats_read(&(worker->sequence), &(worker->running), &(snapshot->workers[i].running), sizeof(*worker) - offsetof(StatsWorker, running)) )
+			return 0;
+	}
+	return 1;
+}
+
+static double
+rate
+(
+ uint64_t now,
+ uint64_t before,
+ double seconds
+)
+{
+	return now >= before && seconds > 0 ? (now - before) / seconds : 0;
+}
+
+static void
+show
+(
+ const StatsSegment * segment,
+ const Snapshot * now,
+ const Snapshot * before,
+ char batch
+)
+{
+	const StatsServer * const server = &(now->server);
+	const StatsServer * const last = &(before->server);
+	const double seconds = (now->taken_ns - before->taken_ns) / 1e9;
+	const uint64_t uptime_s = server->uptime_ms / 1000;
+	char budget[32];
+	
+	snprintf(budget, sizeof(budget), "%"PRIu64" KiB", server->memory_budget >> 10);
+	
+	if ( !batch )
+		fputs("\x1b[H\x1b[2J", stdout);
+	printf("lappenchat on port %"PRIu32", process %"PRIu32", up %"PRIu64":%02u:%02u%s\n", segment->port, segment->process_id, uptime_s / 3600, (unsigned)(uptime_s / 60 % 60), (unsigned)(uptime_s % 60), server->uptime_ms == last->uptime_ms ? " (not updating)" : "");
+	printf("clients %"PRIu32" of %"PRIu32", workers %"PRIu32" (%"PRIu32" to %"PRIu32", grown %"PRIu64" times, shrunk %"PRIu64"), probe waited %"PRIu64" us\n", server->clients, server->capacity, server->workers, server->workers_min, server->workers_max, server->pool_grown, server->pool_shrunk, server->probe_wait_us);
+	printf("queued %"PRIu32" frames, %"PRIu32" to the client with the most\n", server->queued, server->queued_most);
+	printf("broadcast %.0f/s, delivered %.0f/s in %.0f sends/s\n", rate(server->messages_broadcast, last->messages_broadcast, seconds), rate(server->messages_delivered, last->messages_delivered, seconds), rate(server->sends, last->sends, seconds));
+	printf("dropped %"PRIu64" (%.0f/s) for full queues, %"PRIu64" for their text, %"PRIu64" by the filter; masked %"PRIu64", flagged %"PRIu64"\n", server->dropped_queue_full, rate(server->dropped_queue_full, last->dropped_queue_full, seconds), server->dropped_text, server->dropped_filter, server->masked, server->flagged);
+	printf("memory %"PRIu64" KiB, at most %"PRIu64" KiB, of %s; %"PRIu64" clients not let in, %"PRIu64" disconnected, %"PRIu64" frames dropped for it\n", server->memory_used >> 10, server->memory_peak >> 10, server->memory_budget ? budget : "no budget", server->clients_refused, server->clients_shed, server->frames_shed);
+	printf("\n%6s %6s %12s %12s %12s %12s %14s %6s\n", "worker", "busy", "msgs in/s", "bytes in/s", "msgs out/s", "bytes out/s", "completions/s", "batch");
+	for ( uint32_t i = 0 ; i != segment->workers_max ; ++i )
+	{
+		const StatsCounters * const counters = &(now->workers[i].counters);
+		const StatsCounters * const earlier = &(before->workers[i].counters);
+		if ( !now->workers[i].running )
+			continue;
+		const uint64_t dequeues = counters->dequeues - earlier->dequeues;
+		printf("%6"PRIu32" %5.1f%% %12.0f %12.0f %12.0f %12.0f %14.0f %6.1f\n", i, rate(counters->busy_ns, earlier->busy_ns, seconds) / 1e7, rate(counters->messages_in, earlier->messages_in, seconds), rate(counters->bytes_in, earlier->bytes_in, seconds), rate(counters->messages_out, earlier->messages_out, seconds), rate(counters->bytes_out, earlier->bytes_out, seconds), rate(counters->completions, earlier->completions, seconds), dequeues ? (double)(counters->completions - earlier->completions) / dequeues : 0);
+	}
+	
+	/* How long the frames sent in the meantime had waited in
+	 * each lane, by the upper bounds of their buckets */
+	printf("\n%-8s %12s %10s %10s %10s\n", "lane", "frames/s", "p50 us", "p99 us", "max us");
+	for ( unsigned lane = 0 ; lane != stats_lanes ; ++lane )
+	{
+		uint64_t waits[stats_wait_buckets];
+		uint64_t frames = 0;
+		for ( unsigned i = 0 ; i != stats_wait_buckets ; ++i )
+			frames += waits[i] = server->lane_waits[lane][i] - last->lane_waits[lane][i];
+		if ( frames )
+			printf("%-8s %12.0f %10"PRIu64" %10"PRIu64" %10"PRIu64"\n", stats_lane_name(lane), frames / seconds, stats_wait_percentile(waits, .5), stats_wait_percentile(waits, .99), stats_wait_percentile(waits, 1));
+		else
+			printf("%-8s %12d %10s %10s %10s\n", stats_lane_name(lane), 0, "-", "-", "-");
+	}
+	if ( batch )
+		putchar('\n');
+	fflush(stdout);
+}
+
+static int
+top
+(
+ const struct top_options * options,
+ const StatsSegment * segment
+)
+{
+	Snapshot * const snapshots = platform_alloc_aligned(2 * sizeof(*snapshots));
+	if ( !snapshots )
+	{
+		logmsg("couldn't allocate memory");
+		return 0;
+	}
+	
+	int rv = 1;
+	Snapshot * before = snapshots, * now = snapshots + 1;
+	if ( !take_snapshot(segment, before) )
+	{
+		logmsg("couldn't read the stats");
+		platform_free_aligned(snapshots);
+		return 0;
+	}
+	for ( unsigned long shown = 0 ; !options->count || shown != options->count ; )
+	{
+		platform_sleep_ms(options->interval_ms);
+		if ( segment->magic != stats_magic )
+		{
+			logmsg("the server has gone away");
+			rv = 0;
+			break;
+		}
+		if ( !take_snapshot(segment, now) )
+			continue;
+		/* A worker started in the meantime has counted from 0 */
+		for ( uint32_t i = 0 ; i != segment->workers_max ; ++i )
+			if ( now->workers[i].counters.completions < before->workers[i].counters.completions )
+				before->workers[i].counters = (StatsCounters){0};
+		show(segment, now, before, options->batch);
+		++shown;
+		
+		Snapshot * const swap = before;
+		before = now;
+		now = swap;
+	}
+	
+	platform_free_aligned(snapshots);
+	return rv;
+}
+
+int main
+(
+ int argc,
+ char * * argv
+)
+{
+	int rv = 0;
+	char parameter = 0;
+	struct top_options options = {
+		.port = 3144,
+		.interval_ms = 1000
+	};
+	
+	logout = stderr;
+	
+	for ( char * * arg_cur = argv + 1, * * const argv_end = argv+argc ; arg_cur != argv_end ; ++arg_cur )
+	{
+		char * const arg = *arg_cur;
+		if ( parameter )
+		{
+			switch ( parameter )
+			{
+				case 'p':
+					options.port = (unsigned)strtoul(arg, NULL, 10);
+					break;
+				case 'i':
+					options.interval_ms = (uint32_t)strtoul(arg, NULL, 10);
+					break;
+				case 'n':
+					options.count = strtoul(arg, NULL, 10);
+					break;
+			}
+			parameter = 0;
+		}
+		else
+		if ( !strcmp(arg, "-b") )
+			options.batch = 1;
+		else
+		if ( *arg == '-' )
+			parameter = arg[1];
+		else
+		{
+			logmsg("usage: lappenchat-top [-p port] [-i intervalMs] [-n count] [-b]");
+			return 1;
+		}
+	}
+	if ( options.interval_ms < 100 )
+		options.interval_ms = 100;
+
+#if defined(_WIN32)
+	/* For the escape sequences that clear the screen */
+	const HANDLE console = GetStdHandle(STD_OUTPUT_HANDLE);
+	DWORD mode;
+	if ( !options.batch && GetConsoleMode(console, &mode) )
+		SetConsoleMode(console, mode | ENABLE_VIRTUAL_TERMINAL_PROCESSING);
+#endif
+
+	const StatsSegment * const segment = stats_open(options.port);
+	if ( !segment )
+		logmsgf("no server is publishing stats for port %u\n", options.port);
+	else
+	if ( segment->magic != stats_magic || segment->version != stats_version || segment->size != sizeof(*segment) || segment->workers_max > stats_max_workers )
+		logmsgf("the stats for port %u are of a version of the server this one can't read\n", options.port);
+	else
+		rv = top(&options, segment);
+	
+	stats_close(segment);
+	return !rv;
+}
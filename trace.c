@@ -0,0 +1,228 @@
+#include "trace.h"
+
+#include <stdint.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include "logmsg.h"
+#include "platform.h"
+
+/* Each thread keeps the latest this many events */
+#define trace_buffer_events 65536
+
+
+typedef struct {
+	const char * name; // a string literal
+	uint64_t message;
+	uint64_t timestamp; // microseconds
+	uint64_t duration; // microseconds, for complete events
+	long client; // -1 when not pertaining to a particular client
+	char phase; // 'X' for complete events, 'i' for instant ones
+} TraceEvent;
+
+typedef struct TraceBuffer {
+	struct TraceBuffer * next;
+	unsigned long thread_id;
+	/* Only ever written to by the owning thread. The events are
+	 * written before next_event is bumped past them. */
+	volatile uint64_t next_event;
+	TraceEvent events[trace_buffer_events];
+} TraceBuffer;
+
+volatile unsigned long trace_sample;
+
+static const char * trace_path;
+static volatile long messages_seen;
+static PlatformLock buffers_lock;
+static TraceBuffer * buffers;
+static thread_local TraceBuffer * thread_buffer;
+
+int
+trace_init
+(
+ unsigned long sample,
+ const char * path
+)
+{
+	if ( !sample )
+		return 1;
+	
+	platform_lock_init(&buffers_lock);
+	trace_path = path;
+	trace_sample = sample;
+	
+	logmsgf("tracing one message in %lu, to be exported to %s\n", sample, path);
+	return 1;
+}
+
+/* Decides whether the message about to be received gets traced,
+ * and returns its ID if so or 0 otherwise */
+uint64_t
+trace_message
+( void )
+{
+	const long seen = platform_increment(&messages_seen);
+	return seen % trace_sample == 0 ? (uint64_t)(unsigned long)seen : 0;
+}
+
+uint64_t
+trace_now
+( void )
+{
+	return platform_now_us();
+}
+
+static TraceEvent *
+next_event
+( void )
+{
+	TraceBuffer * buffer = thread_buffer;
+	if ( !buffer )
+	{
+		if ( !(buffer = calloc(1, sizeof(*buffer))) )
+			return NULL;
+		buffer->thread_id = platform_thread_id();
+		
+		platform_lock_acquire(&buffers_lock);
+		buffer->next = buffers;
+		buffers = buffer;
+		platform_lock_release(&buffers_lock);
+		
+		thread_buffer = buffer;
+	}
+	
+	return buffer->events + buffer->next_event % trace_buffer_events;
+}
+
+static void
+commit_event
+( void )
+{
+	platform_barrier();
+	++thread_buffer->next_event;
+}
+
+void
+trace_complete
+(
+ const char * name,
+ uint64_t message,
+ uint64_t start,
+ uint64_t end,
+ long client
+)
+{
+	TraceEvent * const event = next_event();
+	if ( event )
+	{
+		*event = (TraceEvent){
+			.name = name,
+			.message = message,
+			.timestamp = start,
+			.duration = end - start,
+			.client = client,
+			.phase = 'X'
+		};
+		commit_event();
+	}
+}
+
+void
+trace_instant
+(
+ const char * name,
+ uint64_t message,
+ uint64_t timestamp
+)
+{
+	TraceEvent * const event = next_event();
+	if ( event )
+	{
+		*event = (TraceEvent){
+			.name = name,
+			.message = message,
+			.timestamp = timestamp,
+			.client = -1,
+			.phase = 'i'
+		};
+		commit_event();
+	}
+}
+
+/* While the server is running, events being recorded during the export
+ * may overwrite the oldest ones as they're being written out, so the
+ * first few events of a busy thread's buffer may come out garbled. */
+int
+trace_export
+( void )
+{
+	if ( !trace_sample )
+		return 0;
+	
+	FILE * const out = fopen(trace_path, "w");
+	if ( !out )
+	{
+		logmsgf("couldn't open trace file %s\n", trace_path);
+		return 0;
+	}
+	
+	const unsigned long process_id = platform_process_id();
+	size_t exported = 0;
+	
+	fputs("{\"displayTimeUnit\":\"ns\",\"traceEvents\":[", out);
+	
+	platform_lock_acquire(&buffers_lock);
+	for ( TraceBuffer * buffer = buffers ; buffer ; buffer = buffer->next )
+	{
+		const uint64_t end = buffer->next_event;
+		uint64_t cur = end > trace_buffer_events ? end - trace_buffer_events : 0;
+		for ( ; cur != end ; ++cur )
+		{
+			const TraceEvent * const event = buffer->events + cur % trace_buffer_events;
+			fprintf(out, "%s\n{\"name\":\"%s\",\"cat\":\"message\",\"ph\":\"%c\",\"ts\":%"PRIu64",", exported ? "," : "", event->name, event->phase, event->timestamp);
+			if ( event->phase == 'X' )
+				fprintf(out, "\"dur\":%"PRIu64",", event->duration);
+			else
+				fputs("\"s\":\"t\",", out);
+			fprintf(out, "\"pid\":%lu,\"tid\":%lu,\"args\":{\"message\":%"PRIu64, process_id, buffer->thread_id, event->message);
+			if ( event->client >= 0 )
+				fprintf(out, ",\"client\":%ld", event->client);
+			fputs("}}", out);
+			++exported;
+		}
+	}
+	platform_lock_release(&buffers_lock);
+	
+	fputs("\n]}\n", out);
+	
+	if ( fclose(out) == 0 )
+	{
+		logmsgf("exported %zu trace events to %s\n", exported, trace_path);
+		return 1;
+	}
+	else
+	{
+		logmsgf("couldn't write trace file %s\n", trace_path);
+		return 0;
+	}
+}
+
+/* To be called once every thread that may have recorded events is gone */
+void
+trace_cleanup
+( void )
+{
+	if ( !trace_sample )
+		return;
+	
+	trace_sample = 0;
+	
+	for ( TraceBuffer * buffer = buffers, * next ; buffer ; buffer = next )
+	{
+		next = buffer->next;
+		free(buffer);
+	}
+	buffers = NULL;
+	
+	platform_lock_destroy(&buffers_lock);
+}
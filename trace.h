@@ -0,0 +1,58 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <stdint.h>
+
+
+/* Sampled tracing of messages on their way through the server. One
+ * message in trace_sample gets timestamps recorded at each stage, into
+ * buffers private to each thread, and these get exported as Chrome
+ * trace-event JSON (chrome://tracing, Perfetto) on request and when the
+ * server shuts down. With tracing off, all that's left on the hot path
+ * is a test of trace_sample, which should be predicted not taken. */
+
+#if defined(__GNUC__)
+#define trace_unlikely(x) __builtin_expect(!!(x), 0)
+#else
+#define trace_unlikely(x) (x)
+#endif
+
+extern volatile unsigned long trace_sample; // 0 when tracing is off
+
+#define trace_enabled() trace_unlikely(trace_sample)
+
+int trace_init
+(
+ unsigned long sample,
+ const char * path
+);
+
+uint64_t trace_message
+(void);
+
+uint64_t trace_now
+(void);
+
+void trace_complete
+(
+ const char * name,
+ uint64_t message,
+ uint64_t start,
+ uint64_t end,
+ long client
+);
+
+void trace_instant
+(
+ const char * name,
+ uint64_t message,
+ uint64_t timestamp
+);
+
+int trace_export
+(void);
+
+void trace_cleanup
+(void);
+
+#endif
@@ -0,0 +1,443 @@
+#include "websocket.h"
+
+#include <ctype.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+/* What the key of the upgrade request is hashed along with */
+#define websocket_guid "258EAFA5-E914-47DA-95CA-C5AB0DC85B11"
+/* Of the Sec-WebSocket-Key header's value, 16 bytes in base64 */
+#define websocket_key_size 24
+
+
+size_t
+websocket_put_header
+(
+ unsigned char * header,
+ uint64_t payload_size
+)
+{
+	size_t size = 0;
+	
+	header[size++] = 0x80 | websocket_binary; // FIN
+	if ( payload_size < 126 )
+		header[size++] = (unsigned char)payload_size;
+	else
+	if ( payload_size <= 0xFFFF )
+	{
+		header[size++] = 126;
+		header[size++] = (unsigned char)(payload_size >> 8);
+		header[size++] = (unsigned char)payload_size;
+	}
+	else
+	{
+		header[size++] = 127;
+		for ( int shift = 56 ; shift >= 0 ; shift -= 8 )
+			header[size++] = (unsigned char)(payload_size >> shift);
+	}
+	return size;
+}
+
+size_t
+websocket_put_close
+(
+ unsigned char * frame,
+ unsigned short status
+)
+{
+	frame[0] = 0x80 | websocket_close;
+	frame[1] = status ? 2 : 0;
+	frame[2] = (unsigned char)(status >> 8);
+	frame[3] = (unsigned char)status;
+	return status ? 4 : 2;
+}
+
+static uint32_t
+rotate_left
+(
+ uint32_t value,
+ unsigned bits
+)
+{
+	return value << bits | value >> (32 - bits);
+}
+
+static void
+sha1_block
+(
+ uint32_t state[5],
+ const unsigned char block[64]
+)
+{
+	uint32_t w[80];
+	uint32_t a = state[0], b = state[1], c = state[2], d = state[3], e = state[4];
+	
+	for ( int i = 0 ; i != 16 ; ++i )
+		w[i] = (uint32_t)block[4 * i] << 24 | (uint32_t)block[4 * i + 1] << 16 | (uint32_t)block[4 * i + 2] << 8 | block[4 * i + 3];
+	for ( int i = 16 ; i != 80 ; ++i )
+		w[i] = rotate_left(w[i - 3] ^ w[i - 8] ^ w[i - 14] ^ w[i - 16], 1);
+	
+	for ( int i = 0 ; i != 80 ; ++i )
+	{
+		uint32_t f, k;
+		if ( i < 20 )
+		{
+			f = (b & c) | (~b & d);
+			k = 0x5A827999;
+		}
+		else
+		if ( i < 40 )
+		{
+			f = b ^ c ^ d;
+			k = 0x6ED9EBA1;
+		}
+		else
+		if ( i < 60 )
+		{
+			f = (b & c) | (b & d) | (c & d);
+			k = 0x8F1BBCDC;
+		}
+		else
+		{
+			f = b ^ c ^ d;
+			k = 0xCA62C1D6;
+		}
+		const uint32_t t = rotate_left(a, 5) + f + e + k + w[i];
+		e = d;
+		d = c;
+		c = rotate_left(b, 30);
+		b = a;
+		a = t;
+	}
+	
+	state[0] += a;
+	state[1] += b;
+	state[2] += c;
+	state[3] += d;
+	state[4] += e;
+}
+
+void
+websocket_sha1
+(
+ const void * data,
+ size_t size,
+ unsigned char digest[20]
+)
+{
+	uint32_t state[5] = {0x67452301, 0xEFCDAB89, 0x98BADCFE, 0x10325476, 0xC3D2E1F0};
+	const unsigned char * bytes = (const unsigned char *)data;
+	unsigned char block[64];
+	const uint64_t bits = (uint64_t)size * 8;
+	
+	for ( ; size >= 64 ; bytes += 64, size -= 64 )
+		sha1_block(state, bytes);
+	
+	/* The rest, padded with a 1 bit, 0 bits and the length in bits */
+	memcpy(block, bytes, size);
+	block[size++] = 0x80;
+	if ( size > 56 )
+	{
+		memset(block + size, 0, 64 - size);
+		sha1_block(state, block);
+		size = 0;
+	}
+	memset(block + size, 0, 56 - size);
+	for ( int i = 0 ; i != 8 ; ++i )
+		block[56 + i] = (unsigned char)(bits >> (56 - 8 * i));
+	sha1_block(state, block);
+	
+	for ( int i = 0 ; i != 20 ; ++i )
+		digest[i] = (unsigned char)(state[i / 4] >> (24 - 8 * (i % 4)));
+}
+
+/* Returns how long the base64 is, without the terminator it ends with */
+static size_t
+put_base64
+(
+ char * out,
+ const unsigned char * bytes,
+ size_t size
+)
+{
+	static const char digits[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+	char * const start = out;
+	
+	for ( ; size ; bytes += 3, size = size > 3 ? size - 3 : 0 )
+	{
+		const uint32_t group = (uint32_t)bytes[0] << 16 | (size > 1 ? (uint32_t)bytes[1] << 8 : 0) | (size > 2 ? bytes[2] : 0);
+		*out++ = digits[group >> 18];
+		*out++ = digits[group >> 12 & 0x3F];
+		*out++ = size > 1 ? digits[group >> 6 & 0x3F] : '=';
+		*out++ = size > 2 ? digits[group & 0x3F] : '=';
+	}
+	*out = '\0';
+	return (size_t)(out - start);
+}
+
+static int
+equal_ignoring_case
+(
+ const char * a,
+ size_t a_size,
+ const char * b
+)
+{
+	if ( a_size != strlen(b) )
+		return 0;
+	for ( size_t i = 0 ; i != a_size ; ++i )
+		if ( tolower((unsigned char)a[i]) != tolower((unsigned char)b[i]) )
+			return 0;
+	return 1;
+}
+
+/* Whether the token is in the comma-separated list, regardless of case */
+static int
+has_token
+(
+ const char * value,
+ const char * end,
+ const char * token
+)
+{
+	while ( value != end )
+	{
+		const char * comma = memchr(value, ',', (size_t)(end - value));
+		const char * token_end = comma ? comma : end;
+		const char * token_start = value;
+		
+		while ( token_start != token_end && (*token_start == ' ' || *token_start == '\t') )
+			++token_start;
+		while ( token_end != token_start && (token_end[-1] == ' ' || token_end[-1] == '\t') )
+			--token_end;
+		if ( equal_ignoring_case(token_start, (size_t)(token_end - token_start), token) )
+			return 1;
+		value = comma ? comma + 1 : end;
+	}
+	return 0;
+}
+
+int
+websocket_take_upgrade
+(
+ const char * request,
+ size_t size,
+ char accept[websocket_accept_size]
+)
+{
+	const char * end = NULL;
+	const char * key = NULL;
+	char upgrade = 0, connection = 0, version = 0;
+	
+	for ( size_t i = 3 ; i < size ; ++i )
+		if ( !memcmp(request + i - 3, "\r\n\r\n", 4) )
+		{
+			end = request + i + 1;
+			break;
+		}
+	if ( !end )
+		return 0;
+	if ( end - request < 4 || memcmp(request, "GET ", 4) )
+		return -1;
+	
+	/* Past the request line, a header to a line */
+	const char * line = (const char *)memchr(request, '\n', (size_t)(end - request)) + 1;
+	for ( const char * line_end ; (line_end = memchr(line, '\r', (size_t)(end - line))) != line ; line = line_end + 2 )
+	{
+		const char * const colon = memchr(line, ':', (size_t)(line_end - line));
+		if ( !colon )
+			return -1;
+		const char * value = colon + 1;
+		const char * value_end = line_end;
+		while ( value != value_end && (*value == ' ' || *value == '\t') )
+			++value;
+		while ( value_end != value && (value_end[-1] == ' ' || value_end[-1] == '\t') )
+			--value_end;
+		const size_t name_size = (size_t)(colon - line);
+		const size_t value_size = (size_t)(value_end - value);
+		
+		if ( equal_ignoring_case(line, name_size, "upgrade") )
+			upgrade = (char)has_token(value, value_end, "websocket");
+		else
+		if ( equal_ignoring_case(line, name_size, "connection") )
+			connection = (char)has_token(value, value_end, "upgrade");
+		else
+		if ( equal_ignoring_case(line, name_size, "sec-websocket-version") )
+			version = value_size == 2 && !memcmp(value, "13", 2);
+		else
+		if ( equal_ignoring_case(line, name_size, "sec-websocket-key") && value_size == websocket_key_size )
+			key = value;
+	}
+	if ( !upgrade || !connection || !version || !key )
+		return -1;
+	
+	char keyed[websocket_key_size + sizeof(websocket_guid) - 1];
+	unsigned char digest[20];
+	memcpy(keyed, key, websocket_key_size);
+	memcpy(keyed + websocket_key_size, websocket_guid, sizeof(websocket_guid) - 1);
+	websocket_sha1(keyed, sizeof(keyed), digest);
+	put_base64(accept, digest, sizeof(digest));
+	
+	return (int)(end - request);
+}
+
+size_t
+websocket_put_reply
+(
+ char * reply,
+ const char * accept
+)
+{
+	return (size_t)snprintf(reply, websocket_reply_size, "HTTP/1.1 101 Switching Protocols\r\nUpgrade: websocket\r\nConnection: Upgrade\r\nSec-WebSocket-Accept: %s\r\n\r\n", accept);
+}
+
+/* How long the header is, as far as its first two bytes tell */
+static size_t
+header_size
+(
+ const unsigned char * header
+)
+{
+	const unsigned char length = header[1] & 0x7F;
+	return 2 + (length == 127 ? 8 : length == 126 ? 2 : 0) + 4;
+}
+
+static void
+end_frame
+(
+ WebSocketDecoder * decoder
+)
+{
+	decoder->in_payload = 0;
+	if ( decoder->opcode == websocket_ping )
+	{
+		memcpy(decoder->ping, decoder->control, decoder->control_n);
+		decoder->ping_n = decoder->control_n;
+		decoder->ping_pending = 1;
+	}
+	else
+	if ( decoder->opcode == websocket_close )
+	{
+		/* A single byte is no status code, and makes for none */
+		decoder->closed = 1;
+		decoder->close_status = decoder->control_n >= 2 ? (unsigned short)(decoder->control[0] << 8 | decoder->control[1]) : 0;
+	}
+}
+
+static const char *
+take_header
+(
+ WebSocketDecoder * decoder
+)
+{
+	const unsigned char * const header = decoder->header;
+	const char fin = (char)(header[0] & 0x80);
+	const unsigned char opcode = header[0] & 0x0F;
+	const unsigned char length = header[1] & 0x7F;
+	uint64_t payload_size = length;
+	size_t mask_at = 2;
+	
+	decoder->header_n = 0;
+	if ( header[0] & 0x70 )
+		return "client sent a WebSocket frame of an extension it didn't agree on";
+	if ( !(header[1] & 0x80) )
+		return "client sent a WebSocket frame that isn't masked";
+	if ( length == 126 )
+	{
+		payload_size = (uint64_t)header[2] << 8 | header[3];
+		mask_at = 4;
+	}
+	else
+	if ( length == 127 )
+	{
+		payload_size = 0;
+		for ( size_t i = 2 ; i != 10 ; ++i )
+			payload_size = payload_size << 8 | header[i];
+		if ( payload_size >> 63 )
+			return "client sent an invalid WebSocket frame length";
+		mask_at = 10;
+	}
+	
+	switch ( opcode )
+	{
+		case websocket_continuation:
+		case websocket_binary:
+			if ( (opcode == websocket_continuation) != decoder->fragmented )
+				return "client sent a WebSocket frame out of its message";
+			decoder->fragmented = !fin;
+			break;
+		case websocket_close:
+		case websocket_ping:
+		case websocket_pong:
+			if ( !fin || payload_size > websocket_control_max )
+				return "client sent an invalid WebSocket control frame";
+			decoder->control_n = 0;
+			break;
+		case websocket_text:
+			return "client sent a text WebSocket message rather than a binary one";
+		default:
+			return "client sent a WebSocket frame of an unknown opcode";
+	}
+	
+	decoder->opcode = opcode;
+	memcpy(decoder->mask, header + mask_at, 4);
+	decoder->remaining = payload_size;
+	decoder->in_payload = 1;
+	if ( !payload_size )
+		end_frame(decoder);
+	return NULL;
+}
+
+const char *
+websocket_decode
+(
+ WebSocketDecoder * decoder,
+ unsigned char * data,
+ size_t size,
+ size_t * payload
+)
+{
+	const unsigned char * in = data;
+	const unsigned char * const end = data + size;
+	unsigned char * out = data;
+	
+	while ( in != end && !decoder->closed )
+	{
+		if ( !decoder->in_payload )
+		{
+			decoder->header[decoder->header_n++] = *in++;
+			if ( decoder->header_n >= 2 && decoder->header_n == header_size(decoder->header) )
+			{
+				const char * const error = take_header(decoder);
+				if ( error )
+					return error;
+			}
+			continue;
+		}
+		
+		/* The mask is kept rotated to where the payload is at */
+		const size_t n = decoder->remaining < (uint64_t)(end - in) ? (size_t)decoder->remaining : (size_t)(end - in);
+		unsigned char * const to = decoder->opcode < websocket_close ? out : decoder->control + decoder->control_n;
+		for ( size_t i = 0 ; i != n ; ++i )
+			to[i] = in[i] ^ decoder->mask[i & 3];
+		if ( n & 3 )
+		{
+			unsigned char mask[4];
+			for ( size_t i = 0 ; i != 4 ; ++i )
+				mask[i] = decoder->mask[(i + n) & 3];
+			memcpy(decoder->mask, mask, 4);
+		}
+		if ( to == out )
+			out += n;
+		else
+			decoder->control_n += (unsigned char)n;
+		in += n;
+		if ( !(decoder->remaining -= n) )
+			end_frame(decoder);
+	}
+	
+	*payload = (size_t)(out - data);
+	return NULL;
+}
@@ -0,0 +1,120 @@
+#ifndef WEBSOCKET_H
+#define WEBSOCKET_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+
+/* The server side of RFC 6455, for clients that can only speak
+ * WebSocket, such as browsers. They come in with an HTTP upgrade
+ * request, and then speak protocol v2 (see protocol.h) inside binary
+ * messages. The messages' boundaries mean nothing: their payloads one
+ * after the other make up the stream a TCP client would have sent.
+ * Every message from the server carries whole v2 frames. No extensions
+ * are agreed to, permessage-deflate included, so that a frame
+ * broadcast goes out the same to every WebSocket client, and its
+ * header is written once, with the frame (see frame.h).
+ *
+ * Everything here works on bytes only, and is the same everywhere. */
+
+/* The longest header of a frame from the server, which is never masked */
+#define websocket_header_max 10
+/* The longest upgrade request taken, headers and all */
+#define websocket_request_max 8192
+/* Of the Sec-WebSocket-Accept header's value, with its terminator */
+#define websocket_accept_size 29
+/* The longest reply to an upgrade request */
+#define websocket_reply_size 160
+/* Of the payload of a control frame */
+#define websocket_control_max 125
+/* The longest Close frame from the server, with a status code */
+#define websocket_close_size 4
+/* The status code of the Close the server shuts down with */
+#define websocket_going_away 1001
+
+enum WebSocketOpcode {
+	websocket_continuation = 0x0,
+	websocket_text = 0x1,
+	websocket_binary = 0x2,
+	websocket_close = 0x8,
+	websocket_ping = 0x9,
+	websocket_pong = 0xA
+};
+
+/* Where a client's stream of frames is at, across recvs */
+typedef struct {
+	/* The header of the frame being read, while it isn't all there */
+	unsigned char header[14];
+	unsigned char header_n;
+	char in_payload;
+	unsigned char opcode;
+	char fragmented; // a message is yet to have its last frame
+	unsigned char mask[4];
+	uint64_t remaining; // of the frame's payload
+	/* A control frame's payload, which is gathered rather than
+	 * passed on, and that of the latest ping still to be answered */
+	unsigned char control[websocket_control_max];
+	unsigned char control_n;
+	unsigned char ping[websocket_control_max];
+	unsigned char ping_n;
+	char ping_pending;
+	char closed; // by the client, nothing after which is read
+	unsigned short close_status; // that the client closed with, 0 if none
+} WebSocketDecoder;
+
+/* Writes the header of a final binary frame of the given length,
+ * returning how long it is */
+size_t websocket_put_header
+(
+ unsigned char * header,
+ uint64_t payload_size
+);
+
+/* Writes a Close frame with the given status code, or none if 0,
+ * returning how long it is */
+size_t websocket_put_close
+(
+ unsigned char * frame,
+ unsigned short status
+);
+
+/* Returns how many bytes the request took, 0 if it isn't all there yet,
+ * or -1 if it's no WebSocket upgrade of version 13, having put what the
+ * Sec-WebSocket-Accept of the reply is to be in accept */
+int websocket_take_upgrade
+(
+ const char * request,
+ size_t size,
+ char accept[websocket_accept_size]
+);
+
+/* Writes the reply to an upgrade request, returning how long it is */
+size_t websocket_put_reply
+(
+ char * reply,
+ const char * accept
+);
+
+/* Unmasks the payloads of data frames in place, packing them together
+ * at the start of the bytes, and gathers the control frames. Returns
+ * what's wrong with the frames, NULL if nothing is, having set payload
+ * to the number of bytes passed on. A ping leaves ping_pending set for
+ * the caller to answer with a pong and clear; a close has it stop,
+ * with the status code it came with in close_status. */
+const char * websocket_decode
+(
+ WebSocketDecoder *,
+ unsigned char * data,
+ size_t size,
+ size_t * payload
+);
+
+/* The SHA-1 of the bytes, which is all the handshake needs it for */
+void websocket_sha1
+(
+ const void * data,
+ size_t size,
+ unsigned char digest[20]
+);
+
+#endif
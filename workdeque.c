@@ -0,0 +1,102 @@
+#include "workdeque.h"
+
+#include <stddef.h>
+#include <stdlib.h>
+#include "platform.h"
+
+
+int
+workdeque_init
+(
+ WorkDeque * deque,
+ size_t capacity
+)
+{
+	deque->top = deque->bottom = 0;
+	deque->capacity = (long)capacity;
+	return (deque->items = malloc(capacity * sizeof(*deque->items))) != NULL;
+}
+
+void
+workdeque_cleanup
+(
+ WorkDeque * deque
+)
+{
+	free(deque->items);
+	deque->items = NULL;
+}
+
+void
+workdeque_reset
+(
+ WorkDeque * deque
+)
+{
+	platform_store_long(&deque->top, 0);
+	platform_store_long(&deque->bottom, 0);
+}
+
+void
+workdeque_push
+(
+ WorkDeque * deque,
+ size_t item
+)
+{
+	const long bottom = deque->bottom;
+	
+	deque->items[bottom % deque->capacity] = item;
+	platform_store_long(&deque->bottom, bottom + 1);
+}
+
+int
+workdeque_pop
+(
+ WorkDeque * deque,
+ size_t * item
+)
+{
+	const long bottom = deque->bottom - 1;
+	
+	/* Thieves are to see the bottom taken before the top is read,
+	 * so that the last item goes either to them or to the owner */
+	platform_store_long(&deque->bottom, bottom);
+	platform_barrier();
+	const long top = platform_load_long(&deque->top);
+	
+	if ( top > bottom )
+	{
+		platform_store_long(&deque->bottom, bottom + 1);
+		return 0;
+	}
+	*item = deque->items[bottom % deque->capacity];
+	if ( top == bottom )
+	{
+		const int won = platform_compare_exchange(&deque->top, top, top + 1);
+		platform_store_long(&deque->bottom, bottom + 1);
+		return won;
+	}
+	return 1;
+}
+
+int
+workdeque_steal
+(
+ WorkDeque * deque,
+ size_t * item
+)
+{
+	for ( ; ; )
+	{
+		const long top = platform_load_long(&deque->top);
+		platform_barrier();
+		const long bottom = platform_load_long(&deque->bottom);
+		
+		if ( top >= bottom )
+			return 0;
+		*item = deque->items[top % deque->capacity];
+		if ( platform_compare_exchange(&deque->top, top, top + 1) )
+			return 1;
+	}
+}
@@ -0,0 +1,59 @@
+#ifndef WORKDEQUE_H
+#define WORKDEQUE_H
+
+#include <stddef.h>
+#include "platform.h"
+
+
+/* A work-stealing deque (Chase and Lev's) of indices: its owner pushes
+ * and pops them at the bottom, while any number of other threads steal
+ * them from the top, without taking a lock. Its capacity is fixed, as
+ * the owner pushes everything there is to do before anybody steals. */
+
+typedef struct {
+	size_t * items;
+	long capacity;
+	volatile long top;
+	volatile long bottom;
+} WorkDeque;
+
+int workdeque_init
+(
+ WorkDeque *,
+ size_t capacity
+);
+
+void workdeque_cleanup
+(
+ WorkDeque *
+);
+
+/* Empties it; nobody may be stealing from it */
+void workdeque_reset
+(
+ WorkDeque *
+);
+
+/* The owner's, with room to be left */
+void workdeque_push
+(
+ WorkDeque *,
+ size_t item
+);
+
+/* The owner's, returning 0 if it's empty */
+int workdeque_pop
+(
+ WorkDeque *,
+ size_t * item
+);
+
+/* Anybody's, returning 0 if it's empty, trying again as long as
+ * it's only others having got to the same item first */
+int workdeque_steal
+(
+ WorkDeque *,
+ size_t * item
+);
+
+#endif